@@ -168,6 +168,14 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
         return NULL;
     }
 
+    if (ngx_array_init(&cycle->reopen_handlers, pool, 1,
+                       sizeof(ngx_reopen_handler_t))
+        != NGX_OK)
+    {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
     n = old_cycle->listening.nelts ? old_cycle->listening.nelts : 10;
 
     cycle->listening.elts = ngx_pcalloc(pool, n * sizeof(ngx_listening_t));
@@ -1115,10 +1123,11 @@ ngx_test_lockfile(u_char *file, ngx_log_t *log)
 void
 ngx_reopen_files(ngx_cycle_t *cycle, ngx_uid_t user)
 {
-    ngx_fd_t          fd;
-    ngx_uint_t        i;
-    ngx_list_part_t  *part;
-    ngx_open_file_t  *file;
+    ngx_fd_t               fd;
+    ngx_uint_t             i;
+    ngx_list_part_t       *part;
+    ngx_open_file_t       *file;
+    ngx_reopen_handler_t  *handler;
 
     part = &cycle->open_files.part;
     file = part->elts;
@@ -1228,6 +1237,14 @@ ngx_reopen_files(ngx_cycle_t *cycle, ngx_uid_t user)
         file[i].fd = fd;
     }
 
+    /* the data that are rebuilt or remapped along with the files */
+
+    handler = cycle->reopen_handlers.elts;
+
+    for (i = 0; i < cycle->reopen_handlers.nelts; i++) {
+        handler[i].handler(cycle, handler[i].data);
+    }
+
 #if !(NGX_WIN32)
 
     if (cycle->log->file->fd != STDERR_FILENO) {
@@ -34,6 +34,14 @@ struct ngx_shm_zone_s {
 };
 
 
+typedef void (*ngx_reopen_handler_pt) (ngx_cycle_t *cycle, void *data);
+
+typedef struct {
+    ngx_reopen_handler_pt     handler;
+    void                     *data;
+} ngx_reopen_handler_t;
+
+
 struct ngx_cycle_s {
     void                  ****conf_ctx;
     ngx_pool_t               *pool;
@@ -51,6 +59,7 @@ struct ngx_cycle_s {
     ngx_array_t               paths;
     ngx_list_t                open_files;
     ngx_list_t                shared_memory;
+    ngx_array_t               reopen_handlers;
 
     ngx_uint_t                connection_n;
     ngx_uint_t                files_n;
@@ -83,6 +92,8 @@ typedef struct {
      ngx_int_t                rlimit_sigpending;
      off_t                    rlimit_core;
 
+     size_t                   pool_cache;
+
      int                      priority;
 
      ngx_uint_t               cpu_affinity_n;
@@ -800,7 +800,8 @@ failed:
 /*
  * ctx->init_handler() - see ctx->alloc
  * ctx->file_handler() - file handler
- * ctx->pre_tree_handler() - handler is called before entering directory
+ * ctx->pre_tree_handler() - handler is called before entering directory,
+ *     the directory is skipped if the handler returns NGX_DECLINED
  * ctx->post_tree_handler() - handler is called after leaving directory
  * ctx->spec_handler() - special (socket, FIFO, etc.) file handler
  *
@@ -943,10 +944,18 @@ ngx_walk_tree(ngx_tree_ctx_t *ctx, ngx_str_t *tree)
             ctx->access = ngx_de_access(&dir);
             ctx->mtime = ngx_de_mtime(&dir);
 
-            if (ctx->pre_tree_handler(ctx, &file) == NGX_ABORT) {
+            rc = ctx->pre_tree_handler(ctx, &file);
+
+            if (rc == NGX_ABORT) {
                 goto failed;
             }
 
+            if (rc == NGX_DECLINED) {
+                ngx_log_debug1(NGX_LOG_DEBUG_CORE, ctx->log, 0,
+                               "tree skip dir \"%s\"", file.data);
+                continue;
+            }
+
             if (ngx_walk_tree(ctx, &file) == NGX_ABORT) {
                 goto failed;
             }
@@ -9,17 +9,76 @@
 #include <ngx_core.h>
 
 
+/*
+ * the perfect hash uses the "hash, displace" scheme: the keys are split
+ * into groups of about 4 keys, and a seed is searched for every group,
+ * starting from the largest groups, to place all its keys into free buckets
+ */
+
+#define NGX_HASH_PERFECT_GROUP  4
+
+#define ngx_hash_reduce(h, n)   (ngx_uint_t) (((uint64_t) (h) * (n)) >> 32)
+
+
+typedef struct {
+    uint32_t          hash;
+    uint32_t          group;
+    ngx_hash_key_t   *name;
+} ngx_hash_perfect_key_t;
+
+
+static ngx_int_t ngx_hash_perfect_init(ngx_hash_init_t *hinit,
+    ngx_hash_key_t *names, ngx_uint_t nelts);
+static ngx_int_t ngx_hash_perfect_place(ngx_hash_perfect_key_t *keys,
+    ngx_uint_t *first, ngx_uint_t *slots, ngx_uint_t *members,
+    ngx_uint_t *gstart, ngx_uint_t *order, ngx_uint_t ngroups,
+    uint32_t *seeds, u_char *taken, ngx_uint_t size);
+static int ngx_libc_cdecl ngx_hash_perfect_cmp(const void *one,
+    const void *two);
+
+
+static ngx_inline uint32_t
+ngx_hash_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+
+static ngx_inline uint32_t
+ngx_hash_fold(ngx_uint_t key)
+{
+#if (NGX_PTR_SIZE == 8)
+    return (uint32_t) (key ^ (key >> 32));
+#else
+    return (uint32_t) key;
+#endif
+}
+
+
 void *
 ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name, size_t len)
 {
-    ngx_uint_t       i;
+    uint32_t         h;
     ngx_hash_elt_t  *elt;
 
 #if 0
     ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0, "hf:\"%*s\"", len, name);
 #endif
 
-    elt = hash->buckets[key % hash->size];
+    if (hash->seeds) {
+        h = ngx_hash_fold(key);
+        h ^= hash->seeds[ngx_hash_reduce(ngx_hash_mix(h), hash->nseeds)];
+        elt = hash->buckets[ngx_hash_reduce(ngx_hash_mix(h), hash->size)];
+
+    } else {
+        elt = hash->buckets[key % hash->size];
+    }
 
     if (elt == NULL) {
         return NULL;
@@ -30,10 +89,8 @@ ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name, size_t len)
             goto next;
         }
 
-        for (i = 0; i < len; i++) {
-            if (name[i] != elt->name[i]) {
-                goto next;
-            }
+        if (ngx_memcmp(name, elt->name, len) != 0) {
+            goto next;
         }
 
         return elt->value;
@@ -254,9 +311,16 @@ ngx_hash_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names, ngx_uint_t nelts)
     u_char          *elts;
     size_t           len;
     u_short         *test;
+    ngx_int_t        rc;
     ngx_uint_t       i, n, key, size, start, bucket_size;
     ngx_hash_elt_t  *elt, **buckets;
 
+    rc = ngx_hash_perfect_init(hinit, names, nelts);
+
+    if (rc != NGX_DECLINED) {
+        return rc;
+    }
+
     for (n = 0; n < nelts; n++) {
         if (hinit->bucket_size < NGX_HASH_ELT_SIZE(&names[n]) + sizeof(void *))
         {
@@ -420,6 +484,8 @@ found:
 
     hinit->hash->buckets = buckets;
     hinit->hash->size = size;
+    hinit->hash->seeds = NULL;
+    hinit->hash->nseeds = 0;
 
 #if 0
 
@@ -455,6 +521,300 @@ found:
 }
 
 
+static ngx_int_t
+ngx_hash_perfect_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
+    ngx_uint_t nelts)
+{
+    u_char                  *elts, *taken;
+    size_t                   len;
+    uint32_t                *seeds;
+    ngx_int_t                rc;
+    ngx_uint_t               i, n, c, g, size, nclasses, ngroups;
+    ngx_uint_t              *first, *slots, *members, *gstart, *order;
+    ngx_hash_elt_t          *elt, **buckets;
+    ngx_hash_perfect_key_t  *keys;
+
+    if (nelts == 0) {
+        return NGX_DECLINED;
+    }
+
+    keys = ngx_alloc(nelts * sizeof(ngx_hash_perfect_key_t),
+                     hinit->pool->log);
+    if (keys == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = 0;
+
+    for (i = 0; i < nelts; i++) {
+        if (names[i].key.data == NULL) {
+            continue;
+        }
+
+        if (names[i].key.len > 0xffff) {
+            ngx_free(keys);
+            return NGX_DECLINED;
+        }
+
+        keys[n].hash = ngx_hash_fold(names[i].key_hash);
+        keys[n].name = &names[i];
+        n++;
+    }
+
+    if (n == 0) {
+        ngx_free(keys);
+        return NGX_DECLINED;
+    }
+
+    ngx_qsort(keys, n, sizeof(ngx_hash_perfect_key_t), ngx_hash_perfect_cmp);
+
+    /*
+     * the keys with the same folded hash cannot be told apart,
+     * so they form a class that shares a bucket
+     */
+
+    nclasses = 1;
+
+    for (i = 1; i < n; i++) {
+        if (keys[i].hash != keys[i - 1].hash) {
+            nclasses++;
+        }
+    }
+
+    ngroups = nclasses / NGX_HASH_PERFECT_GROUP + 1;
+
+    /* the buckets may be added once if the minimal hash is not found */
+
+    size = nclasses + nclasses / 4 + 1;
+
+    first = ngx_alloc((nclasses + 1 + 2 * size + 2 * ngroups + 1)
+                      * sizeof(ngx_uint_t)
+                      + ngroups * sizeof(uint32_t) + size,
+                      hinit->pool->log);
+    if (first == NULL) {
+        ngx_free(keys);
+        return NGX_ERROR;
+    }
+
+    slots = first + nclasses + 1;
+    members = slots + size;
+    gstart = members + size;
+    order = gstart + ngroups + 1;
+    seeds = (uint32_t *) (order + ngroups);
+    taken = (u_char *) (seeds + ngroups);
+
+    c = 0;
+
+    for (i = 0; i < n; i++) {
+        if (i == 0 || keys[i].hash != keys[i - 1].hash) {
+            first[c++] = i;
+        }
+    }
+
+    first[c] = n;
+
+    /* the classes are sorted by groups */
+
+    ngx_memzero(gstart, (ngroups + 1) * sizeof(ngx_uint_t));
+
+    for (c = 0; c < nclasses; c++) {
+        g = ngx_hash_reduce(ngx_hash_mix(keys[first[c]].hash), ngroups);
+        keys[first[c]].group = (uint32_t) g;
+        gstart[g + 1]++;
+    }
+
+    for (g = 0; g < ngroups; g++) {
+        gstart[g + 1] += gstart[g];
+        order[g] = gstart[g];
+    }
+
+    for (c = 0; c < nclasses; c++) {
+        g = keys[first[c]].group;
+        members[order[g]++] = c;
+    }
+
+    size = nclasses;
+
+    rc = ngx_hash_perfect_place(keys, first, slots, members, gstart, order,
+                                ngroups, seeds, taken, size);
+
+    if (rc == NGX_DECLINED) {
+        size = nclasses + nclasses / 4 + 1;
+
+        rc = ngx_hash_perfect_place(keys, first, slots, members, gstart,
+                                    order, ngroups, seeds, taken, size);
+    }
+
+    if (rc != NGX_OK) {
+        goto done;
+    }
+
+    len = nclasses * sizeof(void *);
+
+    for (i = 0; i < n; i++) {
+        len += NGX_HASH_ELT_SIZE(keys[i].name);
+    }
+
+    rc = NGX_ERROR;
+
+    if (hinit->hash == NULL) {
+        hinit->hash = ngx_pcalloc(hinit->pool, sizeof(ngx_hash_wildcard_t));
+        if (hinit->hash == NULL) {
+            goto done;
+        }
+    }
+
+    buckets = ngx_pcalloc(hinit->pool, size * sizeof(ngx_hash_elt_t *));
+    if (buckets == NULL) {
+        goto done;
+    }
+
+    hinit->hash->seeds = ngx_palloc(hinit->pool, ngroups * sizeof(uint32_t));
+    if (hinit->hash->seeds == NULL) {
+        goto done;
+    }
+
+    ngx_memcpy(hinit->hash->seeds, seeds, ngroups * sizeof(uint32_t));
+
+    elts = ngx_palloc(hinit->pool, len);
+    if (elts == NULL) {
+        goto done;
+    }
+
+    /* the keys of a bucket are followed by the terminating NULL value */
+
+    for (c = 0; c < nclasses; c++) {
+        buckets[slots[c]] = (ngx_hash_elt_t *) elts;
+
+        for (i = first[c]; i < first[c + 1]; i++) {
+            elt = (ngx_hash_elt_t *) elts;
+
+            elt->value = keys[i].name->value;
+            elt->len = (u_short) keys[i].name->key.len;
+
+            ngx_strlow(elt->name, keys[i].name->key.data,
+                       keys[i].name->key.len);
+
+            elts += NGX_HASH_ELT_SIZE(keys[i].name);
+        }
+
+        ((ngx_hash_elt_t *) elts)->value = NULL;
+        elts += sizeof(void *);
+    }
+
+    hinit->hash->buckets = buckets;
+    hinit->hash->size = size;
+    hinit->hash->nseeds = ngroups;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_CORE, hinit->pool->log, 0,
+                   "%s: perfect hash of %ui keys, %ui buckets, %ui groups",
+                   hinit->name, n, size, ngroups);
+
+    rc = NGX_OK;
+
+done:
+
+    ngx_free(first);
+    ngx_free(keys);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_hash_perfect_place(ngx_hash_perfect_key_t *keys, ngx_uint_t *first,
+    ngx_uint_t *slots, ngx_uint_t *members, ngx_uint_t *gstart,
+    ngx_uint_t *order, ngx_uint_t ngroups, uint32_t *seeds, u_char *taken,
+    ngx_uint_t size)
+{
+    uint32_t    seed;
+    ngx_uint_t  i, j, k, g, s, max, tries, limit;
+
+    /* the largest groups are placed first while most buckets are free */
+
+    max = 0;
+
+    for (g = 0; g < ngroups; g++) {
+        if (max < gstart[g + 1] - gstart[g]) {
+            max = gstart[g + 1] - gstart[g];
+        }
+    }
+
+    i = 0;
+
+    for (k = max; k > 0; k--) {
+        for (g = 0; g < ngroups; g++) {
+            if (gstart[g + 1] - gstart[g] == k) {
+                order[i++] = g;
+            }
+        }
+    }
+
+    for (g = 0; g < ngroups; g++) {
+        seeds[g] = 0;
+    }
+
+    ngx_memzero(taken, size);
+
+    /* a single key needs about size / free tries at the end */
+
+    limit = 16 * size + 1024;
+
+    for (j = 0; j < i; j++) {
+        g = order[j];
+
+        for (tries = 1; tries <= limit; tries++) {
+            seed = ngx_hash_mix((uint32_t) tries);
+
+            for (k = gstart[g]; k < gstart[g + 1]; k++) {
+                s = ngx_hash_reduce(
+                        ngx_hash_mix(keys[first[members[k]]].hash ^ seed),
+                        size);
+
+                if (taken[s]) {
+                    break;
+                }
+
+                taken[s] = 1;
+                slots[members[k]] = s;
+            }
+
+            if (k == gstart[g + 1]) {
+                seeds[g] = seed;
+                break;
+            }
+
+            while (k > gstart[g]) {
+                k--;
+                taken[slots[members[k]]] = 0;
+            }
+        }
+
+        if (tries > limit) {
+            return NGX_DECLINED;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_hash_perfect_cmp(const void *one, const void *two)
+{
+    ngx_hash_perfect_key_t  *first, *second;
+
+    first = (ngx_hash_perfect_key_t *) one;
+    second = (ngx_hash_perfect_key_t *) two;
+
+    if (first->hash < second->hash) {
+        return -1;
+    }
+
+    return first->hash > second->hash;
+}
+
+
 ngx_int_t
 ngx_hash_wildcard_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
     ngx_uint_t nelts)
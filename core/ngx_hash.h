@@ -20,9 +20,16 @@ typedef struct {
 } ngx_hash_elt_t;
 
 
+/*
+ * if "seeds" is not NULL, the hash is perfect: a bucket is selected by
+ * the seed of the key group and holds only the keys with the same hash
+ */
+
 typedef struct {
     ngx_hash_elt_t  **buckets;
     ngx_uint_t        size;
+    uint32_t         *seeds;
+    ngx_uint_t        nseeds;
 } ngx_hash_t;
 
 
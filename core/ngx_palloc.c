@@ -11,6 +11,13 @@
 
 static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
+static void *ngx_pool_cache_alloc(size_t *size, ngx_log_t *log);
+static void ngx_pool_cache_free(void *p, size_t size);
+
+
+static ngx_pool_cache_slot_t  ngx_pool_cache[NGX_POOL_CACHE_SLOTS];
+static size_t                 ngx_pool_cache_max;
+static size_t                 ngx_pool_cache_size;
 
 
 ngx_pool_t *
@@ -18,7 +25,7 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 {
     ngx_pool_t  *p;
 
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    p = ngx_pool_cache_alloc(&size, log);
     if (p == NULL) {
         return NULL;
     }
@@ -61,7 +68,7 @@ ngx_destroy_pool(ngx_pool_t *pool)
         ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0, "free: %p", l->alloc);
 
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_cache_free(l->alloc, l->size);
         }
     }
 
@@ -84,7 +91,7 @@ ngx_destroy_pool(ngx_pool_t *pool)
 #endif
 
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);
+        ngx_pool_cache_free(p, (size_t) (p->d.end - (u_char *) p));
 
         if (n == NULL) {
             break;
@@ -101,7 +108,7 @@ ngx_reset_pool(ngx_pool_t *pool)
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_cache_free(l->alloc, l->size);
         }
     }
 
@@ -182,7 +189,7 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
 
     psize = (size_t) (pool->d.end - (u_char *) pool);
 
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    m = ngx_pool_cache_alloc(&psize, pool->log);
     if (m == NULL) {
         return NULL;
     }
@@ -220,7 +227,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     ngx_uint_t         n;
     ngx_pool_large_t  *large;
 
-    p = ngx_alloc(size, pool->log);
+    p = ngx_pool_cache_alloc(&size, pool->log);
     if (p == NULL) {
         return NULL;
     }
@@ -230,6 +237,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     for (large = pool->large; large; large = large->next) {
         if (large->alloc == NULL) {
             large->alloc = p;
+            large->size = size;
             return p;
         }
 
@@ -240,11 +248,12 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
 
     large = ngx_palloc(pool, sizeof(ngx_pool_large_t));
     if (large == NULL) {
-        ngx_free(p);
+        ngx_pool_cache_free(p, size);
         return NULL;
     }
 
     large->alloc = p;
+    large->size = size;
     large->next = pool->large;
     pool->large = large;
 
@@ -270,6 +279,7 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
     }
 
     large->alloc = p;
+    large->size = 0;
     large->next = pool->large;
     pool->large = large;
 
@@ -286,7 +296,7 @@ ngx_pfree(ngx_pool_t *pool, void *p)
         if (p == l->alloc) {
             ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
                            "free: %p", l->alloc);
-            ngx_free(l->alloc);
+            ngx_pool_cache_free(l->alloc, l->size);
             l->alloc = NULL;
 
             return NGX_OK;
@@ -404,30 +414,128 @@ ngx_pool_delete_file(void *data)
 }
 
 
-#if 0
+/*
+ * the size of a block rounded up to its size class is returned in "size";
+ * only the blocks of exactly a class size are cached when freed, so
+ * the blocks allocated while the cache was disabled are never reused
+ * beyond their size
+ */
 
 static void *
-ngx_get_cached_block(size_t size)
+ngx_pool_cache_alloc(size_t *size, ngx_log_t *log)
 {
-    void                     *p;
-    ngx_cached_block_slot_t  *slot;
+    void                   *p;
+    size_t                  csize;
+    ngx_pool_cache_slot_t  *slot;
 
-    if (ngx_cycle->cache == NULL) {
-        return NULL;
+    if (ngx_pool_cache_max == 0 || *size > NGX_POOL_CACHE_MAX_SIZE) {
+        return ngx_memalign(NGX_POOL_ALIGNMENT, *size, log);
     }
 
-    slot = &ngx_cycle->cache[(size + ngx_pagesize - 1) / ngx_pagesize];
+    slot = ngx_pool_cache;
+    csize = (size_t) 1 << NGX_POOL_CACHE_MIN_SHIFT;
 
-    slot->tries++;
+    while (csize < *size) {
+        csize <<= 1;
+        slot++;
+    }
+
+    *size = csize;
+
+    p = slot->block;
 
-    if (slot->number) {
-        p = slot->block;
-        slot->block = slot->block->next;
+    if (p) {
+        slot->block = *(void **) p;
         slot->number--;
+        slot->hits++;
+
+        ngx_pool_cache_size -= csize;
+
         return p;
     }
 
-    return NULL;
+    slot->misses++;
+
+    return ngx_memalign(NGX_POOL_ALIGNMENT, csize, log);
 }
 
-#endif
+
+static void
+ngx_pool_cache_free(void *p, size_t size)
+{
+    size_t                  csize;
+    ngx_pool_cache_slot_t  *slot;
+
+    if (ngx_pool_cache_max == 0 || size > NGX_POOL_CACHE_MAX_SIZE) {
+        ngx_free(p);
+        return;
+    }
+
+    slot = ngx_pool_cache;
+    csize = (size_t) 1 << NGX_POOL_CACHE_MIN_SHIFT;
+
+    while (csize < size) {
+        csize <<= 1;
+        slot++;
+    }
+
+    if (csize != size) {
+        ngx_free(p);
+        return;
+    }
+
+    if (ngx_pool_cache_size + csize > ngx_pool_cache_max) {
+        slot->released++;
+        ngx_free(p);
+        return;
+    }
+
+    *(void **) p = slot->block;
+    slot->block = p;
+    slot->number++;
+
+    ngx_pool_cache_size += csize;
+}
+
+
+void
+ngx_pool_cache_init(size_t size)
+{
+    ngx_pool_cache_max = size;
+}
+
+
+void
+ngx_pool_cache_report(ngx_log_t *log)
+{
+    ngx_uint_t              i, hits, misses, released;
+    ngx_pool_cache_slot_t  *slot;
+
+    if (ngx_pool_cache_max == 0) {
+        return;
+    }
+
+    hits = 0;
+    misses = 0;
+    released = 0;
+
+    for (i = 0; i < NGX_POOL_CACHE_SLOTS; i++) {
+        slot = &ngx_pool_cache[i];
+
+        ngx_log_debug5(NGX_LOG_DEBUG_ALLOC, log, 0,
+                       "pool cache %uz: cached:%ui hits:%ui misses:%ui "
+                       "released:%ui",
+                       (size_t) 1 << (NGX_POOL_CACHE_MIN_SHIFT + i),
+                       slot->number, slot->hits, slot->misses,
+                       slot->released);
+
+        hits += slot->hits;
+        misses += slot->misses;
+        released += slot->released;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+                  "pool cache: %ui hits, %ui misses, %ui released, "
+                  "%uz bytes cached",
+                  hits, misses, released, ngx_pool_cache_size);
+}
@@ -26,6 +26,16 @@
     ngx_align((sizeof(ngx_pool_t) + 2 * sizeof(ngx_pool_large_t)),            \
               NGX_POOL_ALIGNMENT)
 
+/*
+ * if the cache is enabled, the pool blocks and the large allocations
+ * up to NGX_POOL_CACHE_MAX_SIZE are rounded up to power of two size classes
+ * starting from 256 bytes, so a freed block may be kept and reused
+ */
+#define NGX_POOL_CACHE_MIN_SHIFT  8
+#define NGX_POOL_CACHE_SLOTS      9
+#define NGX_POOL_CACHE_MAX_SIZE                                               \
+    ((size_t) 1 << (NGX_POOL_CACHE_MIN_SHIFT + NGX_POOL_CACHE_SLOTS - 1))
+
 
 typedef void (*ngx_pool_cleanup_pt)(void *data);
 
@@ -43,6 +53,7 @@ typedef struct ngx_pool_large_s  ngx_pool_large_t;
 struct ngx_pool_large_s {
     ngx_pool_large_t     *next;
     void                 *alloc;
+    size_t                size;
 };
 
 
@@ -65,6 +76,16 @@ struct ngx_pool_s {
 };
 
 
+typedef struct {
+    void                 *block;
+    ngx_uint_t            number;
+
+    ngx_uint_t            hits;
+    ngx_uint_t            misses;
+    ngx_uint_t            released;
+} ngx_pool_cache_slot_t;
+
+
 typedef struct {
     ngx_fd_t              fd;
     u_char               *name;
@@ -79,6 +100,9 @@ ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log);
 void ngx_destroy_pool(ngx_pool_t *pool);
 void ngx_reset_pool(ngx_pool_t *pool);
 
+void ngx_pool_cache_init(size_t size);
+void ngx_pool_cache_report(ngx_log_t *log);
+
 void *ngx_palloc(ngx_pool_t *pool, size_t size);
 void *ngx_pnalloc(ngx_pool_t *pool, size_t size);
 void *ngx_pcalloc(ngx_pool_t *pool, size_t size);
@@ -9,9 +9,39 @@
 #include <ngx_core.h>
 
 
+#define NGX_RADIX_STRIDE  6
+
+
+typedef struct {
+    ngx_radix_stride_node_t  *nodes;
+    uintptr_t                *leaves;
+    ngx_uint_t                nnodes;
+    ngx_uint_t                nleaves;
+} ngx_radix_compress_t;
+
+
+static uintptr_t ngx_radix32tree_find_compressed(ngx_radix_tree_t *tree,
+    uint32_t key);
+#if (NGX_HAVE_INET6)
+static uintptr_t ngx_radix128tree_find_compressed(ngx_radix_tree_t *tree,
+    u_char *key);
+#endif
+static void ngx_radix_compress_node(ngx_radix_compress_t *cp, ngx_uint_t n,
+    ngx_radix_node_t *node, uintptr_t value);
 static ngx_radix_node_t *ngx_radix_alloc(ngx_radix_tree_t *tree);
 
 
+static ngx_inline ngx_uint_t
+ngx_radix_popcount(uint64_t n)
+{
+    n -= (n >> 1) & 0x5555555555555555ULL;
+    n = (n & 0x3333333333333333ULL) + ((n >> 2) & 0x3333333333333333ULL);
+    n = (n + (n >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+
+    return (ngx_uint_t) ((n * 0x0101010101010101ULL) >> 56);
+}
+
+
 ngx_radix_tree_t *
 ngx_radix_tree_create(ngx_pool_t *pool, ngx_int_t preallocate)
 {
@@ -27,6 +57,8 @@ ngx_radix_tree_create(ngx_pool_t *pool, ngx_int_t preallocate)
     tree->free = NULL;
     tree->start = NULL;
     tree->size = 0;
+    tree->nodes = NULL;
+    tree->leaves = NULL;
 
     tree->root = ngx_radix_alloc(tree);
     if (tree->root == NULL) {
@@ -112,6 +144,8 @@ ngx_radix32tree_insert(ngx_radix_tree_t *tree, uint32_t key, uint32_t mask,
     uint32_t           bit;
     ngx_radix_node_t  *node, *next;
 
+    tree->nodes = NULL;
+
     bit = 0x80000000;
 
     node = tree->root;
@@ -176,6 +210,8 @@ ngx_radix32tree_delete(ngx_radix_tree_t *tree, uint32_t key, uint32_t mask)
     uint32_t           bit;
     ngx_radix_node_t  *node;
 
+    tree->nodes = NULL;
+
     bit = 0x80000000;
     node = tree->root;
 
@@ -240,6 +276,10 @@ ngx_radix32tree_find(ngx_radix_tree_t *tree, uint32_t key)
     uintptr_t          value;
     ngx_radix_node_t  *node;
 
+    if (tree->nodes) {
+        return ngx_radix32tree_find_compressed(tree, key);
+    }
+
     bit = 0x80000000;
     value = NGX_RADIX_NO_VALUE;
     node = tree->root;
@@ -273,6 +313,8 @@ ngx_radix128tree_insert(ngx_radix_tree_t *tree, u_char *key, u_char *mask,
     ngx_uint_t         i;
     ngx_radix_node_t  *node, *next;
 
+    tree->nodes = NULL;
+
     i = 0;
     bit = 0x80;
 
@@ -355,6 +397,8 @@ ngx_radix128tree_delete(ngx_radix_tree_t *tree, u_char *key, u_char *mask)
     ngx_uint_t         i;
     ngx_radix_node_t  *node;
 
+    tree->nodes = NULL;
+
     i = 0;
     bit = 0x80;
     node = tree->root;
@@ -429,6 +473,10 @@ ngx_radix128tree_find(ngx_radix_tree_t *tree, u_char *key)
     ngx_uint_t         i;
     ngx_radix_node_t  *node;
 
+    if (tree->nodes) {
+        return ngx_radix128tree_find_compressed(tree, key);
+    }
+
     i = 0;
     bit = 0x80;
     value = NGX_RADIX_NO_VALUE;
@@ -460,6 +508,203 @@ ngx_radix128tree_find(ngx_radix_tree_t *tree, u_char *key)
 #endif
 
 
+/*
+ * The binary tree is converted into a multibit trie similar to Poptrie
+ * (Asai and Ohara, SIGCOMM 2015) to make lookups touch a few cache lines
+ * instead of a node per bit.  The values are pushed to the leaves, so
+ * a lookup returns the value of the leaf it stops at.  The binary tree
+ * is kept for updates, which drop the compressed trie.
+ */
+
+ngx_int_t
+ngx_radix_tree_compress(ngx_radix_tree_t *tree)
+{
+    ngx_radix_compress_t  cp;
+
+    tree->nodes = NULL;
+
+    /* the first pass counts the nodes and the leaves */
+
+    cp.nodes = NULL;
+    cp.leaves = NULL;
+    cp.nnodes = 1;
+    cp.nleaves = 0;
+
+    ngx_radix_compress_node(&cp, 0, tree->root, tree->root->value);
+
+    if (cp.nnodes > NGX_MAX_UINT32_VALUE || cp.nleaves > NGX_MAX_UINT32_VALUE)
+    {
+        return NGX_ERROR;
+    }
+
+    cp.nodes = ngx_palloc(tree->pool,
+                          cp.nnodes * sizeof(ngx_radix_stride_node_t));
+    if (cp.nodes == NULL) {
+        return NGX_ERROR;
+    }
+
+    cp.leaves = ngx_palloc(tree->pool, (cp.nleaves + 1) * sizeof(uintptr_t));
+    if (cp.leaves == NULL) {
+        return NGX_ERROR;
+    }
+
+    cp.nnodes = 1;
+    cp.nleaves = 0;
+
+    ngx_radix_compress_node(&cp, 0, tree->root, tree->root->value);
+
+    tree->nodes = cp.nodes;
+    tree->leaves = cp.leaves;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_radix_compress_node(ngx_radix_compress_t *cp, ngx_uint_t n,
+    ngx_radix_node_t *node, uintptr_t value)
+{
+    uint64_t           vector, leafvec;
+    uintptr_t          v, last, values[1 << NGX_RADIX_STRIDE];
+    ngx_uint_t         i, bit, base0, base1, nchildren;
+    ngx_radix_node_t  *next, *children[1 << NGX_RADIX_STRIDE];
+
+    vector = 0;
+    leafvec = 0;
+    last = NGX_RADIX_NO_VALUE;
+    nchildren = 0;
+
+    base0 = cp->nleaves;
+
+    for (i = 0; i < (1 << NGX_RADIX_STRIDE); i++) {
+
+        next = node;
+        v = value;
+
+        for (bit = 1 << (NGX_RADIX_STRIDE - 1); bit; bit >>= 1) {
+
+            next = (i & bit) ? next->right : next->left;
+
+            if (next == NULL) {
+                break;
+            }
+
+            if (next->value != NGX_RADIX_NO_VALUE) {
+                v = next->value;
+            }
+        }
+
+        if (next && (next->left || next->right)) {
+            vector |= (uint64_t) 1 << i;
+            children[nchildren] = next;
+            values[nchildren++] = v;
+            continue;
+        }
+
+        if (cp->nleaves == base0 || v != last) {
+            leafvec |= (uint64_t) 1 << i;
+
+            if (cp->leaves) {
+                cp->leaves[cp->nleaves] = v;
+            }
+
+            cp->nleaves++;
+            last = v;
+        }
+    }
+
+    base1 = cp->nnodes;
+    cp->nnodes += nchildren;
+
+    if (cp->nodes) {
+        cp->nodes[n].vector = vector;
+        cp->nodes[n].leafvec = leafvec;
+        cp->nodes[n].base0 = (uint32_t) base0;
+        cp->nodes[n].base1 = (uint32_t) base1;
+    }
+
+    for (i = 0; i < nchildren; i++) {
+        ngx_radix_compress_node(cp, base1 + i, children[i], values[i]);
+    }
+}
+
+
+static uintptr_t
+ngx_radix32tree_find_compressed(ngx_radix_tree_t *tree, uint32_t key)
+{
+    uint64_t                  k;
+    ngx_uint_t                i, shift;
+    ngx_radix_stride_node_t  *node;
+
+    k = (uint64_t) key << 32;
+    shift = 64 - NGX_RADIX_STRIDE;
+
+    node = tree->nodes;
+    i = (ngx_uint_t) (k >> shift);
+
+    while (node->vector & ((uint64_t) 1 << i)) {
+        node = &tree->nodes[node->base1
+                            + ngx_radix_popcount(node->vector
+                                                 & (((uint64_t) 2 << i) - 1))
+                            - 1];
+
+        shift -= NGX_RADIX_STRIDE;
+        i = (ngx_uint_t) (k >> shift) & ((1 << NGX_RADIX_STRIDE) - 1);
+    }
+
+    return tree->leaves[node->base0
+                        + ngx_radix_popcount(node->leafvec
+                                             & (((uint64_t) 2 << i) - 1))
+                        - 1];
+}
+
+
+#if (NGX_HAVE_INET6)
+
+static uintptr_t
+ngx_radix128tree_find_compressed(ngx_radix_tree_t *tree, u_char *key)
+{
+    ngx_uint_t                i, b, off;
+    ngx_radix_stride_node_t  *node;
+
+    off = 0;
+    node = tree->nodes;
+
+    for ( ;; ) {
+
+        /* 6 bits at the bit offset, the key is padded with zeros */
+
+        b = off >> 3;
+        i = key[b] << 8;
+
+        if (b < 15) {
+            i |= key[b + 1];
+        }
+
+        i = (i >> (16 - NGX_RADIX_STRIDE - (off & 7)))
+            & ((1 << NGX_RADIX_STRIDE) - 1);
+
+        if (!(node->vector & ((uint64_t) 1 << i))) {
+            break;
+        }
+
+        node = &tree->nodes[node->base1
+                            + ngx_radix_popcount(node->vector
+                                                 & (((uint64_t) 2 << i) - 1))
+                            - 1];
+
+        off += NGX_RADIX_STRIDE;
+    }
+
+    return tree->leaves[node->base0
+                        + ngx_radix_popcount(node->leafvec
+                                             & (((uint64_t) 2 << i) - 1))
+                        - 1];
+}
+
+#endif
+
+
 static ngx_radix_node_t *
 ngx_radix_alloc(ngx_radix_tree_t *tree)
 {
@@ -75,6 +75,12 @@ ngx_atomic_t   ngx_stat_writing0;
 ngx_atomic_t  *ngx_stat_writing = &ngx_stat_writing0;
 ngx_atomic_t   ngx_stat_waiting0;
 ngx_atomic_t  *ngx_stat_waiting = &ngx_stat_waiting0;
+ngx_atomic_t   ngx_stat_upstream_reused0;
+ngx_atomic_t  *ngx_stat_upstream_reused = &ngx_stat_upstream_reused0;
+ngx_atomic_t   ngx_stat_upstream_missed0;
+ngx_atomic_t  *ngx_stat_upstream_missed = &ngx_stat_upstream_missed0;
+ngx_atomic_t   ngx_stat_upstream_closed0;
+ngx_atomic_t  *ngx_stat_upstream_closed = &ngx_stat_upstream_closed0;
 
 #endif
 
@@ -514,7 +520,10 @@ ngx_event_module_init(ngx_cycle_t *cycle)
            + cl          /* ngx_stat_active */
            + cl          /* ngx_stat_reading */
            + cl          /* ngx_stat_writing */
-           + cl;         /* ngx_stat_waiting */
+           + cl          /* ngx_stat_waiting */
+           + cl          /* ngx_stat_upstream_reused */
+           + cl          /* ngx_stat_upstream_missed */
+           + cl;         /* ngx_stat_upstream_closed */
 
 #endif
 
@@ -562,6 +571,9 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     ngx_stat_reading = (ngx_atomic_t *) (shared + 7 * cl);
     ngx_stat_writing = (ngx_atomic_t *) (shared + 8 * cl);
     ngx_stat_waiting = (ngx_atomic_t *) (shared + 9 * cl);
+    ngx_stat_upstream_reused = (ngx_atomic_t *) (shared + 10 * cl);
+    ngx_stat_upstream_missed = (ngx_atomic_t *) (shared + 11 * cl);
+    ngx_stat_upstream_closed = (ngx_atomic_t *) (shared + 12 * cl);
 
 #endif
 
@@ -512,6 +512,9 @@ extern ngx_atomic_t  *ngx_stat_active;
 extern ngx_atomic_t  *ngx_stat_reading;
 extern ngx_atomic_t  *ngx_stat_writing;
 extern ngx_atomic_t  *ngx_stat_waiting;
+extern ngx_atomic_t  *ngx_stat_upstream_reused;
+extern ngx_atomic_t  *ngx_stat_upstream_missed;
+extern ngx_atomic_t  *ngx_stat_upstream_closed;
 
 #endif
 
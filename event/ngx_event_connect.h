@@ -17,6 +17,7 @@
 #define NGX_PEER_KEEPALIVE           1
 #define NGX_PEER_NEXT                2
 #define NGX_PEER_FAILED              4
+#define NGX_PEER_RETRY               8
 
 
 typedef struct ngx_peer_connection_s  ngx_peer_connection_t;
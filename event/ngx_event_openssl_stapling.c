@@ -30,14 +30,39 @@ typedef struct {
 
     X509                        *cert;
     X509                        *issuer;
+    STACK_OF(X509)              *chain;
+
+    ngx_shm_zone_t              *cache;
+    u_char                       id[SHA_DIGEST_LENGTH];
+    uint32_t                     hash;
 
     time_t                       valid;
+    time_t                       expire;
 
     unsigned                     verify:1;
     unsigned                     loading:1;
 } ngx_ssl_stapling_t;
 
 
+typedef struct {
+    ngx_rbtree_node_t            node;
+    u_char                       id[SHA_DIGEST_LENGTH];
+
+    time_t                       valid;
+    time_t                       expire;
+    time_t                       loading;
+
+    size_t                       len;
+    u_char                      *data;
+} ngx_ssl_stapling_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+} ngx_ssl_stapling_cache_t;
+
+
 typedef struct ngx_ssl_ocsp_ctx_s  ngx_ssl_ocsp_ctx_t;
 
 struct ngx_ssl_ocsp_ctx_s {
@@ -82,16 +107,30 @@ struct ngx_ssl_ocsp_ctx_s {
 };
 
 
+static ngx_int_t ngx_ssl_stapling_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    X509 *cert, ngx_str_t *file, ngx_str_t *responder, ngx_uint_t verify);
 static ngx_int_t ngx_ssl_stapling_file(ngx_conf_t *cf, ngx_ssl_t *ssl,
-    ngx_str_t *file);
-static ngx_int_t ngx_ssl_stapling_issuer(ngx_conf_t *cf, ngx_ssl_t *ssl);
+    ngx_ssl_stapling_t *staple, ngx_str_t *file);
+static ngx_int_t ngx_ssl_stapling_issuer(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_ssl_stapling_t *staple);
 static ngx_int_t ngx_ssl_stapling_responder(ngx_conf_t *cf, ngx_ssl_t *ssl,
-    ngx_str_t *responder);
+    ngx_ssl_stapling_t *staple, ngx_str_t *responder);
 
 static int ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn,
     void *data);
 static void ngx_ssl_stapling_update(ngx_ssl_stapling_t *staple);
 static void ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx);
+static time_t ngx_ssl_stapling_time(ASN1_GENERALIZEDTIME *asn1time);
+
+static void ngx_ssl_stapling_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_ssl_stapling_node_t *ngx_ssl_stapling_cache_lookup(
+    ngx_ssl_stapling_t *staple);
+static u_char *ngx_ssl_stapling_cache_get(ngx_ssl_stapling_t *staple,
+    size_t *len, ngx_log_t *log);
+static ngx_int_t ngx_ssl_stapling_cache_lock(ngx_ssl_stapling_t *staple);
+static void ngx_ssl_stapling_cache_store(ngx_ssl_stapling_t *staple,
+    ngx_str_t *response, time_t valid, time_t expire, ngx_log_t *log);
 
 static void ngx_ssl_stapling_cleanup(void *data);
 
@@ -117,8 +156,34 @@ static u_char *ngx_ssl_ocsp_log_error(ngx_log_t *log, u_char *buf, size_t len);
 ngx_int_t
 ngx_ssl_stapling(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file,
     ngx_str_t *responder, ngx_uint_t verify)
+{
+    X509  *cert;
+
+    for (cert = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_certificate_index);
+         cert;
+         cert = X509_get_ex_data(cert, ngx_ssl_next_certificate_index))
+    {
+        if (ngx_ssl_stapling_certificate(cf, ssl, cert, file, responder,
+                                         verify)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    SSL_CTX_set_tlsext_status_cb(ssl->ctx, ngx_ssl_certificate_status_callback);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_ssl_stapling_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl, X509 *cert,
+    ngx_str_t *file, ngx_str_t *responder, ngx_uint_t verify)
 {
     ngx_int_t                  rc;
+    ngx_str_t                  url;
+    unsigned int               len;
     ngx_pool_cleanup_t        *cln;
     ngx_ssl_stapling_t        *staple;
 
@@ -135,29 +200,36 @@ ngx_ssl_stapling(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file,
     cln->handler = ngx_ssl_stapling_cleanup;
     cln->data = staple;
 
-    if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_stapling_index, staple)
-        == 0)
-    {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "SSL_CTX_set_ex_data() failed");
+    if (X509_set_ex_data(cert, ngx_ssl_stapling_index, staple) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "X509_set_ex_data() failed");
         return NGX_ERROR;
     }
 
     staple->ssl_ctx = ssl->ctx;
+    staple->cert = cert;
     staple->timeout = 60000;
     staple->verify = verify;
 
+    /* the key of the response in the shared cache */
+
+    if (X509_digest(cert, EVP_sha1(), staple->id, &len) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "X509_digest() failed");
+        return NGX_ERROR;
+    }
+
+    staple->hash = ngx_crc32_short(staple->id, SHA_DIGEST_LENGTH);
+
     if (file->len) {
         /* use OCSP response from the file */
 
-        if (ngx_ssl_stapling_file(cf, ssl, file) != NGX_OK) {
+        if (ngx_ssl_stapling_file(cf, ssl, staple, file) != NGX_OK) {
             return NGX_ERROR;
         }
 
-        goto done;
+        return NGX_OK;
     }
 
-    rc = ngx_ssl_stapling_issuer(cf, ssl);
+    rc = ngx_ssl_stapling_issuer(cf, ssl, staple);
 
     if (rc == NGX_DECLINED) {
         return NGX_OK;
@@ -167,35 +239,26 @@ ngx_ssl_stapling(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file,
         return NGX_ERROR;
     }
 
-    rc = ngx_ssl_stapling_responder(cf, ssl, responder);
+    /* each certificate may have its own responder in the AIA extension */
 
-    if (rc == NGX_DECLINED) {
-        return NGX_OK;
-    }
+    url = *responder;
 
-    if (rc != NGX_OK) {
+    if (ngx_ssl_stapling_responder(cf, ssl, staple, &url) == NGX_ERROR) {
         return NGX_ERROR;
     }
 
-done:
-
-    SSL_CTX_set_tlsext_status_cb(ssl->ctx, ngx_ssl_certificate_status_callback);
-    SSL_CTX_set_tlsext_status_arg(ssl->ctx, staple);
-
     return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_ssl_stapling_file(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file)
+ngx_ssl_stapling_file(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_ssl_stapling_t *staple, ngx_str_t *file)
 {
-    BIO                 *bio;
-    int                  len;
-    u_char              *p, *buf;
-    OCSP_RESPONSE       *response;
-    ngx_ssl_stapling_t  *staple;
-
-    staple = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_stapling_index);
+    BIO            *bio;
+    int             len;
+    u_char         *p, *buf;
+    OCSP_RESPONSE  *response;
 
     if (ngx_conf_full_name(cf->cycle, file, 1) != NGX_OK) {
         return NGX_ERROR;
@@ -255,17 +318,21 @@ failed:
 
 
 static ngx_int_t
-ngx_ssl_stapling_issuer(ngx_conf_t *cf, ngx_ssl_t *ssl)
+ngx_ssl_stapling_issuer(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_ssl_stapling_t *staple)
 {
-    int                  i, n, rc;
-    X509                *cert, *issuer;
-    X509_STORE          *store;
-    X509_STORE_CTX      *store_ctx;
-    STACK_OF(X509)      *chain;
-    ngx_ssl_stapling_t  *staple;
+    int              i, n, rc;
+    X509            *cert, *issuer;
+    X509_STORE      *store;
+    X509_STORE_CTX  *store_ctx;
+    STACK_OF(X509)  *chain;
+
+    cert = staple->cert;
 
-    staple = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_stapling_index);
-    cert = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_certificate_index);
+#ifdef SSL_CTRL_SELECT_CURRENT_CERT
+    /* OpenSSL 1.0.2+, chains are kept per certificate */
+    SSL_CTX_select_current_cert(ssl->ctx, cert);
+#endif
 
 #if OPENSSL_VERSION_NUMBER >= 0x10001000L
     SSL_CTX_get_extra_chain_certs(ssl->ctx, &chain);
@@ -273,6 +340,8 @@ ngx_ssl_stapling_issuer(ngx_conf_t *cf, ngx_ssl_t *ssl)
     chain = ssl->ctx->extra_certs;
 #endif
 
+    staple->chain = chain;
+
     n = sk_X509_num(chain);
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ssl->log, 0,
@@ -286,7 +355,6 @@ ngx_ssl_stapling_issuer(ngx_conf_t *cf, ngx_ssl_t *ssl)
             ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ssl->log, 0,
                            "SSL get issuer: found %p in extra certs", issuer);
 
-            staple->cert = cert;
             staple->issuer = issuer;
 
             return NGX_OK;
@@ -334,7 +402,6 @@ ngx_ssl_stapling_issuer(ngx_conf_t *cf, ngx_ssl_t *ssl)
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ssl->log, 0,
                    "SSL get issuer: found %p in cert store", issuer);
 
-    staple->cert = cert;
     staple->issuer = issuer;
 
     return NGX_OK;
@@ -342,15 +409,13 @@ ngx_ssl_stapling_issuer(ngx_conf_t *cf, ngx_ssl_t *ssl)
 
 
 static ngx_int_t
-ngx_ssl_stapling_responder(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *responder)
+ngx_ssl_stapling_responder(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_ssl_stapling_t *staple, ngx_str_t *responder)
 {
     ngx_url_t                  u;
     char                      *s;
-    ngx_ssl_stapling_t        *staple;
     STACK_OF(OPENSSL_STRING)  *aia;
 
-    staple = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_stapling_index);
-
     if (responder->len == 0) {
 
         /* extract OCSP responder URL from certificate */
@@ -434,12 +499,116 @@ ngx_int_t
 ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_resolver_t *resolver, ngx_msec_t resolver_timeout)
 {
+    X509                *cert;
     ngx_ssl_stapling_t  *staple;
 
-    staple = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_stapling_index);
+    for (cert = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_certificate_index);
+         cert;
+         cert = X509_get_ex_data(cert, ngx_ssl_next_certificate_index))
+    {
+        staple = X509_get_ex_data(cert, ngx_ssl_stapling_index);
 
-    staple->resolver = resolver;
-    staple->resolver_timeout = resolver_timeout;
+        if (staple == NULL) {
+            continue;
+        }
+
+        staple->resolver = resolver;
+        staple->resolver_timeout = resolver_timeout;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_stapling_cache(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_shm_zone_t *shm_zone)
+{
+    X509                *cert;
+    ngx_ssl_stapling_t  *staple;
+
+    for (cert = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_certificate_index);
+         cert;
+         cert = X509_get_ex_data(cert, ngx_ssl_next_certificate_index))
+    {
+        staple = X509_get_ex_data(cert, ngx_ssl_stapling_index);
+
+        if (staple == NULL) {
+            continue;
+        }
+
+        staple->cache = shm_zone;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_ssl_stapling_prefetch(ngx_ssl_t *ssl)
+{
+    X509                *cert;
+    ngx_ssl_stapling_t  *staple;
+
+    /*
+     * start loading responses before the first handshake; with a shared
+     * cache only one worker actually queries the responder
+     */
+
+    for (cert = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_certificate_index);
+         cert;
+         cert = X509_get_ex_data(cert, ngx_ssl_next_certificate_index))
+    {
+        staple = X509_get_ex_data(cert, ngx_ssl_stapling_index);
+
+        if (staple == NULL) {
+            continue;
+        }
+
+        ngx_ssl_stapling_update(staple);
+    }
+}
+
+
+ngx_int_t
+ngx_ssl_stapling_cache_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                     len;
+    ngx_slab_pool_t           *shpool;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    cache = ngx_slab_alloc(shpool, sizeof(ngx_ssl_stapling_cache_t));
+    if (cache == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = cache;
+    shm_zone->data = cache;
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_ssl_stapling_rbtree_insert_value);
+
+    len = sizeof(" in OCSP stapling cache \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in OCSP stapling cache \"%V\"%Z",
+                &shm_zone->shm.name);
 
     return NGX_OK;
 }
@@ -449,6 +618,8 @@ static int
 ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
 {
     int                  rc;
+    X509                *cert;
+    size_t               len;
     u_char              *p;
     ngx_connection_t    *c;
     ngx_ssl_stapling_t  *staple;
@@ -458,10 +629,39 @@ ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
     ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "SSL certificate status callback");
 
-    staple = data;
     rc = SSL_TLSEXT_ERR_NOACK;
 
-    if (staple->staple.len) {
+    /* the certificate has been already selected for the cipher suite */
+
+    cert = SSL_get_certificate(ssl_conn);
+
+    if (cert == NULL) {
+        return rc;
+    }
+
+    staple = X509_get_ex_data(cert, ngx_ssl_stapling_index);
+
+    if (staple == NULL) {
+        return rc;
+    }
+
+    p = NULL;
+    len = 0;
+
+    if (staple->cache) {
+        p = ngx_ssl_stapling_cache_get(staple, &len, c->log);
+    }
+
+    if (staple->expire && staple->expire <= ngx_time()) {
+
+        /* the response is past its nextUpdate time */
+
+        ngx_free(staple->staple.data);
+        ngx_str_null(&staple->staple);
+        staple->expire = 0;
+    }
+
+    if (p == NULL && staple->staple.len) {
         /* we have to copy ocsp response as OpenSSL will free it by itself */
 
         p = OPENSSL_malloc(staple->staple.len);
@@ -471,8 +671,11 @@ ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
         }
 
         ngx_memcpy(p, staple->staple.data, staple->staple.len);
+        len = staple->staple.len;
+    }
 
-        SSL_set_tlsext_status_ocsp_resp(ssl_conn, p, staple->staple.len);
+    if (p) {
+        SSL_set_tlsext_status_ocsp_resp(ssl_conn, p, len);
 
         rc = SSL_TLSEXT_ERR_OK;
     }
@@ -494,6 +697,10 @@ ngx_ssl_stapling_update(ngx_ssl_stapling_t *staple)
         return;
     }
 
+    if (staple->cache && ngx_ssl_stapling_cache_lock(staple) != NGX_OK) {
+        return;
+    }
+
     staple->loading = 1;
 
     ctx = ngx_ssl_ocsp_start();
@@ -531,9 +738,9 @@ ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx)
     u_char                *p;
     int                    n;
     size_t                 len;
+    time_t                 valid, expire;
     ngx_str_t              response;
     X509_STORE            *store;
-    STACK_OF(X509)        *chain;
     OCSP_CERTID           *id;
     OCSP_RESPONSE         *ocsp;
     OCSP_BASICRESP        *basic;
@@ -584,13 +791,7 @@ ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx)
         goto error;
     }
 
-#if OPENSSL_VERSION_NUMBER >= 0x10001000L
-    SSL_CTX_get_extra_chain_certs(staple->ssl_ctx, &chain);
-#else
-    chain = staple->ssl_ctx->extra_certs;
-#endif
-
-    if (OCSP_basic_verify(basic, chain, store,
+    if (OCSP_basic_verify(basic, staple->chain, store,
                           staple->verify ? OCSP_TRUSTOTHER : OCSP_NOVERIFY)
         != 1)
     {
@@ -628,13 +829,38 @@ ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx)
         goto error;
     }
 
+    expire = nextupdate ? ngx_ssl_stapling_time(nextupdate) : NGX_ERROR;
+
     OCSP_CERTID_free(id);
     OCSP_BASICRESP_free(basic);
     OCSP_RESPONSE_free(ocsp);
 
-    /* copy the response to memory not in ctx->pool */
+    valid = ngx_time() + 3600; /* ssl_stapling_valid */
+
+    if (expire == NGX_ERROR) {
+        expire = 0;
+
+    } else if (expire - 300 < valid) {
+
+        /* refresh the response well before it expires */
+
+        valid = ngx_max(expire - 300, ngx_time() + 300);
+    }
 
     response.len = len;
+    response.data = ctx->response->pos;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ctx->log, 0,
+                   "ssl ocsp response, %s, %uz",
+                   OCSP_cert_status_str(n), response.len);
+
+    if (staple->cache) {
+        ngx_ssl_stapling_cache_store(staple, &response, valid, expire,
+                                     ctx->log);
+    }
+
+    /* copy the response to memory not in ctx->pool */
+
     response.data = ngx_alloc(response.len, ctx->log);
 
     if (response.data == NULL) {
@@ -643,20 +869,17 @@ ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx)
 
     ngx_memcpy(response.data, ctx->response->pos, response.len);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ctx->log, 0,
-                   "ssl ocsp response, %s, %uz",
-                   OCSP_cert_status_str(n), response.len);
-
     if (staple->staple.data) {
         ngx_free(staple->staple.data);
     }
 
     staple->staple = response;
+    staple->expire = expire;
 
 done:
 
     staple->loading = 0;
-    staple->valid = ngx_time() + 3600; /* ssl_stapling_valid */
+    staple->valid = valid;
 
     ngx_ssl_ocsp_done(ctx);
     return;
@@ -666,6 +889,11 @@ error:
     staple->loading = 0;
     staple->valid = ngx_time() + 300; /* ssl_stapling_err_valid */
 
+    if (staple->cache) {
+        ngx_ssl_stapling_cache_store(staple, NULL, staple->valid, 0,
+                                     ctx->log);
+    }
+
     if (id) {
         OCSP_CERTID_free(id);
     }
@@ -682,6 +910,313 @@ error:
 }
 
 
+static time_t
+ngx_ssl_stapling_time(ASN1_GENERALIZEDTIME *asn1time)
+{
+    u_char     *p;
+    ngx_int_t   year, month, day, hour, min, sec;
+
+    /*
+     * OpenSSL doesn't provide a way to convert ASN1_GENERALIZEDTIME
+     * into time_t, so "YYYYMMDDHHMMSSZ" is parsed here
+     */
+
+    if (ASN1_STRING_length(asn1time) < 15) {
+        return NGX_ERROR;
+    }
+
+    p = ASN1_STRING_data(asn1time);
+
+    year = ngx_atoi(p, 4);
+    month = ngx_atoi(p + 4, 2);
+    day = ngx_atoi(p + 6, 2);
+    hour = ngx_atoi(p + 8, 2);
+    min = ngx_atoi(p + 10, 2);
+    sec = ngx_atoi(p + 12, 2);
+
+    if (year < 1970 || month < 1 || month > 12 || day < 1 || day > 31
+        || hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60)
+    {
+        return NGX_ERROR;
+    }
+
+    /* shift new year to March 1 and start months from 1 (not 0) */
+
+    if (--month <= 0) {
+        month += 12;
+        year -= 1;
+    }
+
+    /* Gauss' formula for Gregorian days since March 1, 1 BC */
+
+    return (time_t) (
+               /* days in years including leap years since March 1, 1 BC */
+
+               365 * year + year / 4 - year / 100 + year / 400
+
+               /* days before the month */
+
+               + 367 * month / 12 - 30
+
+               /* days before the day */
+
+               + day - 1
+
+               /*
+                * 719527 days were between March 1, 1 BC and March 1, 1970,
+                * 31 and 28 days were in January and February 1970
+                */
+
+               - 719527 + 31 + 28) * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+
+static void
+ngx_ssl_stapling_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t        **p;
+    ngx_ssl_stapling_node_t   *sn, *snt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            sn = (ngx_ssl_stapling_node_t *) node;
+            snt = (ngx_ssl_stapling_node_t *) temp;
+
+            p = (ngx_memcmp(sn->id, snt->id, SHA_DIGEST_LENGTH) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_ssl_stapling_node_t *
+ngx_ssl_stapling_cache_lookup(ngx_ssl_stapling_t *staple)
+{
+    ngx_int_t                  rc;
+    ngx_rbtree_node_t         *node, *sentinel;
+    ngx_ssl_stapling_node_t   *sn;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    /* the shared memory mutex must be held */
+
+    cache = staple->cache->data;
+
+    node = cache->rbtree.root;
+    sentinel = cache->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (staple->hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (staple->hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* staple->hash == node->key */
+
+        sn = (ngx_ssl_stapling_node_t *) node;
+
+        rc = ngx_memcmp(staple->id, sn->id, SHA_DIGEST_LENGTH);
+
+        if (rc == 0) {
+            return sn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static u_char *
+ngx_ssl_stapling_cache_get(ngx_ssl_stapling_t *staple, size_t *len,
+    ngx_log_t *log)
+{
+    u_char                   *p;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_stapling_node_t  *sn;
+
+    shpool = (ngx_slab_pool_t *) staple->cache->shm.addr;
+
+    p = NULL;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    sn = ngx_ssl_stapling_cache_lookup(staple);
+
+    if (sn && sn->len && sn->expire && sn->expire <= ngx_time()) {
+
+        /* the response is past its nextUpdate time */
+
+        ngx_slab_free_locked(shpool, sn->data);
+
+        sn->data = NULL;
+        sn->len = 0;
+        sn->expire = 0;
+    }
+
+    if (sn && sn->len) {
+
+        /* OpenSSL will free the response by itself */
+
+        p = OPENSSL_malloc(sn->len);
+
+        if (p) {
+            ngx_memcpy(p, sn->data, sn->len);
+            *len = sn->len;
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (sn && sn->len && p == NULL) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "OPENSSL_malloc() failed");
+    }
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_ssl_stapling_cache_lock(ngx_ssl_stapling_t *staple)
+{
+    time_t                     now;
+    ngx_slab_pool_t           *shpool;
+    ngx_ssl_stapling_node_t   *sn;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    /*
+     * the worker that marks the cached response as loading queries
+     * the responder, others use the response from the cache
+     */
+
+    cache = staple->cache->data;
+    shpool = (ngx_slab_pool_t *) staple->cache->shm.addr;
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    sn = ngx_ssl_stapling_cache_lookup(staple);
+
+    if (sn == NULL) {
+        sn = ngx_slab_alloc_locked(shpool, sizeof(ngx_ssl_stapling_node_t));
+
+        if (sn == NULL) {
+            ngx_shmtx_unlock(&shpool->mutex);
+
+            /* load the response without the cache */
+
+            return NGX_OK;
+        }
+
+        ngx_memzero(sn, sizeof(ngx_ssl_stapling_node_t));
+
+        sn->node.key = staple->hash;
+        ngx_memcpy(sn->id, staple->id, SHA_DIGEST_LENGTH);
+
+        ngx_rbtree_insert(&cache->rbtree, &sn->node);
+    }
+
+    if (sn->valid >= now) {
+        staple->valid = sn->valid;
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    if (sn->loading + (time_t) (staple->timeout / 1000) > now) {
+        staple->valid = now;
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    sn->loading = now;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_ssl_stapling_cache_store(ngx_ssl_stapling_t *staple, ngx_str_t *response,
+    time_t valid, time_t expire, ngx_log_t *log)
+{
+    u_char                   *p;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_stapling_node_t  *sn;
+
+    shpool = (ngx_slab_pool_t *) staple->cache->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    sn = ngx_ssl_stapling_cache_lookup(staple);
+
+    if (sn == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
+    }
+
+    sn->loading = 0;
+    sn->valid = valid;
+
+    if (response == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
+    }
+
+    p = ngx_slab_alloc_locked(shpool, response->len);
+
+    if (p == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "could not allocate OCSP response%s", shpool->log_ctx);
+        return;
+    }
+
+    if (sn->data) {
+        ngx_slab_free_locked(shpool, sn->data);
+    }
+
+    ngx_memcpy(p, response->data, response->len);
+
+    sn->data = p;
+    sn->len = response->len;
+    sn->expire = expire;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
 static void
 ngx_ssl_stapling_cleanup(void *data)
 {
@@ -1745,4 +2280,28 @@ ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
 }
 
 
+ngx_int_t
+ngx_ssl_stapling_cache(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_shm_zone_t *shm_zone)
+{
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_stapling_cache_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    shm_zone->data = data;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_ssl_stapling_prefetch(ngx_ssl_t *ssl)
+{
+    return;
+}
+
+
 #endif
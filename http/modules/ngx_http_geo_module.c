@@ -31,6 +31,41 @@ typedef struct {
 } ngx_http_geo_high_ranges_t;
 
 
+/*
+ * a range of the binary base, the value is an offset of the value length
+ * followed by the value data, the ranges are stored in the Eytzinger
+ * order starting from the index 1
+ */
+
+typedef struct {
+    uint32_t                         start;
+    uint32_t                         end;
+    uint32_t                         value;
+} ngx_http_geo_binary_range_t;
+
+
+typedef struct {
+    ngx_http_geo_binary_range_t     *ranges;
+    ngx_uint_t                       nranges;
+    u_char                          *base;
+    ngx_http_variable_value_t       *default_value;
+} ngx_http_geo_binary_t;
+
+
+/*
+ * an external base is rebuilt from its source by the master process
+ * and is remapped by all processes on the "reopen" signal
+ */
+
+typedef struct {
+    ngx_str_t                        name;
+    u_char                          *bin;
+    ngx_file_mapping_t               fm;
+    ngx_file_uniq_t                  uniq;
+    ngx_http_geo_binary_t           *binary;
+} ngx_http_geo_external_t;
+
+
 typedef struct {
     ngx_str_node_t                   sn;
     ngx_http_variable_value_t       *value;
@@ -42,6 +77,8 @@ typedef struct {
     ngx_http_variable_value_t       *value;
     ngx_str_t                       *net;
     ngx_http_geo_high_ranges_t       high;
+    ngx_http_geo_binary_t            binary;
+    ngx_http_geo_external_t         *external;
     ngx_radix_tree_t                *tree;
 #if (NGX_HAVE_INET6)
     ngx_radix_tree_t                *tree6;
@@ -63,6 +100,7 @@ typedef struct {
     unsigned                         allow_binary_include:1;
     unsigned                         binary_include:1;
     unsigned                         proxy_recursive:1;
+    unsigned                         compress:1;
 } ngx_http_geo_conf_ctx_t;
 
 
@@ -70,6 +108,7 @@ typedef struct {
     union {
         ngx_http_geo_trees_t         trees;
         ngx_http_geo_high_ranges_t   high;
+        ngx_http_geo_binary_t        binary;
     } u;
 
     ngx_array_t                     *proxies;
@@ -79,6 +118,8 @@ typedef struct {
 } ngx_http_geo_ctx_t;
 
 
+static in_addr_t ngx_http_geo_inaddr(ngx_http_request_t *r,
+    ngx_http_geo_ctx_t *ctx);
 static ngx_int_t ngx_http_geo_addr(ngx_http_request_t *r,
     ngx_http_geo_ctx_t *ctx, ngx_addr_t *addr);
 static ngx_int_t ngx_http_geo_real_addr(ngx_http_request_t *r,
@@ -105,9 +146,26 @@ static char *ngx_http_geo_include(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_str_t *name);
 static ngx_int_t ngx_http_geo_include_binary_base(ngx_conf_t *cf,
     ngx_http_geo_conf_ctx_t *ctx, ngx_str_t *name);
-static void ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx);
+static ngx_int_t ngx_http_geo_check_binary_base(ngx_file_mapping_t *fm);
+static void ngx_http_geo_cleanup_binary_base(void *data);
+static char *ngx_http_geo_external(ngx_conf_t *cf,
+    ngx_http_geo_conf_ctx_t *ctx, ngx_str_t *name);
+static char *ngx_http_geo_external_entry(ngx_conf_t *cf, ngx_command_t *dummy,
+    void *conf);
+static ngx_int_t ngx_http_geo_external_load(ngx_cycle_t *cycle, ngx_log_t *log,
+    ngx_http_geo_external_t *ext, ngx_uint_t compile);
+static ngx_int_t ngx_http_geo_external_compile(ngx_cycle_t *cycle,
+    ngx_log_t *log, ngx_http_geo_external_t *ext);
+static void ngx_http_geo_external_reopen(ngx_cycle_t *cycle, void *data);
+static void ngx_http_geo_cleanup_external(void *data);
+static ngx_int_t ngx_http_geo_pack_ranges(ngx_http_geo_conf_ctx_t *ctx,
+    ngx_pool_t *pool);
+static ngx_int_t ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx);
 static u_char *ngx_http_geo_copy_values(u_char *base, u_char *p,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_uint_t ngx_http_geo_eytzinger(ngx_http_geo_binary_range_t *dst,
+    ngx_http_geo_binary_range_t *src, ngx_uint_t i, ngx_uint_t k,
+    ngx_uint_t n);
 
 
 static ngx_command_t  ngx_http_geo_commands[] = {
@@ -154,17 +212,24 @@ ngx_module_t  ngx_http_geo_module = {
 };
 
 
+/*
+ * the binary base is position independent and is mapped read-only,
+ * so "ptr_size" is the size of the offsets used instead of pointers
+ */
+
 typedef struct {
     u_char    GEORNG[6];
     u_char    version;
     u_char    ptr_size;
     uint32_t  endianness;
     uint32_t  crc32;
+    uint32_t  size;
+    uint32_t  ranges;
 } ngx_http_geo_header_t;
 
 
 static ngx_http_geo_header_t  ngx_http_geo_header = {
-    { 'G', 'E', 'O', 'R', 'N', 'G' }, 0, sizeof(void *), 0x12345678, 0
+    { 'G', 'E', 'O', 'R', 'N', 'G' }, 1, sizeof(uint32_t), 0x12345678, 0, 0, 0
 };
 
 
@@ -243,17 +308,124 @@ ngx_http_geo_range_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
     ngx_http_geo_ctx_t *ctx = (ngx_http_geo_ctx_t *) data;
 
     in_addr_t              inaddr;
-    ngx_addr_t             addr;
     ngx_uint_t             n;
-    struct sockaddr_in    *sin;
     ngx_http_geo_range_t  *range;
+
+    *v = *ctx->u.high.default_value;
+
+    inaddr = ngx_http_geo_inaddr(r, ctx);
+
+    if (ctx->u.high.low) {
+        range = ctx->u.high.low[inaddr >> 16];
+
+        if (range) {
+            n = inaddr & 0xffff;
+            do {
+                if (n >= (ngx_uint_t) range->start
+                    && n <= (ngx_uint_t) range->end)
+                {
+                    *v = *range->value;
+                    break;
+                }
+            } while ((++range)->value);
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http geo: %v", v);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_geo_binary_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_geo_ctx_t *ctx = (ngx_http_geo_ctx_t *) data;
+
+    u_char                       *p;
+    in_addr_t                     inaddr;
+    ngx_uint_t                    k, n;
+    ngx_http_geo_binary_range_t  *ranges;
+
+    *v = *ctx->u.binary.default_value;
+
+    inaddr = ngx_http_geo_inaddr(r, ctx);
+
+    ranges = ctx->u.binary.ranges;
+    n = ctx->u.binary.nranges;
+
+    /*
+     * the first range that ends not before the address: the path of
+     * the search is collected in k, the result is the last node where
+     * the search went left, that is the node before the trailing ones
+     */
+
+    k = 1;
+
+    while (k <= n) {
+        k = 2 * k + (ranges[k].end < inaddr);
+    }
+
+    while (k & 1) {
+        k >>= 1;
+    }
+
+    k >>= 1;
+
+    if (k && ranges[k].start <= inaddr) {
+        p = ctx->u.binary.base + ranges[k].value;
+
+        v->len = *(uint32_t *) p;
+        v->valid = 1;
+        v->no_cacheable = 0;
+        v->not_found = 0;
+        v->data = p + sizeof(uint32_t);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http geo: %v", v);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_geo_external_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char  *p;
+
+    if (ngx_http_geo_binary_variable(r, v, data) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* the base may be remapped while the request is still alive */
+
+    p = ngx_pnalloc(r->pool, v->len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, v->data, v->len);
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static in_addr_t
+ngx_http_geo_inaddr(ngx_http_request_t *r, ngx_http_geo_ctx_t *ctx)
+{
+    in_addr_t              inaddr;
+    ngx_addr_t             addr;
+    struct sockaddr_in    *sin;
 #if (NGX_HAVE_INET6)
     u_char                *p;
     struct in6_addr       *inaddr6;
 #endif
 
-    *v = *ctx->u.high.default_value;
-
     if (ngx_http_geo_addr(r, ctx, &addr) == NGX_OK) {
 
         switch (addr.sockaddr->sa_family) {
@@ -287,26 +459,7 @@ ngx_http_geo_range_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
         inaddr = INADDR_NONE;
     }
 
-    if (ctx->u.high.low) {
-        range = ctx->u.high.low[inaddr >> 16];
-
-        if (range) {
-            n = inaddr & 0xffff;
-            do {
-                if (n >= (ngx_uint_t) range->start
-                    && n <= (ngx_uint_t) range->end)
-                {
-                    *v = *range->value;
-                    break;
-                }
-            } while ((++range)->value);
-        }
-    }
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http geo: %v", v);
-
-    return NGX_OK;
+    return inaddr;
 }
 
 
@@ -372,12 +525,9 @@ static char *
 ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     char                     *rv;
-    size_t                    len;
     ngx_str_t                *value, name;
-    ngx_uint_t                i;
     ngx_conf_t                save;
     ngx_pool_t               *pool;
-    ngx_array_t              *a;
     ngx_http_variable_t      *var;
     ngx_http_geo_ctx_t       *geo;
     ngx_http_geo_conf_ctx_t   ctx;
@@ -445,9 +595,6 @@ ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_rbtree_init(&ctx.rbtree, &ctx.sentinel, ngx_str_rbtree_insert_value);
 
     ctx.pool = cf->pool;
-    ctx.data_size = sizeof(ngx_http_geo_header_t)
-                  + sizeof(ngx_http_variable_value_t)
-                  + 0x10000 * sizeof(ngx_http_geo_range_t *);
     ctx.allow_binary_include = 1;
 
     save = *cf;
@@ -466,23 +613,8 @@ ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     if (ctx.ranges) {
 
         if (ctx.high.low && !ctx.binary_include) {
-            for (i = 0; i < 0x10000; i++) {
-                a = (ngx_array_t *) ctx.high.low[i];
-
-                if (a == NULL || a->nelts == 0) {
-                    continue;
-                }
-
-                len = a->nelts * sizeof(ngx_http_geo_range_t);
-
-                ctx.high.low[i] = ngx_palloc(cf->pool, len + sizeof(void *));
-                if (ctx.high.low[i] == NULL) {
-                    return NGX_CONF_ERROR;
-                }
-
-                ngx_memcpy(ctx.high.low[i], a->elts, len);
-                ctx.high.low[i][a->nelts].value = NULL;
-                ctx.data_size += len + sizeof(void *);
+            if (ngx_http_geo_pack_ranges(&ctx, cf->pool) != NGX_OK) {
+                return NGX_CONF_ERROR;
             }
 
             if (ctx.allow_binary_include
@@ -490,7 +622,7 @@ ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                 && ctx.entries > 100000
                 && ctx.includes == 1)
             {
-                ngx_http_geo_create_binary_base(&ctx);
+                (void) ngx_http_geo_create_binary_base(&ctx);
             }
         }
 
@@ -498,9 +630,24 @@ ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             ctx.high.default_value = &ngx_http_variable_null_value;
         }
 
-        geo->u.high = ctx.high;
+        if (ctx.binary_include) {
+            ctx.binary.default_value = ctx.high.default_value;
+            geo->u.binary = ctx.binary;
+
+            if (ctx.external) {
+                ctx.external->binary = &geo->u.binary;
+                var->get_handler = ngx_http_geo_external_variable;
+
+            } else {
+                var->get_handler = ngx_http_geo_binary_variable;
+            }
+
+        } else {
+            geo->u.high = ctx.high;
+
+            var->get_handler = ngx_http_geo_range_variable;
+        }
 
-        var->get_handler = ngx_http_geo_range_variable;
         var->data = (uintptr_t) geo;
 
         ngx_destroy_pool(ctx.temp_pool);
@@ -550,6 +697,18 @@ ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             return NGX_CONF_ERROR;
         }
 #endif
+
+        if (ctx.compress) {
+            if (ngx_radix_tree_compress(ctx.tree) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+#if (NGX_HAVE_INET6)
+            if (ngx_radix_tree_compress(ctx.tree6) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+#endif
+        }
     }
 
     return rv;
@@ -584,6 +743,13 @@ ngx_http_geo(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
                 goto failed;
             }
 
+            if (ctx->compress) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "the \"ranges\" directive cannot be "
+                                   "used with \"compress\"");
+                goto failed;
+            }
+
             ctx->ranges = 1;
 
             rv = NGX_CONF_OK;
@@ -596,6 +762,20 @@ ngx_http_geo(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
             rv = NGX_CONF_OK;
             goto done;
         }
+
+        else if (ngx_strcmp(value[0].data, "compress") == 0) {
+
+            if (ctx->ranges) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "the \"compress\" directive cannot be "
+                                   "used with \"ranges\"");
+                goto failed;
+            }
+
+            ctx->compress = 1;
+            rv = NGX_CONF_OK;
+            goto done;
+        }
     }
 
     if (cf->args->nelts != 2) {
@@ -610,6 +790,12 @@ ngx_http_geo(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
 
         goto done;
 
+    } else if (ngx_strcmp(value[0].data, "external") == 0) {
+
+        rv = ngx_http_geo_external(cf, ctx, &value[1]);
+
+        goto done;
+
     } else if (ngx_strcmp(value[0].data, "proxy") == 0) {
 
         if (ngx_http_geo_cidr_value(cf, &value[1], &cidr) != NGX_OK) {
@@ -1252,8 +1438,8 @@ ngx_http_geo_value(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
 
     ngx_rbtree_insert(&ctx->rbtree, &gvvn->sn.node);
 
-    ctx->data_size += ngx_align(sizeof(ngx_http_variable_value_t) + value->len,
-                                sizeof(void *));
+    ctx->data_size += ngx_align(sizeof(uint32_t) + value->len,
+                                sizeof(uint32_t));
 
     return val;
 }
@@ -1368,31 +1554,29 @@ static ngx_int_t
 ngx_http_geo_include_binary_base(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_str_t *name)
 {
-    u_char                     *base, ch;
-    time_t                      mtime;
-    size_t                      size, len;
-    ssize_t                     n;
-    uint32_t                    crc32;
-    ngx_err_t                   err;
-    ngx_int_t                   rc;
-    ngx_uint_t                  i;
-    ngx_file_t                  file;
-    ngx_file_info_t             fi;
-    ngx_http_geo_range_t       *range, **ranges;
-    ngx_http_geo_header_t      *header;
-    ngx_http_variable_value_t  *vv;
+    u_char                  ch;
+    time_t                  mtime;
+    ngx_int_t               rc;
+    ngx_file_info_t         fi;
+    ngx_pool_cleanup_t     *cln;
+    ngx_file_mapping_t     *fm;
+    ngx_http_geo_header_t  *header;
+
+    fm = ngx_palloc(ctx->pool, sizeof(ngx_file_mapping_t));
+    if (fm == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
-    file.name = *name;
-    file.log = cf->log;
+    fm->name = ngx_pnalloc(ctx->pool, name->len + 1);
+    if (fm->name == NULL) {
+        return NGX_ERROR;
+    }
 
-    file.fd = ngx_open_file(name->data, NGX_FILE_RDONLY, 0, 0);
-    if (file.fd == NGX_INVALID_FILE) {
-        err = ngx_errno;
-        if (err != NGX_ENOENT) {
-            ngx_conf_log_error(NGX_LOG_CRIT, cf, err,
-                               ngx_open_file_n " \"%s\" failed", name->data);
-        }
+    ngx_cpystrn(fm->name, name->data, name->len + 1);
+
+    fm->log = cf->log;
+
+    if (ngx_open_file_mapping(fm) != NGX_OK) {
         return NGX_DECLINED;
     }
 
@@ -1412,13 +1596,12 @@ ngx_http_geo_include_binary_base(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
         goto done;
     }
 
-    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+    if (ngx_fd_info(fm->fd, &fi) == NGX_FILE_ERROR) {
         ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
                            ngx_fd_info_n " \"%s\" failed", name->data);
         goto failed;
     }
 
-    size = (size_t) ngx_file_size(&fi);
     mtime = ngx_file_mtime(&fi);
 
     ch = name->data[name->len - 4];
@@ -1438,145 +1621,497 @@ ngx_http_geo_include_binary_base(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
         goto failed;
     }
 
-    base = ngx_palloc(ctx->pool, size);
-    if (base == NULL) {
+    if (ngx_http_geo_check_binary_base(fm) != NGX_OK) {
         goto failed;
     }
 
-    n = ngx_read_file(&file, base, size, 0);
+    cln = ngx_pool_cleanup_add(ctx->pool, 0);
+    if (cln == NULL) {
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    cln->handler = ngx_http_geo_cleanup_binary_base;
+    cln->data = fm;
 
-    if (n == NGX_ERROR) {
-        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
-                           ngx_read_file_n " \"%s\" failed", name->data);
-        goto failed;
+    ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                       "using binary geo range base \"%s\"", name->data);
+
+    ctx->include_name = *name;
+    ctx->binary_include = 1;
+
+    header = fm->addr;
+
+    ctx->binary.base = fm->addr;
+    ctx->binary.ranges = (ngx_http_geo_binary_range_t *)
+                             (ctx->binary.base + sizeof(ngx_http_geo_header_t));
+    ctx->binary.nranges = header->ranges;
+
+    return NGX_OK;
+
+failed:
+
+    rc = NGX_DECLINED;
+
+done:
+
+    ngx_close_file_mapping(fm);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_geo_check_binary_base(ngx_file_mapping_t *fm)
+{
+    u_char                 *base;
+    size_t                  size;
+    uint32_t                crc32;
+    ngx_http_geo_header_t  *header;
+
+    base = fm->addr;
+    size = fm->size;
+
+    header = (ngx_http_geo_header_t *) base;
+
+    if (size < sizeof(ngx_http_geo_header_t)
+        || ngx_memcmp(&ngx_http_geo_header, header, 12) != 0
+        || header->size != size
+        || (size - sizeof(ngx_http_geo_header_t))
+           / sizeof(ngx_http_geo_binary_range_t) <= header->ranges)
+    {
+        ngx_log_error(NGX_LOG_WARN, fm->log, 0,
+                      "incompatible binary geo range base \"%s\"", fm->name);
+        return NGX_DECLINED;
     }
 
-    if ((size_t) n != size) {
-        ngx_conf_log_error(NGX_LOG_CRIT, cf, 0,
-            ngx_read_file_n " \"%s\" returned only %z bytes instead of %z",
-            name->data, n, size);
-        goto failed;
+    crc32 = ngx_crc32_long(base + sizeof(ngx_http_geo_header_t),
+                           size - sizeof(ngx_http_geo_header_t));
+
+    if (crc32 != header->crc32) {
+        ngx_log_error(NGX_LOG_WARN, fm->log, 0,
+                      "CRC32 mismatch in binary geo range base \"%s\"",
+                      fm->name);
+        return NGX_DECLINED;
     }
 
-    header = (ngx_http_geo_header_t *) base;
+    return NGX_OK;
+}
 
-    if (size < 16 || ngx_memcmp(&ngx_http_geo_header, header, 12) != 0) {
-        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
-             "incompatible binary geo range base \"%s\"", name->data);
-        goto failed;
+
+static void
+ngx_http_geo_cleanup_binary_base(void *data)
+{
+    ngx_file_mapping_t  *fm = data;
+
+    ngx_close_file_mapping(fm);
+}
+
+
+static char *
+ngx_http_geo_external(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
+    ngx_str_t *name)
+{
+    ngx_str_t                 file;
+    ngx_pool_cleanup_t       *cln;
+    ngx_reopen_handler_t     *rh;
+    ngx_http_geo_external_t  *ext;
+
+    if (!ctx->ranges) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the \"external\" directive must be used "
+                           "with \"ranges\"");
+        return NGX_CONF_ERROR;
     }
 
-    ngx_crc32_init(crc32);
+    if (ctx->entries || ctx->binary_include) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "external geo range base \"%V\" cannot be mixed with usual entries",
+            name);
+        return NGX_CONF_ERROR;
+    }
 
-    vv = (ngx_http_variable_value_t *) (base + sizeof(ngx_http_geo_header_t));
+    file = *name;
 
-    while(vv->data) {
-        len = ngx_align(sizeof(ngx_http_variable_value_t) + vv->len,
-                        sizeof(void *));
-        ngx_crc32_update(&crc32, (u_char *) vv, len);
-        vv->data += (size_t) base;
-        vv = (ngx_http_variable_value_t *) ((u_char *) vv + len);
+    if (ngx_conf_full_name(cf->cycle, &file, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
     }
-    ngx_crc32_update(&crc32, (u_char *) vv, sizeof(ngx_http_variable_value_t));
-    vv++;
 
-    ranges = (ngx_http_geo_range_t **) vv;
+    ext = ngx_pcalloc(ctx->pool, sizeof(ngx_http_geo_external_t));
+    if (ext == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-    for (i = 0; i < 0x10000; i++) {
-        ngx_crc32_update(&crc32, (u_char *) &ranges[i], sizeof(void *));
-        if (ranges[i]) {
-            ranges[i] = (ngx_http_geo_range_t *)
-                            ((u_char *) ranges[i] + (size_t) base);
-        }
+    ext->name.len = file.len;
+    ext->name.data = ngx_pnalloc(ctx->pool, 2 * file.len + 6);
+    if (ext->name.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ext->bin = ngx_sprintf(ext->name.data, "%V%Z", &file);
+    ngx_sprintf(ext->bin, "%V.bin%Z", &file);
+
+    ext->binary = &ctx->binary;
+
+    cln = ngx_pool_cleanup_add(ctx->pool, 0);
+    if (cln == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_http_geo_cleanup_external;
+    cln->data = ext;
+
+    if (ngx_http_geo_external_load(cf->cycle, cf->log, ext, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    rh = ngx_array_push(&cf->cycle->reopen_handlers);
+    if (rh == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    range = (ngx_http_geo_range_t *) &ranges[0x10000];
+    rh->handler = ngx_http_geo_external_reopen;
+    rh->data = ext;
+
+    ctx->include_name.len = file.len + 4;
+    ctx->include_name.data = ext->bin;
+    ctx->binary_include = 1;
+    ctx->external = ext;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_geo_external_entry(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+{
+    ngx_str_t  *value;
 
-    while ((u_char *) range < base + size) {
-        while (range->value) {
-            ngx_crc32_update(&crc32, (u_char *) range,
-                             sizeof(ngx_http_geo_range_t));
-            range->value = (ngx_http_variable_value_t *)
-                               ((u_char *) range->value + (size_t) base);
-            range++;
+    value = cf->args->elts;
+
+    if (cf->args->nelts != 2
+        || ngx_strcmp(value[0].data, "default") == 0
+        || ngx_strcmp(value[0].data, "include") == 0
+        || ngx_strcmp(value[0].data, "external") == 0
+        || ngx_strcmp(value[0].data, "proxy") == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" is not allowed in external geo range base",
+                           &value[0]);
+        return NGX_CONF_ERROR;
+    }
+
+    return ngx_http_geo(cf, dummy, conf);
+}
+
+
+static ngx_int_t
+ngx_http_geo_external_load(ngx_cycle_t *cycle, ngx_log_t *log,
+    ngx_http_geo_external_t *ext, ngx_uint_t compile)
+{
+    time_t                  mtime;
+    ngx_int_t               rc;
+    ngx_file_info_t         fi;
+    ngx_file_mapping_t      fm;
+    ngx_http_geo_header_t  *header;
+
+    if (compile) {
+        if (ngx_file_info(ext->name.data, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_file_info_n " \"%s\" failed", ext->name.data);
+            return NGX_ERROR;
+        }
+
+        mtime = ngx_file_mtime(&fi);
+
+        if (ngx_file_info(ext->bin, &fi) == NGX_FILE_ERROR
+            || ngx_file_mtime(&fi) < mtime)
+        {
+            if (ngx_http_geo_external_compile(cycle, log, ext) != NGX_OK) {
+                return NGX_ERROR;
+            }
         }
-        ngx_crc32_update(&crc32, (u_char *) range, sizeof(void *));
-        range = (ngx_http_geo_range_t *) ((u_char *) range + sizeof(void *));
     }
 
-    ngx_crc32_final(crc32);
+    if (ngx_file_info(ext->bin, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_file_info_n " \"%s\" failed", ext->bin);
+        return NGX_ERROR;
+    }
 
-    if (crc32 != header->crc32) {
-        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
-                  "CRC32 mismatch in binary geo range base \"%s\"", name->data);
+    if (ext->fm.addr && ngx_file_uniq(&fi) == ext->uniq) {
+        return NGX_OK;
+    }
+
+    fm.name = ext->bin;
+    fm.log = log;
+
+    rc = ngx_open_file_mapping(&fm);
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_CRIT, log, NGX_ENOENT,
+                      ngx_open_file_n " \"%s\" failed", ext->bin);
+    }
+
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fm.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", ext->bin);
         goto failed;
     }
 
-    ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
-                       "using binary geo range base \"%s\"", name->data);
+    if (ngx_http_geo_check_binary_base(&fm) != NGX_OK) {
+        goto failed;
+    }
 
-    ctx->include_name = *name;
-    ctx->binary_include = 1;
-    ctx->high.low = ranges;
-    rc = NGX_OK;
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "using external geo range base \"%s\"", ext->bin);
 
-    goto done;
+    header = fm.addr;
+
+    ext->binary->base = fm.addr;
+    ext->binary->ranges = (ngx_http_geo_binary_range_t *)
+                              (ext->binary->base
+                               + sizeof(ngx_http_geo_header_t));
+    ext->binary->nranges = header->ranges;
+
+    if (ext->fm.addr) {
+        ngx_close_file_mapping(&ext->fm);
+    }
+
+    ext->fm = fm;
+    ext->uniq = ngx_file_uniq(&fi);
+
+    return NGX_OK;
 
 failed:
 
-    rc = NGX_DECLINED;
+    ngx_close_file_mapping(&fm);
 
-done:
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_geo_external_compile(ngx_cycle_t *cycle, ngx_log_t *log,
+    ngx_http_geo_external_t *ext)
+{
+    char                     *rv;
+    ngx_int_t                 rc;
+    ngx_conf_t                conf;
+    ngx_http_geo_conf_ctx_t   ctx;
+
+    ngx_memzero(&ctx, sizeof(ngx_http_geo_conf_ctx_t));
+    ngx_memzero(&conf, sizeof(ngx_conf_t));
+
+    rc = NGX_ERROR;
+
+    ctx.pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (ctx.pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx.temp_pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (ctx.temp_pool == NULL) {
+        goto failed;
+    }
+
+    conf.pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (conf.pool == NULL) {
+        goto failed;
+    }
+
+    conf.args = ngx_array_create(ctx.temp_pool, 10, sizeof(ngx_str_t));
+    if (conf.args == NULL) {
+        goto failed;
+    }
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
-                      ngx_close_file_n " \"%s\" failed", name->data);
+    ngx_rbtree_init(&ctx.rbtree, &ctx.sentinel, ngx_str_rbtree_insert_value);
+
+    ctx.ranges = 1;
+    ctx.include_name = ext->name;
+
+    conf.temp_pool = ctx.temp_pool;
+    conf.ctx = &ctx;
+    conf.cycle = cycle;
+    conf.log = log;
+    conf.module_type = NGX_HTTP_MODULE;
+    conf.cmd_type = NGX_HTTP_MAIN_CONF;
+    conf.handler = ngx_http_geo_external_entry;
+
+    rv = ngx_conf_parse(&conf, &ext->name);
+
+    if (rv != NGX_CONF_OK) {
+        goto failed;
+    }
+
+    if (ctx.high.low == NULL) {
+        ctx.high.low = ngx_pcalloc(ctx.pool,
+                                   0x10000 * sizeof(ngx_http_geo_range_t *));
+        if (ctx.high.low == NULL) {
+            goto failed;
+        }
     }
 
+    if (ngx_http_geo_pack_ranges(&ctx, ctx.pool) != NGX_OK) {
+        goto failed;
+    }
+
+    rc = ngx_http_geo_create_binary_base(&ctx);
+
+failed:
+
+    if (conf.pool) {
+        ngx_destroy_pool(conf.pool);
+    }
+
+    if (ctx.temp_pool) {
+        ngx_destroy_pool(ctx.temp_pool);
+    }
+
+    ngx_destroy_pool(ctx.pool);
+
     return rc;
 }
 
 
 static void
+ngx_http_geo_external_reopen(ngx_cycle_t *cycle, void *data)
+{
+    ngx_http_geo_external_t  *ext = data;
+
+    /* the base is rebuilt by the master process only */
+
+    (void) ngx_http_geo_external_load(cycle, cycle->log, ext,
+                                      ngx_process == NGX_PROCESS_MASTER
+                                      || ngx_process == NGX_PROCESS_SINGLE);
+}
+
+
+static void
+ngx_http_geo_cleanup_external(void *data)
+{
+    ngx_http_geo_external_t  *ext = data;
+
+    if (ext->fm.addr) {
+        ngx_close_file_mapping(&ext->fm);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_geo_pack_ranges(ngx_http_geo_conf_ctx_t *ctx, ngx_pool_t *pool)
+{
+    size_t        len;
+    ngx_uint_t    i;
+    ngx_array_t  *a;
+
+    for (i = 0; i < 0x10000; i++) {
+        a = (ngx_array_t *) ctx->high.low[i];
+
+        if (a == NULL) {
+            continue;
+        }
+
+        if (a->nelts == 0) {
+            ctx->high.low[i] = NULL;
+            continue;
+        }
+
+        len = a->nelts * sizeof(ngx_http_geo_range_t);
+
+        ctx->high.low[i] = ngx_palloc(pool, len + sizeof(void *));
+        if (ctx->high.low[i] == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(ctx->high.low[i], a->elts, len);
+        ctx->high.low[i][a->nelts].value = NULL;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
 ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx)
 {
-    u_char                              *p;
+    u_char                              *p, *name;
     uint32_t                             hash;
     ngx_str_t                            s;
-    ngx_uint_t                           i;
+    ngx_uint_t                           i, n;
     ngx_file_mapping_t                   fm;
-    ngx_http_geo_range_t                *r, *range, **ranges;
+    ngx_http_geo_range_t                *r;
     ngx_http_geo_header_t               *header;
+    ngx_http_geo_binary_range_t         *range, *ranges;
     ngx_http_geo_variable_value_node_t  *gvvn;
 
-    fm.name = ngx_pnalloc(ctx->temp_pool, ctx->include_name.len + 5);
+    n = 0;
+
+    for (i = 0; i < 0x10000; i++) {
+        r = ctx->high.low[i];
+        if (r == NULL) {
+            continue;
+        }
+
+        do {
+            n++;
+        } while ((++r)->value);
+    }
+
+    ranges = ngx_palloc(ctx->temp_pool,
+                        n * sizeof(ngx_http_geo_binary_range_t));
+    if (ranges == NULL) {
+        return NGX_ERROR;
+    }
+
+    name = ngx_pnalloc(ctx->temp_pool, ctx->include_name.len + 5);
+    if (name == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(name, "%V.bin%Z", &ctx->include_name);
+
+    /* the base is created aside to not truncate a mapped one */
+
+    fm.name = ngx_pnalloc(ctx->temp_pool, ctx->include_name.len + 9);
     if (fm.name == NULL) {
-        return;
+        return NGX_ERROR;
     }
 
-    ngx_sprintf(fm.name, "%V.bin%Z", &ctx->include_name);
+    ngx_sprintf(fm.name, "%V.bin.tmp%Z", &ctx->include_name);
 
-    fm.size = ctx->data_size;
+    fm.size = sizeof(ngx_http_geo_header_t)
+              + (n + 1) * sizeof(ngx_http_geo_binary_range_t)
+              + ctx->data_size;
     fm.log = ctx->pool->log;
 
+    if (fm.size > NGX_MAX_UINT32_VALUE) {
+        return NGX_ERROR;
+    }
+
     ngx_log_error(NGX_LOG_NOTICE, fm.log, 0,
-                  "creating binary geo range base \"%s\"", fm.name);
+                  "creating binary geo range base \"%s\"", name);
 
     if (ngx_create_file_mapping(&fm) != NGX_OK) {
-        return;
+        return NGX_ERROR;
     }
 
     p = ngx_cpymem(fm.addr, &ngx_http_geo_header,
                    sizeof(ngx_http_geo_header_t));
 
-    p = ngx_http_geo_copy_values(fm.addr, p, ctx->rbtree.root,
-                                 ctx->rbtree.sentinel);
+    p += (n + 1) * sizeof(ngx_http_geo_binary_range_t);
 
-    p += sizeof(ngx_http_variable_value_t);
+    (void) ngx_http_geo_copy_values(fm.addr, p, ctx->rbtree.root,
+                                    ctx->rbtree.sentinel);
 
-    ranges = (ngx_http_geo_range_t **) p;
+    /* the ranges split by 64K blocks are joined back where possible */
 
-    p += 0x10000 * sizeof(ngx_http_geo_range_t *);
+    range = NULL;
+    n = 0;
 
     for (i = 0; i < 0x10000; i++) {
         r = ctx->high.low[i];
@@ -1584,9 +2119,6 @@ ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx)
             continue;
         }
 
-        range = (ngx_http_geo_range_t *) p;
-        ranges[i] = (ngx_http_geo_range_t *) (p - (u_char *) fm.addr);
-
         do {
             s.len = r->value->len;
             s.data = r->value->data;
@@ -1594,24 +2126,59 @@ ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx)
             gvvn = (ngx_http_geo_variable_value_node_t *)
                         ngx_str_rbtree_lookup(&ctx->rbtree, &s, hash);
 
-            range->value = (ngx_http_variable_value_t *) gvvn->offset;
-            range->start = r->start;
-            range->end = r->end;
-            range++;
+            if (range
+                && range->value == gvvn->offset
+                && range->end + 1 == ((i << 16) | r->start))
+            {
+                range->end = (i << 16) | r->end;
+                continue;
+            }
 
-        } while ((++r)->value);
+            range = &ranges[n++];
 
-        range->value = NULL;
+            range->start = (i << 16) | r->start;
+            range->end = (i << 16) | r->end;
+            range->value = (uint32_t) gvvn->offset;
 
-        p = (u_char *) range + sizeof(void *);
+        } while ((++r)->value);
     }
 
+    range = (ngx_http_geo_binary_range_t *)
+                ((u_char *) fm.addr + sizeof(ngx_http_geo_header_t));
+
+    ngx_memzero(range, sizeof(ngx_http_geo_binary_range_t));
+
+    (void) ngx_http_geo_eytzinger(range, ranges, 0, 1, n);
+
+    /* the joined ranges may leave a gap before the values */
+
+    p = (u_char *) &range[n + 1];
+
+    ngx_memzero(p, (u_char *) fm.addr + fm.size - ctx->data_size - p);
+
     header = fm.addr;
+    header->size = (uint32_t) fm.size;
+    header->ranges = (uint32_t) n;
     header->crc32 = ngx_crc32_long((u_char *) fm.addr
                                        + sizeof(ngx_http_geo_header_t),
                                    fm.size - sizeof(ngx_http_geo_header_t));
 
     ngx_close_file_mapping(&fm);
+
+    if (ngx_rename_file(fm.name, name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, fm.log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      fm.name, name);
+
+        if (ngx_delete_file(fm.name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, fm.log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", fm.name);
+        }
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
 }
 
 
@@ -1619,7 +2186,6 @@ static u_char *
 ngx_http_geo_copy_values(u_char *base, u_char *p, ngx_rbtree_node_t *node,
     ngx_rbtree_node_t *sentinel)
 {
-    ngx_http_variable_value_t           *vv;
     ngx_http_geo_variable_value_node_t  *gvvn;
 
     if (node == sentinel) {
@@ -1629,16 +2195,28 @@ ngx_http_geo_copy_values(u_char *base, u_char *p, ngx_rbtree_node_t *node,
     gvvn = (ngx_http_geo_variable_value_node_t *) node;
     gvvn->offset = p - base;
 
-    vv = (ngx_http_variable_value_t *) p;
-    *vv = *gvvn->value;
-    p += sizeof(ngx_http_variable_value_t);
-    vv->data = (u_char *) (p - base);
+    *(uint32_t *) p = (uint32_t) gvvn->sn.str.len;
+    p += sizeof(uint32_t);
 
     p = ngx_cpymem(p, gvvn->sn.str.data, gvvn->sn.str.len);
 
-    p = ngx_align_ptr(p, sizeof(void *));
+    p = ngx_align_ptr(p, sizeof(uint32_t));
 
     p = ngx_http_geo_copy_values(base, p, node->left, sentinel);
 
     return ngx_http_geo_copy_values(base, p, node->right, sentinel);
 }
+
+
+static ngx_uint_t
+ngx_http_geo_eytzinger(ngx_http_geo_binary_range_t *dst,
+    ngx_http_geo_binary_range_t *src, ngx_uint_t i, ngx_uint_t k, ngx_uint_t n)
+{
+    if (k <= n) {
+        i = ngx_http_geo_eytzinger(dst, src, i, 2 * k, n);
+        dst[k] = src[i++];
+        i = ngx_http_geo_eytzinger(dst, src, i, 2 * k + 1, n);
+    }
+
+    return i;
+}
@@ -15,6 +15,7 @@
 typedef struct {
     ngx_flag_t           enable;
     ngx_flag_t           no_buffer;
+    ngx_flag_t           cache;
 
     ngx_hash_t           types;
 
@@ -30,6 +31,30 @@ typedef struct {
 } ngx_http_gzip_conf_t;
 
 
+typedef struct {
+    ngx_uint_t           states;
+} ngx_http_gzip_main_conf_t;
+
+
+typedef struct ngx_http_gzip_state_s  ngx_http_gzip_state_t;
+
+struct ngx_http_gzip_state_s {
+    z_stream                zstream;
+    ngx_http_gzip_state_t  *next;
+
+    ngx_int_t               level;
+    int                     wbits;
+    int                     memlevel;
+
+    u_char                 *start;
+    u_char                 *end;
+    u_char                 *free_mem;
+
+    ngx_pool_t             *pool;
+    ngx_log_t              *log;
+};
+
+
 typedef struct {
     ngx_chain_t         *in;
     ngx_chain_t         *free;
@@ -40,12 +65,18 @@ typedef struct {
     ngx_chain_t         *copied;
     ngx_chain_t         *copy_buf;
 
+#if (NGX_HTTP_CACHE)
+    ngx_buf_t           *variant;
+    ngx_chain_t         *stored;
+    ngx_chain_t        **last_stored;
+    size_t               stored_len;
+    ngx_uint_t           level;
+#endif
+
     ngx_buf_t           *in_buf;
     ngx_buf_t           *out_buf;
     ngx_int_t            bufs;
 
-    void                *preallocated;
-    char                *free_mem;
     ngx_uint_t           allocated;
 
     int                  wbits;
@@ -57,12 +88,13 @@ typedef struct {
     unsigned             nomem:1;
     unsigned             gzheader:1;
     unsigned             buffering:1;
+    unsigned             store:1;
 
     size_t               zin;
     size_t               zout;
 
     uint32_t             crc32;
-    z_stream             zstream;
+    z_stream            *zstream;
     ngx_http_request_t  *request;
 } ngx_http_gzip_ctx_t;
 
@@ -100,18 +132,30 @@ static ngx_int_t ngx_http_gzip_filter_deflate(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
 static ngx_int_t ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
+#if (NGX_HTTP_CACHE)
+static ngx_int_t ngx_http_gzip_filter_variant(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_gzip_filter_capture(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+#endif
 
 static void *ngx_http_gzip_filter_alloc(void *opaque, u_int items,
     u_int size);
 static void ngx_http_gzip_filter_free(void *opaque, void *address);
 static void ngx_http_gzip_filter_free_copy_buf(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
+static void ngx_http_gzip_filter_release(ngx_http_gzip_ctx_t *ctx,
+    ngx_uint_t reuse);
+static void ngx_http_gzip_filter_cleanup(void *data);
 
 static ngx_int_t ngx_http_gzip_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_gzip_ratio_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 
+static ngx_int_t ngx_http_gzip_enabled(ngx_http_request_t *r);
 static ngx_int_t ngx_http_gzip_filter_init(ngx_conf_t *cf);
+static void *ngx_http_gzip_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_gzip_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_gzip_create_conf(ngx_conf_t *cf);
 static char *ngx_http_gzip_merge_conf(ngx_conf_t *cf,
     void *parent, void *child);
@@ -193,6 +237,24 @@ static ngx_command_t  ngx_http_gzip_filter_commands[] = {
       offsetof(ngx_http_gzip_conf_t, min_length),
       NULL },
 
+    { ngx_string("gzip_states"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_gzip_main_conf_t, states),
+      NULL },
+
+#if (NGX_HTTP_CACHE)
+
+    { ngx_string("gzip_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_gzip_conf_t, cache),
+      NULL },
+
+#endif
+
       ngx_null_command
 };
 
@@ -201,8 +263,8 @@ static ngx_http_module_t  ngx_http_gzip_filter_module_ctx = {
     ngx_http_gzip_add_variables,           /* preconfiguration */
     ngx_http_gzip_filter_init,             /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_gzip_create_main_conf,        /* create main configuration */
+    ngx_http_gzip_init_main_conf,          /* init main configuration */
 
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -228,8 +290,14 @@ ngx_module_t  ngx_http_gzip_filter_module = {
 };
 
 
+static ngx_str_t  ngx_http_gzip_coding = ngx_string("gzip");
 static ngx_str_t  ngx_http_gzip_ratio = ngx_string("gzip_ratio");
 
+/* idle deflate states kept by a worker for the next responses */
+
+static ngx_http_gzip_state_t  *ngx_http_gzip_states;
+static ngx_uint_t              ngx_http_gzip_nstates;
+
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
 
@@ -280,6 +348,12 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
         return ngx_http_next_header_filter(r);
     }
 
+    if (r->headers_in.accept_encoding
+        && ngx_http_encoding_ok(r, &ngx_http_gzip_coding) != NGX_OK)
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
     ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_gzip_ctx_t));
     if (ctx == NULL) {
         return NGX_ERROR;
@@ -292,6 +366,43 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
 
     ngx_http_gzip_filter_memory(r, ctx);
 
+#if (NGX_HTTP_CACHE)
+
+    /*
+     * a response served from the cache may have its compressed
+     * variant stored next to the cache node by an earlier request;
+     * variants are kept per compression level, and are neither used
+     * nor stored if the body is changed by filters such as ssi or sub
+     */
+
+    if (conf->cache && r->cached && r->cache && r == r->main
+        && r->cache->file_cache->variant_max
+        && !r->filter_need_in_memory)
+    {
+        switch (ngx_http_file_cache_variant_get(r,
+                                                NGX_HTTP_CACHE_ENCODING_GZIP,
+                                                conf->level, &ctx->variant))
+        {
+        case NGX_OK:
+            ctx->zin = (r->headers_out.content_length_n > 0)
+                       ? (size_t) r->headers_out.content_length_n : 0;
+            ctx->zout = ngx_buf_size(ctx->variant);
+            ctx->buffering = 0;
+            break;
+
+        case NGX_DECLINED:
+            ctx->store = 1;
+            ctx->last_stored = &ctx->stored;
+            ctx->level = conf->level;
+            break;
+
+        default: /* NGX_ERROR */
+            return NGX_ERROR;
+        }
+    }
+
+#endif
+
     h = ngx_list_push(&r->headers_out.headers);
     if (h == NULL) {
         return NGX_ERROR;
@@ -302,12 +413,21 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
     ngx_str_set(&h->value, "gzip");
     r->headers_out.content_encoding = h;
 
-    r->main_filter_need_in_memory = 1;
-
     ngx_http_clear_content_length(r);
     ngx_http_clear_accept_ranges(r);
     ngx_http_clear_etag(r);
 
+#if (NGX_HTTP_CACHE)
+
+    if (ctx->variant) {
+        r->headers_out.content_length_n = ctx->zout;
+        return ngx_http_next_header_filter(r);
+    }
+
+#endif
+
+    r->main_filter_need_in_memory = 1;
+
     return ngx_http_next_header_filter(r);
 }
 
@@ -328,6 +448,14 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http gzip filter");
 
+#if (NGX_HTTP_CACHE)
+
+    if (ctx->variant) {
+        return ngx_http_gzip_filter_variant(r, ctx, in);
+    }
+
+#endif
+
     if (ctx->buffering) {
 
         /*
@@ -358,7 +486,7 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         }
     }
 
-    if (ctx->preallocated == NULL) {
+    if (ctx->zstream == NULL) {
         if (ngx_http_gzip_filter_deflate_start(r, ctx) != NGX_OK) {
             goto failed;
         }
@@ -442,6 +570,16 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             }
         }
 
+#if (NGX_HTTP_CACHE)
+
+        if (ctx->store) {
+            if (ngx_http_gzip_filter_capture(r, ctx) != NGX_OK) {
+                goto failed;
+            }
+        }
+
+#endif
+
         rc = ngx_http_next_body_filter(r, ctx->out);
 
         if (rc == NGX_ERROR) {
@@ -457,6 +595,18 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         ctx->nomem = 0;
 
         if (ctx->done) {
+
+#if (NGX_HTTP_CACHE)
+
+            if (ctx->store) {
+                ngx_http_file_cache_variant_store(r,
+                                                  NGX_HTTP_CACHE_ENCODING_GZIP,
+                                                  ctx->level, ctx->stored,
+                                                  ctx->stored_len);
+            }
+
+#endif
+
             return rc;
         }
     }
@@ -467,10 +617,8 @@ failed:
 
     ctx->done = 1;
 
-    if (ctx->preallocated) {
-        deflateEnd(&ctx->zstream);
-
-        ngx_pfree(r->pool, ctx->preallocated);
+    if (ctx->zstream) {
+        ngx_http_gzip_filter_release(ctx, 0);
     }
 
     ngx_http_gzip_filter_free_copy_buf(r, ctx);
@@ -479,6 +627,92 @@ failed:
 }
 
 
+#if (NGX_HTTP_CACHE)
+
+static ngx_int_t
+ngx_http_gzip_filter_variant(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx,
+    ngx_chain_t *in)
+{
+    ngx_uint_t    last;
+    ngx_chain_t   out;
+
+    /* the cached response body is consumed without being read */
+
+    last = 0;
+
+    for ( /* void */ ; in; in = in->next) {
+        in->buf->pos = in->buf->last;
+        in->buf->file_pos = in->buf->file_last;
+
+        if (in->buf->last_buf) {
+            last = 1;
+        }
+    }
+
+    if (!last) {
+        return NGX_OK;
+    }
+
+    ctx->done = 1;
+    ctx->variant->last_buf = 1;
+
+    out.buf = ctx->variant;
+    out.next = NULL;
+
+    return ngx_http_next_body_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_gzip_filter_capture(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
+{
+    size_t        size;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl, *ln;
+
+    for (cl = ctx->out; cl; cl = cl->next) {
+
+        size = cl->buf->last - cl->buf->pos;
+
+        if (size == 0) {
+            continue;
+        }
+
+        if (ctx->stored_len + size > r->cache->file_cache->variant_max) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "gzip variant exceeds %uz, not stored",
+                           r->cache->file_cache->variant_max);
+            ctx->store = 0;
+            return NGX_OK;
+        }
+
+        b = ngx_create_temp_buf(r->pool, size);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->last = ngx_cpymem(b->pos, cl->buf->pos, size);
+
+        ln = ngx_alloc_chain_link(r->pool);
+        if (ln == NULL) {
+            return NGX_ERROR;
+        }
+
+        ln->buf = b;
+        ln->next = NULL;
+
+        *ctx->last_stored = ln;
+        ctx->last_stored = &ln->next;
+
+        ctx->stored_len += size;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static void
 ngx_http_gzip_filter_memory(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 {
@@ -519,7 +753,23 @@ ngx_http_gzip_filter_memory(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
      *  *) 5920 bytes on amd64 and sparc64
      */
 
+#ifndef ZLIBNG_VERSION
+
     ctx->allocated = 8192 + (1 << (wbits + 2)) + (1 << (memlevel + 9));
+
+#else
+
+    /*
+     * zlib-ng in the zlib compatible mode, it uses SIMD for the longest
+     * match search and CRC folding, adds (64 + sizeof(void *)) bytes to
+     * each allocation for alignment, 16 bytes of padding to the window,
+     * and uses 128K hash table regardless of memlevel
+     */
+
+    ctx->allocated = 8192 + 16 + (1 << (wbits + 2)) + 131072
+                     + (1 << (memlevel + 8)) + 4 * (64 + sizeof(void *));
+
+#endif
 }
 
 
@@ -595,31 +845,107 @@ static ngx_int_t
 ngx_http_gzip_filter_deflate_start(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx)
 {
-    int                    rc;
-    ngx_http_gzip_conf_t  *conf;
+    int                         rc;
+    size_t                      size;
+    ngx_pool_cleanup_t         *cln;
+    ngx_http_gzip_conf_t       *conf;
+    ngx_http_gzip_state_t      *state, **sp;
+    ngx_http_gzip_main_conf_t  *gmcf;
 
     conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+    gmcf = ngx_http_get_module_main_conf(r, ngx_http_gzip_filter_module);
 
-    ctx->preallocated = ngx_palloc(r->pool, ctx->allocated);
-    if (ctx->preallocated == NULL) {
-        return NGX_ERROR;
+    state = NULL;
+
+    if (gmcf->states) {
+
+        /*
+         * a worker reuses idle deflate states with the same parameters:
+         * they were reset by deflateReset() when released, so neither
+         * the zlib memory allocation nor its initialization is repeated
+         */
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_gzip_filter_cleanup;
+        cln->data = ctx;
+
+        for (sp = &ngx_http_gzip_states; *sp; sp = &(*sp)->next) {
+
+            if ((*sp)->level == conf->level
+                && (*sp)->wbits == ctx->wbits
+                && (*sp)->memlevel == ctx->memlevel)
+            {
+                state = *sp;
+                *sp = state->next;
+                ngx_http_gzip_nstates--;
+
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "gzip reuse state: %p", state);
+                break;
+            }
+        }
     }
 
-    ctx->free_mem = ctx->preallocated;
+    if (state == NULL) {
 
-    ctx->zstream.zalloc = ngx_http_gzip_filter_alloc;
-    ctx->zstream.zfree = ngx_http_gzip_filter_free;
-    ctx->zstream.opaque = ctx;
+        size = ngx_align(sizeof(ngx_http_gzip_state_t), NGX_ALIGNMENT)
+               + ctx->allocated;
 
-    rc = deflateInit2(&ctx->zstream, (int) conf->level, Z_DEFLATED,
-                      - ctx->wbits, ctx->memlevel, Z_DEFAULT_STRATEGY);
+        if (gmcf->states) {
+            state = ngx_alloc(size, r->connection->log);
 
-    if (rc != Z_OK) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-                      "deflateInit2() failed: %d", rc);
-        return NGX_ERROR;
+        } else {
+            state = ngx_palloc(r->pool, size);
+        }
+
+        if (state == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(&state->zstream, sizeof(z_stream));
+
+        state->level = conf->level;
+        state->wbits = ctx->wbits;
+        state->memlevel = ctx->memlevel;
+
+        state->start = (u_char *) state
+                       + ngx_align(sizeof(ngx_http_gzip_state_t),
+                                   NGX_ALIGNMENT);
+        state->end = state->start + ctx->allocated;
+        state->free_mem = state->start;
+
+        state->pool = gmcf->states ? NULL : r->pool;
+        state->log = r->connection->log;
+
+        state->zstream.zalloc = ngx_http_gzip_filter_alloc;
+        state->zstream.zfree = ngx_http_gzip_filter_free;
+        state->zstream.opaque = state;
+
+        rc = deflateInit2(&state->zstream, (int) conf->level, Z_DEFLATED,
+                          - ctx->wbits, ctx->memlevel, Z_DEFAULT_STRATEGY);
+
+        if (rc != Z_OK) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "deflateInit2() failed: %d", rc);
+
+            if (state->pool) {
+                ngx_pfree(r->pool, state);
+
+            } else {
+                ngx_free(state);
+            }
+
+            return NGX_ERROR;
+        }
     }
 
+    state->log = r->connection->log;
+    ctx->zstream = &state->zstream;
+
     r->connection->buffered |= NGX_HTTP_GZIP_BUFFERED;
 
     ctx->last_out = &ctx->out;
@@ -665,7 +991,7 @@ ngx_http_gzip_filter_gzheader(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 static ngx_int_t
 ngx_http_gzip_filter_add_data(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 {
-    if (ctx->zstream.avail_in || ctx->flush != Z_NO_FLUSH || ctx->redo) {
+    if (ctx->zstream->avail_in || ctx->flush != Z_NO_FLUSH || ctx->redo) {
         return NGX_OK;
     }
 
@@ -696,13 +1022,13 @@ ngx_http_gzip_filter_add_data(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 
     ctx->in = ctx->in->next;
 
-    ctx->zstream.next_in = ctx->in_buf->pos;
-    ctx->zstream.avail_in = ctx->in_buf->last - ctx->in_buf->pos;
+    ctx->zstream->next_in = ctx->in_buf->pos;
+    ctx->zstream->avail_in = ctx->in_buf->last - ctx->in_buf->pos;
 
     ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "gzip in_buf:%p ni:%p ai:%ud",
                    ctx->in_buf,
-                   ctx->zstream.next_in, ctx->zstream.avail_in);
+                   ctx->zstream->next_in, ctx->zstream->avail_in);
 
     if (ctx->in_buf->last_buf) {
         ctx->flush = Z_FINISH;
@@ -711,10 +1037,10 @@ ngx_http_gzip_filter_add_data(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
         ctx->flush = Z_SYNC_FLUSH;
     }
 
-    if (ctx->zstream.avail_in) {
+    if (ctx->zstream->avail_in) {
 
-        ctx->crc32 = crc32(ctx->crc32, ctx->zstream.next_in,
-                           ctx->zstream.avail_in);
+        ctx->crc32 = crc32(ctx->crc32, ctx->zstream->next_in,
+                           ctx->zstream->avail_in);
 
     } else if (ctx->flush == Z_NO_FLUSH) {
         return NGX_AGAIN;
@@ -729,7 +1055,7 @@ ngx_http_gzip_filter_get_buf(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 {
     ngx_http_gzip_conf_t  *conf;
 
-    if (ctx->zstream.avail_out) {
+    if (ctx->zstream->avail_out) {
         return NGX_OK;
     }
 
@@ -755,8 +1081,8 @@ ngx_http_gzip_filter_get_buf(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
         return NGX_DECLINED;
     }
 
-    ctx->zstream.next_out = ctx->out_buf->pos;
-    ctx->zstream.avail_out = conf->bufs.size;
+    ctx->zstream->next_out = ctx->out_buf->pos;
+    ctx->zstream->avail_out = conf->bufs.size;
 
     return NGX_OK;
 }
@@ -772,11 +1098,11 @@ ngx_http_gzip_filter_deflate(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 
     ngx_log_debug6(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                  "deflate in: ni:%p no:%p ai:%ud ao:%ud fl:%d redo:%d",
-                 ctx->zstream.next_in, ctx->zstream.next_out,
-                 ctx->zstream.avail_in, ctx->zstream.avail_out,
+                 ctx->zstream->next_in, ctx->zstream->next_out,
+                 ctx->zstream->avail_in, ctx->zstream->avail_out,
                  ctx->flush, ctx->redo);
 
-    rc = deflate(&ctx->zstream, ctx->flush);
+    rc = deflate(ctx->zstream, ctx->flush);
 
     if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
         ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
@@ -786,25 +1112,25 @@ ngx_http_gzip_filter_deflate(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 
     ngx_log_debug5(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "deflate out: ni:%p no:%p ai:%ud ao:%ud rc:%d",
-                   ctx->zstream.next_in, ctx->zstream.next_out,
-                   ctx->zstream.avail_in, ctx->zstream.avail_out,
+                   ctx->zstream->next_in, ctx->zstream->next_out,
+                   ctx->zstream->avail_in, ctx->zstream->avail_out,
                    rc);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "gzip in_buf:%p pos:%p",
                    ctx->in_buf, ctx->in_buf->pos);
 
-    if (ctx->zstream.next_in) {
-        ctx->in_buf->pos = ctx->zstream.next_in;
+    if (ctx->zstream->next_in) {
+        ctx->in_buf->pos = ctx->zstream->next_in;
 
-        if (ctx->zstream.avail_in == 0) {
-            ctx->zstream.next_in = NULL;
+        if (ctx->zstream->avail_in == 0) {
+            ctx->zstream->next_in = NULL;
         }
     }
 
-    ctx->out_buf->last = ctx->zstream.next_out;
+    ctx->out_buf->last = ctx->zstream->next_out;
 
-    if (ctx->zstream.avail_out == 0) {
+    if (ctx->zstream->avail_out == 0) {
 
         /* zlib wants to output some more gzipped data */
 
@@ -844,7 +1170,7 @@ ngx_http_gzip_filter_deflate(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
             }
 
         } else {
-            ctx->zstream.avail_out = 0;
+            ctx->zstream->avail_out = 0;
         }
 
         b->flush = 1;
@@ -891,23 +1217,12 @@ static ngx_int_t
 ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx)
 {
-    int                rc;
     ngx_buf_t         *b;
     ngx_chain_t       *cl;
     struct gztrailer  *trailer;
 
-    ctx->zin = ctx->zstream.total_in;
-    ctx->zout = 10 + ctx->zstream.total_out + 8;
-
-    rc = deflateEnd(&ctx->zstream);
-
-    if (rc != Z_OK) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-                      "deflateEnd() failed: %d", rc);
-        return NGX_ERROR;
-    }
-
-    ngx_pfree(r->pool, ctx->preallocated);
+    ctx->zin = ctx->zstream->total_in;
+    ctx->zout = 10 + ctx->zstream->total_out + 8;
 
     cl = ngx_alloc_chain_link(r->pool);
     if (cl == NULL) {
@@ -919,7 +1234,7 @@ ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
     *ctx->last_out = cl;
     ctx->last_out = &cl->next;
 
-    if (ctx->zstream.avail_out >= 8) {
+    if (ctx->zstream->avail_out >= 8) {
         trailer = (struct gztrailer *) ctx->out_buf->last;
         ctx->out_buf->last += 8;
         ctx->out_buf->last_buf = 1;
@@ -964,8 +1279,7 @@ ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
 
 #endif
 
-    ctx->zstream.avail_in = 0;
-    ctx->zstream.avail_out = 0;
+    ngx_http_gzip_filter_release(ctx, 1);
 
     ctx->done = 1;
 
@@ -978,7 +1292,7 @@ ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
 static void *
 ngx_http_gzip_filter_alloc(void *opaque, u_int items, u_int size)
 {
-    ngx_http_gzip_ctx_t *ctx = opaque;
+    ngx_http_gzip_state_t *state = opaque;
 
     void        *p;
     ngx_uint_t   alloc;
@@ -995,37 +1309,44 @@ ngx_http_gzip_filter_alloc(void *opaque, u_int items, u_int size)
         alloc = 8192;
     }
 
-    if (alloc <= ctx->allocated) {
-        p = ctx->free_mem;
-        ctx->free_mem += alloc;
-        ctx->allocated -= alloc;
+    if (alloc <= (ngx_uint_t) (state->end - state->free_mem)) {
+        p = state->free_mem;
+        state->free_mem += alloc;
 
-        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, state->log, 0,
                        "gzip alloc: n:%ud s:%ud a:%ud p:%p",
                        items, size, alloc, p);
 
         return p;
     }
 
-    ngx_log_error(NGX_LOG_ALERT, ctx->request->connection->log, 0,
-                  "gzip filter failed to use preallocated memory: %ud of %ud",
-                  items * size, ctx->allocated);
+    ngx_log_error(NGX_LOG_ALERT, state->log, 0,
+                  "gzip filter failed to use preallocated memory: %ud of %uz",
+                  items * size, (size_t) (state->end - state->free_mem));
 
-    p = ngx_palloc(ctx->request->pool, items * size);
+    if (state->pool) {
+        return ngx_palloc(state->pool, items * size);
+    }
 
-    return p;
+    return ngx_alloc(items * size, state->log);
 }
 
 
 static void
 ngx_http_gzip_filter_free(void *opaque, void *address)
 {
-#if 0
-    ngx_http_gzip_ctx_t *ctx = opaque;
+    ngx_http_gzip_state_t *state = opaque;
+
+    u_char  *p;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0,
                    "gzip free: %p", address);
-#endif
+
+    p = address;
+
+    if (state->pool == NULL && (p < state->start || p >= state->end)) {
+        ngx_free(address);
+    }
 }
 
 
@@ -1043,6 +1364,70 @@ ngx_http_gzip_filter_free_copy_buf(ngx_http_request_t *r,
 }
 
 
+static void
+ngx_http_gzip_filter_release(ngx_http_gzip_ctx_t *ctx, ngx_uint_t reuse)
+{
+    ngx_http_gzip_state_t      *state, **sp;
+    ngx_http_gzip_main_conf_t  *gmcf;
+
+    state = (ngx_http_gzip_state_t *) ctx->zstream;
+    ctx->zstream = NULL;
+
+    if (state->pool) {
+        deflateEnd(&state->zstream);
+        ngx_pfree(state->pool, state);
+        return;
+    }
+
+    gmcf = ngx_http_get_module_main_conf(ctx->request,
+                                         ngx_http_gzip_filter_module);
+
+    if (reuse && deflateReset(&state->zstream) == Z_OK) {
+
+        if (ngx_http_gzip_nstates == gmcf->states) {
+
+            /* the least recently released state is at the end */
+
+            for (sp = &ngx_http_gzip_states; (*sp)->next; sp = &(*sp)->next) {
+                /* void */
+            }
+
+            deflateEnd(&(*sp)->zstream);
+            ngx_free(*sp);
+
+            *sp = NULL;
+            ngx_http_gzip_nstates--;
+        }
+
+        /* the connection log may be freed before the state is reused */
+
+        state->log = ngx_cycle->log;
+
+        state->next = ngx_http_gzip_states;
+        ngx_http_gzip_states = state;
+        ngx_http_gzip_nstates++;
+
+        return;
+    }
+
+    deflateEnd(&state->zstream);
+    ngx_free(state);
+}
+
+
+static void
+ngx_http_gzip_filter_cleanup(void *data)
+{
+    ngx_http_gzip_ctx_t  *ctx = data;
+
+    /* the request was finalized before the response was compressed */
+
+    if (ctx->zstream) {
+        ngx_http_gzip_filter_release(ctx, 1);
+    }
+}
+
+
 static ngx_int_t
 ngx_http_gzip_add_variables(ngx_conf_t *cf)
 {
@@ -1103,6 +1488,33 @@ ngx_http_gzip_ratio_variable(ngx_http_request_t *r,
 }
 
 
+static void *
+ngx_http_gzip_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_gzip_main_conf_t  *gmcf;
+
+    gmcf = ngx_palloc(cf->pool, sizeof(ngx_http_gzip_main_conf_t));
+    if (gmcf == NULL) {
+        return NULL;
+    }
+
+    gmcf->states = NGX_CONF_UNSET_UINT;
+
+    return gmcf;
+}
+
+
+static char *
+ngx_http_gzip_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_gzip_main_conf_t *gmcf = conf;
+
+    ngx_conf_init_uint_value(gmcf->states, 0);
+
+    return NGX_CONF_OK;
+}
+
+
 static void *
 ngx_http_gzip_create_conf(ngx_conf_t *cf)
 {
@@ -1123,6 +1535,7 @@ ngx_http_gzip_create_conf(ngx_conf_t *cf)
 
     conf->enable = NGX_CONF_UNSET;
     conf->no_buffer = NGX_CONF_UNSET;
+    conf->cache = NGX_CONF_UNSET;
 
     conf->postpone_gzipping = NGX_CONF_UNSET_SIZE;
     conf->level = NGX_CONF_UNSET;
@@ -1142,6 +1555,7 @@ ngx_http_gzip_merge_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->enable, prev->enable, 0);
     ngx_conf_merge_value(conf->no_buffer, prev->no_buffer, 0);
+    ngx_conf_merge_value(conf->cache, prev->cache, 0);
 
     ngx_conf_merge_bufs_value(conf->bufs, prev->bufs,
                               (128 * 1024) / ngx_pagesize, ngx_pagesize);
@@ -1166,9 +1580,35 @@ ngx_http_gzip_merge_conf(ngx_conf_t *cf, void *parent, void *child)
 }
 
 
+static ngx_int_t
+ngx_http_gzip_enabled(ngx_http_request_t *r)
+{
+    ngx_http_gzip_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
+    if (!conf->enable
+        || (r->headers_out.content_length_n != -1
+            && r->headers_out.content_length_n < conf->min_length)
+        || ngx_http_test_content_type(r, &conf->types) == NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_gzip_filter_init(ngx_conf_t *cf)
 {
+    if (ngx_http_encoding_add(cf, &ngx_http_gzip_coding,
+                              ngx_http_gzip_enabled)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
     ngx_http_next_header_filter = ngx_http_top_header_filter;
     ngx_http_top_header_filter = ngx_http_gzip_header_filter;
 
@@ -17,10 +17,21 @@
 
 typedef struct {
     ngx_uint_t  enable;
+    ngx_uint_t  brotli;
+    ngx_uint_t  zstd;
 } ngx_http_gzip_static_conf_t;
 
 
+typedef struct {
+    ngx_str_t   name;
+    ngx_str_t   suffix;
+    ngx_uint_t  offset;
+} ngx_http_gzip_static_coding_t;
+
+
 static ngx_int_t ngx_http_gzip_static_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_gzip_static_send(ngx_http_request_t *r,
+    ngx_http_gzip_static_coding_t *coding, ngx_uint_t enable);
 static void *ngx_http_gzip_static_create_conf(ngx_conf_t *cf);
 static char *ngx_http_gzip_static_merge_conf(ngx_conf_t *cf, void *parent,
     void *child);
@@ -44,6 +55,20 @@ static ngx_command_t  ngx_http_gzip_static_commands[] = {
       offsetof(ngx_http_gzip_static_conf_t, enable),
       &ngx_http_gzip_static },
 
+    { ngx_string("brotli_static"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_gzip_static_conf_t, brotli),
+      &ngx_http_gzip_static },
+
+    { ngx_string("zstd_static"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_gzip_static_conf_t, zstd),
+      &ngx_http_gzip_static },
+
       ngx_null_command
 };
 
@@ -79,21 +104,30 @@ ngx_module_t  ngx_http_gzip_static_module = {
 };
 
 
+/* precompressed files are tested in the order of preference */
+
+static ngx_http_gzip_static_coding_t  ngx_http_gzip_static_codings[] = {
+
+    { ngx_string("zstd"), ngx_string(".zst"),
+      offsetof(ngx_http_gzip_static_conf_t, zstd) },
+
+    { ngx_string("br"), ngx_string(".br"),
+      offsetof(ngx_http_gzip_static_conf_t, brotli) },
+
+    { ngx_string("gzip"), ngx_string(".gz"),
+      offsetof(ngx_http_gzip_static_conf_t, enable) },
+
+    { ngx_null_string, ngx_null_string, 0 }
+};
+
+
 static ngx_int_t
 ngx_http_gzip_static_handler(ngx_http_request_t *r)
 {
-    u_char                       *p;
-    size_t                        root;
-    ngx_str_t                     path;
-    ngx_int_t                     rc;
-    ngx_uint_t                    level;
-    ngx_log_t                    *log;
-    ngx_buf_t                    *b;
-    ngx_chain_t                   out;
-    ngx_table_elt_t              *h;
-    ngx_open_file_info_t          of;
-    ngx_http_core_loc_conf_t     *clcf;
-    ngx_http_gzip_static_conf_t  *gzcf;
+    ngx_int_t                       rc;
+    ngx_uint_t                      enable;
+    ngx_http_gzip_static_conf_t    *gzcf;
+    ngx_http_gzip_static_coding_t  *coding;
 
     if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
         return NGX_DECLINED;
@@ -105,12 +139,51 @@ ngx_http_gzip_static_handler(ngx_http_request_t *r)
 
     gzcf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_static_module);
 
-    if (gzcf->enable == NGX_HTTP_GZIP_STATIC_OFF) {
-        return NGX_DECLINED;
+    for (coding = ngx_http_gzip_static_codings; coding->name.len; coding++) {
+
+        enable = *(ngx_uint_t *) ((char *) gzcf + coding->offset);
+
+        if (enable == NGX_HTTP_GZIP_STATIC_OFF) {
+            continue;
+        }
+
+        rc = ngx_http_gzip_static_send(r, coding, enable);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
     }
 
-    if (gzcf->enable == NGX_HTTP_GZIP_STATIC_ON) {
-        rc = ngx_http_gzip_ok(r);
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_gzip_static_send(ngx_http_request_t *r,
+    ngx_http_gzip_static_coding_t *coding, ngx_uint_t enable)
+{
+    u_char                    *p;
+    size_t                     root;
+    ngx_str_t                  path;
+    ngx_int_t                  rc;
+    ngx_uint_t                 level;
+    ngx_log_t                 *log;
+    ngx_buf_t                 *b;
+    ngx_chain_t                out;
+    ngx_table_elt_t           *h;
+    ngx_open_file_info_t       of;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    if (enable == NGX_HTTP_GZIP_STATIC_ON) {
+
+        if (coding->offset
+            == offsetof(ngx_http_gzip_static_conf_t, enable))
+        {
+            rc = ngx_http_gzip_ok(r);
+
+        } else {
+            rc = ngx_http_encoding_ok(r, &coding->name);
+        }
 
     } else {
         /* always */
@@ -125,14 +198,12 @@ ngx_http_gzip_static_handler(ngx_http_request_t *r)
 
     log = r->connection->log;
 
-    p = ngx_http_map_uri_to_path(r, &path, &root, sizeof(".gz") - 1);
+    p = ngx_http_map_uri_to_path(r, &path, &root, coding->suffix.len);
     if (p == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    *p++ = '.';
-    *p++ = 'g';
-    *p++ = 'z';
+    p = ngx_cpymem(p, coding->suffix.data, coding->suffix.len);
     *p = '\0';
 
     path.len = p - path.data;
@@ -188,7 +259,7 @@ ngx_http_gzip_static_handler(ngx_http_request_t *r)
         return NGX_DECLINED;
     }
 
-    if (gzcf->enable == NGX_HTTP_GZIP_STATIC_ON) {
+    if (enable == NGX_HTTP_GZIP_STATIC_ON) {
         r->gzip_vary = 1;
 
         if (rc != NGX_OK) {
@@ -243,7 +314,7 @@ ngx_http_gzip_static_handler(ngx_http_request_t *r)
 
     h->hash = 1;
     ngx_str_set(&h->key, "Content-Encoding");
-    ngx_str_set(&h->value, "gzip");
+    h->value = coding->name;
     r->headers_out.content_encoding = h;
 
     r->ignore_content_encoding = 1;
@@ -296,6 +367,8 @@ ngx_http_gzip_static_create_conf(ngx_conf_t *cf)
     }
 
     conf->enable = NGX_CONF_UNSET_UINT;
+    conf->brotli = NGX_CONF_UNSET_UINT;
+    conf->zstd = NGX_CONF_UNSET_UINT;
 
     return conf;
 }
@@ -309,6 +382,10 @@ ngx_http_gzip_static_merge_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_uint_value(conf->enable, prev->enable,
                               NGX_HTTP_GZIP_STATIC_OFF);
+    ngx_conf_merge_uint_value(conf->brotli, prev->brotli,
+                              NGX_HTTP_GZIP_STATIC_OFF);
+    ngx_conf_merge_uint_value(conf->zstd, prev->zstd,
+                              NGX_HTTP_GZIP_STATIC_OFF);
 
     return NGX_CONF_OK;
 }
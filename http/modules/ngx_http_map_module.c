@@ -16,6 +16,57 @@ typedef struct {
 } ngx_http_map_conf_t;
 
 
+/*
+ * an external map is rebuilt from its source by the master process
+ * into a position independent table that is mapped read-only and
+ * is remapped by all processes on the "reopen" signal
+ */
+
+typedef struct {
+    ngx_str_t                   name;
+    u_char                     *bin;
+    ngx_file_mapping_t          fm;
+    ngx_file_uniq_t             uniq;
+    u_char                     *base;
+    uint32_t                   *buckets;
+    ngx_uint_t                  nbuckets;
+} ngx_http_map_external_t;
+
+
+/*
+ * the key and the value are offsets of the length followed by the data,
+ * the keys are ordered by buckets
+ */
+
+typedef struct {
+    uint32_t                    hash;
+    uint32_t                    key;
+    uint32_t                    value;
+} ngx_http_map_binary_key_t;
+
+
+typedef struct {
+    ngx_str_node_t              sn;
+    uint32_t                    offset;
+} ngx_http_map_value_node_t;
+
+
+typedef struct {
+    ngx_str_t                   key;
+    uint32_t                    hash;
+    ngx_http_map_value_node_t  *value;
+} ngx_http_map_entry_t;
+
+
+typedef struct {
+    ngx_array_t                 entries;
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    size_t                      data_size;
+    ngx_pool_t                 *pool;
+} ngx_http_map_build_t;
+
+
 typedef struct {
     ngx_hash_keys_arrays_t      keys;
 
@@ -26,6 +77,7 @@ typedef struct {
 #endif
 
     ngx_http_variable_value_t  *default_value;
+    ngx_http_map_external_t    *external;
     ngx_conf_t                 *cf;
     ngx_uint_t                  hostnames;      /* unsigned  hostnames:1 */
 } ngx_http_map_conf_ctx_t;
@@ -35,15 +87,51 @@ typedef struct {
     ngx_http_map_t              map;
     ngx_http_complex_value_t    value;
     ngx_http_variable_value_t  *default_value;
+    ngx_http_map_external_t    *external;
     ngx_uint_t                  hostnames;      /* unsigned  hostnames:1 */
 } ngx_http_map_ctx_t;
 
 
+typedef struct {
+    u_char                      MAPTBL[6];
+    u_char                      version;
+    u_char                      ptr_size;
+    uint32_t                    endianness;
+    uint32_t                    crc32;
+    uint32_t                    size;
+    uint32_t                    buckets;
+    uint32_t                    keys;
+} ngx_http_map_header_t;
+
+
+static ngx_http_map_header_t  ngx_http_map_header = {
+    { 'M', 'A', 'P', 'T', 'B', 'L' }, 1, sizeof(uint32_t), 0x12345678,
+    0, 0, 0, 0
+};
+
+
 static int ngx_libc_cdecl ngx_http_map_cmp_dns_wildcards(const void *one,
     const void *two);
 static void *ngx_http_map_create_conf(ngx_conf_t *cf);
 static char *ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_map(ngx_conf_t *cf, ngx_command_t *dummy, void *conf);
+static ngx_int_t ngx_http_map_external_find(ngx_http_request_t *r,
+    ngx_http_map_external_t *ext, ngx_str_t *match,
+    ngx_http_variable_value_t *v);
+static char *ngx_http_map_external(ngx_conf_t *cf,
+    ngx_http_map_conf_ctx_t *ctx, ngx_str_t *name);
+static char *ngx_http_map_external_entry(ngx_conf_t *cf, ngx_command_t *dummy,
+    void *conf);
+static ngx_int_t ngx_http_map_external_load(ngx_cycle_t *cycle, ngx_log_t *log,
+    ngx_http_map_external_t *ext, ngx_uint_t compile);
+static ngx_int_t ngx_http_map_external_compile(ngx_cycle_t *cycle,
+    ngx_log_t *log, ngx_http_map_external_t *ext);
+static ngx_int_t ngx_http_map_write_table(ngx_http_map_build_t *b,
+    ngx_file_mapping_t *fm);
+static u_char *ngx_http_map_copy_values(u_char *base, u_char *p,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_map_external_reopen(ngx_cycle_t *cycle, void *data);
+static void ngx_http_map_cleanup_external(void *data);
 
 
 static ngx_command_t  ngx_http_map_commands[] = {
@@ -110,6 +198,7 @@ ngx_http_map_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
 {
     ngx_http_map_ctx_t  *map = (ngx_http_map_ctx_t *) data;
 
+    ngx_int_t                   rc;
     ngx_str_t                   val;
     ngx_http_variable_value_t  *value;
 
@@ -124,7 +213,24 @@ ngx_http_map_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
         val.len--;
     }
 
-    value = ngx_http_map_find(r, &map->map, &val);
+    if (map->external) {
+        rc = ngx_http_map_external_find(r, map->external, &val, v);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_OK) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http map: \"%V\" \"%v\"", &val, v);
+            return NGX_OK;
+        }
+
+        value = NULL;
+
+    } else {
+        value = ngx_http_map_find(r, &map->map, &val);
+    }
 
     if (value == NULL) {
         value = map->default_value;
@@ -147,6 +253,65 @@ ngx_http_map_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
 }
 
 
+static ngx_int_t
+ngx_http_map_external_find(ngx_http_request_t *r, ngx_http_map_external_t *ext,
+    ngx_str_t *match, ngx_http_variable_value_t *v)
+{
+    u_char                     *low, *p;
+    uint32_t                    hash;
+    ngx_uint_t                  i, last;
+    ngx_http_map_binary_key_t  *keys;
+
+    low = ngx_pnalloc(r->pool, match->len);
+    if (low == NULL) {
+        return NGX_ERROR;
+    }
+
+    hash = (uint32_t) ngx_hash_strlow(low, match->data, match->len);
+
+    keys = (ngx_http_map_binary_key_t *) &ext->buckets[ext->nbuckets + 1];
+
+    i = ext->buckets[hash % ext->nbuckets];
+    last = ext->buckets[hash % ext->nbuckets + 1];
+
+    for ( /* void */ ; i < last; i++) {
+
+        if (keys[i].hash != hash) {
+            continue;
+        }
+
+        p = ext->base + keys[i].key;
+
+        if (*(uint32_t *) p != match->len
+            || ngx_memcmp(p + sizeof(uint32_t), low, match->len) != 0)
+        {
+            continue;
+        }
+
+        p = ext->base + keys[i].value;
+
+        v->len = *(uint32_t *) p;
+
+        /* the table may be remapped while the request is still alive */
+
+        v->data = ngx_pnalloc(r->pool, v->len);
+        if (v->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(v->data, p + sizeof(uint32_t), v->len);
+
+        v->valid = 1;
+        v->no_cacheable = 0;
+        v->not_found = 0;
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
 static void *
 ngx_http_map_create_conf(ngx_conf_t *cf)
 {
@@ -264,6 +429,7 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 #endif
 
     ctx.default_value = NULL;
+    ctx.external = NULL;
     ctx.cf = &save;
     ctx.hostnames = 0;
 
@@ -286,6 +452,7 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                                              &ngx_http_variable_null_value;
 
     map->hostnames = ctx.hostnames;
+    map->external = ctx.external;
 
     hash.key = ngx_hash_key_lc;
     hash.max_size = mcf->hash_max_size;
@@ -401,6 +568,10 @@ ngx_http_map(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
         return ngx_conf_include(cf, dummy, conf);
     }
 
+    if (ngx_strcmp(value[0].data, "external") == 0) {
+        return ngx_http_map_external(cf, ctx, &value[1]);
+    }
+
     if (value[1].data[0] == '$') {
         name = value[1];
         name.len--;
@@ -502,6 +673,13 @@ found:
         return NGX_CONF_OK;
     }
 
+    if (ctx->external) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "external map \"%V\" cannot be mixed with "
+                           "usual entries", &ctx->external->name);
+        return NGX_CONF_ERROR;
+    }
+
 #if (NGX_PCRE)
 
     if (value[0].len && value[0].data[0] == '~') {
@@ -565,3 +743,526 @@ found:
 
     return NGX_CONF_ERROR;
 }
+
+
+static char *
+ngx_http_map_external(ngx_conf_t *cf, ngx_http_map_conf_ctx_t *ctx,
+    ngx_str_t *name)
+{
+    ngx_str_t                 file;
+    ngx_pool_cleanup_t       *cln;
+    ngx_reopen_handler_t     *rh;
+    ngx_http_map_external_t  *ext;
+
+    if (ctx->external) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate external map parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ctx->keys.keys.nelts
+        || ctx->keys.dns_wc_head.nelts
+        || ctx->keys.dns_wc_tail.nelts
+#if (NGX_PCRE)
+        || ctx->regexes.nelts
+#endif
+       )
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "external map \"%V\" cannot be mixed with "
+                           "usual entries", name);
+        return NGX_CONF_ERROR;
+    }
+
+    file = *name;
+
+    if (ngx_conf_full_name(cf->cycle, &file, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ext = ngx_pcalloc(ctx->keys.pool, sizeof(ngx_http_map_external_t));
+    if (ext == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ext->name.len = file.len;
+    ext->name.data = ngx_pnalloc(ctx->keys.pool, 2 * file.len + 6);
+    if (ext->name.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ext->bin = ngx_sprintf(ext->name.data, "%V%Z", &file);
+    ngx_sprintf(ext->bin, "%V.bin%Z", &file);
+
+    cln = ngx_pool_cleanup_add(ctx->keys.pool, 0);
+    if (cln == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_http_map_cleanup_external;
+    cln->data = ext;
+
+    if (ngx_http_map_external_load(cf->cycle, cf->log, ext, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    rh = ngx_array_push(&cf->cycle->reopen_handlers);
+    if (rh == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    rh->handler = ngx_http_map_external_reopen;
+    rh->data = ext;
+
+    ctx->external = ext;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_map_external_entry(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+{
+    uint32_t                    hash;
+    ngx_str_t                  *value, *key;
+    ngx_http_map_entry_t       *e;
+    ngx_http_map_build_t       *b;
+    ngx_http_map_value_node_t  *vn;
+
+    b = cf->ctx;
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts != 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of the map parameters");
+        return NGX_CONF_ERROR;
+    }
+
+    if (value[1].data[0] == '$') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "variables are not supported in external map");
+        return NGX_CONF_ERROR;
+    }
+
+    if (value[0].data[0] == '~') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "regular expressions are not supported "
+                           "in external map");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(value[0].data, "default") == 0
+        || ngx_strcmp(value[0].data, "include") == 0
+        || ngx_strcmp(value[0].data, "external") == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" is not allowed in external map", &value[0]);
+        return NGX_CONF_ERROR;
+    }
+
+    key = &value[0];
+
+    if (key->len && key->data[0] == '\\') {
+        key->len--;
+        key->data++;
+    }
+
+    hash = ngx_crc32_long(value[1].data, value[1].len);
+
+    vn = (ngx_http_map_value_node_t *)
+             ngx_str_rbtree_lookup(&b->rbtree, &value[1], hash);
+
+    if (vn == NULL) {
+        vn = ngx_palloc(b->pool, sizeof(ngx_http_map_value_node_t));
+        if (vn == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        vn->sn.node.key = hash;
+        vn->sn.str = value[1];
+        vn->offset = 0;
+
+        ngx_rbtree_insert(&b->rbtree, &vn->sn.node);
+
+        b->data_size += ngx_align(sizeof(uint32_t) + value[1].len,
+                                  sizeof(uint32_t));
+    }
+
+    e = ngx_array_push(&b->entries);
+    if (e == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    e->key = *key;
+    e->hash = (uint32_t) ngx_hash_strlow(key->data, key->data, key->len);
+    e->value = vn;
+
+    b->data_size += ngx_align(sizeof(uint32_t) + key->len, sizeof(uint32_t));
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_map_external_load(ngx_cycle_t *cycle, ngx_log_t *log,
+    ngx_http_map_external_t *ext, ngx_uint_t compile)
+{
+    u_char                 *base;
+    size_t                  size;
+    time_t                  mtime;
+    uint32_t                crc32, *buckets;
+    ngx_int_t               rc;
+    ngx_file_info_t         fi;
+    ngx_file_mapping_t      fm;
+    ngx_http_map_header_t  *header;
+
+    if (compile) {
+        if (ngx_file_info(ext->name.data, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_file_info_n " \"%s\" failed", ext->name.data);
+            return NGX_ERROR;
+        }
+
+        mtime = ngx_file_mtime(&fi);
+
+        if (ngx_file_info(ext->bin, &fi) == NGX_FILE_ERROR
+            || ngx_file_mtime(&fi) < mtime)
+        {
+            if (ngx_http_map_external_compile(cycle, log, ext) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (ngx_file_info(ext->bin, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_file_info_n " \"%s\" failed", ext->bin);
+        return NGX_ERROR;
+    }
+
+    if (ext->fm.addr && ngx_file_uniq(&fi) == ext->uniq) {
+        return NGX_OK;
+    }
+
+    fm.name = ext->bin;
+    fm.log = log;
+
+    rc = ngx_open_file_mapping(&fm);
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_CRIT, log, NGX_ENOENT,
+                      ngx_open_file_n " \"%s\" failed", ext->bin);
+    }
+
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fm.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", ext->bin);
+        goto failed;
+    }
+
+    base = fm.addr;
+    size = fm.size;
+
+    header = (ngx_http_map_header_t *) base;
+    buckets = (uint32_t *) (base + sizeof(ngx_http_map_header_t));
+
+    if (size < sizeof(ngx_http_map_header_t)
+        || ngx_memcmp(&ngx_http_map_header, header, 12) != 0
+        || header->size != size
+        || header->buckets == 0
+        || (size - sizeof(ngx_http_map_header_t)) / sizeof(uint32_t)
+           <= header->buckets
+        || (size - sizeof(ngx_http_map_header_t)
+            - (header->buckets + 1) * sizeof(uint32_t))
+           / sizeof(ngx_http_map_binary_key_t) < header->keys
+        || buckets[header->buckets] != header->keys)
+    {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "incompatible external map \"%s\"", ext->bin);
+        goto failed;
+    }
+
+    crc32 = ngx_crc32_long(base + sizeof(ngx_http_map_header_t),
+                           size - sizeof(ngx_http_map_header_t));
+
+    if (crc32 != header->crc32) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "CRC32 mismatch in external map \"%s\"", ext->bin);
+        goto failed;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "using external map \"%s\"", ext->bin);
+
+    ext->base = base;
+    ext->buckets = buckets;
+    ext->nbuckets = header->buckets;
+
+    if (ext->fm.addr) {
+        ngx_close_file_mapping(&ext->fm);
+    }
+
+    ext->fm = fm;
+    ext->uniq = ngx_file_uniq(&fi);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_close_file_mapping(&fm);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_map_external_compile(ngx_cycle_t *cycle, ngx_log_t *log,
+    ngx_http_map_external_t *ext)
+{
+    char                  *rv;
+    ngx_int_t              rc;
+    ngx_conf_t             conf;
+    ngx_file_mapping_t     fm;
+    ngx_http_map_build_t   b;
+
+    b.pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (b.pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+
+    if (ngx_array_init(&b.entries, b.pool, 1024, sizeof(ngx_http_map_entry_t))
+        != NGX_OK)
+    {
+        goto done;
+    }
+
+    ngx_rbtree_init(&b.rbtree, &b.sentinel, ngx_str_rbtree_insert_value);
+
+    b.data_size = 0;
+
+    ngx_memzero(&conf, sizeof(ngx_conf_t));
+
+    conf.args = ngx_array_create(b.pool, 10, sizeof(ngx_str_t));
+    if (conf.args == NULL) {
+        goto done;
+    }
+
+    conf.pool = b.pool;
+    conf.temp_pool = b.pool;
+    conf.ctx = &b;
+    conf.cycle = cycle;
+    conf.log = log;
+    conf.module_type = NGX_HTTP_MODULE;
+    conf.cmd_type = NGX_HTTP_MAIN_CONF;
+    conf.handler = ngx_http_map_external_entry;
+
+    rv = ngx_conf_parse(&conf, &ext->name);
+
+    if (rv != NGX_CONF_OK) {
+        goto done;
+    }
+
+    /* the table is created aside to not truncate a mapped one */
+
+    fm.name = ngx_pnalloc(b.pool, ext->name.len + 9);
+    if (fm.name == NULL) {
+        goto done;
+    }
+
+    ngx_sprintf(fm.name, "%V.bin.tmp%Z", &ext->name);
+
+    fm.log = log;
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "creating external map \"%s\"", ext->bin);
+
+    if (ngx_http_map_write_table(&b, &fm) != NGX_OK) {
+        goto done;
+    }
+
+    if (ngx_rename_file(fm.name, ext->bin) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      fm.name, ext->bin);
+
+        if (ngx_delete_file(fm.name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", fm.name);
+        }
+
+        goto done;
+    }
+
+    rc = NGX_OK;
+
+done:
+
+    ngx_destroy_pool(b.pool);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_map_write_table(ngx_http_map_build_t *b, ngx_file_mapping_t *fm)
+{
+    u_char                     *p, *k;
+    uint32_t                   *buckets, *next;
+    ngx_uint_t                  i, j, n, nbuckets;
+    ngx_http_map_entry_t       *e;
+    ngx_http_map_header_t      *header;
+    ngx_http_map_binary_key_t  *keys, *key;
+
+    e = b->entries.elts;
+    nbuckets = b->entries.nelts ? b->entries.nelts : 1;
+
+    fm->size = sizeof(ngx_http_map_header_t)
+               + (nbuckets + 1) * sizeof(uint32_t)
+               + b->entries.nelts * sizeof(ngx_http_map_binary_key_t)
+               + b->data_size;
+
+    if (fm->size > NGX_MAX_UINT32_VALUE) {
+        ngx_log_error(NGX_LOG_EMERG, fm->log, 0,
+                      "external map \"%s\" is too large", fm->name);
+        return NGX_ERROR;
+    }
+
+    next = ngx_palloc(b->pool, nbuckets * sizeof(uint32_t));
+    if (next == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_create_file_mapping(fm) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(fm->addr, &ngx_http_map_header,
+                   sizeof(ngx_http_map_header_t));
+
+    buckets = (uint32_t *) p;
+    keys = (ngx_http_map_binary_key_t *) &buckets[nbuckets + 1];
+
+    p = ngx_http_map_copy_values(fm->addr, (u_char *) &keys[b->entries.nelts],
+                                 b->rbtree.root, b->rbtree.sentinel);
+
+    /* the keys are placed by buckets with the counting sort */
+
+    ngx_memzero(buckets, (nbuckets + 1) * sizeof(uint32_t));
+
+    for (i = 0; i < b->entries.nelts; i++) {
+        buckets[e[i].hash % nbuckets + 1]++;
+    }
+
+    for (i = 0; i < nbuckets; i++) {
+        buckets[i + 1] += buckets[i];
+        next[i] = buckets[i];
+    }
+
+    for (i = 0; i < b->entries.nelts; i++) {
+        n = e[i].hash % nbuckets;
+
+        for (j = buckets[n]; j < next[n]; j++) {
+            k = (u_char *) fm->addr + keys[j].key;
+
+            if (keys[j].hash == e[i].hash
+                && *(uint32_t *) k == e[i].key.len
+                && ngx_memcmp(k + sizeof(uint32_t), e[i].key.data,
+                              e[i].key.len) == 0)
+            {
+                ngx_log_error(NGX_LOG_EMERG, fm->log, 0,
+                              "conflicting parameter \"%V\" in external map",
+                              &e[i].key);
+                goto failed;
+            }
+        }
+
+        key = &keys[next[n]++];
+
+        key->hash = e[i].hash;
+        key->key = (uint32_t) (p - (u_char *) fm->addr);
+        key->value = e[i].value->offset;
+
+        *(uint32_t *) p = (uint32_t) e[i].key.len;
+        p = ngx_cpymem(p + sizeof(uint32_t), e[i].key.data, e[i].key.len);
+
+        p = ngx_align_ptr(p, sizeof(uint32_t));
+    }
+
+    header = fm->addr;
+    header->size = (uint32_t) fm->size;
+    header->buckets = (uint32_t) nbuckets;
+    header->keys = (uint32_t) b->entries.nelts;
+    header->crc32 = ngx_crc32_long((u_char *) fm->addr
+                                       + sizeof(ngx_http_map_header_t),
+                                   fm->size - sizeof(ngx_http_map_header_t));
+
+    ngx_close_file_mapping(fm);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_close_file_mapping(fm);
+
+    if (ngx_delete_file(fm->name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, fm->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", fm->name);
+    }
+
+    return NGX_ERROR;
+}
+
+
+static u_char *
+ngx_http_map_copy_values(u_char *base, u_char *p, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel)
+{
+    ngx_http_map_value_node_t  *vn;
+
+    if (node == sentinel) {
+        return p;
+    }
+
+    vn = (ngx_http_map_value_node_t *) node;
+    vn->offset = (uint32_t) (p - base);
+
+    *(uint32_t *) p = (uint32_t) vn->sn.str.len;
+    p = ngx_cpymem(p + sizeof(uint32_t), vn->sn.str.data, vn->sn.str.len);
+
+    p = ngx_align_ptr(p, sizeof(uint32_t));
+
+    p = ngx_http_map_copy_values(base, p, node->left, sentinel);
+
+    return ngx_http_map_copy_values(base, p, node->right, sentinel);
+}
+
+
+static void
+ngx_http_map_external_reopen(ngx_cycle_t *cycle, void *data)
+{
+    ngx_http_map_external_t  *ext = data;
+
+    /* the table is rebuilt by the master process only */
+
+    (void) ngx_http_map_external_load(cycle, cycle->log, ext,
+                                      ngx_process == NGX_PROCESS_MASTER
+                                      || ngx_process == NGX_PROCESS_SINGLE);
+}
+
+
+static void
+ngx_http_map_cleanup_external(void *data)
+{
+    ngx_http_map_external_t  *ext = data;
+
+    if (ext->fm.addr) {
+        ngx_close_file_mapping(&ext->fm);
+    }
+}
@@ -27,6 +27,8 @@ typedef struct {
     size_t        min_file_chunk;
     size_t        value_len;
 
+    ngx_uint_t    prefetch;
+
     ngx_array_t  *types_keys;
 } ngx_http_ssi_loc_conf_t;
 
@@ -45,6 +47,12 @@ typedef struct {
 } ngx_http_ssi_block_t;
 
 
+typedef struct {
+    ngx_str_t                      uri;
+    ngx_http_postponed_request_t  *pr;
+} ngx_http_ssi_prefetch_t;
+
+
 typedef enum {
     ssi_start_state = 0,
     ssi_tag_state,
@@ -82,6 +90,21 @@ static ngx_int_t ngx_http_ssi_evaluate_string(ngx_http_request_t *r,
 static ngx_int_t ngx_http_ssi_regex_match(ngx_http_request_t *r,
     ngx_str_t *pattern, ngx_str_t *str);
 
+static ngx_int_t ngx_http_ssi_prefetch(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx);
+static ngx_int_t ngx_http_ssi_prefetch_scan(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx, u_char *p, u_char *last);
+static u_char *ngx_http_ssi_prefetch_space(u_char *p, u_char *last);
+static ngx_int_t ngx_http_ssi_prefetch_start(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx, u_char *value, size_t len);
+static ngx_int_t ngx_http_ssi_prefetch_attach(ngx_http_request_t *r,
+    ngx_http_postponed_request_t *pr);
+static ngx_int_t ngx_http_ssi_prefetch_abandon(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx);
+static void ngx_http_ssi_prefetch_discard(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_ssi_discarded(ngx_http_request_t *r);
+static void ngx_http_ssi_consume(ngx_chain_t *in);
+
 static ngx_int_t ngx_http_ssi_include(ngx_http_request_t *r,
     ngx_http_ssi_ctx_t *ctx, ngx_str_t **params);
 static ngx_int_t ngx_http_ssi_stub_output(ngx_http_request_t *r, void *data,
@@ -155,6 +178,13 @@ static ngx_command_t  ngx_http_ssi_filter_commands[] = {
       offsetof(ngx_http_ssi_loc_conf_t, value_len),
       NULL },
 
+    { ngx_string("ssi_prefetch"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ssi_loc_conf_t, prefetch),
+      NULL },
+
     { ngx_string("ssi_types"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_http_types_slot,
@@ -325,7 +355,10 @@ ngx_http_ssi_header_filter(ngx_http_request_t *r)
 
     slcf = ngx_http_get_module_loc_conf(r, ngx_http_ssi_filter_module);
 
+    ctx = ngx_http_get_module_ctx(r, ngx_http_ssi_filter_module);
+
     if (!slcf->enable
+        || (ctx && ctx->discard)
         || r->headers_out.content_length_n == 0
         || ngx_http_test_content_type(r, &slcf->types) == NULL)
     {
@@ -385,6 +418,11 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_http_ssi_main_conf_t  *smcf;
     ngx_str_t                 *params[NGX_HTTP_SSI_MAX_PARAMS + 1];
 
+    if (r != r->main && ngx_http_ssi_discarded(r)) {
+        ngx_http_ssi_consume(in);
+        return NGX_OK;
+    }
+
     ctx = ngx_http_get_module_ctx(r, ngx_http_ssi_filter_module);
 
     if (ctx == NULL
@@ -409,6 +447,10 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
     if (ctx->wait) {
 
+        if (in && ngx_http_ssi_prefetch(r, ctx) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
         if (r != r->connection->data) {
             ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "http ssi filter wait \"%V?%V\" non-active",
@@ -798,6 +840,12 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
                     continue;
                 }
 
+                if (rc == NGX_AGAIN && ctx->wait) {
+                    if (ngx_http_ssi_prefetch(r, ctx) == NGX_ERROR) {
+                        return NGX_ERROR;
+                    }
+                }
+
                 if (rc == NGX_DONE || rc == NGX_AGAIN || rc == NGX_ERROR) {
                     ngx_http_ssi_buffered(r, ctx);
                     return rc;
@@ -844,6 +892,17 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             continue;
         }
 
+        if (ctx->buf->last_buf
+            && ctx->prefetch
+            && ctx->prefetch_next < ctx->prefetch->nelts)
+        {
+            if (ngx_http_ssi_prefetch_abandon(r, ctx) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            b = NULL;
+        }
+
         if (ctx->buf->last_buf || ngx_buf_in_memory(ctx->buf)) {
             if (b == NULL) {
                 if (ctx->free) {
@@ -1967,6 +2026,498 @@ ngx_http_ssi_regex_match(ngx_http_request_t *r, ngx_str_t *pattern,
 }
 
 
+static ngx_int_t
+ngx_http_ssi_prefetch(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+{
+    u_char                   *p;
+    ngx_int_t                 rc;
+    ngx_buf_t                *b;
+    ngx_chain_t              *cl;
+    ngx_http_ssi_loc_conf_t  *slcf;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_ssi_filter_module);
+
+    if (slcf->prefetch == 0
+        || ctx->buf == NULL
+        || r->postponed == NULL
+        || !ctx->output
+        || ctx->conditional
+        || ctx->block)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * resume the scan where the previous one has stopped if it is still
+     * ahead of the parser, otherwise start from the parser position
+     */
+
+    b = ctx->buf;
+    p = ctx->pos;
+    cl = ctx->in;
+
+    if (ctx->prefetch_pos >= p && ctx->prefetch_pos <= b->last) {
+        p = ctx->prefetch_pos;
+
+    } else if (ctx->prefetch_pos) {
+
+        for ( /* void */ ; cl; cl = cl->next) {
+            if (ngx_buf_in_memory(cl->buf)
+                && ctx->prefetch_pos >= cl->buf->pos
+                && ctx->prefetch_pos <= cl->buf->last)
+            {
+                b = cl->buf;
+                p = ctx->prefetch_pos;
+                cl = cl->next;
+                break;
+            }
+        }
+
+        if (p != ctx->prefetch_pos) {
+            cl = ctx->in;
+        }
+    }
+
+    for ( ;; ) {
+
+        if (ngx_buf_in_memory(b)) {
+            rc = ngx_http_ssi_prefetch_scan(r, ctx, p, b->last);
+
+            if (rc == NGX_DONE) {
+                return NGX_OK;
+            }
+
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            ctx->prefetch_pos = b->last;
+
+        } else if (!ngx_buf_special(b)) {
+            return NGX_OK;
+        }
+
+        if (cl == NULL) {
+            return NGX_OK;
+        }
+
+        b = cl->buf;
+        p = b->pos;
+        cl = cl->next;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_ssi_prefetch_scan(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx,
+    u_char *p, u_char *last)
+{
+    u_char                   *tag, *start, *value, quote;
+    size_t                    len;
+    ngx_int_t                 rc;
+    ngx_str_t                 command, name;
+    ngx_uint_t                nparams, plain;
+    ngx_http_ssi_loc_conf_t  *slcf;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_ssi_filter_module);
+
+    tag = p;
+
+    for ( ;; ) {
+
+        p = ngx_strlchr(p, last, '<');
+        if (p == NULL) {
+            return NGX_OK;
+        }
+
+        tag = p;
+        len = ngx_min((size_t) (last - p), sizeof("<!--#") - 1);
+
+        if (ngx_strncmp(p, "<!--#", len) != 0) {
+            p++;
+            continue;
+        }
+
+        if (len < sizeof("<!--#") - 1) {
+            goto done;
+        }
+
+        p = ngx_http_ssi_prefetch_space(p + len, last);
+
+        command.data = p;
+
+        while (p < last
+               && *p != ' ' && *p != CR && *p != LF && *p != '\t'
+               && *p != '-')
+        {
+            p++;
+        }
+
+        command.len = p - command.data;
+
+        if (p == last
+            || command.len == 0
+            || command.len > NGX_HTTP_SSI_COMMAND_LEN)
+        {
+            goto done;
+        }
+
+        /* the contents of "if" and "block" may never be output as is */
+
+        if ((command.len == 2 && ngx_strncmp(command.data, "if", 2) == 0)
+            || (command.len == 5
+                && ngx_strncmp(command.data, "block", 5) == 0))
+        {
+            goto done;
+        }
+
+        value = NULL;
+        len = 0;
+        nparams = 0;
+        plain = 1;
+
+        for ( ;; ) {
+            p = ngx_http_ssi_prefetch_space(p, last);
+
+            if (last - p < 3) {
+                goto done;
+            }
+
+            if (*p == '-') {
+                if (ngx_strncmp(p, "-->", 3) != 0) {
+                    goto done;
+                }
+
+                p += 3;
+                break;
+            }
+
+            name.data = p;
+
+            while (p < last
+                   && *p != ' ' && *p != CR && *p != LF && *p != '\t'
+                   && *p != '=' && *p != '-')
+            {
+                p++;
+            }
+
+            name.len = p - name.data;
+
+            if (name.len > NGX_HTTP_SSI_PARAM_LEN) {
+                goto done;
+            }
+
+            p = ngx_http_ssi_prefetch_space(p, last);
+
+            if (p == last || *p++ != '=') {
+                goto done;
+            }
+
+            p = ngx_http_ssi_prefetch_space(p, last);
+
+            if (p == last || (*p != '"' && *p != '\'')) {
+                goto done;
+            }
+
+            quote = *p++;
+
+            for (start = p; p < last && *p != quote; p++) {
+                if (*p == '$') {
+                    plain = 0;
+
+                } else if (*p == '\\') {
+                    plain = 0;
+
+                    if (++p == last) {
+                        break;
+                    }
+                }
+            }
+
+            if (p == last || (size_t) (p - start) > ctx->value_len) {
+                goto done;
+            }
+
+            if (name.len == 7 && ngx_strncmp(name.data, "virtual", 7) == 0) {
+                value = start;
+                len = p - start;
+            }
+
+            p++;
+            nparams++;
+        }
+
+        if (command.len != 7
+            || ngx_strncmp(command.data, "include", 7) != 0
+            || nparams != 1
+            || value == NULL
+            || len == 0
+            || !plain)
+        {
+            continue;
+        }
+
+        if (ctx->prefetch
+            && ctx->prefetch->nelts - ctx->prefetch_next >= slcf->prefetch)
+        {
+            goto done;
+        }
+
+        rc = ngx_http_ssi_prefetch_start(r, ctx, value, len);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_DECLINED) {
+            goto done;
+        }
+    }
+
+done:
+
+    ctx->prefetch_pos = tag;
+
+    return NGX_DONE;
+}
+
+
+static u_char *
+ngx_http_ssi_prefetch_space(u_char *p, u_char *last)
+{
+    while (p < last && (*p == ' ' || *p == CR || *p == LF || *p == '\t')) {
+        p++;
+    }
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_ssi_prefetch_start(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx,
+    u_char *value, size_t len)
+{
+    u_char                        *dst, *src;
+    size_t                         n;
+    ngx_str_t                      uri, args;
+    ngx_uint_t                     flags;
+    ngx_http_request_t            *sr;
+    ngx_http_ssi_prefetch_t       *pf;
+    ngx_http_postponed_request_t  *pr, **ppr;
+
+    if (ctx->prefetch == NULL) {
+        ctx->prefetch = ngx_array_create(r->pool, 4,
+                                         sizeof(ngx_http_ssi_prefetch_t));
+        if (ctx->prefetch == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    pf = ngx_array_push(ctx->prefetch);
+    if (pf == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the raw value is kept to match it against the "include" command */
+
+    pf->uri.len = len;
+    pf->uri.data = ngx_pnalloc(r->pool, 2 * len);
+    if (pf->uri.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(pf->uri.data, value, len);
+
+    uri.len = len;
+    uri.data = ngx_cpymem(pf->uri.data + len, value, len) - len;
+
+    if (ngx_http_ssi_evaluate_string(r, ctx, &uri, NGX_HTTP_SSI_ADD_PREFIX)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    dst = uri.data;
+    src = uri.data;
+
+    ngx_unescape_uri(&dst, &src, uri.len, NGX_UNESCAPE_URI);
+
+    n = (uri.data + uri.len) - src;
+    if (n) {
+        dst = ngx_movemem(dst, src, n);
+    }
+
+    uri.len = dst - uri.data;
+
+    ngx_str_null(&args);
+    flags = NGX_HTTP_LOG_UNSAFE;
+
+    if (ngx_http_parse_unsafe_uri(r, &uri, &args, &flags) != NGX_OK
+        || ngx_http_subrequest(r, &uri, &args, &sr, NULL, flags) != NGX_OK)
+    {
+        ctx->prefetch->nelts--;
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "ssi prefetch: \"%V\"", &uri);
+
+    /*
+     * the subrequest runs detached from the postponed list until
+     * the "include" command is reached, so its output stays in place
+     */
+
+    for (ppr = &r->postponed; (*ppr)->next; ppr = &(*ppr)->next) {
+        /* void */
+    }
+
+    pr = *ppr;
+    *ppr = NULL;
+
+    pf->pr = pr;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_ssi_prefetch_attach(ngx_http_request_t *r,
+    ngx_http_postponed_request_t *pr)
+{
+    ngx_connection_t              *c;
+    ngx_http_postponed_request_t  *p;
+
+    if (r->postponed) {
+        for (p = r->postponed; p->next; p = p->next) { /* void */ }
+        p->next = pr;
+
+        return NGX_OK;
+    }
+
+    r->postponed = pr;
+
+    c = r->connection;
+
+    if (c->data != r) {
+        return NGX_OK;
+    }
+
+    c->data = pr->request;
+
+    return ngx_http_post_request(pr->request, NULL);
+}
+
+
+static ngx_int_t
+ngx_http_ssi_prefetch_abandon(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+{
+    ngx_uint_t                i;
+    ngx_http_request_t       *sr;
+    ngx_http_ssi_ctx_t       *sctx;
+    ngx_http_ssi_prefetch_t  *pf;
+
+    /*
+     * the parser has not reached some prefetched includes: the subrequests
+     * are already running and are completed after the document, but
+     * their output is discarded
+     */
+
+    if (ctx->out && ngx_http_ssi_output(r, ctx) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    pf = ctx->prefetch->elts;
+
+    for (i = ctx->prefetch_next; i < ctx->prefetch->nelts; i++) {
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "prefetched SSI include \"%V\" was not reached, "
+                      "its output is discarded", &pf[i].uri);
+
+        sr = pf[i].pr->request;
+
+        sctx = ngx_http_get_module_ctx(sr, ngx_http_ssi_filter_module);
+
+        if (sctx == NULL) {
+            sctx = ngx_pcalloc(sr->pool, sizeof(ngx_http_ssi_ctx_t));
+            if (sctx == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_http_set_ctx(sr, sctx, ngx_http_ssi_filter_module);
+        }
+
+        sctx->discard = 1;
+
+        ngx_http_ssi_prefetch_discard(sr);
+
+        if (ngx_http_ssi_prefetch_attach(r, pf[i].pr) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ctx->prefetch_next = ctx->prefetch->nelts;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_ssi_prefetch_discard(ngx_http_request_t *r)
+{
+    ngx_http_postponed_request_t  *pr, **ppr;
+
+    /* drop the output already kept by the subrequest and its subrequests */
+
+    ppr = &r->postponed;
+
+    while (*ppr) {
+        pr = *ppr;
+
+        if (pr->request) {
+            ngx_http_ssi_prefetch_discard(pr->request);
+            ppr = &pr->next;
+            continue;
+        }
+
+        ngx_http_ssi_consume(pr->out);
+
+        *ppr = pr->next;
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_ssi_discarded(ngx_http_request_t *r)
+{
+    ngx_http_ssi_ctx_t  *ctx;
+
+    for ( /* void */ ; r != r->main; r = r->parent) {
+        ctx = ngx_http_get_module_ctx(r, ngx_http_ssi_filter_module);
+
+        if (ctx && ctx->discard) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_http_ssi_consume(ngx_chain_t *in)
+{
+    ngx_chain_t  *cl;
+
+    /* the buffers are marked as sent to be reused by their owners */
+
+    for (cl = in; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->last;
+        cl->buf->file_pos = cl->buf->file_last;
+    }
+}
+
+
 static ngx_int_t
 ngx_http_ssi_include(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx,
     ngx_str_t **params)
@@ -1982,6 +2533,7 @@ ngx_http_ssi_include(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx,
     ngx_http_ssi_var_t          *var;
     ngx_http_ssi_ctx_t          *mctx;
     ngx_http_ssi_block_t        *bl;
+    ngx_http_ssi_prefetch_t     *pf;
     ngx_http_post_subrequest_t  *psr;
 
     uri = params[NGX_HTTP_SSI_INCLUDE_VIRTUAL];
@@ -2032,6 +2584,25 @@ ngx_http_ssi_include(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx,
         }
     }
 
+    if (ctx->prefetch
+        && ctx->prefetch_next < ctx->prefetch->nelts
+        && uri && file == NULL && wait == NULL && set == NULL && stub == NULL)
+    {
+        pf = ctx->prefetch->elts;
+        pf = &pf[ctx->prefetch_next];
+
+        if (uri->len == pf->uri.len
+            && ngx_strncmp(uri->data, pf->uri.data, uri->len) == 0)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "ssi include prefetched: \"%V\"", uri);
+
+            ctx->prefetch_next++;
+
+            return ngx_http_ssi_prefetch_attach(r, pf->pr);
+        }
+    }
+
     if (uri == NULL) {
         uri = file;
         wait = (ngx_str_t *) -1;
@@ -2881,6 +3452,7 @@ ngx_http_ssi_create_loc_conf(ngx_conf_t *cf)
 
     slcf->min_file_chunk = NGX_CONF_UNSET_SIZE;
     slcf->value_len = NGX_CONF_UNSET_SIZE;
+    slcf->prefetch = NGX_CONF_UNSET_UINT;
 
     return slcf;
 }
@@ -2899,6 +3471,7 @@ ngx_http_ssi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_size_value(conf->min_file_chunk, prev->min_file_chunk, 1024);
     ngx_conf_merge_size_value(conf->value_len, prev->value_len, 255);
+    ngx_conf_merge_uint_value(conf->prefetch, prev->prefetch, 0);
 
     if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
                              &prev->types_keys, &prev->types,
@@ -76,8 +76,14 @@ typedef struct {
     unsigned                  block:1;
     unsigned                  output:1;
     unsigned                  output_chosen:1;
+    unsigned                  discard:1;
 
     ngx_http_request_t       *wait;
+
+    ngx_array_t              *prefetch;
+    ngx_uint_t                prefetch_next;
+    u_char                   *prefetch_pos;
+
     void                     *value_buf;
     ngx_str_t                 timefmt;
     ngx_str_t                 errmsg;
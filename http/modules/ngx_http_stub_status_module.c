@@ -10,13 +10,38 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_STUB_STATUS_OFF                 0x0002
+#define NGX_HTTP_STUB_STATUS_UPSTREAM_KEEPALIVE  0x0004
+#define NGX_HTTP_STUB_STATUS_CACHE               0x0008
+
+
+typedef struct {
+    ngx_uint_t  extra;
+} ngx_http_stub_status_loc_conf_t;
+
+
 static ngx_int_t ngx_http_stub_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_stub_status_add_variables(ngx_conf_t *cf);
+static void *ngx_http_stub_status_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_stub_status_merge_loc_conf(ngx_conf_t *cf,
+    void *parent, void *child);
 
 static char *ngx_http_set_status(ngx_conf_t *cf, ngx_command_t *cmd,
                                  void *conf);
 
+
+static ngx_conf_bitmask_t  ngx_http_stub_status_extra_mask[] = {
+    { ngx_string("off"), NGX_HTTP_STUB_STATUS_OFF },
+    { ngx_string("upstream_keepalive"),
+      NGX_HTTP_STUB_STATUS_UPSTREAM_KEEPALIVE },
+#if (NGX_HTTP_CACHE)
+    { ngx_string("cache"), NGX_HTTP_STUB_STATUS_CACHE },
+#endif
+    { ngx_null_string, 0 }
+};
+
+
 static ngx_command_t  ngx_http_status_commands[] = {
 
     { ngx_string("stub_status"),
@@ -26,6 +51,13 @@ static ngx_command_t  ngx_http_status_commands[] = {
       0,
       NULL },
 
+    { ngx_string("stub_status_extra"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_stub_status_loc_conf_t, extra),
+      &ngx_http_stub_status_extra_mask },
+
       ngx_null_command
 };
 
@@ -41,8 +73,8 @@ static ngx_http_module_t  ngx_http_stub_status_module_ctx = {
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
 
-    NULL,                                  /* create location configuration */
-    NULL                                   /* merge location configuration */
+    ngx_http_stub_status_create_loc_conf,  /* create location configuration */
+    ngx_http_stub_status_merge_loc_conf    /* merge location configuration */
 };
 
 
@@ -88,6 +120,8 @@ static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r)
     ngx_chain_t        out;
     ngx_atomic_int_t   ap, hn, ac, rq, rd, wr, wa;
 
+    ngx_http_stub_status_loc_conf_t  *sslcf;
+
     if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
         return NGX_HTTP_NOT_ALLOWED;
     }
@@ -115,6 +149,19 @@ static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r)
            + 6 + 3 * NGX_ATOMIC_T_LEN
            + sizeof("Reading:  Writing:  Waiting:  \n") + 3 * NGX_ATOMIC_T_LEN;
 
+    sslcf = ngx_http_get_module_loc_conf(r, ngx_http_stub_status_module);
+
+    if (sslcf->extra & NGX_HTTP_STUB_STATUS_UPSTREAM_KEEPALIVE) {
+        size += sizeof("Upstream keepalive: reused  missed  closed  \n")
+                + 3 * NGX_ATOMIC_T_LEN;
+    }
+
+#if (NGX_HTTP_CACHE)
+    if (sslcf->extra & NGX_HTTP_STUB_STATUS_CACHE) {
+        size += ngx_http_file_cache_stats_size((ngx_cycle_t *) ngx_cycle);
+    }
+#endif
+
     b = ngx_create_temp_buf(r->pool, size);
     if (b == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -141,6 +188,22 @@ static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r)
     b->last = ngx_sprintf(b->last, "Reading: %uA Writing: %uA Waiting: %uA \n",
                           rd, wr, wa);
 
+    if (sslcf->extra & NGX_HTTP_STUB_STATUS_UPSTREAM_KEEPALIVE) {
+        b->last = ngx_sprintf(b->last,
+                              "Upstream keepalive: reused %uA missed %uA "
+                              "closed %uA \n",
+                              *ngx_stat_upstream_reused,
+                              *ngx_stat_upstream_missed,
+                              *ngx_stat_upstream_closed);
+    }
+
+#if (NGX_HTTP_CACHE)
+    if (sslcf->extra & NGX_HTTP_STUB_STATUS_CACHE) {
+        b->last = ngx_http_file_cache_stats((ngx_cycle_t *) ngx_cycle,
+                                            b->last);
+    }
+#endif
+
     r->headers_out.status = NGX_HTTP_OK;
     r->headers_out.content_length_n = b->last - b->pos;
 
@@ -220,6 +283,44 @@ ngx_http_stub_status_add_variables(ngx_conf_t *cf)
 }
 
 
+static void *
+ngx_http_stub_status_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_stub_status_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_stub_status_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->extra = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_stub_status_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_stub_status_loc_conf_t *prev = parent;
+    ngx_http_stub_status_loc_conf_t *conf = child;
+
+    ngx_conf_merge_bitmask_value(conf->extra, prev->extra,
+                                 (NGX_CONF_BITMASK_SET
+                                  |NGX_HTTP_STUB_STATUS_OFF));
+
+    if (conf->extra & NGX_HTTP_STUB_STATUS_OFF) {
+        conf->extra = NGX_CONF_BITMASK_SET|NGX_HTTP_STUB_STATUS_OFF;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static char *ngx_http_set_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_core_loc_conf_t  *clcf;
@@ -13,6 +13,36 @@
 typedef struct {
     ngx_str_t                  match;
     ngx_http_complex_value_t   value;
+} ngx_http_sub_pair_t;
+
+
+typedef struct {
+    ngx_uint_t                 depth;
+    ngx_uint_t                 match;  /* pair index + 1 */
+    ngx_uint_t                 dict;
+} ngx_http_sub_state_t;
+
+
+/*
+ * the Aho-Corasick automaton of all search strings: the transitions
+ * are stored as a dense table indexed by the state and the class of
+ * a byte, bytes absent from the search strings share the class 0
+ */
+
+typedef struct {
+    ngx_uint_t                *next;
+    ngx_http_sub_state_t      *states;
+    ngx_uint_t                 nclasses;
+    ngx_uint_t                 npairs;
+    size_t                     max_len;
+    ngx_int_t                  start;
+    u_char                     class[256];
+} ngx_http_sub_tables_t;
+
+
+typedef struct {
+    ngx_array_t               *pairs;
+    ngx_http_sub_tables_t     *tables;
 
     ngx_hash_t                 types;
 
@@ -22,19 +52,18 @@ typedef struct {
 } ngx_http_sub_loc_conf_t;
 
 
-typedef enum {
-    sub_start_state = 0,
-    sub_match_state,
-} ngx_http_sub_state_e;
-
-
 typedef struct {
-    ngx_str_t                  match;
+    ngx_http_sub_tables_t     *tables;
+
     ngx_str_t                  saved;
     ngx_str_t                  looked;
 
     ngx_uint_t                 once;   /* unsigned  once:1 */
 
+    ngx_uint_t                 index;
+    ngx_uint_t                 nmatched;
+    u_char                    *matched;
+
     ngx_buf_t                 *buf;
 
     u_char                    *pos;
@@ -47,7 +76,7 @@ typedef struct {
     ngx_chain_t               *busy;
     ngx_chain_t               *free;
 
-    ngx_str_t                  sub;
+    ngx_str_t                 *sub;
 
     ngx_uint_t                 state;
 } ngx_http_sub_ctx_t;
@@ -60,6 +89,8 @@ static ngx_int_t ngx_http_sub_parse(ngx_http_request_t *r,
 
 static char * ngx_http_sub_filter(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static ngx_http_sub_tables_t *ngx_http_sub_init_tables(ngx_conf_t *cf,
+    ngx_array_t *pairs);
 static void *ngx_http_sub_create_conf(ngx_conf_t *cf);
 static char *ngx_http_sub_merge_conf(ngx_conf_t *cf,
     void *parent, void *child);
@@ -136,7 +167,7 @@ ngx_http_sub_header_filter(ngx_http_request_t *r)
 
     slcf = ngx_http_get_module_loc_conf(r, ngx_http_sub_filter_module);
 
-    if (slcf->match.len == 0
+    if (slcf->pairs == NULL
         || r->headers_out.content_length_n == 0
         || ngx_http_test_content_type(r, &slcf->types) == NULL)
     {
@@ -148,19 +179,32 @@ ngx_http_sub_header_filter(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
-    ctx->saved.data = ngx_pnalloc(r->pool, slcf->match.len);
+    ctx->tables = slcf->tables;
+
+    ctx->saved.data = ngx_pnalloc(r->pool, ctx->tables->max_len);
     if (ctx->saved.data == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->looked.data = ngx_pnalloc(r->pool, slcf->match.len);
+    ctx->looked.data = ngx_pnalloc(r->pool, ctx->tables->max_len);
     if (ctx->looked.data == NULL) {
         return NGX_ERROR;
     }
 
+    ctx->sub = ngx_pcalloc(r->pool, ctx->tables->npairs * sizeof(ngx_str_t));
+    if (ctx->sub == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (slcf->once) {
+        ctx->matched = ngx_pcalloc(r->pool, ctx->tables->npairs);
+        if (ctx->matched == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
     ngx_http_set_ctx(r, ctx, ngx_http_sub_filter_module);
 
-    ctx->match = slcf->match;
     ctx->last_out = &ctx->out;
 
     r->filter_need_in_memory = 1;
@@ -182,6 +226,7 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_buf_t                 *b;
     ngx_chain_t               *cl;
     ngx_http_sub_ctx_t        *ctx;
+    ngx_http_sub_pair_t       *pair;
     ngx_http_sub_loc_conf_t   *slcf;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_sub_filter_module);
@@ -228,17 +273,12 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             ctx->pos = ctx->buf->pos;
         }
 
-        if (ctx->state == sub_start_state) {
-            ctx->copy_start = ctx->pos;
-            ctx->copy_end = ctx->pos;
-        }
-
         b = NULL;
 
         while (ctx->pos < ctx->buf->last) {
 
             ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "saved: \"%V\" state: %d", &ctx->saved, ctx->state);
+                           "saved: \"%V\" state: %ui", &ctx->saved, ctx->state);
 
             rc = ngx_http_sub_parse(r, ctx);
 
@@ -250,48 +290,49 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
                 return rc;
             }
 
-            if (ctx->copy_start != ctx->copy_end) {
+            if (ctx->saved.len) {
 
                 ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                                "saved: \"%V\"", &ctx->saved);
 
-                if (ctx->saved.len) {
-
-                    if (ctx->free) {
-                        cl = ctx->free;
-                        ctx->free = ctx->free->next;
-                        b = cl->buf;
-                        ngx_memzero(b, sizeof(ngx_buf_t));
-
-                    } else {
-                        b = ngx_calloc_buf(r->pool);
-                        if (b == NULL) {
-                            return NGX_ERROR;
-                        }
-
-                        cl = ngx_alloc_chain_link(r->pool);
-                        if (cl == NULL) {
-                            return NGX_ERROR;
-                        }
+                if (ctx->free) {
+                    cl = ctx->free;
+                    ctx->free = ctx->free->next;
+                    b = cl->buf;
+                    ngx_memzero(b, sizeof(ngx_buf_t));
 
-                        cl->buf = b;
+                } else {
+                    b = ngx_calloc_buf(r->pool);
+                    if (b == NULL) {
+                        return NGX_ERROR;
                     }
 
-                    b->pos = ngx_pnalloc(r->pool, ctx->saved.len);
-                    if (b->pos == NULL) {
+                    cl = ngx_alloc_chain_link(r->pool);
+                    if (cl == NULL) {
                         return NGX_ERROR;
                     }
 
-                    ngx_memcpy(b->pos, ctx->saved.data, ctx->saved.len);
-                    b->last = b->pos + ctx->saved.len;
-                    b->memory = 1;
-
-                    *ctx->last_out = cl;
-                    ctx->last_out = &cl->next;
+                    cl->buf = b;
+                }
 
-                    ctx->saved.len = 0;
+                b->pos = ngx_pnalloc(r->pool, ctx->saved.len);
+                if (b->pos == NULL) {
+                    return NGX_ERROR;
                 }
 
+                ngx_memcpy(b->pos, ctx->saved.data, ctx->saved.len);
+                b->last = b->pos + ctx->saved.len;
+                b->memory = 1;
+
+                cl->next = NULL;
+                *ctx->last_out = cl;
+                ctx->last_out = &cl->next;
+
+                ctx->saved.len = 0;
+            }
+
+            if (ctx->copy_start != ctx->copy_end) {
+
                 if (ctx->free) {
                     cl = ctx->free;
                     ctx->free = ctx->free->next;
@@ -329,15 +370,6 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
                 ctx->last_out = &cl->next;
             }
 
-            if (ctx->state == sub_start_state) {
-                ctx->copy_start = ctx->pos;
-                ctx->copy_end = ctx->pos;
-
-            } else {
-                ctx->copy_start = NULL;
-                ctx->copy_end = NULL;
-            }
-
             if (rc == NGX_AGAIN) {
                 continue;
             }
@@ -357,19 +389,22 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
             slcf = ngx_http_get_module_loc_conf(r, ngx_http_sub_filter_module);
 
-            if (ctx->sub.data == NULL) {
+            pair = slcf->pairs->elts;
+
+            if (ctx->sub[ctx->index].data == NULL) {
 
-                if (ngx_http_complex_value(r, &slcf->value, &ctx->sub)
+                if (ngx_http_complex_value(r, &pair[ctx->index].value,
+                                           &ctx->sub[ctx->index])
                     != NGX_OK)
                 {
                     return NGX_ERROR;
                 }
             }
 
-            if (ctx->sub.len) {
+            if (ctx->sub[ctx->index].len) {
                 b->memory = 1;
-                b->pos = ctx->sub.data;
-                b->last = ctx->sub.data + ctx->sub.len;
+                b->pos = ctx->sub[ctx->index].data;
+                b->last = b->pos + ctx->sub[ctx->index].len;
 
             } else {
                 b->sync = 1;
@@ -380,11 +415,44 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             *ctx->last_out = cl;
             ctx->last_out = &cl->next;
 
-            ctx->once = slcf->once;
-
             continue;
         }
 
+        if (ctx->buf->last_buf && ctx->looked.len) {
+
+            /* the partial match at the end of the response */
+
+            if (ctx->free) {
+                cl = ctx->free;
+                ctx->free = ctx->free->next;
+                b = cl->buf;
+                ngx_memzero(b, sizeof(ngx_buf_t));
+
+            } else {
+                b = ngx_calloc_buf(r->pool);
+                if (b == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cl = ngx_alloc_chain_link(r->pool);
+                if (cl == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cl->buf = b;
+            }
+
+            b->pos = ctx->looked.data;
+            b->last = ctx->looked.data + ctx->looked.len;
+            b->memory = 1;
+
+            cl->next = NULL;
+            *ctx->last_out = cl;
+            ctx->last_out = &cl->next;
+
+            ctx->looked.len = 0;
+        }
+
         if (ctx->buf->last_buf || ngx_buf_in_memory(ctx->buf)) {
             if (b == NULL) {
                 if (ctx->free) {
@@ -506,9 +574,11 @@ ngx_http_sub_output(ngx_http_request_t *r, ngx_http_sub_ctx_t *ctx)
 static ngx_int_t
 ngx_http_sub_parse(ngx_http_request_t *r, ngx_http_sub_ctx_t *ctx)
 {
-    u_char                *p, *last, *copy_end, ch, match;
-    size_t                 looked;
-    ngx_http_sub_state_e   state;
+    u_char                 *p, *last, *start;
+    size_t                  n, held;
+    ngx_uint_t              state, i, index, nclasses, *next;
+    ngx_http_sub_state_t   *states;
+    ngx_http_sub_tables_t  *tables;
 
     if (ctx->once) {
         ctx->copy_start = ctx->pos;
@@ -521,102 +591,114 @@ ngx_http_sub_parse(ngx_http_request_t *r, ngx_http_sub_ctx_t *ctx)
         return NGX_AGAIN;
     }
 
+    tables = ctx->tables;
+    states = tables->states;
+    next = tables->next;
+    nclasses = tables->nclasses;
+
     state = ctx->state;
-    looked = ctx->looked.len;
+    start = ctx->pos;
     last = ctx->buf->last;
-    copy_end = ctx->copy_end;
 
-    for (p = ctx->pos; p < last; p++) {
+    for (p = start; p < last; p++) {
 
-        ch = *p;
-        ch = ngx_tolower(ch);
+        if (state == 0) {
 
-        if (state == sub_start_state) {
+            /* the tight loop skips bytes that cannot start a match */
 
-            /* the tight loop */
+            if (tables->start != -1) {
+                p = memchr(p, (int) tables->start, last - p);
 
-            match = ctx->match.data[0];
-
-            for ( ;; ) {
-                if (ch == match) {
-                    copy_end = p;
-                    ctx->looked.data[0] = *p;
-                    looked = 1;
-                    state = sub_match_state;
-
-                    goto match_started;
-                }
-
-                if (++p == last) {
+                if (p == NULL) {
+                    p = last;
                     break;
                 }
 
-                ch = *p;
-                ch = ngx_tolower(ch);
+            } else {
+                while (next[tables->class[*p]] == 0) {
+                    if (++p == last) {
+                        goto again;
+                    }
+                }
             }
+        }
 
-            ctx->state = state;
-            ctx->pos = p;
-            ctx->looked.len = looked;
-            ctx->copy_end = p;
+        state = next[state * nclasses + tables->class[*p]];
 
-            if (ctx->copy_start == NULL) {
-                ctx->copy_start = ctx->buf->pos;
-            }
+        i = states[state].match ? state : states[state].dict;
 
-            return NGX_AGAIN;
+        for ( /* void */ ; i; i = states[i].dict) {
 
-        match_started:
+            index = states[i].match - 1;
 
-            continue;
+            if (ctx->matched == NULL || !ctx->matched[index]) {
+                goto found;
+            }
         }
+    }
 
-        /* state == sub_match_state */
+again:
 
-        if (ch == ctx->match.data[looked]) {
-            ctx->looked.data[looked] = *p;
-            looked++;
+    /*
+     * the bytes of the current state may yet start a match, they are
+     * held in ctx->looked, and only the rest of ctx->saved is output
+     */
 
-            if (looked == ctx->match.len) {
-                if ((size_t) (p - ctx->pos) < looked) {
-                    ctx->saved.len = 0;
-                }
+    n = last - start;
+    held = states[state].depth;
 
-                ctx->state = sub_start_state;
-                ctx->pos = p + 1;
-                ctx->looked.len = 0;
-                ctx->copy_end = copy_end;
+    if (held <= n) {
+        ngx_memcpy(ctx->looked.data, last - held, held);
 
-                if (ctx->copy_start == NULL && copy_end) {
-                    ctx->copy_start = ctx->buf->pos;
-                }
+        ctx->copy_end = last - held;
 
-                return NGX_OK;
-            }
+    } else {
+        ctx->saved.len -= held - n;
 
-        } else if (ch == ctx->match.data[0]) {
-            copy_end = p;
-            ctx->looked.data[0] = *p;
-            looked = 1;
+        ngx_memcpy(ctx->looked.data, ctx->saved.data + ctx->saved.len,
+                   held - n);
+        ngx_memcpy(ctx->looked.data + held - n, start, n);
 
-        } else {
-            copy_end = p;
-            looked = 0;
-            state = sub_start_state;
-        }
+        ctx->copy_end = start;
     }
 
+    ctx->copy_start = start;
+    ctx->pos = last;
     ctx->state = state;
+    ctx->looked.len = held;
+
+    return NGX_AGAIN;
+
+found:
+
+    p++;
+
+    n = p - start;
+    held = states[i].depth;
+
+    if (held <= n) {
+        ctx->copy_end = p - held;
+
+    } else {
+        ctx->saved.len -= held - n;
+        ctx->copy_end = start;
+    }
+
+    ctx->copy_start = start;
     ctx->pos = p;
-    ctx->looked.len = looked;
+    ctx->state = 0;
+    ctx->looked.len = 0;
+    ctx->index = index;
 
-    ctx->copy_end = (state == sub_start_state) ? p : copy_end;
+    if (ctx->matched) {
+        ctx->matched[index] = 1;
 
-    if (ctx->copy_start == NULL && ctx->copy_end) {
-        ctx->copy_start = ctx->buf->pos;
+        if (++ctx->nmatched == tables->npairs) {
+            ctx->once = 1;
+        }
     }
 
-    return NGX_AGAIN;
+    return NGX_OK;
 }
 
 
@@ -626,23 +708,52 @@ ngx_http_sub_filter(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_sub_loc_conf_t *slcf = conf;
 
     ngx_str_t                         *value;
+    ngx_uint_t                         i;
+    ngx_http_sub_pair_t               *pair;
     ngx_http_compile_complex_value_t   ccv;
 
-    if (slcf->match.data) {
-        return "is duplicate";
+    value = cf->args->elts;
+
+    if (value[1].len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "empty search string");
+        return NGX_CONF_ERROR;
     }
 
-    value = cf->args->elts;
+    if (slcf->pairs == NULL) {
+        slcf->pairs = ngx_array_create(cf->pool, 1,
+                                       sizeof(ngx_http_sub_pair_t));
+        if (slcf->pairs == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
 
     ngx_strlow(value[1].data, value[1].data, value[1].len);
 
-    slcf->match = value[1];
+    pair = slcf->pairs->elts;
+
+    for (i = 0; i < slcf->pairs->nelts; i++) {
+        if (pair[i].match.len == value[1].len
+            && ngx_strncmp(pair[i].match.data, value[1].data, value[1].len)
+               == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate search string \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    pair = ngx_array_push(slcf->pairs);
+    if (pair == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    pair->match = value[1];
 
     ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
 
     ccv.cf = cf;
     ccv.value = &value[2];
-    ccv.complex_value = &slcf->value;
+    ccv.complex_value = &pair->value;
 
     if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
         return NGX_CONF_ERROR;
@@ -652,6 +763,156 @@ ngx_http_sub_filter(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static ngx_http_sub_tables_t *
+ngx_http_sub_init_tables(ngx_conf_t *cf, ngx_array_t *pairs)
+{
+    u_char                 *p, *last;
+    ngx_uint_t              i, c, n, s, t, u, nstates, nclasses, *fail, *queue;
+    ngx_uint_t             *next, *row;
+    ngx_http_sub_pair_t    *pair;
+    ngx_http_sub_state_t   *states;
+    ngx_http_sub_tables_t  *tables;
+
+    tables = ngx_pcalloc(cf->pool, sizeof(ngx_http_sub_tables_t));
+    if (tables == NULL) {
+        return NULL;
+    }
+
+    pair = pairs->elts;
+
+    /* byte classes, the search strings are already in lowercase */
+
+    nclasses = 1;
+    nstates = 1;
+
+    for (i = 0; i < pairs->nelts; i++) {
+
+        last = pair[i].match.data + pair[i].match.len;
+
+        for (p = pair[i].match.data; p < last; p++) {
+            if (tables->class[*p] == 0) {
+                tables->class[*p] = (u_char) nclasses++;
+            }
+        }
+
+        nstates += pair[i].match.len;
+
+        if (tables->max_len < pair[i].match.len) {
+            tables->max_len = pair[i].match.len;
+        }
+    }
+
+    for (c = 'A'; c <= 'Z'; c++) {
+        tables->class[c] = tables->class[c | 0x20];
+    }
+
+    next = ngx_pcalloc(cf->pool, nstates * nclasses * sizeof(ngx_uint_t));
+    if (next == NULL) {
+        return NULL;
+    }
+
+    states = ngx_pcalloc(cf->pool, nstates * sizeof(ngx_http_sub_state_t));
+    if (states == NULL) {
+        return NULL;
+    }
+
+    /* the trie, the state 0 is its root */
+
+    n = 1;
+
+    for (i = 0; i < pairs->nelts; i++) {
+
+        s = 0;
+        last = pair[i].match.data + pair[i].match.len;
+
+        for (p = pair[i].match.data; p < last; p++) {
+            row = &next[s * nclasses];
+
+            if (row[tables->class[*p]] == 0) {
+                states[n].depth = states[s].depth + 1;
+                row[tables->class[*p]] = n++;
+            }
+
+            s = row[tables->class[*p]];
+        }
+
+        states[s].match = i + 1;
+    }
+
+    /*
+     * the failure links are resolved in breadth-first order and folded
+     * into the transitions, so the scan makes one lookup per byte
+     */
+
+    fail = ngx_pcalloc(cf->temp_pool, n * sizeof(ngx_uint_t));
+    if (fail == NULL) {
+        return NULL;
+    }
+
+    queue = ngx_palloc(cf->temp_pool, n * sizeof(ngx_uint_t));
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    t = 0;
+    u = 0;
+
+    for (c = 1; c < nclasses; c++) {
+        if (next[c]) {
+            queue[t++] = next[c];
+        }
+    }
+
+    while (u < t) {
+        s = queue[u++];
+        row = &next[s * nclasses];
+
+        for (c = 0; c < nclasses; c++) {
+
+            if (row[c] == 0) {
+                row[c] = next[fail[s] * nclasses + c];
+                continue;
+            }
+
+            fail[row[c]] = next[fail[s] * nclasses + c];
+
+            states[row[c]].dict = states[fail[row[c]]].match
+                                  ? fail[row[c]] : states[fail[row[c]]].dict;
+
+            queue[t++] = row[c];
+        }
+    }
+
+    /* a single byte that may start a match is looked for with memchr() */
+
+    tables->start = -1;
+
+    for (c = 0; c < 256; c++) {
+        if (next[tables->class[c]] == 0) {
+            continue;
+        }
+
+        if (tables->start != -1) {
+            tables->start = -1;
+            break;
+        }
+
+        tables->start = c;
+    }
+
+    tables->next = next;
+    tables->states = states;
+    tables->nclasses = nclasses;
+    tables->npairs = pairs->nelts;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "sub filter automaton: %ui strings, %ui states, "
+                   "%ui classes", pairs->nelts, n, nclasses);
+
+    return tables;
+}
+
+
 static void *
 ngx_http_sub_create_conf(ngx_conf_t *cf)
 {
@@ -665,10 +926,8 @@ ngx_http_sub_create_conf(ngx_conf_t *cf)
     /*
      * set by ngx_pcalloc():
      *
-     *     conf->match = { 0, NULL };
-     *     conf->sub = { 0, NULL };
-     *     conf->sub_lengths = NULL;
-     *     conf->sub_values = NULL;
+     *     conf->pairs = NULL;
+     *     conf->tables = NULL;
      *     conf->types = { NULL };
      *     conf->types_keys = NULL;
      */
@@ -686,10 +945,25 @@ ngx_http_sub_merge_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_sub_loc_conf_t *conf = child;
 
     ngx_conf_merge_value(conf->once, prev->once, 1);
-    ngx_conf_merge_str_value(conf->match, prev->match, "");
 
-    if (conf->value.value.data == NULL) {
-        conf->value = prev->value;
+    if (conf->pairs == NULL && prev->pairs) {
+
+        if (prev->tables == NULL) {
+            prev->tables = ngx_http_sub_init_tables(cf, prev->pairs);
+            if (prev->tables == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        conf->pairs = prev->pairs;
+        conf->tables = prev->tables;
+    }
+
+    if (conf->pairs && conf->tables == NULL) {
+        conf->tables = ngx_http_sub_init_tables(cf, conf->pairs);
+        if (conf->tables == NULL) {
+            return NGX_CONF_ERROR;
+        }
     }
 
     if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
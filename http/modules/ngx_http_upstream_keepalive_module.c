@@ -12,23 +12,54 @@
 
 typedef struct {
     ngx_uint_t                         max_cached;
+    ngx_uint_t                         max_per_peer;
+    ngx_uint_t                         requests;
+    ngx_uint_t                         pipeline;
+    ngx_msec_t                         timeout;
 
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
 
+    ngx_queue_t                       *buckets;
+    ngx_queue_t                       *busy;
+    ngx_uint_t                         nbuckets;
+
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
 
 } ngx_http_upstream_keepalive_srv_conf_t;
 
 
-typedef struct {
+typedef struct ngx_http_upstream_keepalive_peer_data_s
+    ngx_http_upstream_keepalive_peer_data_t;
+
+struct ngx_http_upstream_keepalive_peer_data_s {
     ngx_http_upstream_keepalive_srv_conf_t  *conf;
 
+    ngx_http_request_t                *request;
     ngx_http_upstream_t               *upstream;
 
     void                              *data;
 
+    /*
+     * a request using a connection is linked into the busy buckets,
+     * requests pipelined after it are linked into its waiting queue
+     */
+
+    ngx_queue_t                        queue;
+    ngx_queue_t                        waiting;
+    ngx_uint_t                         nwaiting;
+    ngx_http_upstream_keepalive_peer_data_t  *owner;
+
+    ngx_connection_t                  *handoff;
+    ngx_event_t                        event;
+
+    uint32_t                           hash;
+
+    unsigned                           registered:1;
+    unsigned                           broken:1;
+    unsigned                           retry:1;
+
     ngx_event_get_peer_pt              original_get_peer;
     ngx_event_free_peer_pt             original_free_peer;
 
@@ -36,16 +67,17 @@ typedef struct {
     ngx_event_set_peer_session_pt      original_set_session;
     ngx_event_save_peer_session_pt     original_save_session;
 #endif
-
-} ngx_http_upstream_keepalive_peer_data_t;
+};
 
 
 typedef struct {
     ngx_http_upstream_keepalive_srv_conf_t  *conf;
 
     ngx_queue_t                        queue;
+    ngx_queue_t                        bucket;
     ngx_connection_t                  *connection;
 
+    uint32_t                           hash;
     socklen_t                          socklen;
     u_char                             sockaddr[NGX_SOCKADDRLEN];
 
@@ -62,6 +94,19 @@ static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
+static void ngx_http_upstream_keepalive_evict(
+    ngx_http_upstream_keepalive_cache_t *item);
+
+static void ngx_http_upstream_keepalive_register(
+    ngx_http_upstream_keepalive_peer_data_t *kp, uint32_t hash);
+static ngx_int_t ngx_http_upstream_keepalive_pipeline(
+    ngx_http_upstream_keepalive_peer_data_t *kp, ngx_peer_connection_t *pc,
+    uint32_t hash);
+static ngx_int_t ngx_http_upstream_keepalive_handoff(
+    ngx_http_upstream_keepalive_peer_data_t *kp, ngx_connection_t *c);
+static void ngx_http_upstream_keepalive_pipeline_fail(
+    ngx_http_upstream_keepalive_peer_data_t *kp);
+static void ngx_http_upstream_keepalive_resume_handler(ngx_event_t *ev);
 
 
 #if (NGX_HTTP_SSL)
@@ -79,12 +124,26 @@ static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
 
     { ngx_string("keepalive"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
       ngx_http_upstream_keepalive,
       0,
       0,
       NULL },
 
+    { ngx_string("keepalive_timeout"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, timeout),
+      NULL },
+
+    { ngx_string("keepalive_requests"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
+      NULL },
+
       ngx_null_command
 };
 
@@ -142,6 +201,15 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
 
     us->peer.init = ngx_http_upstream_init_keepalive_peer;
 
+    /* cached connections are neither timed out nor limited by default */
+
+    ngx_conf_init_msec_value(kcf->timeout, 0);
+    ngx_conf_init_uint_value(kcf->requests, 0);
+
+    if (kcf->max_per_peer == 0 || kcf->max_per_peer > kcf->max_cached) {
+        kcf->max_per_peer = kcf->max_cached;
+    }
+
     /* allocate cache items and add to free queue */
 
     cached = ngx_pcalloc(cf->pool,
@@ -153,6 +221,30 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     ngx_queue_init(&kcf->cache);
     ngx_queue_init(&kcf->free);
 
+    /* cached connections are also linked into per address hash buckets */
+
+    kcf->nbuckets = kcf->max_cached;
+
+    kcf->buckets = ngx_palloc(cf->pool, sizeof(ngx_queue_t) * kcf->nbuckets);
+    if (kcf->buckets == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < kcf->nbuckets; i++) {
+        ngx_queue_init(&kcf->buckets[i]);
+    }
+
+    if (kcf->pipeline) {
+        kcf->busy = ngx_palloc(cf->pool, sizeof(ngx_queue_t) * kcf->nbuckets);
+        if (kcf->busy == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < kcf->nbuckets; i++) {
+            ngx_queue_init(&kcf->busy[i]);
+        }
+    }
+
     for (i = 0; i < kcf->max_cached; i++) {
         ngx_queue_insert_head(&kcf->free, &cached[i].queue);
         cached[i].conf = kcf;
@@ -175,7 +267,7 @@ ngx_http_upstream_init_keepalive_peer(ngx_http_request_t *r,
     kcf = ngx_http_conf_upstream_srv_conf(us,
                                           ngx_http_upstream_keepalive_module);
 
-    kp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_keepalive_peer_data_t));
+    kp = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_keepalive_peer_data_t));
     if (kp == NULL) {
         return NGX_ERROR;
     }
@@ -185,7 +277,11 @@ ngx_http_upstream_init_keepalive_peer(ngx_http_request_t *r,
     }
 
     kp->conf = kcf;
+    kp->request = r;
     kp->upstream = r->upstream;
+
+    ngx_queue_init(&kp->waiting);
+
     kp->data = r->upstream->peer.data;
     kp->original_get_peer = r->upstream->peer.get;
     kp->original_free_peer = r->upstream->peer.free;
@@ -211,13 +307,26 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
+    uint32_t           hash;
     ngx_int_t          rc;
-    ngx_queue_t       *q, *cache;
+    ngx_queue_t       *q, *bucket;
     ngx_connection_t  *c;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer");
 
+    if (kp->retry) {
+
+        /* a new connection to the peer kept from the previous try */
+
+        kp->retry = 0;
+
+        pc->cached = 0;
+        pc->connection = NULL;
+
+        return NGX_OK;
+    }
+
     /* ask balancer */
 
     rc = kp->original_get_peer(pc, kp->data);
@@ -228,25 +337,33 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
 
     /* search cache for suitable connection */
 
-    cache = &kp->conf->cache;
+    hash = ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen);
+    bucket = &kp->conf->buckets[hash % kp->conf->nbuckets];
 
-    for (q = ngx_queue_head(cache);
-         q != ngx_queue_sentinel(cache);
+    for (q = ngx_queue_head(bucket);
+         q != ngx_queue_sentinel(bucket);
          q = ngx_queue_next(q))
     {
-        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, bucket);
         c = item->connection;
 
-        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
-                         item->socklen, pc->socklen)
-            == 0)
+        if (item->hash == hash
+            && ngx_memn2cmp((u_char *) &item->sockaddr,
+                            (u_char *) pc->sockaddr,
+                            item->socklen, pc->socklen)
+               == 0)
         {
-            ngx_queue_remove(q);
-            ngx_queue_insert_head(&kp->conf->free, q);
+            ngx_queue_remove(&item->bucket);
+            ngx_queue_remove(&item->queue);
+            ngx_queue_insert_head(&kp->conf->free, &item->queue);
 
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                            "get keepalive peer: using connection %p", c);
 
+            if (c->read->timer_set) {
+                ngx_del_timer(c->read);
+            }
+
             c->idle = 0;
             c->log = pc->log;
             c->read->log = pc->log;
@@ -256,34 +373,226 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
             pc->connection = c;
             pc->cached = 1;
 
+#if (NGX_STAT_STUB)
+            (void) ngx_atomic_fetch_add(ngx_stat_upstream_reused, 1);
+#endif
+
+            ngx_http_upstream_keepalive_register(kp, hash);
+
+            return NGX_DONE;
+        }
+    }
+
+    if (kp->conf->pipeline && kp->upstream->pipelining) {
+
+        if (!kp->upstream->request_sent
+            && ngx_http_upstream_keepalive_pipeline(kp, pc, hash) == NGX_OK)
+        {
+#if (NGX_STAT_STUB)
+            (void) ngx_atomic_fetch_add(ngx_stat_upstream_reused, 1);
+#endif
             return NGX_DONE;
         }
+
+        ngx_http_upstream_keepalive_register(kp, hash);
     }
 
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_upstream_missed, 1);
+#endif
+
     return NGX_OK;
 }
 
 
+static void
+ngx_http_upstream_keepalive_register(
+    ngx_http_upstream_keepalive_peer_data_t *kp, uint32_t hash)
+{
+    if (!kp->conf->pipeline || !kp->upstream->pipelining) {
+        return;
+    }
+
+    kp->hash = hash;
+    kp->registered = 1;
+
+    ngx_queue_insert_head(&kp->conf->busy[hash % kp->conf->nbuckets],
+                          &kp->queue);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_pipeline(
+    ngx_http_upstream_keepalive_peer_data_t *kp, ngx_peer_connection_t *pc,
+    uint32_t hash)
+{
+    ngx_buf_t                                *b;
+    ngx_queue_t                              *q, *bucket;
+    ngx_chain_t                              *cl, *out, **ll;
+    ngx_event_t                              *ev;
+    ngx_connection_t                         *c;
+    ngx_http_upstream_t                      *u;
+    ngx_http_upstream_keepalive_peer_data_t  *owner;
+
+    bucket = &kp->conf->busy[hash % kp->conf->nbuckets];
+
+    for (q = ngx_queue_head(bucket);
+         q != ngx_queue_sentinel(bucket);
+         q = ngx_queue_next(q))
+    {
+        owner = ngx_queue_data(q, ngx_http_upstream_keepalive_peer_data_t,
+                               queue);
+        u = owner->upstream;
+        c = u->peer.connection;
+
+        if (owner->hash != hash
+            || owner->broken
+            || c == NULL
+            || !u->request_body_sent
+            || owner->nwaiting >= kp->conf->pipeline
+            || (kp->conf->requests
+                && c->requests + owner->nwaiting + 1 >= kp->conf->requests)
+            || ngx_memn2cmp((u_char *) u->peer.sockaddr,
+                            (u_char *) pc->sockaddr,
+                            u->peer.socklen, pc->socklen)
+               != 0)
+        {
+            continue;
+        }
+
+        /*
+         * the request is sent through copies of the buffers, so
+         * they are intact if a new connection is needed after all
+         */
+
+        out = NULL;
+        ll = &out;
+
+        for (cl = kp->upstream->request_bufs; cl; cl = cl->next) {
+            b = ngx_alloc_buf(kp->request->pool);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(b, cl->buf, sizeof(ngx_buf_t));
+
+            *ll = ngx_alloc_chain_link(kp->request->pool);
+            if (*ll == NULL) {
+                return NGX_ERROR;
+            }
+
+            (*ll)->buf = b;
+            ll = &(*ll)->next;
+        }
+
+        *ll = NULL;
+
+        cl = c->send_chain(c, out, 0);
+
+        if (cl != NULL) {
+
+            /*
+             * a partially sent request makes the connection unusable
+             * for the next responses, so it is not reused anymore
+             */
+
+            owner->broken = 1;
+            return NGX_DECLINED;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get keepalive peer: pipelined on connection %p, "
+                       "depth %ui", c, owner->nwaiting + 1);
+
+        kp->owner = owner;
+        ngx_queue_insert_tail(&owner->waiting, &kp->queue);
+        owner->nwaiting++;
+
+        kp->upstream->pipelined = 1;
+
+        /* the request does not wait for its turn longer than a response */
+
+        ev = &kp->event;
+
+        ev->handler = ngx_http_upstream_keepalive_resume_handler;
+        ev->data = kp;
+        ev->log = kp->request->connection->log;
+
+        ngx_add_timer(ev, kp->upstream->conf->read_timeout);
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
 static void
 ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_uint_t state)
 {
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
-    ngx_http_upstream_keepalive_cache_t      *item;
+    ngx_http_upstream_keepalive_cache_t      *item, *cached;
 
-    ngx_queue_t          *q;
+    uint32_t              hash;
+    ngx_uint_t            n;
+    ngx_queue_t          *q, *bucket;
+    ngx_event_t          *ev;
     ngx_connection_t     *c;
     ngx_http_upstream_t  *u;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer");
 
+    kp->retry = 0;
+
+    ev = &kp->event;
+
+    if (ev->prev) {
+        ngx_delete_posted_event(ev);
+    }
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    if (kp->owner) {
+
+        /*
+         * the request waits for its turn on a pipelined connection;
+         * its response can not be skipped, so the connection is closed
+         * after the current one
+         */
+
+        kp->owner->broken = 1;
+        kp->owner->nwaiting--;
+        ngx_queue_remove(&kp->queue);
+        kp->owner = NULL;
+
+        goto invalid;
+    }
+
+    if (kp->registered) {
+        ngx_queue_remove(&kp->queue);
+        kp->registered = 0;
+    }
+
+    if (kp->handoff) {
+
+        /* the connection was handed over but not yet resumed */
+
+        ngx_http_upstream_keepalive_close(kp->handoff);
+        kp->handoff = NULL;
+
+        goto invalid;
+    }
+
     /* cache valid connections */
 
     u = kp->upstream;
     c = pc->connection;
 
-    if (state & NGX_PEER_FAILED
+    if (state & (NGX_PEER_FAILED|NGX_PEER_RETRY)
         || c == NULL
         || c->read->eof
         || c->read->error
@@ -298,31 +607,88 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         goto invalid;
     }
 
+    if (++c->requests >= kp->conf->requests && kp->conf->requests) {
+        goto invalid;
+    }
+
     if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
         goto invalid;
     }
 
+    if (kp->broken) {
+        goto invalid;
+    }
+
+    if (kp->nwaiting) {
+
+        if (ngx_http_upstream_keepalive_handoff(kp, c) != NGX_OK) {
+            goto invalid;
+        }
+
+        pc->connection = NULL;
+
+        goto invalid;
+    }
+
+    if (u->pipeline_buf) {
+        ngx_log_error(NGX_LOG_ERR, pc->log, 0,
+                      "upstream sent more data than expected");
+        goto invalid;
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
-    if (ngx_queue_empty(&kp->conf->free)) {
+    hash = ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen);
+    bucket = &kp->conf->buckets[hash % kp->conf->nbuckets];
 
-        q = ngx_queue_last(&kp->conf->cache);
-        ngx_queue_remove(q);
+    /*
+     * the bucket keeps connections in most recently used order, so
+     * the last matching one is the oldest connection to the same peer
+     */
+
+    n = 0;
+    item = NULL;
+
+    for (q = ngx_queue_head(bucket);
+         q != ngx_queue_sentinel(bucket);
+         q = ngx_queue_next(q))
+    {
+        cached = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, bucket);
+
+        if (cached->hash == hash
+            && ngx_memn2cmp((u_char *) &cached->sockaddr,
+                            (u_char *) pc->sockaddr,
+                            cached->socklen, pc->socklen)
+               == 0)
+        {
+            item = cached;
+            n++;
+        }
+    }
+
+    if (n >= kp->conf->max_per_peer) {
+        ngx_http_upstream_keepalive_evict(item);
+        q = &item->queue;
 
+    } else if (ngx_queue_empty(&kp->conf->free)) {
+
+        q = ngx_queue_last(&kp->conf->cache);
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
 
-        ngx_http_upstream_keepalive_close(item->connection);
+        ngx_http_upstream_keepalive_evict(item);
 
     } else {
         q = ngx_queue_head(&kp->conf->free);
-        ngx_queue_remove(q);
-
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
     }
 
+    ngx_queue_remove(q);
+
     item->connection = c;
+    item->hash = hash;
     ngx_queue_insert_head(&kp->conf->cache, q);
+    ngx_queue_insert_head(bucket, &item->bucket);
 
     pc->connection = NULL;
 
@@ -336,6 +702,10 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     c->write->handler = ngx_http_upstream_keepalive_dummy_handler;
     c->read->handler = ngx_http_upstream_keepalive_close_handler;
 
+    if (kp->conf->timeout) {
+        ngx_add_timer(c->read, kp->conf->timeout);
+    }
+
     c->data = item;
     c->idle = 1;
     c->log = ngx_cycle->log;
@@ -352,10 +722,187 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
 
 invalid:
 
+    if (kp->nwaiting) {
+        ngx_http_upstream_keepalive_pipeline_fail(kp);
+    }
+
+    if (state & NGX_PEER_RETRY) {
+
+        /* the peer is not released, it is used again for the retry */
+
+        kp->retry = 1;
+        return;
+    }
+
     kp->original_free_peer(pc, kp->data, state);
 }
 
 
+static ngx_int_t
+ngx_http_upstream_keepalive_handoff(
+    ngx_http_upstream_keepalive_peer_data_t *kp, ngx_connection_t *c)
+{
+    size_t                                    size;
+    ngx_buf_t                                *b, *rest;
+    ngx_queue_t                              *q;
+    ngx_event_t                              *ev;
+    ngx_http_upstream_keepalive_peer_data_t  *next, *item;
+
+    q = ngx_queue_head(&kp->waiting);
+    next = ngx_queue_data(q, ngx_http_upstream_keepalive_peer_data_t, queue);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "free keepalive peer: passing connection %p to %p",
+                   c, next->request);
+
+    /* the data of the next response read so far */
+
+    rest = kp->upstream->pipeline_buf;
+
+    if (rest) {
+        size = rest->last - rest->pos;
+
+        b = ngx_create_temp_buf(next->request->pool, size);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->last = ngx_cpymem(b->last, rest->pos, size);
+
+        next->upstream->pipeline_buf = b;
+    }
+
+    ngx_queue_remove(q);
+    next->owner = NULL;
+
+    while (!ngx_queue_empty(&kp->waiting)) {
+        q = ngx_queue_head(&kp->waiting);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_peer_data_t,
+                              queue);
+        item->owner = next;
+
+        ngx_queue_insert_tail(&next->waiting, q);
+    }
+
+    next->nwaiting = kp->nwaiting - 1;
+    kp->nwaiting = 0;
+
+    ngx_http_upstream_keepalive_register(next, kp->hash);
+
+    /* keep the connection quiet till the next request resumes */
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->write->handler = ngx_http_upstream_keepalive_dummy_handler;
+    c->read->handler = ngx_http_upstream_keepalive_dummy_handler;
+
+    c->data = NULL;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+    c->pool->log = ngx_cycle->log;
+
+    next->handoff = c;
+
+    ev = &next->event;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    ev->handler = ngx_http_upstream_keepalive_resume_handler;
+    ev->data = next;
+    ev->log = next->request->connection->log;
+
+    ngx_post_event(ev, &ngx_posted_events);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_pipeline_fail(
+    ngx_http_upstream_keepalive_peer_data_t *kp)
+{
+    ngx_queue_t                              *q;
+    ngx_event_t                              *ev;
+    ngx_http_upstream_keepalive_peer_data_t  *item;
+
+    /* the waiting requests are passed to the next upstream */
+
+    while (!ngx_queue_empty(&kp->waiting)) {
+        q = ngx_queue_head(&kp->waiting);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_peer_data_t,
+                              queue);
+        item->owner = NULL;
+        item->handoff = NULL;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, item->request->connection->log, 0,
+                       "keepalive pipelined request %p failed",
+                       item->request);
+
+        ev = &item->event;
+
+        if (ev->timer_set) {
+            ngx_del_timer(ev);
+        }
+
+        ev->handler = ngx_http_upstream_keepalive_resume_handler;
+        ev->data = item;
+        ev->log = item->request->connection->log;
+
+        ngx_post_event(ev, &ngx_posted_events);
+    }
+
+    kp->nwaiting = 0;
+}
+
+
+static void
+ngx_http_upstream_keepalive_resume_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                         *c;
+    ngx_http_upstream_keepalive_peer_data_t  *kp;
+
+    kp = ev->data;
+
+    if (ev->timedout) {
+        ev->timedout = 0;
+
+        ngx_log_error(NGX_LOG_INFO, ev->log, 0,
+                      "upstream pipelined request timed out in queue, "
+                      "retrying on a new connection");
+
+        /*
+         * the response of the request will still be sent on the connection,
+         * so the connection cannot be used after the current response
+         */
+
+        kp->owner->broken = 1;
+        kp->owner->nwaiting--;
+        ngx_queue_remove(&kp->queue);
+        kp->owner = NULL;
+
+        ngx_http_upstream_resume_pipelined(kp->request, NULL);
+        return;
+    }
+
+    c = kp->handoff;
+    kp->handoff = NULL;
+
+    ngx_http_upstream_resume_pipelined(kp->request, c);
+}
+
+
 static void
 ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev)
 {
@@ -379,7 +926,7 @@ ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
 
     c = ev->data;
 
-    if (c->close) {
+    if (c->close || c->read->timedout) {
         goto close;
     }
 
@@ -400,13 +947,37 @@ close:
     item = c->data;
     conf = item->conf;
 
-    ngx_http_upstream_keepalive_close(c);
+    ngx_http_upstream_keepalive_evict(item);
 
     ngx_queue_remove(&item->queue);
     ngx_queue_insert_head(&conf->free, &item->queue);
 }
 
 
+static void
+ngx_http_upstream_keepalive_evict(ngx_http_upstream_keepalive_cache_t *item)
+{
+    ngx_connection_t  *c;
+
+    c = item->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "keepalive closing connection %p", c);
+
+    ngx_queue_remove(&item->bucket);
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_upstream_closed, 1);
+#endif
+
+    ngx_http_upstream_keepalive_close(c);
+}
+
+
 static void
 ngx_http_upstream_keepalive_close(ngx_connection_t *c)
 {
@@ -469,9 +1040,13 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
      *
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
+     *     conf->max_per_peer = 0;
+     *     conf->pipeline = 0;
      */
 
     conf->max_cached = 1;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+    conf->requests = NGX_CONF_UNSET_UINT;
 
     return conf;
 }
@@ -519,6 +1094,32 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     for (i = 2; i < cf->args->nelts; i++) {
 
+        if (ngx_strncmp(value[i].data, "per_peer=", 9) == 0) {
+
+            n = ngx_atoi(&value[i].data[9], value[i].len - 9);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            kcf->max_per_peer = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "pipeline=", 9) == 0) {
+
+            n = ngx_atoi(&value[i].data[9], value[i].len - 9);
+
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            kcf->pipeline = n;
+
+            continue;
+        }
+
         if (ngx_strcmp(value[i].data, "single") == 0) {
             ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
                                "the \"single\" parameter is deprecated");
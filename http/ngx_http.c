@@ -1392,6 +1392,7 @@ ngx_http_add_address(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
     addr->opt = *lsopt;
     addr->hash.buckets = NULL;
     addr->hash.size = 0;
+    addr->hash.seeds = NULL;
     addr->wc_head = NULL;
     addr->wc_tail = NULL;
 #if (NGX_PCRE)
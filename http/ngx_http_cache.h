@@ -24,6 +24,8 @@
 
 #define NGX_HTTP_CACHE_KEY_LEN       16
 
+#define NGX_HTTP_CACHE_ENCODING_GZIP 1
+
 
 typedef struct {
     ngx_uint_t                       status;
@@ -31,6 +33,10 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct ngx_http_file_cache_hot_s  ngx_http_file_cache_hot_t;
+typedef struct ngx_http_file_cache_variant_s  ngx_http_file_cache_variant_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -45,16 +51,67 @@ typedef struct {
     unsigned                         exists:1;
     unsigned                         updating:1;
     unsigned                         deleting:1;
-                                     /* 11 unused bits */
+    unsigned                         shard:8;
+                                     /* 3 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
     time_t                           valid_sec;
     size_t                           body_start;
     off_t                            fs_size;
+
+    ngx_http_file_cache_hot_t       *hot;
+    ngx_http_file_cache_variant_t   *variants;
 } ngx_http_file_cache_node_t;
 
 
+struct ngx_http_file_cache_hot_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_node_t      *node;
+    size_t                           len;
+    u_char                           data[1];
+};
+
+
+struct ngx_http_file_cache_variant_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_node_t      *node;
+    ngx_http_file_cache_variant_t   *next;
+    ngx_uint_t                       encoding;
+    ngx_uint_t                       level;
+    size_t                           len;
+    u_char                           data[1];
+};
+
+
+typedef struct {
+    ngx_queue_t                      queue;
+    ngx_atomic_t                     cold;
+    ngx_atomic_t                     loading;
+    off_t                            size;
+    ngx_uint_t                       files;
+
+    ngx_atomic_t                     reads;
+    ngx_atomic_t                     read_bytes;
+    ngx_atomic_t                     writes;
+    ngx_atomic_t                     write_bytes;
+    ngx_atomic_t                     deletes;
+} ngx_http_file_cache_shard_sh_t;
+
+
+typedef struct {
+    ngx_http_file_cache_shard_sh_t  *sh;
+    ngx_http_file_cache_t           *cache;
+
+    ngx_path_t                      *path;
+    ngx_path_t                      *temp_path;
+
+    ngx_uint_t                       index;
+    ngx_uint_t                       weight;
+    off_t                            max_size;
+} ngx_http_file_cache_shard_t;
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -78,6 +135,7 @@ struct ngx_http_cache_s {
     ngx_buf_t                       *buf;
 
     ngx_http_file_cache_t           *file_cache;
+    ngx_http_file_cache_shard_t     *shard;
     ngx_http_file_cache_node_t      *node;
 
     ngx_msec_t                       lock_timeout;
@@ -92,6 +150,7 @@ struct ngx_http_cache_s {
     unsigned                         updating:1;
     unsigned                         exists:1;
     unsigned                         temp_file:1;
+    unsigned                         hot:1;
 };
 
 
@@ -109,10 +168,15 @@ typedef struct {
 typedef struct {
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
-    ngx_queue_t                      queue;
-    ngx_atomic_t                     cold;
-    ngx_atomic_t                     loading;
-    off_t                            size;
+    ngx_queue_t                      hot_queue;
+    size_t                           hot_size;
+    ngx_queue_t                      variant_queue;
+    size_t                           variant_size;
+    u_char                          *sketch;
+    ngx_uint_t                       sketch_width;
+    ngx_uint_t                       sketch_adds;
+    ngx_uint_t                       nshards;
+    ngx_http_file_cache_shard_sh_t   shards[1];
 } ngx_http_file_cache_sh_t;
 
 
@@ -120,11 +184,20 @@ struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
 
-    ngx_path_t                      *path;
+    ngx_array_t                      shards;
+    ngx_uint_t                       weight;
 
     off_t                            max_size;
     size_t                           bsize;
 
+    size_t                           hot_max_size;
+    size_t                           hot_max;
+
+    size_t                           variant_max_size;
+    size_t                           variant_max;
+
+    size_t                           sketch_size;
+
     time_t                           inactive;
 
     ngx_uint_t                       files;
@@ -145,7 +218,13 @@ void ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
+ngx_int_t ngx_http_file_cache_variant_get(ngx_http_request_t *r,
+    ngx_uint_t encoding, ngx_uint_t level, ngx_buf_t **bp);
+void ngx_http_file_cache_variant_store(ngx_http_request_t *r,
+    ngx_uint_t encoding, ngx_uint_t level, ngx_chain_t *in, size_t len);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
+size_t ngx_http_file_cache_stats_size(ngx_cycle_t *cycle);
+u_char *ngx_http_file_cache_stats(ngx_cycle_t *cycle, u_char *buf);
 
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
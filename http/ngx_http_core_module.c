@@ -73,6 +73,11 @@ static char *ngx_http_core_resolver(ngx_conf_t *cf, ngx_command_t *cmd,
 #if (NGX_HTTP_GZIP)
 static ngx_int_t ngx_http_gzip_accept_encoding(ngx_str_t *ae);
 static ngx_uint_t ngx_http_gzip_quantity(u_char *p, u_char *last);
+static ngx_int_t ngx_http_encoding_allowed(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_encoding_quantity(ngx_str_t *ae,
+    ngx_str_t *coding);
+static ngx_uint_t ngx_http_encoding_qvalue(u_char *p, u_char *last);
+static ngx_uint_t ngx_http_encoding_rank(ngx_str_t *coding);
 static char *ngx_http_gzip_disable(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 #endif
@@ -191,6 +196,16 @@ static ngx_str_t  ngx_http_gzip_no_cache = ngx_string("no-cache");
 static ngx_str_t  ngx_http_gzip_no_store = ngx_string("no-store");
 static ngx_str_t  ngx_http_gzip_private = ngx_string("private");
 
+
+/* content codings in the order of preference for equal quantities */
+
+static ngx_str_t  ngx_http_encodings[] = {
+    ngx_string("zstd"),
+    ngx_string("br"),
+    ngx_string("gzip"),
+    ngx_null_string
+};
+
 #endif
 
 
@@ -2171,11 +2186,7 @@ ngx_http_auth_basic_user(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_gzip_ok(ngx_http_request_t *r)
 {
-    time_t                     date, expires;
-    ngx_uint_t                 p;
-    ngx_array_t               *cc;
-    ngx_table_elt_t           *e, *d, *ae;
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_table_elt_t  *ae;
 
     r->gzip_tested = 1;
 
@@ -2214,6 +2225,105 @@ ngx_http_gzip_ok(ngx_http_request_t *r)
         return NGX_DECLINED;
     }
 
+    if (ngx_http_encoding_allowed(r) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    r->gzip_ok = 1;
+
+    return NGX_OK;
+}
+
+
+/*
+ * negotiates a content coding: the coding should be accepted by a client,
+ * and no other coding that applies to the response should be accepted with
+ * a higher quantity, or with the same quantity and a higher preference;
+ * the response should also pass the same gzip_* restrictions as gzipped
+ * responses do
+ */
+
+ngx_int_t
+ngx_http_encoding_ok(ngx_http_request_t *r, ngx_str_t *coding)
+{
+    ngx_uint_t                  i, q, n, rank;
+    ngx_table_elt_t            *ae;
+    ngx_http_encoding_t        *e;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    if (r != r->main) {
+        return NGX_DECLINED;
+    }
+
+    ae = r->headers_in.accept_encoding;
+    if (ae == NULL) {
+        return NGX_DECLINED;
+    }
+
+    q = ngx_http_encoding_quantity(&ae->value, coding);
+
+    if (q == 0) {
+        return NGX_DECLINED;
+    }
+
+    rank = ngx_http_encoding_rank(coding);
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    e = cmcf->encodings.elts;
+    for (i = 0; i < cmcf->encodings.nelts; i++) {
+
+        if (e[i].name.len == coding->len
+            && ngx_strncasecmp(e[i].name.data, coding->data, coding->len) == 0)
+        {
+            continue;
+        }
+
+        if (e[i].enabled(r) != NGX_OK) {
+            continue;
+        }
+
+        n = ngx_http_encoding_quantity(&ae->value, &e[i].name);
+
+        if (n > q || (n == q && ngx_http_encoding_rank(&e[i].name) < rank)) {
+            return NGX_DECLINED;
+        }
+    }
+
+    return ngx_http_encoding_allowed(r);
+}
+
+
+ngx_int_t
+ngx_http_encoding_add(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_http_encoding_enabled_pt enabled)
+{
+    ngx_http_encoding_t        *e;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    e = ngx_array_push(&cmcf->encodings);
+    if (e == NULL) {
+        return NGX_ERROR;
+    }
+
+    e->name = *name;
+    e->enabled = enabled;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_encoding_allowed(ngx_http_request_t *r)
+{
+    time_t                     date, expires;
+    ngx_uint_t                 p;
+    ngx_array_t               *cc;
+    ngx_table_elt_t           *e, *d;
+    ngx_http_core_loc_conf_t  *clcf;
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     if (r->headers_in.msie6 && clcf->gzip_disable_msie6) {
@@ -2330,8 +2440,6 @@ ok:
 
 #endif
 
-    r->gzip_ok = 1;
-
     return NGX_OK;
 }
 
@@ -2464,6 +2572,115 @@ ngx_http_gzip_quantity(u_char *p, u_char *last)
     return q;
 }
 
+
+static ngx_uint_t
+ngx_http_encoding_rank(ngx_str_t *coding)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; ngx_http_encodings[i].len; i++) {
+        if (ngx_http_encodings[i].len == coding->len
+            && ngx_strncasecmp(ngx_http_encodings[i].data, coding->data,
+                               coding->len)
+               == 0)
+        {
+            break;
+        }
+    }
+
+    return i;
+}
+
+
+/*
+ * returns the quantity of the coding in thousandths,
+ * or 0 if the coding is not listed or is listed with an invalid quantity
+ */
+
+static ngx_uint_t
+ngx_http_encoding_quantity(ngx_str_t *ae, ngx_str_t *coding)
+{
+    size_t       len;
+    u_char      *p, *start, *last;
+    ngx_uint_t   q;
+
+    p = ae->data;
+    last = p + ae->len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+
+        start = p;
+
+        while (p < last && *p != ',' && *p != ';' && *p != ' ') {
+            p++;
+        }
+
+        len = p - start;
+        q = 1000;
+
+        while (p < last && *p != ',') {
+
+            if (*p++ != ';') {
+                continue;
+            }
+
+            while (p < last && *p == ' ') {
+                p++;
+            }
+
+            if (last - p > 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+                q = ngx_http_encoding_qvalue(p + 2, last);
+            }
+        }
+
+        if (len == coding->len
+            && ngx_strncasecmp(start, coding->data, len) == 0)
+        {
+            return q;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_uint_t
+ngx_http_encoding_qvalue(u_char *p, u_char *last)
+{
+    u_char      c;
+    ngx_uint_t  q, scale;
+
+    c = *p++;
+
+    if (c != '0' && c != '1') {
+        return 0;
+    }
+
+    q = (c - '0') * 1000;
+
+    if (p == last || *p != '.') {
+        return q;
+    }
+
+    p++;
+
+    for (scale = 100; p < last && scale; scale /= 10) {
+        c = *p++;
+
+        if (c < '0' || c > '9') {
+            break;
+        }
+
+        q += (c - '0') * scale;
+    }
+
+    return (q > 1000) ? 0 : q;
+}
+
 #endif
 
 
@@ -3464,6 +3681,15 @@ ngx_http_core_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+#if (NGX_HTTP_GZIP)
+    if (ngx_array_init(&cmcf->encodings, cf->pool, 4,
+                       sizeof(ngx_http_encoding_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+#endif
+
     cmcf->server_names_hash_max_size = NGX_CONF_UNSET_UINT;
     cmcf->server_names_hash_bucket_size = NGX_CONF_UNSET_UINT;
 
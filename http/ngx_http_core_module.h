@@ -154,6 +154,18 @@ typedef struct {
 } ngx_http_phase_t;
 
 
+#if (NGX_HTTP_GZIP)
+
+typedef ngx_int_t (*ngx_http_encoding_enabled_pt)(ngx_http_request_t *r);
+
+typedef struct {
+    ngx_str_t                      name;
+    ngx_http_encoding_enabled_pt   enabled;
+} ngx_http_encoding_t;
+
+#endif
+
+
 
 /*
  serverָ:
@@ -205,6 +217,10 @@ typedef struct {
 
     ngx_uint_t                 try_files;       /* unsigned  try_files:1 */
 
+#if (NGX_HTTP_GZIP)
+    ngx_array_t                encodings;       /* ngx_http_encoding_t */
+#endif
+
     ngx_http_phase_t           phases[NGX_HTTP_LOG_PHASE + 1];
 } ngx_http_core_main_conf_t;
 
@@ -544,6 +560,9 @@ u_char *ngx_http_map_uri_to_path(ngx_http_request_t *r, ngx_str_t *name,
 ngx_int_t ngx_http_auth_basic_user(ngx_http_request_t *r);
 #if (NGX_HTTP_GZIP)
 ngx_int_t ngx_http_gzip_ok(ngx_http_request_t *r);
+ngx_int_t ngx_http_encoding_ok(ngx_http_request_t *r, ngx_str_t *coding);
+ngx_int_t ngx_http_encoding_add(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_http_encoding_enabled_pt enabled);
 #endif
 
 
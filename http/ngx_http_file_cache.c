@@ -11,6 +11,10 @@
 #include <ngx_md5.h>
 
 
+static void ngx_http_file_cache_init_shards(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_init_sketch(ngx_http_file_cache_t *cache);
+static ngx_http_file_cache_shard_t *
+    ngx_http_file_cache_shard(ngx_http_file_cache_t *cache, u_char *key);
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
@@ -23,6 +27,20 @@ static void ngx_http_cache_aio_event_handler(ngx_event_t *ev);
 #endif
 static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_hot_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_hot_store(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_hot_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_variants_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_variant_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_variant_t *v);
+static ngx_uint_t ngx_http_file_cache_sketch(ngx_http_file_cache_t *cache,
+    u_char *key, ngx_uint_t add);
+static ngx_int_t ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_http_cache_t *c, ngx_uint_t freq);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
 static ngx_http_file_cache_node_t *
@@ -30,21 +48,26 @@ static ngx_http_file_cache_node_t *
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 static void ngx_http_file_cache_cleanup(void *data);
-static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
-static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
-static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+static time_t ngx_http_file_cache_forced_expire(
+    ngx_http_file_cache_shard_t *shard);
+static time_t ngx_http_file_cache_expire(ngx_http_file_cache_shard_t *shard);
+static void ngx_http_file_cache_delete(ngx_http_file_cache_shard_t *shard,
     ngx_queue_t *q, u_char *name);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
+static ngx_int_t ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx,
+    ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
-static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
+static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_shard_t *shard,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
+static char *ngx_http_file_cache_add_shard(ngx_conf_t *cf,
+    ngx_http_file_cache_t *cache, ngx_str_t *value);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -60,35 +83,57 @@ ngx_str_t  ngx_http_cache_status[] = {
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
 
+#define NGX_HTTP_FILE_CACHE_SKETCH_DEPTH  4
+
+
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_file_cache_t  *ocache = data;
 
-    size_t                  len;
-    ngx_uint_t              n;
-    ngx_http_file_cache_t  *cache;
+    size_t                        len;
+    ngx_uint_t                    i, n;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard, *oshard;
 
     cache = shm_zone->data;
+    shard = cache->shards.elts;
 
     if (ocache) {
-        if (ngx_strcmp(cache->path->name.data, ocache->path->name.data) != 0) {
-            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
-                          "cache \"%V\" uses the \"%V\" cache path "
-                          "while previously it used the \"%V\" cache path",
-                          &shm_zone->shm.name, &cache->path->name,
-                          &ocache->path->name);
+        oshard = ocache->shards.elts;
 
+        if (cache->shards.nelts != ocache->shards.nelts) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" uses %ui cache paths "
+                          "while previously it used %ui cache paths",
+                          &shm_zone->shm.name, cache->shards.nelts,
+                          ocache->shards.nelts);
             return NGX_ERROR;
         }
 
-        for (n = 0; n < 3; n++) {
-            if (cache->path->level[n] != ocache->path->level[n]) {
+        for (i = 0; i < cache->shards.nelts; i++) {
+
+            if (ngx_strcmp(shard[i].path->name.data,
+                           oshard[i].path->name.data)
+                != 0)
+            {
                 ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
-                              "cache \"%V\" had previously different levels",
-                              &shm_zone->shm.name);
+                              "cache \"%V\" uses the \"%V\" cache path "
+                              "while previously it used the \"%V\" cache path",
+                              &shm_zone->shm.name, &shard[i].path->name,
+                              &oshard[i].path->name);
+
                 return NGX_ERROR;
             }
+
+            for (n = 0; n < 3; n++) {
+                if (shard[i].path->level[n] != oshard[i].path->level[n]) {
+                    ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                                  "cache \"%V\" had previously "
+                                  "different levels", &shm_zone->shm.name);
+                    return NGX_ERROR;
+                }
+            }
         }
 
         cache->sh = ocache->sh;
@@ -96,10 +141,43 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
         cache->shpool = ocache->shpool;
         cache->bsize = ocache->bsize;
 
-        cache->max_size /= cache->bsize;
+        ngx_http_file_cache_init_shards(cache);
+
+        if (cache->sketch_size == 0) {
+
+            if (cache->sh->sketch) {
+
+                /* the sketch was disabled */
+
+                ngx_shmtx_lock(&cache->shpool->mutex);
+
+                ngx_slab_free_locked(cache->shpool, cache->sh->sketch);
 
-        if (!cache->sh->cold || cache->sh->loading) {
-            cache->path->loader = NULL;
+                cache->sh->sketch = NULL;
+                cache->sh->sketch_width = 0;
+                cache->sh->sketch_adds = 0;
+
+                ngx_shmtx_unlock(&cache->shpool->mutex);
+            }
+
+        } else if (cache->sh->sketch == NULL
+                   || cache->sh->sketch_width
+                      != cache->sketch_size / NGX_HTTP_FILE_CACHE_SKETCH_DEPTH)
+        {
+            /*
+             * the sketch was enabled or resized; the old one is kept
+             * if the new one cannot be allocated
+             */
+
+            if (ngx_http_file_cache_init_sketch(cache) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        for (i = 0; i < cache->shards.nelts; i++) {
+            if (!shard[i].sh->cold || shard[i].sh->loading) {
+                shard[i].path->loader = NULL;
+            }
         }
 
         return NGX_OK;
@@ -109,12 +187,19 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     if (shm_zone->shm.exists) {
         cache->sh = cache->shpool->data;
-        cache->bsize = ngx_fs_bsize(cache->path->name.data);
+        cache->bsize = ngx_fs_bsize(shard[0].path->name.data);
+
+        ngx_http_file_cache_init_shards(cache);
 
         return NGX_OK;
     }
 
-    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_file_cache_sh_t));
+    n = cache->shards.nelts;
+
+    len = sizeof(ngx_http_file_cache_sh_t)
+          + (n - 1) * sizeof(ngx_http_file_cache_shard_sh_t);
+
+    cache->sh = ngx_slab_alloc(cache->shpool, len);
     if (cache->sh == NULL) {
         return NGX_ERROR;
     }
@@ -124,15 +209,33 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
                     ngx_http_file_cache_rbtree_insert_value);
 
-    ngx_queue_init(&cache->sh->queue);
+    ngx_queue_init(&cache->sh->hot_queue);
+    ngx_queue_init(&cache->sh->variant_queue);
 
-    cache->sh->cold = 1;
-    cache->sh->loading = 0;
-    cache->sh->size = 0;
+    cache->sh->hot_size = 0;
+    cache->sh->variant_size = 0;
+    cache->sh->sketch = NULL;
+    cache->sh->sketch_width = 0;
+    cache->sh->sketch_adds = 0;
+    cache->sh->nshards = n;
 
-    cache->bsize = ngx_fs_bsize(cache->path->name.data);
+    for (i = 0; i < n; i++) {
+        ngx_memzero(&cache->sh->shards[i],
+                    sizeof(ngx_http_file_cache_shard_sh_t));
 
-    cache->max_size /= cache->bsize;
+        ngx_queue_init(&cache->sh->shards[i].queue);
+        cache->sh->shards[i].cold = 1;
+    }
+
+    cache->bsize = ngx_fs_bsize(shard[0].path->name.data);
+
+    ngx_http_file_cache_init_shards(cache);
+
+    if (cache->sketch_size) {
+        if (ngx_http_file_cache_init_sketch(cache) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
 
     len = sizeof(" in cache keys zone \"\"") + shm_zone->shm.name.len;
 
@@ -148,6 +251,88 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 }
 
 
+static void
+ngx_http_file_cache_init_shards(ngx_http_file_cache_t *cache)
+{
+    ngx_uint_t                    i;
+    ngx_http_file_cache_shard_t  *shard;
+
+    cache->max_size /= cache->bsize;
+
+    shard = cache->shards.elts;
+
+    for (i = 0; i < cache->shards.nelts; i++) {
+        shard[i].sh = &cache->sh->shards[i];
+
+        /* max_size is divided between the paths proportionally to weights */
+
+        shard[i].max_size = cache->max_size / cache->weight * shard[i].weight;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_init_sketch(ngx_http_file_cache_t *cache)
+{
+    u_char  *sketch, *old;
+    size_t   width;
+
+    width = cache->sketch_size / NGX_HTTP_FILE_CACHE_SKETCH_DEPTH;
+
+    sketch = ngx_slab_alloc(cache->shpool,
+                            width * NGX_HTTP_FILE_CACHE_SKETCH_DEPTH);
+    if (sketch == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(sketch, width * NGX_HTTP_FILE_CACHE_SKETCH_DEPTH);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    old = cache->sh->sketch;
+
+    cache->sh->sketch_width = width;
+    cache->sh->sketch_adds = 0;
+    cache->sh->sketch = sketch;
+
+    if (old) {
+        ngx_slab_free_locked(cache->shpool, old);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static ngx_http_file_cache_shard_t *
+ngx_http_file_cache_shard(ngx_http_file_cache_t *cache, u_char *key)
+{
+    uint32_t                      hash;
+    ngx_uint_t                    i;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = cache->shards.elts;
+
+    if (cache->shards.nelts == 1) {
+        return &shard[0];
+    }
+
+    hash = ngx_crc32_short(key, NGX_HTTP_CACHE_KEY_LEN) % cache->weight;
+
+    for (i = 0; i < cache->shards.nelts - 1; i++) {
+
+        if (hash < shard[i].weight) {
+            break;
+        }
+
+        hash -= shard[i].weight;
+    }
+
+    return &shard[i];
+}
+
+
 ngx_int_t
 ngx_http_file_cache_new(ngx_http_request_t *r)
 {
@@ -173,6 +358,7 @@ ngx_http_file_cache_new(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_file_cache_create(ngx_http_request_t *r)
 {
+    ngx_int_t               rc;
     ngx_http_cache_t       *c;
     ngx_pool_cleanup_t     *cln;
     ngx_http_file_cache_t  *cache;
@@ -188,11 +374,18 @@ ngx_http_file_cache_create(ngx_http_request_t *r)
     cln->handler = ngx_http_file_cache_cleanup;
     cln->data = c;
 
-    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
+    rc = ngx_http_file_cache_exists(cache, c);
+
+    if (rc == NGX_ERROR) {
         return NGX_ERROR;
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (rc == NGX_AGAIN && c->node == NULL) {
+        /* not admitted to the cache */
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_file_cache_name(r, c->shard->path) != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -238,6 +431,7 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_file_cache_open(ngx_http_request_t *r)
 {
+    size_t                     size;
     ngx_int_t                  rc, rv;
     ngx_uint_t                 cold, test;
     ngx_http_cache_t          *c;
@@ -281,7 +475,7 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         return NGX_HTTP_CACHE_SCARCE;
     }
 
-    cold = cache->sh->cold;
+    cold = c->shard->sh->cold;
 
     if (rc == NGX_OK) {
 
@@ -295,7 +489,9 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 
     } else { /* rc == NGX_DECLINED */
 
-        if (c->min_uses > 1) {
+        if (c->min_uses > 1
+            && (cache->sketch_size == 0 || cache->sh->sketch == NULL || cold))
+        {
 
             if (!cold) {
                 return NGX_HTTP_CACHE_SCARCE;
@@ -311,10 +507,23 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         }
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (ngx_http_file_cache_name(r, c->shard->path) != NGX_OK) {
         return NGX_ERROR;
     }
 
+    if (c->exists && cache->hot_max) {
+        rc = ngx_http_file_cache_hot_read(r, c);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+
+        /* the hot copy was not usable, the file is read from disk */
+
+        c->hot = 0;
+        c->buf = NULL;
+    }
+
     if (!test) {
         goto done;
     }
@@ -358,7 +567,15 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     c->length = of.size;
     c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
 
-    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    size = c->body_start;
+
+    /* small files are read at once to be kept in the hot tier */
+
+    if (c->length <= (off_t) cache->hot_max && c->length > (off_t) size) {
+        size = (size_t) c->length;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, size);
     if (c->buf == NULL) {
         return NGX_ERROR;
     }
@@ -484,10 +701,15 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_http_file_cache_t         *cache;
     ngx_http_file_cache_header_t  *h;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    if (c->hot) {
+        n = (ssize_t) c->length;
 
-    if (n < 0) {
-        return n;
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
+
+        if (n < 0) {
+            return n;
+        }
     }
 
     if ((size_t) n < c->header_start) {
@@ -524,7 +746,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     cache = c->file_cache;
 
-    if (cache->sh->cold) {
+    if (c->shard->sh->cold) {
 
         ngx_shmtx_lock(&cache->shpool->mutex);
 
@@ -535,12 +757,24 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             c->node->uniq = c->uniq;
             c->node->fs_size = c->fs_size;
 
-            cache->sh->size += c->fs_size;
+            c->shard->sh->size += c->fs_size;
+            c->shard->sh->files++;
         }
 
         ngx_shmtx_unlock(&cache->shpool->mutex);
     }
 
+    if (c->file.fd != NGX_INVALID_FILE) {
+        (void) ngx_atomic_fetch_add(&c->shard->sh->reads, 1);
+        (void) ngx_atomic_fetch_add(&c->shard->sh->read_bytes, c->length);
+    }
+
+    if (!c->hot && cache->hot_max
+        && n == c->length && c->length <= (off_t) cache->hot_max)
+    {
+        c->hot = 1;
+    }
+
     now = ngx_time();
 
     if (c->valid_sec < now) {
@@ -565,6 +799,10 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return rc;
     }
 
+    if (c->hot && c->node->hot == NULL) {
+        ngx_http_file_cache_hot_store(cache, c);
+    }
+
     return NGX_OK;
 }
 
@@ -586,7 +824,8 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         goto noaio;
     }
 
-    n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+    n = ngx_file_aio_read(&c->file, c->buf->pos, c->buf->end - c->buf->pos, 0,
+                          r->pool);
 
     if (n != NGX_AGAIN) {
         return n;
@@ -604,7 +843,7 @@ noaio:
 
 #endif
 
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+    return ngx_read_file(&c->file, c->buf->pos, c->buf->end - c->buf->pos, 0);
 }
 
 
@@ -631,8 +870,12 @@ ngx_http_cache_aio_event_handler(ngx_event_t *ev)
 static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_int_t                     rc;
+    ngx_uint_t                    freq;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    freq = 0;
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
@@ -640,6 +883,12 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
     if (fcn == NULL) {
         fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+        /* the sketch may be absent in the old workers after reload */
+
+        if (cache->sketch_size && cache->sh->sketch) {
+            freq = ngx_http_file_cache_sketch(cache, c->key, 1);
+        }
     }
 
     if (fcn) {
@@ -678,12 +927,23 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         goto done;
     }
 
+    shard = ngx_http_file_cache_shard(cache, c->key);
+
+    if (cache->sketch_size
+        && cache->sh->sketch
+        && !shard->sh->cold
+        && ngx_http_file_cache_admit(cache, shard, c, freq) != NGX_OK)
+    {
+        rc = NGX_AGAIN;
+        goto failed;
+    }
+
     fcn = ngx_slab_alloc_locked(cache->shpool,
                                 sizeof(ngx_http_file_cache_node_t));
     if (fcn == NULL) {
         ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        (void) ngx_http_file_cache_forced_expire(cache);
+        (void) ngx_http_file_cache_forced_expire(shard);
 
         ngx_shmtx_lock(&cache->shpool->mutex);
 
@@ -706,11 +966,22 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
     fcn->count = 1;
     fcn->updating = 0;
     fcn->deleting = 0;
+    fcn->shard = shard->index;
+    fcn->hot = NULL;
+    fcn->variants = NULL;
 
 renew:
 
     rc = NGX_DECLINED;
 
+    if (fcn->hot) {
+        ngx_http_file_cache_hot_free(cache, fcn);
+    }
+
+    if (fcn->variants) {
+        ngx_http_file_cache_variants_free(cache, fcn);
+    }
+
     fcn->valid_msec = 0;
     fcn->error = 0;
     fcn->exists = 0;
@@ -719,21 +990,464 @@ renew:
     fcn->body_start = 0;
     fcn->fs_size = 0;
 
-done:
+done:
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    shard = cache->shards.elts;
+    shard += fcn->shard;
+
+    ngx_queue_insert_head(&shard->sh->queue, &fcn->queue);
+
+    c->uniq = fcn->uniq;
+    c->error = fcn->error;
+    c->node = fcn;
+    c->shard = shard;
+
+failed:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+
+/*
+ * a count-min sketch of recent key popularity with conservative update;
+ * the counters are halved after every 10 * width additions, so that
+ * the sketch keeps track of recent frequency only
+ */
+
+static ngx_uint_t
+ngx_http_file_cache_sketch(ngx_http_file_cache_t *cache, u_char *key,
+    ngx_uint_t add)
+{
+    u_char      *p, *counter[NGX_HTTP_FILE_CACHE_SKETCH_DEPTH];
+    uint32_t     h1, h2;
+    ngx_uint_t   i, n, min, width;
+
+    width = cache->sh->sketch_width;
+
+    /* the key is an MD5 hash, so its parts are used as the row hashes */
+
+    ngx_memcpy(&h1, key, sizeof(uint32_t));
+    ngx_memcpy(&h2, key + sizeof(uint32_t), sizeof(uint32_t));
+
+    min = 255;
+    p = cache->sh->sketch;
+
+    for (i = 0; i < NGX_HTTP_FILE_CACHE_SKETCH_DEPTH; i++) {
+        counter[i] = p + (uint32_t) (h1 + i * h2) % width;
+
+        if (*counter[i] < min) {
+            min = *counter[i];
+        }
+
+        p += width;
+    }
+
+    if (!add || min == 255) {
+        return min;
+    }
+
+    for (i = 0; i < NGX_HTTP_FILE_CACHE_SKETCH_DEPTH; i++) {
+        if (*counter[i] == min) {
+            (*counter[i])++;
+        }
+    }
+
+    if (++cache->sh->sketch_adds >= 10 * width) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache sketch aging");
+
+        p = cache->sh->sketch;
+
+        for (n = 0; n < width * NGX_HTTP_FILE_CACHE_SKETCH_DEPTH; n++) {
+            p[n] >>= 1;
+        }
+
+        cache->sh->sketch_adds /= 2;
+    }
+
+    return min + 1;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_http_cache_t *c, ngx_uint_t freq)
+{
+    ngx_uint_t                   victim;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[NGX_HTTP_CACHE_KEY_LEN];
+
+    if (freq < c->min_uses) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                       "http file cache admit: %ui < %ui",
+                       freq, c->min_uses);
+        return NGX_DECLINED;
+    }
+
+    if (shard->sh->size < shard->max_size
+        || ngx_queue_empty(&shard->sh->queue))
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * the cache is full, so a new entry will evict the least recently
+     * used one: admit it only if it is more popular than the victim
+     */
+
+    q = ngx_queue_last(&shard->sh->queue);
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    victim = ngx_http_file_cache_sketch(cache, key, 0);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache admit: %ui, victim: %ui", freq, victim);
+
+    if (freq > victim) {
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_hot_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    size_t                      len;
+    ngx_buf_t                  *b;
+    ngx_http_file_cache_t      *cache;
+    ngx_http_file_cache_hot_t  *hot;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    hot = c->node->hot;
+    len = hot ? hot->len : 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (len == 0) {
+        return NGX_DECLINED;
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    /* the entry may have been replaced while the lock was released */
+
+    hot = c->node->hot;
+
+    if (hot == NULL || hot->len > len) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    len = hot->len;
+    ngx_memcpy(b->pos, hot->data, len);
+
+    ngx_queue_remove(&hot->queue);
+    ngx_queue_insert_head(&cache->sh->hot_queue, &hot->queue);
+
+    c->uniq = c->node->uniq;
+    c->fs_size = c->node->fs_size;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache hot: %uz", len);
+
+    c->buf = b;
+    c->length = len;
+    c->hot = 1;
+
+    return ngx_http_file_cache_read(r, c);
+}
+
+
+static void
+ngx_http_file_cache_hot_store(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
+{
+    size_t                       len;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_hot_t   *hot;
+    ngx_http_file_cache_node_t  *fcn;
+
+    len = (size_t) c->length;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+
+    if (fcn->hot || !fcn->exists || fcn->uniq != c->uniq) {
+        goto done;
+    }
+
+    cache->shpool->log_nomem = 0;
+
+    for ( ;; ) {
+
+        if (cache->sh->hot_size + len <= cache->hot_max_size) {
+            hot = ngx_slab_alloc_locked(cache->shpool,
+                                   offsetof(ngx_http_file_cache_hot_t, data)
+                                   + len);
+            if (hot) {
+                break;
+            }
+        }
+
+        if (ngx_queue_empty(&cache->sh->hot_queue)) {
+            cache->shpool->log_nomem = 1;
+            goto done;
+        }
+
+        q = ngx_queue_last(&cache->sh->hot_queue);
+        hot = ngx_queue_data(q, ngx_http_file_cache_hot_t, queue);
+
+        ngx_http_file_cache_hot_free(cache, hot->node);
+    }
+
+    cache->shpool->log_nomem = 1;
+
+    hot->node = fcn;
+    hot->len = len;
+    ngx_memcpy(hot->data, c->buf->pos, len);
+
+    ngx_queue_insert_head(&cache->sh->hot_queue, &hot->queue);
+    cache->sh->hot_size += len;
+
+    fcn->hot = hot;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache hot store: %uz, total: %uz",
+                   len, cache->sh->hot_size);
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static void
+ngx_http_file_cache_hot_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_hot_t  *hot;
+
+    hot = fcn->hot;
+
+    ngx_queue_remove(&hot->queue);
+    cache->sh->hot_size -= hot->len;
+
+    ngx_slab_free_locked(cache->shpool, hot);
+
+    fcn->hot = NULL;
+}
+
+
+ngx_int_t
+ngx_http_file_cache_variant_get(ngx_http_request_t *r, ngx_uint_t encoding,
+    ngx_uint_t level, ngx_buf_t **bp)
+{
+    size_t                          len;
+    ngx_buf_t                      *b;
+    ngx_http_cache_t               *c;
+    ngx_http_file_cache_t          *cache;
+    ngx_http_file_cache_node_t     *fcn;
+    ngx_http_file_cache_variant_t  *v;
+
+    c = r->cache;
+    cache = c->file_cache;
+
+    if (cache->variant_max == 0 || c->node == NULL || c->updated) {
+        return NGX_DECLINED;
+    }
+
+    fcn = c->node;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for (v = fcn->variants; v; v = v->next) {
+        if (v->encoding == encoding && v->level == level) {
+            break;
+        }
+    }
+
+    len = (v && fcn->uniq == c->uniq) ? v->len : 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (len == 0) {
+        return NGX_DECLINED;
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    /* the variant may have been freed while the lock was released */
+
+    for (v = fcn->variants; v; v = v->next) {
+        if (v->encoding == encoding && v->level == level) {
+            break;
+        }
+    }
+
+    if (v == NULL || v->len != len || fcn->uniq != c->uniq) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    b->last = ngx_cpymem(b->pos, v->data, len);
+
+    ngx_queue_remove(&v->queue);
+    ngx_queue_insert_head(&cache->sh->variant_queue, &v->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache variant %ui level:%ui: %uz",
+                   encoding, level, len);
+
+    *bp = b;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_file_cache_variant_store(ngx_http_request_t *r, ngx_uint_t encoding,
+    ngx_uint_t level, ngx_chain_t *in, size_t len)
+{
+    u_char                         *p;
+    ngx_queue_t                    *q;
+    ngx_http_cache_t               *c;
+    ngx_http_file_cache_t          *cache;
+    ngx_http_file_cache_node_t     *fcn;
+    ngx_http_file_cache_variant_t  *v, *old;
+
+    c = r->cache;
+    cache = c->file_cache;
+
+    if (len == 0 || len > cache->variant_max) {
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    /*
+     * the node is looked up again as it may have been released
+     * by ngx_http_file_cache_free() while the response was sent
+     */
+
+    fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+    if (fcn == NULL || !fcn->exists || fcn->uniq != c->uniq) {
+        goto done;
+    }
+
+    for (v = fcn->variants; v; v = v->next) {
+        if (v->encoding == encoding && v->level == level) {
+            goto done;
+        }
+    }
+
+    cache->shpool->log_nomem = 0;
+
+    for ( ;; ) {
+
+        if (cache->sh->variant_size + len <= cache->variant_max_size) {
+            v = ngx_slab_alloc_locked(cache->shpool,
+                               offsetof(ngx_http_file_cache_variant_t, data)
+                               + len);
+            if (v) {
+                break;
+            }
+        }
+
+        if (ngx_queue_empty(&cache->sh->variant_queue)) {
+            cache->shpool->log_nomem = 1;
+            goto done;
+        }
+
+        q = ngx_queue_last(&cache->sh->variant_queue);
+        old = ngx_queue_data(q, ngx_http_file_cache_variant_t, queue);
+
+        ngx_http_file_cache_variant_free(cache, old);
+    }
+
+    cache->shpool->log_nomem = 1;
+
+    v->node = fcn;
+    v->encoding = encoding;
+    v->level = level;
+    v->len = len;
+
+    for (p = v->data; in; in = in->next) {
+        p = ngx_cpymem(p, in->buf->pos, in->buf->last - in->buf->pos);
+    }
+
+    v->next = fcn->variants;
+    fcn->variants = v;
+
+    ngx_queue_insert_head(&cache->sh->variant_queue, &v->queue);
+    cache->sh->variant_size += len;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache variant %ui level:%ui store: %uz, "
+                   "total: %uz", encoding, level, len, cache->sh->variant_size);
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
 
-    fcn->expire = ngx_time() + cache->inactive;
+static void
+ngx_http_file_cache_variants_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    while (fcn->variants) {
+        ngx_http_file_cache_variant_free(cache, fcn->variants);
+    }
+}
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
 
-    c->uniq = fcn->uniq;
-    c->error = fcn->error;
-    c->node = fcn;
+static void
+ngx_http_file_cache_variant_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_variant_t *v)
+{
+    ngx_http_file_cache_variant_t  **vp;
 
-failed:
+    for (vp = &v->node->variants; *vp != v; vp = &(*vp)->next) {
+        /* void */
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    *vp = v->next;
 
-    return rc;
+    ngx_queue_remove(&v->queue);
+    cache->sh->variant_size -= v->len;
+
+    ngx_slab_free_locked(cache->shpool, v);
 }
 
 
@@ -899,7 +1613,7 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 void
 ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 {
-    off_t                   fs_size;
+    off_t                   fs_size, size;
     ngx_int_t               rc;
     ngx_file_uniq_t         uniq;
     ngx_file_info_t         fi;
@@ -923,6 +1637,7 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 
     uniq = 0;
     fs_size = 0;
+    size = 0;
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache rename: \"%s\" to \"%s\"",
@@ -948,20 +1663,37 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
         } else {
             uniq = ngx_file_uniq(&fi);
             fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+            size = ngx_file_size(&fi);
         }
     }
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
+    if (c->node->hot) {
+        ngx_http_file_cache_hot_free(cache, c->node);
+    }
+
+    if (c->node->variants) {
+        ngx_http_file_cache_variants_free(cache, c->node);
+    }
+
     c->node->count--;
     c->node->uniq = uniq;
     c->node->body_start = c->body_start;
 
-    cache->sh->size += fs_size - c->node->fs_size;
+    c->shard->sh->size += fs_size - c->node->fs_size;
     c->node->fs_size = fs_size;
 
     if (rc == NGX_OK) {
+
+        if (!c->node->exists) {
+            c->shard->sh->files++;
+        }
+
         c->node->exists = 1;
+
+        c->shard->sh->writes++;
+        c->shard->sh->write_bytes += size;
     }
 
     c->node->updating = 0;
@@ -994,9 +1726,11 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (!c->hot) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
     }
 
     rc = ngx_http_send_header(r);
@@ -1005,6 +1739,23 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return rc;
     }
 
+    if (c->hot) {
+
+        /* the whole response is in the memory of the c->buf */
+
+        b->pos = c->buf->start + c->body_start;
+        b->last = c->buf->start + c->length;
+
+        b->memory = (c->length - c->body_start) ? 1: 0;
+        b->last_buf = (r == r->main) ? 1: 0;
+        b->last_in_chain = 1;
+
+        out.buf = b;
+        out.next = NULL;
+
+        return ngx_http_output_filter(r, &out);
+    }
+
     b->file_pos = c->body_start;
     b->file_last = c->length;
 
@@ -1109,7 +1860,7 @@ ngx_http_file_cache_cleanup(void *data)
 
 
 static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_shard_t *shard)
 {
     u_char                      *name;
     size_t                       len;
@@ -1117,12 +1868,15 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
     ngx_uint_t                   tries;
     ngx_path_t                  *path;
     ngx_queue_t                 *q;
+    ngx_http_file_cache_t       *cache;
     ngx_http_file_cache_node_t  *fcn;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire: \"%V\"",
+                   &shard->path->name);
 
-    path = cache->path;
+    cache = shard->cache;
+    path = shard->path;
     len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
 
     name = ngx_alloc(len + 1, ngx_cycle->log);
@@ -1137,8 +1891,8 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
-    for (q = ngx_queue_last(&cache->sh->queue);
-         q != ngx_queue_sentinel(&cache->sh->queue);
+    for (q = ngx_queue_last(&shard->sh->queue);
+         q != ngx_queue_sentinel(&shard->sh->queue);
          q = ngx_queue_prev(q))
     {
         fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
@@ -1149,7 +1903,7 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
                   fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
         if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
+            ngx_http_file_cache_delete(shard, q, name);
             wait = 0;
 
         } else {
@@ -1172,20 +1926,22 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 
 
 static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_expire(ngx_http_file_cache_shard_t *shard)
 {
     u_char                      *name, *p;
     size_t                       len;
     time_t                       now, wait;
     ngx_path_t                  *path;
     ngx_queue_t                 *q;
+    ngx_http_file_cache_t       *cache;
     ngx_http_file_cache_node_t  *fcn;
     u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire: \"%V\"", &shard->path->name);
 
-    path = cache->path;
+    cache = shard->cache;
+    path = shard->path;
     len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
 
     name = ngx_alloc(len + 1, ngx_cycle->log);
@@ -1201,12 +1957,12 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
     for ( ;; ) {
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
+        if (ngx_queue_empty(&shard->sh->queue)) {
             wait = 10;
             break;
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
+        q = ngx_queue_last(&shard->sh->queue);
 
         fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
@@ -1223,7 +1979,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
                        fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
         if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
+            ngx_http_file_cache_delete(shard, q, name);
             continue;
         }
 
@@ -1245,7 +2001,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
         ngx_queue_remove(q);
         fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        ngx_queue_insert_head(&shard->sh->queue, &fcn->queue);
 
         ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                       "ignore long locked inactive cache entry %*s, count:%d",
@@ -1261,20 +2017,32 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
 
 static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
+ngx_http_file_cache_delete(ngx_http_file_cache_shard_t *shard, ngx_queue_t *q,
     u_char *name)
 {
     u_char                      *p;
     size_t                       len;
     ngx_path_t                  *path;
+    ngx_http_file_cache_t       *cache;
     ngx_http_file_cache_node_t  *fcn;
 
+    cache = shard->cache;
+
     fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
+    if (fcn->hot) {
+        ngx_http_file_cache_hot_free(cache, fcn);
+    }
+
+    if (fcn->variants) {
+        ngx_http_file_cache_variants_free(cache, fcn);
+    }
+
     if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+        shard->sh->size -= fcn->fs_size;
+        shard->sh->files--;
 
-        path = cache->path;
+        path = shard->path;
         p = name + path->name.len + 1 + path->len;
         p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
                          sizeof(ngx_rbtree_key_t));
@@ -1300,6 +2068,8 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
         ngx_shmtx_lock(&cache->shpool->mutex);
         fcn->count--;
         fcn->deleting = 0;
+
+        shard->sh->deletes++;
     }
 
     if (fcn->count == 0) {
@@ -1313,12 +2083,15 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
 static time_t
 ngx_http_file_cache_manager(void *data)
 {
-    ngx_http_file_cache_t  *cache = data;
+    ngx_http_file_cache_shard_t  *shard = data;
+
+    off_t                   size;
+    time_t                  next, wait;
+    ngx_http_file_cache_t  *cache;
 
-    off_t   size;
-    time_t  next, wait;
+    cache = shard->cache;
 
-    next = ngx_http_file_cache_expire(cache);
+    next = ngx_http_file_cache_expire(shard);
 
     cache->last = ngx_current_msec;
     cache->files = 0;
@@ -1326,18 +2099,19 @@ ngx_http_file_cache_manager(void *data)
     for ( ;; ) {
         ngx_shmtx_lock(&cache->shpool->mutex);
 
-        size = cache->sh->size;
+        size = shard->sh->size;
 
         ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O", size);
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: \"%V\" %O",
+                       &shard->path->name, size);
 
-        if (size < cache->max_size) {
+        if (size < shard->max_size) {
             return next;
         }
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+        wait = ngx_http_file_cache_forced_expire(shard);
 
         if (wait > 0) {
             return wait;
@@ -1353,45 +2127,48 @@ ngx_http_file_cache_manager(void *data)
 static void
 ngx_http_file_cache_loader(void *data)
 {
-    ngx_http_file_cache_t  *cache = data;
+    ngx_http_file_cache_shard_t  *shard = data;
 
-    ngx_tree_ctx_t  tree;
+    ngx_tree_ctx_t          tree;
+    ngx_http_file_cache_t  *cache;
 
-    if (!cache->sh->cold || cache->sh->loading) {
+    if (!shard->sh->cold || shard->sh->loading) {
         return;
     }
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+    if (!ngx_atomic_cmp_set(&shard->sh->loading, 0, ngx_pid)) {
         return;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader: \"%V\"", &shard->path->name);
+
+    cache = shard->cache;
 
     tree.init_handler = NULL;
     tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_noop;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
     tree.post_tree_handler = ngx_http_file_cache_noop;
     tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
+    tree.data = shard;
     tree.alloc = 0;
     tree.log = ngx_cycle->log;
 
     cache->last = ngx_current_msec;
     cache->files = 0;
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
+    if (ngx_walk_tree(&tree, &shard->path->name) == NGX_ABORT) {
+        shard->sh->loading = 0;
         return;
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    shard->sh->cold = 0;
+    shard->sh->loading = 0;
 
     ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
                   "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  &shard->path->name,
+                  ((double) shard->sh->size * cache->bsize) / (1024 * 1024),
                   cache->bsize);
 }
 
@@ -1403,13 +2180,36 @@ ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = ctx->data;
+
+    /* temporary files are kept inside the cache path */
+
+    if (shard->temp_path
+        && path->len == shard->temp_path->name.len
+        && ngx_strncmp(path->data, shard->temp_path->name.data, path->len)
+           == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 {
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+    ngx_msec_t                    elapsed;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
-    cache = ctx->data;
+    shard = ctx->data;
+    cache = shard->cache;
 
     if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
         (void) ngx_http_file_cache_delete_file(ctx, path);
@@ -1450,11 +2250,12 @@ ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
 static ngx_int_t
 ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
 {
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+    u_char                       *p;
+    ngx_int_t                     n;
+    ngx_uint_t                    i;
+    ngx_http_cache_t              c;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
         return NGX_ERROR;
@@ -1467,7 +2268,8 @@ ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
     }
 
     ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    shard = ctx->data;
+    cache = shard->cache;
 
     c.length = ctx->size;
     c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
@@ -1486,14 +2288,19 @@ ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
         c.key[i] = (u_char) n;
     }
 
-    return ngx_http_file_cache_add(cache, &c);
+    return ngx_http_file_cache_add(shard, &c);
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+ngx_http_file_cache_add(ngx_http_file_cache_shard_t *shard,
+    ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *nshard;
+
+    cache = shard->cache;
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
@@ -1526,16 +2333,41 @@ ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         fcn->valid_sec = 0;
         fcn->body_start = 0;
         fcn->fs_size = c->fs_size;
+        fcn->shard = shard->index;
+        fcn->hot = NULL;
+        fcn->variants = NULL;
 
-        cache->sh->size += c->fs_size;
+        shard->sh->size += c->fs_size;
+        shard->sh->files++;
 
     } else {
+
+        if (fcn->shard != shard->index) {
+
+            /*
+             * the key was placed on another path after the path weights
+             * were changed, so this copy would never be used or accounted
+             */
+
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+
+            ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                          "cache \"%V\" keeps the key on another path, "
+                          "the stale copy on \"%V\" is removed",
+                          &cache->shm_zone->shm.name, &shard->path->name);
+
+            return NGX_DECLINED;
+        }
+
         ngx_queue_remove(&fcn->queue);
     }
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    nshard = cache->shards.elts;
+    nshard += fcn->shard;
+
+    ngx_queue_insert_head(&nshard->sh->queue, &fcn->queue);
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
@@ -1584,29 +2416,116 @@ ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status)
 }
 
 
+size_t
+ngx_http_file_cache_stats_size(ngx_cycle_t *cycle)
+{
+    size_t                        size;
+    ngx_uint_t                    i;
+    ngx_path_t                  **path;
+    ngx_http_file_cache_shard_t  *shard;
+
+    size = 0;
+
+    path = cycle->paths.elts;
+    for (i = 0; i < cycle->paths.nelts; i++) {
+
+        if (path[i]->manager != ngx_http_file_cache_manager) {
+            continue;
+        }
+
+        shard = path[i]->data;
+
+        size += sizeof("  \n") + shard->cache->shm_zone->shm.name.len
+                + shard->path->name.len
+                + 2 * (NGX_OFF_T_LEN + 1) + 5 * (NGX_ATOMIC_T_LEN + 1);
+    }
+
+    if (size) {
+        size += sizeof("Cache zone path size files reads read_bytes "
+                       "writes write_bytes deletes\n") - 1;
+    }
+
+    return size;
+}
+
+
+u_char *
+ngx_http_file_cache_stats(ngx_cycle_t *cycle, u_char *buf)
+{
+    ngx_uint_t                        i, header;
+    ngx_path_t                      **path;
+    ngx_http_file_cache_t            *cache;
+    ngx_http_file_cache_shard_t      *shard;
+    ngx_http_file_cache_shard_sh_t   *sh;
+
+    header = 0;
+
+    path = cycle->paths.elts;
+    for (i = 0; i < cycle->paths.nelts; i++) {
+
+        if (path[i]->manager != ngx_http_file_cache_manager) {
+            continue;
+        }
+
+        shard = path[i]->data;
+        cache = shard->cache;
+        sh = shard->sh;
+
+        if (sh == NULL) {
+            continue;
+        }
+
+        if (!header) {
+            buf = ngx_cpymem(buf, "Cache zone path size files reads read_bytes "
+                             "writes write_bytes deletes\n",
+                             sizeof("Cache zone path size files reads "
+                                    "read_bytes writes write_bytes deletes\n")
+                             - 1);
+            header = 1;
+        }
+
+        buf = ngx_sprintf(buf, " %V %V %O %O %uA %uA %uA %uA %uA\n",
+                          &cache->shm_zone->shm.name, &shard->path->name,
+                          sh->size * (off_t) cache->bsize, (off_t) sh->files,
+                          sh->reads, sh->read_bytes,
+                          sh->writes, sh->write_bytes, sh->deletes);
+    }
+
+    return buf;
+}
+
+
 char *
 ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    off_t                   max_size;
-    u_char                 *last, *p;
-    time_t                  inactive;
-    ssize_t                 size;
-    ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files;
-    ngx_msec_t              loader_sleep, loader_threshold;
-    ngx_uint_t              i, n;
-    ngx_http_file_cache_t  *cache;
+    off_t                         max_size;
+    u_char                       *last, *p;
+    size_t                        len;
+    time_t                        inactive;
+    ssize_t                       size, hot_max_size, hot_max, sketch;
+    ssize_t                       variant_max_size, variant_max;
+    ngx_str_t                     s, name, *value;
+    ngx_int_t                     loader_files;
+    ngx_msec_t                    loader_sleep, loader_threshold;
+    ngx_uint_t                    i, n;
+    ngx_path_t                    levels;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_file_cache_t));
     if (cache == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    cache->path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
-    if (cache->path == NULL) {
+    if (ngx_array_init(&cache->shards, cf->pool, 1,
+                       sizeof(ngx_http_file_cache_shard_t))
+        != NGX_OK)
+    {
         return NGX_CONF_ERROR;
     }
 
+    ngx_memzero(&levels, sizeof(ngx_path_t));
+
     inactive = 600;
     loader_files = 100;
     loader_sleep = 50;
@@ -1615,16 +2534,15 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     name.len = 0;
     size = 0;
     max_size = NGX_MAX_OFF_T_VALUE;
+    hot_max_size = 0;
+    hot_max = NGX_CONF_UNSET;
+    variant_max_size = 0;
+    variant_max = NGX_CONF_UNSET;
+    sketch = 0;
 
     value = cf->args->elts;
 
-    cache->path->name = value[1];
-
-    if (cache->path->name.data[cache->path->name.len - 1] == '/') {
-        cache->path->name.len--;
-    }
-
-    if (ngx_conf_full_name(cf->cycle, &cache->path->name, 0) != NGX_OK) {
+    if (ngx_http_file_cache_add_shard(cf, cache, &value[1]) != NGX_CONF_OK) {
         return NGX_CONF_ERROR;
     }
 
@@ -1639,8 +2557,8 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
                 if (*p > '0' && *p < '3') {
 
-                    cache->path->level[n] = *p++ - '0';
-                    cache->path->len += cache->path->level[n] + 1;
+                    levels.level[n] = *p++ - '0';
+                    levels.len += levels.level[n] + 1;
 
                     if (p == last) {
                         break;
@@ -1656,7 +2574,7 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                 goto invalid_levels;
             }
 
-            if (cache->path->len < 10 + 3) {
+            if (levels.len < 10 + 3) {
                 continue;
             }
 
@@ -1667,6 +2585,18 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             return NGX_CONF_ERROR;
         }
 
+        if (ngx_strncmp(value[i].data, "path=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            if (ngx_http_file_cache_add_shard(cf, cache, &s) != NGX_CONF_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
 
             name.data = value[i].data + 10;
@@ -1722,6 +2652,84 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "hot_max_size=", 13) == 0) {
+
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            hot_max_size = ngx_parse_size(&s);
+            if (hot_max_size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid hot_max_size value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "hot_max=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            hot_max = ngx_parse_size(&s);
+            if (hot_max == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid hot_max value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "encoded_max_size=", 17) == 0) {
+
+            s.len = value[i].len - 17;
+            s.data = value[i].data + 17;
+
+            variant_max_size = ngx_parse_size(&s);
+            if (variant_max_size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid encoded_max_size value \"%V\"",
+                           &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "encoded_max=", 12) == 0) {
+
+            s.len = value[i].len - 12;
+            s.data = value[i].data + 12;
+
+            variant_max = ngx_parse_size(&s);
+            if (variant_max == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid encoded_max value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "sketch=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            sketch = ngx_parse_size(&s);
+            if (sketch == NGX_ERROR
+                || sketch < NGX_HTTP_FILE_CACHE_SKETCH_DEPTH)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sketch value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "loader_files=", 13) == 0) {
 
             loader_files = ngx_atoi(value[i].data + 13, value[i].len - 13);
@@ -1776,17 +2784,94 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    cache->path->manager = ngx_http_file_cache_manager;
-    cache->path->loader = ngx_http_file_cache_loader;
-    cache->path->data = cache;
-    cache->path->conf_file = cf->conf_file->file.name.data;
-    cache->path->line = cf->conf_file->line;
+    if (hot_max == NGX_CONF_UNSET) {
+        hot_max = 64 * 1024;
+    }
+
+    if (hot_max_size == 0) {
+        hot_max = 0;
+
+    } else if (hot_max > hot_max_size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"hot_max\" must not be greater "
+                           "than \"hot_max_size\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (variant_max == NGX_CONF_UNSET) {
+        variant_max = 1024 * 1024;
+    }
+
+    if (variant_max_size == 0) {
+        variant_max = 0;
+
+    } else if (variant_max > variant_max_size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"encoded_max\" must not be greater "
+                           "than \"encoded_max_size\"");
+        return NGX_CONF_ERROR;
+    }
+
     cache->loader_files = loader_files;
     cache->loader_sleep = loader_sleep;
     cache->loader_threshold = loader_threshold;
 
-    if (ngx_add_path(cf, &cache->path) != NGX_OK) {
-        return NGX_CONF_ERROR;
+    shard = cache->shards.elts;
+
+    for (i = 0; i < cache->shards.nelts; i++) {
+
+        ngx_memcpy(shard[i].path->level, levels.level, sizeof(levels.level));
+        shard[i].path->len = levels.len;
+
+        shard[i].path->manager = ngx_http_file_cache_manager;
+        shard[i].path->loader = ngx_http_file_cache_loader;
+        shard[i].path->data = &shard[i];
+        shard[i].path->conf_file = cf->conf_file->file.name.data;
+        shard[i].path->line = cf->conf_file->line;
+
+        shard[i].cache = cache;
+        shard[i].index = i;
+
+        if (ngx_add_path(cf, &shard[i].path) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (cache->shards.nelts == 1) {
+            break;
+        }
+
+        /*
+         * responses are written to temporary files on the same disk
+         * to avoid copying them between file systems
+         */
+
+        shard[i].temp_path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+        if (shard[i].temp_path == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        len = shard[i].path->name.len + sizeof("/temp") - 1;
+
+        p = ngx_pnalloc(cf->pool, len + 1);
+        if (p == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        shard[i].temp_path->name.len = len;
+        shard[i].temp_path->name.data = p;
+
+        p = ngx_cpymem(p, shard[i].path->name.data, shard[i].path->name.len);
+        ngx_memcpy(p, "/temp", sizeof("/temp"));
+
+        ngx_memcpy(shard[i].temp_path->level, levels.level,
+                   sizeof(levels.level));
+        shard[i].temp_path->len = levels.len;
+        shard[i].temp_path->conf_file = cf->conf_file->file.name.data;
+        shard[i].temp_path->line = cf->conf_file->line;
+
+        if (ngx_add_path(cf, &shard[i].temp_path) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
     }
 
     cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
@@ -1806,6 +2891,87 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     cache->inactive = inactive;
     cache->max_size = max_size;
+    cache->hot_max_size = hot_max_size;
+    cache->hot_max = hot_max;
+    cache->variant_max_size = variant_max_size;
+    cache->variant_max = variant_max;
+    cache->sketch_size = sketch;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_file_cache_add_shard(ngx_conf_t *cf, ngx_http_file_cache_t *cache,
+    ngx_str_t *value)
+{
+    u_char                       *p, *last;
+    ngx_str_t                     name;
+    ngx_int_t                     weight;
+    ngx_http_file_cache_shard_t  *shard;
+
+    name = *value;
+    weight = 1;
+
+    last = name.data + name.len;
+
+    p = ngx_strlcasestrn(name.data, last, (u_char *) ":weight=", 8 - 1);
+
+    if (p) {
+        name.len = p - name.data;
+
+        p += sizeof(":weight=") - 1;
+
+        weight = ngx_atoi(p, last - p);
+        if (weight == NGX_ERROR || weight == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid cache path weight \"%V\"", value);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (name.len && name.data[name.len - 1] == '/') {
+        name.len--;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid cache path \"%V\"", value);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cache->shards.nelts == 256) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "too many cache paths");
+        return NGX_CONF_ERROR;
+    }
+
+    shard = ngx_array_push(&cache->shards);
+    if (shard == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(shard, sizeof(ngx_http_file_cache_shard_t));
+
+    shard->path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+    if (shard->path == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shard->path->name.len = name.len;
+    shard->path->name.data = ngx_pnalloc(cf->pool, name.len + 1);
+    if (shard->path->name.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    (void) ngx_cpystrn(shard->path->name.data, name.data, name.len + 1);
+
+    if (ngx_conf_full_name(cf->cycle, &shard->path->name, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    shard->weight = weight;
+    cache->weight += weight;
 
     return NGX_CONF_OK;
 }
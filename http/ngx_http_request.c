@@ -713,10 +713,15 @@ ngx_http_ssl_handshake_handler(ngx_connection_t *c)
         unsigned int             len;
         const unsigned char     *data;
         static const ngx_str_t   spdy = ngx_string(NGX_SPDY_NPN_NEGOTIATED);
+        static const ngx_str_t   spdy3 =
+                                     ngx_string(NGX_SPDY_V3_NPN_NEGOTIATED);
 
         SSL_get0_next_proto_negotiated(c->ssl->connection, &data, &len);
 
-        if (len == spdy.len && ngx_strncmp(data, spdy.data, spdy.len) == 0) {
+        if ((len == spdy.len && ngx_strncmp(data, spdy.data, spdy.len) == 0)
+            || (len == spdy3.len
+                && ngx_strncmp(data, spdy3.data, spdy3.len) == 0))
+        {
             ngx_http_spdy_init(c->read);
             return;
         }
@@ -822,6 +827,9 @@ ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
 #endif
 
         SSL_set_options(ssl_conn, SSL_CTX_get_options(sscf->ssl.ctx));
+
+        c->ssl->buffer_size = sscf->ssl.buffer_size;
+        c->ssl->dynamic_records = sscf->ssl.dynamic_records;
     }
 
     return SSL_TLSEXT_ERR_OK;
@@ -2498,6 +2506,11 @@ ngx_http_finalize_connection(ngx_http_request_t *r)
         return;
     }
 
+    if (r->reading_body) {
+        r->keepalive = 0;
+        r->lingering_close = 1;
+    }
+
 	//keepaliveΪ1,ͷţTCPӻҪ
 	//ngx_http_set_keepaliveͷngx_http_request_tṹ壬ر
     if (!ngx_terminate
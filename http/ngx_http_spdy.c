@@ -42,16 +42,30 @@
 
 #define ngx_spdy_frame_parse_sid(p)                                           \
     (ngx_spdy_frame_parse_uint32(p) & 0x7fffffff)
+#define ngx_spdy_frame_parse_delta(p)                                         \
+    (ngx_spdy_frame_parse_uint32(p) & 0x7fffffff)
 
 
-#define ngx_spdy_ctl_frame_check(h)                                           \
-    (((h) & 0xffffff00) == ngx_spdy_ctl_frame_head(0))
+#define ngx_spdy_ctl_frame_check(h, v)                                        \
+    (((h) & 0xffffff00) == ngx_spdy_ctl_frame_head(v, 0))
 #define ngx_spdy_data_frame_check(h)                                          \
     (!((h) & (uint32_t) NGX_SPDY_CTL_BIT << 31))
 
-#define ngx_spdy_ctl_frame_type(h)   ((h) & 0x000000ff)
-#define ngx_spdy_frame_flags(p)      ((p) >> 24)
-#define ngx_spdy_frame_length(p)     ((p) & 0x00ffffff)
+#define ngx_spdy_ctl_frame_version(h)  (((h) >> 16) & 0x7fff)
+#define ngx_spdy_ctl_frame_type(h)     ((h) & 0x000000ff)
+#define ngx_spdy_frame_flags(p)        ((p) >> 24)
+#define ngx_spdy_frame_length(p)       ((p) & 0x00ffffff)
+
+
+/* the name/value block fields are 16-bit in spdy/2 and 32-bit in spdy/3 */
+
+#define ngx_http_spdy_nv_size(sc)                                             \
+    ((sc)->version == NGX_SPDY_VERSION_2 ? NGX_SPDY_NV_NLEN_SIZE              \
+                                         : NGX_SPDY_V3_NV_NLEN_SIZE)
+
+#define ngx_http_spdy_nv_parse(sc, p)                                         \
+    ((sc)->version == NGX_SPDY_VERSION_2 ? ngx_spdy_frame_parse_uint16(p)     \
+                                         : ngx_spdy_frame_parse_uint32(p))
 
 
 #define NGX_SPDY_SKIP_HEADERS_BUFFER_SIZE  4096
@@ -66,17 +80,46 @@
 #define NGX_SPDY_FLOW_CONTROL_ERROR        7
 
 #define NGX_SPDY_SETTINGS_MAX_STREAMS      4
+#define NGX_SPDY_SETTINGS_INIT_WINDOW      7
 
 #define NGX_SPDY_SETTINGS_FLAG_PERSIST     0x01
 
+/*
+ * header blocks are small, so the deflate window is kept just large
+ * enough for the dictionary and the hash and pending buffers minimal
+ */
+
+#define NGX_SPDY_DEFLATE_WBITS             11
+#define NGX_SPDY_DEFLATE_MEMLEVEL          1
+
+#define NGX_SPDY_ZCACHE_SLOTS              8
+#define NGX_SPDY_ZCACHE_FREE               32
+
 typedef struct {
     ngx_uint_t    hash;
     u_char        len;
-    u_char        header[7];
+    u_char        header[8];
     ngx_int_t   (*handler)(ngx_http_request_t *r);
 } ngx_http_spdy_request_header_t;
 
 
+typedef struct ngx_http_spdy_zblock_s  ngx_http_spdy_zblock_t;
+
+struct ngx_http_spdy_zblock_s {
+    size_t                     size;
+    ngx_http_spdy_zblock_t    *next;
+};
+
+#define NGX_SPDY_ZBLOCK_SIZE                                                  \
+    ngx_align(sizeof(ngx_http_spdy_zblock_t), NGX_ALIGNMENT)
+
+typedef struct {
+    size_t                     size;
+    ngx_uint_t                 nfree;
+    ngx_http_spdy_zblock_t    *free;
+} ngx_http_spdy_zcache_t;
+
+
 static void ngx_http_spdy_read_handler(ngx_event_t *rev);
 static void ngx_http_spdy_write_handler(ngx_event_t *wev);
 static void ngx_http_spdy_handle_connection(ngx_http_spdy_connection_t *sc);
@@ -95,10 +138,14 @@ static u_char *ngx_http_spdy_state_headers_skip(ngx_http_spdy_connection_t *sc,
     u_char *pos, u_char *end);
 static u_char *ngx_http_spdy_state_data(ngx_http_spdy_connection_t *sc,
     u_char *pos, u_char *end);
+static u_char *ngx_http_spdy_state_read_data(ngx_http_spdy_connection_t *sc,
+    u_char *pos, u_char *end);
 static u_char *ngx_http_spdy_state_rst_stream(ngx_http_spdy_connection_t *sc,
     u_char *pos, u_char *end);
 static u_char *ngx_http_spdy_state_ping(ngx_http_spdy_connection_t *sc,
     u_char *pos, u_char *end);
+static u_char *ngx_http_spdy_state_window_update(
+    ngx_http_spdy_connection_t *sc, u_char *pos, u_char *end);
 static u_char *ngx_http_spdy_state_skip(ngx_http_spdy_connection_t *sc,
     u_char *pos, u_char *end);
 static u_char *ngx_http_spdy_state_settings(ngx_http_spdy_connection_t *sc,
@@ -114,9 +161,13 @@ static u_char *ngx_http_spdy_state_protocol_error(
 static u_char *ngx_http_spdy_state_internal_error(
     ngx_http_spdy_connection_t *sc);
 
+static ngx_int_t ngx_http_spdy_send_goaway(ngx_http_spdy_connection_t *sc,
+    ngx_uint_t status);
 static ngx_int_t ngx_http_spdy_send_rst_stream(ngx_http_spdy_connection_t *sc,
     ngx_uint_t sid, ngx_uint_t status, ngx_uint_t priority);
 static ngx_int_t ngx_http_spdy_send_settings(ngx_http_spdy_connection_t *sc);
+static ngx_int_t ngx_http_spdy_send_window_update(
+    ngx_http_spdy_connection_t *sc, ngx_uint_t sid, ngx_uint_t delta);
 static ngx_int_t ngx_http_spdy_settings_frame_handler(
     ngx_http_spdy_connection_t *sc, ngx_http_spdy_out_frame_t *frame);
 static ngx_http_spdy_out_frame_t *ngx_http_spdy_get_ctl_frame(
@@ -128,6 +179,11 @@ static ngx_http_spdy_stream_t *ngx_http_spdy_create_stream(
     ngx_http_spdy_connection_t *sc, ngx_uint_t id, ngx_uint_t priority);
 static ngx_http_spdy_stream_t *ngx_http_spdy_get_stream_by_id(
     ngx_http_spdy_connection_t *sc, ngx_uint_t sid);
+static ngx_int_t ngx_http_spdy_terminate_stream(ngx_http_spdy_connection_t *sc,
+    ngx_http_spdy_stream_t *stream, ngx_uint_t status);
+static void ngx_http_spdy_adjust_windows(ngx_http_spdy_connection_t *sc,
+    ssize_t delta);
+static void ngx_http_spdy_resume_stream(ngx_http_spdy_stream_t *stream);
 #define ngx_http_spdy_streams_index_size(sscf)  (sscf->streams_index_mask + 1)
 #define ngx_http_spdy_stream_index(sscf, sid)                                 \
     ((sid >> 1) & sscf->streams_index_mask)
@@ -140,6 +196,7 @@ static ngx_int_t ngx_http_spdy_parse_method(ngx_http_request_t *r);
 static ngx_int_t ngx_http_spdy_parse_scheme(ngx_http_request_t *r);
 static ngx_int_t ngx_http_spdy_parse_url(ngx_http_request_t *r);
 static ngx_int_t ngx_http_spdy_parse_version(ngx_http_request_t *r);
+static ngx_int_t ngx_http_spdy_parse_host(ngx_http_request_t *r);
 
 static ngx_int_t ngx_http_spdy_construct_request_line(ngx_http_request_t *r);
 static void ngx_http_spdy_run_request(ngx_http_request_t *r);
@@ -152,10 +209,18 @@ static void ngx_http_spdy_finalize_connection(ngx_http_spdy_connection_t *sc,
 
 static void ngx_http_spdy_pool_cleanup(void *data);
 
+static ngx_int_t ngx_http_spdy_inflate_release(ngx_http_spdy_connection_t *sc);
+static ngx_int_t ngx_http_spdy_inflate_restore(ngx_http_spdy_connection_t *sc);
+
 static void *ngx_http_spdy_zalloc(void *opaque, u_int items, u_int size);
 static void ngx_http_spdy_zfree(void *opaque, void *address);
 
 
+/* zlib memory blocks of the worker process, they are reused across sessions */
+
+static ngx_http_spdy_zcache_t  ngx_http_spdy_zcache[NGX_SPDY_ZCACHE_SLOTS];
+
+
 static const u_char ngx_http_spdy_dict[] =
     "options" "get" "head" "post" "put" "delete" "trace"
     "accept" "accept-charset" "accept-encoding" "accept-language"
@@ -183,6 +248,188 @@ static const u_char ngx_http_spdy_dict[] =
     "version" "url";
 
 
+static const u_char ngx_http_spdy_v3_dict[] = {
+    0x00, 0x00, 0x00, 0x07, 0x6f, 0x70, 0x74, 0x69,  /* - - - - o p t i */
+    0x6f, 0x6e, 0x73, 0x00, 0x00, 0x00, 0x04, 0x68,  /* o n s - - - - h */
+    0x65, 0x61, 0x64, 0x00, 0x00, 0x00, 0x04, 0x70,  /* e a d - - - - p */
+    0x6f, 0x73, 0x74, 0x00, 0x00, 0x00, 0x03, 0x70,  /* o s t - - - - p */
+    0x75, 0x74, 0x00, 0x00, 0x00, 0x06, 0x64, 0x65,  /* u t - - - - d e */
+    0x6c, 0x65, 0x74, 0x65, 0x00, 0x00, 0x00, 0x05,  /* l e t e - - - - */
+    0x74, 0x72, 0x61, 0x63, 0x65, 0x00, 0x00, 0x00,  /* t r a c e - - - */
+    0x06, 0x61, 0x63, 0x63, 0x65, 0x70, 0x74, 0x00,  /* - a c c e p t - */
+    0x00, 0x00, 0x0e, 0x61, 0x63, 0x63, 0x65, 0x70,  /* - - - a c c e p */
+    0x74, 0x2d, 0x63, 0x68, 0x61, 0x72, 0x73, 0x65,  /* t - c h a r s e */
+    0x74, 0x00, 0x00, 0x00, 0x0f, 0x61, 0x63, 0x63,  /* t - - - - a c c */
+    0x65, 0x70, 0x74, 0x2d, 0x65, 0x6e, 0x63, 0x6f,  /* e p t - e n c o */
+    0x64, 0x69, 0x6e, 0x67, 0x00, 0x00, 0x00, 0x0f,  /* d i n g - - - - */
+    0x61, 0x63, 0x63, 0x65, 0x70, 0x74, 0x2d, 0x6c,  /* a c c e p t - l */
+    0x61, 0x6e, 0x67, 0x75, 0x61, 0x67, 0x65, 0x00,  /* a n g u a g e - */
+    0x00, 0x00, 0x0d, 0x61, 0x63, 0x63, 0x65, 0x70,  /* - - - a c c e p */
+    0x74, 0x2d, 0x72, 0x61, 0x6e, 0x67, 0x65, 0x73,  /* t - r a n g e s */
+    0x00, 0x00, 0x00, 0x03, 0x61, 0x67, 0x65, 0x00,  /* - - - - a g e - */
+    0x00, 0x00, 0x05, 0x61, 0x6c, 0x6c, 0x6f, 0x77,  /* - - - a l l o w */
+    0x00, 0x00, 0x00, 0x0d, 0x61, 0x75, 0x74, 0x68,  /* - - - - a u t h */
+    0x6f, 0x72, 0x69, 0x7a, 0x61, 0x74, 0x69, 0x6f,  /* o r i z a t i o */
+    0x6e, 0x00, 0x00, 0x00, 0x0d, 0x63, 0x61, 0x63,  /* n - - - - c a c */
+    0x68, 0x65, 0x2d, 0x63, 0x6f, 0x6e, 0x74, 0x72,  /* h e - c o n t r */
+    0x6f, 0x6c, 0x00, 0x00, 0x00, 0x0a, 0x63, 0x6f,  /* o l - - - - c o */
+    0x6e, 0x6e, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e,  /* n n e c t i o n */
+    0x00, 0x00, 0x00, 0x0c, 0x63, 0x6f, 0x6e, 0x74,  /* - - - - c o n t */
+    0x65, 0x6e, 0x74, 0x2d, 0x62, 0x61, 0x73, 0x65,  /* e n t - b a s e */
+    0x00, 0x00, 0x00, 0x10, 0x63, 0x6f, 0x6e, 0x74,  /* - - - - c o n t */
+    0x65, 0x6e, 0x74, 0x2d, 0x65, 0x6e, 0x63, 0x6f,  /* e n t - e n c o */
+    0x64, 0x69, 0x6e, 0x67, 0x00, 0x00, 0x00, 0x10,  /* d i n g - - - - */
+    0x63, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x2d,  /* c o n t e n t - */
+    0x6c, 0x61, 0x6e, 0x67, 0x75, 0x61, 0x67, 0x65,  /* l a n g u a g e */
+    0x00, 0x00, 0x00, 0x0e, 0x63, 0x6f, 0x6e, 0x74,  /* - - - - c o n t */
+    0x65, 0x6e, 0x74, 0x2d, 0x6c, 0x65, 0x6e, 0x67,  /* e n t - l e n g */
+    0x74, 0x68, 0x00, 0x00, 0x00, 0x10, 0x63, 0x6f,  /* t h - - - - c o */
+    0x6e, 0x74, 0x65, 0x6e, 0x74, 0x2d, 0x6c, 0x6f,  /* n t e n t - l o */
+    0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x00, 0x00,  /* c a t i o n - - */
+    0x00, 0x0b, 0x63, 0x6f, 0x6e, 0x74, 0x65, 0x6e,  /* - - c o n t e n */
+    0x74, 0x2d, 0x6d, 0x64, 0x35, 0x00, 0x00, 0x00,  /* t - m d 5 - - - */
+    0x0d, 0x63, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74,  /* - c o n t e n t */
+    0x2d, 0x72, 0x61, 0x6e, 0x67, 0x65, 0x00, 0x00,  /* - r a n g e - - */
+    0x00, 0x0c, 0x63, 0x6f, 0x6e, 0x74, 0x65, 0x6e,  /* - - c o n t e n */
+    0x74, 0x2d, 0x74, 0x79, 0x70, 0x65, 0x00, 0x00,  /* t - t y p e - - */
+    0x00, 0x04, 0x64, 0x61, 0x74, 0x65, 0x00, 0x00,  /* - - d a t e - - */
+    0x00, 0x04, 0x65, 0x74, 0x61, 0x67, 0x00, 0x00,  /* - - e t a g - - */
+    0x00, 0x06, 0x65, 0x78, 0x70, 0x65, 0x63, 0x74,  /* - - e x p e c t */
+    0x00, 0x00, 0x00, 0x07, 0x65, 0x78, 0x70, 0x69,  /* - - - - e x p i */
+    0x72, 0x65, 0x73, 0x00, 0x00, 0x00, 0x04, 0x66,  /* r e s - - - - f */
+    0x72, 0x6f, 0x6d, 0x00, 0x00, 0x00, 0x04, 0x68,  /* r o m - - - - h */
+    0x6f, 0x73, 0x74, 0x00, 0x00, 0x00, 0x08, 0x69,  /* o s t - - - - i */
+    0x66, 0x2d, 0x6d, 0x61, 0x74, 0x63, 0x68, 0x00,  /* f - m a t c h - */
+    0x00, 0x00, 0x11, 0x69, 0x66, 0x2d, 0x6d, 0x6f,  /* - - - i f - m o */
+    0x64, 0x69, 0x66, 0x69, 0x65, 0x64, 0x2d, 0x73,  /* d i f i e d - s */
+    0x69, 0x6e, 0x63, 0x65, 0x00, 0x00, 0x00, 0x0d,  /* i n c e - - - - */
+    0x69, 0x66, 0x2d, 0x6e, 0x6f, 0x6e, 0x65, 0x2d,  /* i f - n o n e - */
+    0x6d, 0x61, 0x74, 0x63, 0x68, 0x00, 0x00, 0x00,  /* m a t c h - - - */
+    0x08, 0x69, 0x66, 0x2d, 0x72, 0x61, 0x6e, 0x67,  /* - i f - r a n g */
+    0x65, 0x00, 0x00, 0x00, 0x13, 0x69, 0x66, 0x2d,  /* e - - - - i f - */
+    0x75, 0x6e, 0x6d, 0x6f, 0x64, 0x69, 0x66, 0x69,  /* u n m o d i f i */
+    0x65, 0x64, 0x2d, 0x73, 0x69, 0x6e, 0x63, 0x65,  /* e d - s i n c e */
+    0x00, 0x00, 0x00, 0x0d, 0x6c, 0x61, 0x73, 0x74,  /* - - - - l a s t */
+    0x2d, 0x6d, 0x6f, 0x64, 0x69, 0x66, 0x69, 0x65,  /* - m o d i f i e */
+    0x64, 0x00, 0x00, 0x00, 0x08, 0x6c, 0x6f, 0x63,  /* d - - - - l o c */
+    0x61, 0x74, 0x69, 0x6f, 0x6e, 0x00, 0x00, 0x00,  /* a t i o n - - - */
+    0x0c, 0x6d, 0x61, 0x78, 0x2d, 0x66, 0x6f, 0x72,  /* - m a x - f o r */
+    0x77, 0x61, 0x72, 0x64, 0x73, 0x00, 0x00, 0x00,  /* w a r d s - - - */
+    0x06, 0x70, 0x72, 0x61, 0x67, 0x6d, 0x61, 0x00,  /* - p r a g m a - */
+    0x00, 0x00, 0x12, 0x70, 0x72, 0x6f, 0x78, 0x79,  /* - - - p r o x y */
+    0x2d, 0x61, 0x75, 0x74, 0x68, 0x65, 0x6e, 0x74,  /* - a u t h e n t */
+    0x69, 0x63, 0x61, 0x74, 0x65, 0x00, 0x00, 0x00,  /* i c a t e - - - */
+    0x13, 0x70, 0x72, 0x6f, 0x78, 0x79, 0x2d, 0x61,  /* - p r o x y - a */
+    0x75, 0x74, 0x68, 0x6f, 0x72, 0x69, 0x7a, 0x61,  /* u t h o r i z a */
+    0x74, 0x69, 0x6f, 0x6e, 0x00, 0x00, 0x00, 0x05,  /* t i o n - - - - */
+    0x72, 0x61, 0x6e, 0x67, 0x65, 0x00, 0x00, 0x00,  /* r a n g e - - - */
+    0x07, 0x72, 0x65, 0x66, 0x65, 0x72, 0x65, 0x72,  /* - r e f e r e r */
+    0x00, 0x00, 0x00, 0x0b, 0x72, 0x65, 0x74, 0x72,  /* - - - - r e t r */
+    0x79, 0x2d, 0x61, 0x66, 0x74, 0x65, 0x72, 0x00,  /* y - a f t e r - */
+    0x00, 0x00, 0x06, 0x73, 0x65, 0x72, 0x76, 0x65,  /* - - - s e r v e */
+    0x72, 0x00, 0x00, 0x00, 0x02, 0x74, 0x65, 0x00,  /* r - - - - t e - */
+    0x00, 0x00, 0x07, 0x74, 0x72, 0x61, 0x69, 0x6c,  /* - - - t r a i l */
+    0x65, 0x72, 0x00, 0x00, 0x00, 0x11, 0x74, 0x72,  /* e r - - - - t r */
+    0x61, 0x6e, 0x73, 0x66, 0x65, 0x72, 0x2d, 0x65,  /* a n s f e r - e */
+    0x6e, 0x63, 0x6f, 0x64, 0x69, 0x6e, 0x67, 0x00,  /* n c o d i n g - */
+    0x00, 0x00, 0x07, 0x75, 0x70, 0x67, 0x72, 0x61,  /* - - - u p g r a */
+    0x64, 0x65, 0x00, 0x00, 0x00, 0x0a, 0x75, 0x73,  /* d e - - - - u s */
+    0x65, 0x72, 0x2d, 0x61, 0x67, 0x65, 0x6e, 0x74,  /* e r - a g e n t */
+    0x00, 0x00, 0x00, 0x04, 0x76, 0x61, 0x72, 0x79,  /* - - - - v a r y */
+    0x00, 0x00, 0x00, 0x03, 0x76, 0x69, 0x61, 0x00,  /* - - - - v i a - */
+    0x00, 0x00, 0x07, 0x77, 0x61, 0x72, 0x6e, 0x69,  /* - - - w a r n i */
+    0x6e, 0x67, 0x00, 0x00, 0x00, 0x10, 0x77, 0x77,  /* n g - - - - w w */
+    0x77, 0x2d, 0x61, 0x75, 0x74, 0x68, 0x65, 0x6e,  /* w - a u t h e n */
+    0x74, 0x69, 0x63, 0x61, 0x74, 0x65, 0x00, 0x00,  /* t i c a t e - - */
+    0x00, 0x06, 0x6d, 0x65, 0x74, 0x68, 0x6f, 0x64,  /* - - m e t h o d */
+    0x00, 0x00, 0x00, 0x03, 0x67, 0x65, 0x74, 0x00,  /* - - - - g e t - */
+    0x00, 0x00, 0x06, 0x73, 0x74, 0x61, 0x74, 0x75,  /* - - - s t a t u */
+    0x73, 0x00, 0x00, 0x00, 0x06, 0x32, 0x30, 0x30,  /* s - - - - 2 0 0 */
+    0x20, 0x4f, 0x4b, 0x00, 0x00, 0x00, 0x07, 0x76,  /* - O K - - - - v */
+    0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x00, 0x00,  /* e r s i o n - - */
+    0x00, 0x08, 0x48, 0x54, 0x54, 0x50, 0x2f, 0x31,  /* - - H T T P - 1 */
+    0x2e, 0x31, 0x00, 0x00, 0x00, 0x03, 0x75, 0x72,  /* . 1 - - - - u r */
+    0x6c, 0x00, 0x00, 0x00, 0x06, 0x70, 0x75, 0x62,  /* l - - - - p u b */
+    0x6c, 0x69, 0x63, 0x00, 0x00, 0x00, 0x0a, 0x73,  /* l i c - - - - s */
+    0x65, 0x74, 0x2d, 0x63, 0x6f, 0x6f, 0x6b, 0x69,  /* e t - c o o k i */
+    0x65, 0x00, 0x00, 0x00, 0x0a, 0x6b, 0x65, 0x65,  /* e - - - - k e e */
+    0x70, 0x2d, 0x61, 0x6c, 0x69, 0x76, 0x65, 0x00,  /* p - a l i v e - */
+    0x00, 0x00, 0x06, 0x6f, 0x72, 0x69, 0x67, 0x69,  /* - - - o r i g i */
+    0x6e, 0x31, 0x30, 0x30, 0x31, 0x30, 0x31, 0x32,  /* n 1 0 0 1 0 1 2 */
+    0x30, 0x31, 0x32, 0x30, 0x32, 0x32, 0x30, 0x35,  /* 0 1 2 0 2 2 0 5 */
+    0x32, 0x30, 0x36, 0x33, 0x30, 0x30, 0x33, 0x30,  /* 2 0 6 3 0 0 3 0 */
+    0x32, 0x33, 0x30, 0x33, 0x33, 0x30, 0x34, 0x33,  /* 2 3 0 3 3 0 4 3 */
+    0x30, 0x35, 0x33, 0x30, 0x36, 0x33, 0x30, 0x37,  /* 0 5 3 0 6 3 0 7 */
+    0x34, 0x30, 0x32, 0x34, 0x30, 0x35, 0x34, 0x30,  /* 4 0 2 4 0 5 4 0 */
+    0x36, 0x34, 0x30, 0x37, 0x34, 0x30, 0x38, 0x34,  /* 6 4 0 7 4 0 8 4 */
+    0x30, 0x39, 0x34, 0x31, 0x30, 0x34, 0x31, 0x31,  /* 0 9 4 1 0 4 1 1 */
+    0x34, 0x31, 0x32, 0x34, 0x31, 0x33, 0x34, 0x31,  /* 4 1 2 4 1 3 4 1 */
+    0x34, 0x34, 0x31, 0x35, 0x34, 0x31, 0x36, 0x34,  /* 4 4 1 5 4 1 6 4 */
+    0x31, 0x37, 0x35, 0x30, 0x32, 0x35, 0x30, 0x34,  /* 1 7 5 0 2 5 0 4 */
+    0x35, 0x30, 0x35, 0x32, 0x30, 0x33, 0x20, 0x4e,  /* 5 0 5 2 0 3 - N */
+    0x6f, 0x6e, 0x2d, 0x41, 0x75, 0x74, 0x68, 0x6f,  /* o n - A u t h o */
+    0x72, 0x69, 0x74, 0x61, 0x74, 0x69, 0x76, 0x65,  /* r i t a t i v e */
+    0x20, 0x49, 0x6e, 0x66, 0x6f, 0x72, 0x6d, 0x61,  /* - I n f o r m a */
+    0x74, 0x69, 0x6f, 0x6e, 0x32, 0x30, 0x34, 0x20,  /* t i o n 2 0 4 - */
+    0x4e, 0x6f, 0x20, 0x43, 0x6f, 0x6e, 0x74, 0x65,  /* N o - C o n t e */
+    0x6e, 0x74, 0x33, 0x30, 0x31, 0x20, 0x4d, 0x6f,  /* n t 3 0 1 - M o */
+    0x76, 0x65, 0x64, 0x20, 0x50, 0x65, 0x72, 0x6d,  /* v e d - P e r m */
+    0x61, 0x6e, 0x65, 0x6e, 0x74, 0x6c, 0x79, 0x34,  /* a n e n t l y 4 */
+    0x30, 0x30, 0x20, 0x42, 0x61, 0x64, 0x20, 0x52,  /* 0 0 - B a d - R */
+    0x65, 0x71, 0x75, 0x65, 0x73, 0x74, 0x34, 0x30,  /* e q u e s t 4 0 */
+    0x31, 0x20, 0x55, 0x6e, 0x61, 0x75, 0x74, 0x68,  /* 1 - U n a u t h */
+    0x6f, 0x72, 0x69, 0x7a, 0x65, 0x64, 0x34, 0x30,  /* o r i z e d 4 0 */
+    0x33, 0x20, 0x46, 0x6f, 0x72, 0x62, 0x69, 0x64,  /* 3 - F o r b i d */
+    0x64, 0x65, 0x6e, 0x34, 0x30, 0x34, 0x20, 0x4e,  /* d e n 4 0 4 - N */
+    0x6f, 0x74, 0x20, 0x46, 0x6f, 0x75, 0x6e, 0x64,  /* o t - F o u n d */
+    0x35, 0x30, 0x30, 0x20, 0x49, 0x6e, 0x74, 0x65,  /* 5 0 0 - I n t e */
+    0x72, 0x6e, 0x61, 0x6c, 0x20, 0x53, 0x65, 0x72,  /* r n a l - S e r */
+    0x76, 0x65, 0x72, 0x20, 0x45, 0x72, 0x72, 0x6f,  /* v e r - E r r o */
+    0x72, 0x35, 0x30, 0x31, 0x20, 0x4e, 0x6f, 0x74,  /* r 5 0 1 - N o t */
+    0x20, 0x49, 0x6d, 0x70, 0x6c, 0x65, 0x6d, 0x65,  /* - I m p l e m e */
+    0x6e, 0x74, 0x65, 0x64, 0x35, 0x30, 0x33, 0x20,  /* n t e d 5 0 3 - */
+    0x53, 0x65, 0x72, 0x76, 0x69, 0x63, 0x65, 0x20,  /* S e r v i c e - */
+    0x55, 0x6e, 0x61, 0x76, 0x61, 0x69, 0x6c, 0x61,  /* U n a v a i l a */
+    0x62, 0x6c, 0x65, 0x4a, 0x61, 0x6e, 0x20, 0x46,  /* b l e J a n - F */
+    0x65, 0x62, 0x20, 0x4d, 0x61, 0x72, 0x20, 0x41,  /* e b - M a r - A */
+    0x70, 0x72, 0x20, 0x4d, 0x61, 0x79, 0x20, 0x4a,  /* p r - M a y - J */
+    0x75, 0x6e, 0x20, 0x4a, 0x75, 0x6c, 0x20, 0x41,  /* u n - J u l - A */
+    0x75, 0x67, 0x20, 0x53, 0x65, 0x70, 0x74, 0x20,  /* u g - S e p t - */
+    0x4f, 0x63, 0x74, 0x20, 0x4e, 0x6f, 0x76, 0x20,  /* O c t - N o v - */
+    0x44, 0x65, 0x63, 0x20, 0x30, 0x30, 0x3a, 0x30,  /* D e c - 0 0 : 0 */
+    0x30, 0x3a, 0x30, 0x30, 0x20, 0x4d, 0x6f, 0x6e,  /* 0 : 0 0 - M o n */
+    0x2c, 0x20, 0x54, 0x75, 0x65, 0x2c, 0x20, 0x57,  /* , - T u e , - W */
+    0x65, 0x64, 0x2c, 0x20, 0x54, 0x68, 0x75, 0x2c,  /* e d , - T h u , */
+    0x20, 0x46, 0x72, 0x69, 0x2c, 0x20, 0x53, 0x61,  /* - F r i , - S a */
+    0x74, 0x2c, 0x20, 0x53, 0x75, 0x6e, 0x2c, 0x20,  /* t , - S u n , - */
+    0x47, 0x4d, 0x54, 0x63, 0x68, 0x75, 0x6e, 0x6b,  /* G M T c h u n k */
+    0x65, 0x64, 0x2c, 0x74, 0x65, 0x78, 0x74, 0x2f,  /* e d , t e x t - */
+    0x68, 0x74, 0x6d, 0x6c, 0x2c, 0x69, 0x6d, 0x61,  /* h t m l , i m a */
+    0x67, 0x65, 0x2f, 0x70, 0x6e, 0x67, 0x2c, 0x69,  /* g e - p n g , i */
+    0x6d, 0x61, 0x67, 0x65, 0x2f, 0x6a, 0x70, 0x67,  /* m a g e - j p g */
+    0x2c, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x2f, 0x67,  /* , i m a g e - g */
+    0x69, 0x66, 0x2c, 0x61, 0x70, 0x70, 0x6c, 0x69,  /* i f , a p p l i */
+    0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x2f, 0x78,  /* c a t i o n - x */
+    0x6d, 0x6c, 0x2c, 0x61, 0x70, 0x70, 0x6c, 0x69,  /* m l , a p p l i */
+    0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x2f, 0x78,  /* c a t i o n - x */
+    0x68, 0x74, 0x6d, 0x6c, 0x2b, 0x78, 0x6d, 0x6c,  /* h t m l + x m l */
+    0x2c, 0x74, 0x65, 0x78, 0x74, 0x2f, 0x70, 0x6c,  /* , t e x t - p l */
+    0x61, 0x69, 0x6e, 0x2c, 0x74, 0x65, 0x78, 0x74,  /* a i n , t e x t */
+    0x2f, 0x6a, 0x61, 0x76, 0x61, 0x73, 0x63, 0x72,  /* - j a v a s c r */
+    0x69, 0x70, 0x74, 0x2c, 0x70, 0x75, 0x62, 0x6c,  /* i p t , p u b l */
+    0x69, 0x63, 0x70, 0x72, 0x69, 0x76, 0x61, 0x74,  /* i c p r i v a t */
+    0x65, 0x6d, 0x61, 0x78, 0x2d, 0x61, 0x67, 0x65,  /* e m a x - a g e */
+    0x3d, 0x67, 0x7a, 0x69, 0x70, 0x2c, 0x64, 0x65,  /* = g z i p , d e */
+    0x66, 0x6c, 0x61, 0x74, 0x65, 0x2c, 0x73, 0x64,  /* f l a t e , s d */
+    0x63, 0x68, 0x63, 0x68, 0x61, 0x72, 0x73, 0x65,  /* c h c h a r s e */
+    0x74, 0x3d, 0x75, 0x74, 0x66, 0x2d, 0x38, 0x63,  /* t = u t f - 8 c */
+    0x68, 0x61, 0x72, 0x73, 0x65, 0x74, 0x3d, 0x69,  /* h a r s e t = i */
+    0x73, 0x6f, 0x2d, 0x38, 0x38, 0x35, 0x39, 0x2d,  /* s o - 8 8 5 9 - */
+    0x31, 0x2c, 0x75, 0x74, 0x66, 0x2d, 0x2c, 0x2a,  /* 1 , u t f - , - */
+    0x2c, 0x65, 0x6e, 0x71, 0x3d, 0x30, 0x2e         /* , e n q = 0 . */
+};
+
+
 static ngx_http_spdy_request_header_t ngx_http_spdy_request_headers[] = {
     { 0, 6, "method", ngx_http_spdy_parse_method },
     { 0, 6, "scheme", ngx_http_spdy_parse_scheme },
@@ -195,6 +442,19 @@ static ngx_http_spdy_request_header_t ngx_http_spdy_request_headers[] = {
      / sizeof(ngx_http_spdy_request_header_t))
 
 
+static ngx_http_spdy_request_header_t ngx_http_spdy_v3_request_headers[] = {
+    { 0, 7, ":method", ngx_http_spdy_parse_method },
+    { 0, 7, ":scheme", ngx_http_spdy_parse_scheme },
+    { 0, 5, ":path", ngx_http_spdy_parse_url },
+    { 0, 8, ":version", ngx_http_spdy_parse_version },
+    { 0, 5, ":host", ngx_http_spdy_parse_host },
+};
+
+#define NGX_SPDY_V3_REQUEST_HEADERS                                           \
+    (sizeof(ngx_http_spdy_v3_request_headers)                                 \
+     / sizeof(ngx_http_spdy_request_header_t))
+
+
 void
 ngx_http_spdy_init(ngx_event_t *rev)
 {
@@ -235,11 +495,26 @@ ngx_http_spdy_init(ngx_event_t *rev)
 
     sc->handler = ngx_http_spdy_state_detect_settings;
 
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    cln->handler = ngx_http_spdy_pool_cleanup;
+    cln->data = sc;
+
     sc->zstream_in.zalloc = ngx_http_spdy_zalloc;
     sc->zstream_in.zfree = ngx_http_spdy_zfree;
     sc->zstream_in.opaque = sc;
 
+#if (ZLIB_VERNUM >= 0x1235)
+    /* the window size is taken from the zlib header sent by client */
+    rc = inflateInit2(&sc->zstream_in, 0);
+#else
     rc = inflateInit(&sc->zstream_in);
+#endif
+
     if (rc != Z_OK) {
         ngx_log_error(NGX_LOG_ALERT, c->log, 0,
                       "inflateInit() failed: %d", rc);
@@ -247,30 +522,24 @@ ngx_http_spdy_init(ngx_event_t *rev)
         return;
     }
 
+    sc->inflate_active = 1;
+
+    /* deflate is initialized on the first SYN_REPLY, see below */
+
     sc->zstream_out.zalloc = ngx_http_spdy_zalloc;
     sc->zstream_out.zfree = ngx_http_spdy_zfree;
     sc->zstream_out.opaque = sc;
 
     sscf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_spdy_module);
 
-    rc = deflateInit2(&sc->zstream_out, (int) sscf->headers_comp,
-                      Z_DEFLATED, 11, 4, Z_DEFAULT_STRATEGY);
+    sc->send_window = NGX_SPDY_DEFAULT_WINDOW;
+    sc->recv_window = NGX_SPDY_DEFAULT_WINDOW;
+    sc->init_window = NGX_SPDY_DEFAULT_WINDOW;
 
-    if (rc != Z_OK) {
-        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
-                      "deflateInit2() failed: %d", rc);
-        ngx_http_close_connection(c);
-        return;
-    }
+    ngx_queue_init(&sc->window_waiting);
 
-    rc = deflateSetDictionary(&sc->zstream_out, ngx_http_spdy_dict,
-                              sizeof(ngx_http_spdy_dict));
-    if (rc != Z_OK) {
-        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
-                      "deflateSetDictionary() failed: %d", rc);
-        ngx_http_close_connection(c);
-        return;
-    }
+    ngx_rbtree_init(&sc->sched, &sc->sched_sentinel,
+                    ngx_rbtree_insert_timer_value);
 
     sc->pool = ngx_create_pool(sscf->pool_size, sc->connection->log);
     if (sc->pool == NULL) {
@@ -278,15 +547,6 @@ ngx_http_spdy_init(ngx_event_t *rev)
         return;
     }
 
-    cln = ngx_pool_cleanup_add(c->pool, sizeof(ngx_pool_cleanup_file_t));
-    if (cln == NULL) {
-        ngx_http_close_connection(c);
-        return;
-    }
-
-    cln->handler = ngx_http_spdy_pool_cleanup;
-    cln->data = sc;
-
     sc->streams_index = ngx_pcalloc(sc->pool,
                                     ngx_http_spdy_streams_index_size(sscf)
                                     * sizeof(ngx_http_spdy_stream_t *));
@@ -457,8 +717,10 @@ ngx_http_spdy_send_output_queue(ngx_http_spdy_connection_t *sc)
     ngx_chain_t                *cl;
     ngx_event_t                *wev;
     ngx_connection_t           *c;
+    ngx_rbtree_node_t          *node;
     ngx_http_core_loc_conf_t   *clcf;
-    ngx_http_spdy_out_frame_t  *out, *frame, *fn;
+    ngx_http_spdy_stream_t     *stream;
+    ngx_http_spdy_out_frame_t  *out, *frame, *fn, **fp;
 
     c = sc->connection;
 
@@ -472,6 +734,32 @@ ngx_http_spdy_send_output_queue(ngx_http_spdy_connection_t *sc)
         return NGX_OK;
     }
 
+    /*
+     * DATA frames are taken from the scheduler in the order of their
+     * virtual finish time and placed after the control frames, those
+     * which will not be sent are returned back to the scheduler
+     */
+
+    while (sc->sched.root != sc->sched.sentinel) {
+        node = ngx_rbtree_min(sc->sched.root, sc->sched.sentinel);
+
+        stream = (ngx_http_spdy_stream_t *)
+                     ((u_char *) node - offsetof(ngx_http_spdy_stream_t, node));
+
+        frame = stream->sched_first;
+        stream->sched_first = frame->next;
+
+        ngx_rbtree_delete(&sc->sched, node);
+
+        if (stream->sched_first) {
+            node->key = stream->sched_first->tag;
+            ngx_rbtree_insert(&sc->sched, node);
+        }
+
+        frame->next = sc->last_out;
+        sc->last_out = frame;
+    }
+
     cl = NULL;
     out = NULL;
 
@@ -520,10 +808,15 @@ ngx_http_spdy_send_output_queue(ngx_http_spdy_connection_t *sc)
     for ( /* void */ ; out; out = out->next) {
         if (out->handler(sc, out) != NGX_OK) {
             out->blocked = 1;
+            out->scheduled = 0;
             out->priority = NGX_SPDY_HIGHEST_PRIORITY;
             break;
         }
 
+        if (out->scheduled) {
+            sc->vtime = out->tag;
+        }
+
         ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
                        "spdy frame sent: %p sid:%ui bl:%ui size:%uz",
                        out, out->stream ? out->stream->id : 0,
@@ -540,10 +833,87 @@ ngx_http_spdy_send_output_queue(ngx_http_spdy_connection_t *sc)
 
     sc->last_out = frame;
 
+    fp = &sc->last_out;
+
+    while (*fp) {
+        frame = *fp;
+
+        if (!frame->scheduled) {
+            fp = &frame->next;
+            continue;
+        }
+
+        *fp = frame->next;
+
+        stream = frame->stream;
+
+        if (stream->sched_first) {
+            ngx_rbtree_delete(&sc->sched, &stream->node);
+
+        } else {
+            stream->sched_last = frame;
+        }
+
+        frame->next = stream->sched_first;
+        stream->sched_first = frame;
+
+        stream->node.key = frame->tag;
+        ngx_rbtree_insert(&sc->sched, &stream->node);
+    }
+
     return NGX_OK;
 }
 
 
+void
+ngx_http_spdy_queue_data_frame(ngx_http_spdy_connection_t *sc,
+    ngx_http_spdy_out_frame_t *frame)
+{
+    ngx_uint_t               shift;
+    ngx_rbtree_key_t         start;
+    ngx_http_spdy_stream_t  *stream;
+
+    stream = frame->stream;
+
+    /*
+     * self-clocked weighted fair queueing: a frame is tagged with
+     * the virtual time of its finish, and the cost of a byte doubles
+     * with each lower priority level, spdy/2 has half as many levels
+     */
+
+    shift = frame->priority;
+
+    if (sc->version == NGX_SPDY_VERSION_2) {
+        shift <<= 1;
+    }
+
+    if ((ngx_rbtree_key_int_t) (stream->vfinish - sc->vtime) > 0) {
+        start = stream->vfinish;
+
+    } else {
+        start = sc->vtime;
+    }
+
+    stream->vfinish = start + ((ngx_rbtree_key_t) frame->size << shift);
+
+    frame->tag = stream->vfinish;
+    frame->scheduled = 1;
+    frame->next = NULL;
+
+    if (stream->sched_first) {
+        stream->sched_last->next = frame;
+        stream->sched_last = frame;
+        return;
+    }
+
+    stream->sched_first = frame;
+    stream->sched_last = frame;
+
+    stream->node.key = frame->tag;
+    ngx_rbtree_insert(&sc->sched, &stream->node);
+}
+
+
 static void
 ngx_http_spdy_handle_connection(ngx_http_spdy_connection_t *sc)
 {
@@ -583,6 +953,21 @@ ngx_http_spdy_handle_connection(ngx_http_spdy_connection_t *sc)
     sc->free_ctl_frames = NULL;
     sc->free_fake_connections = NULL;
 
+    /*
+     * the compression state is released for the time of keepalive,
+     * it is rebuilt without losing the position in the zlib streams
+     */
+
+    if (sc->deflate_active) {
+        (void) deflateEnd(&sc->zstream_out);
+        sc->deflate_active = 0;
+    }
+
+    if (ngx_http_spdy_inflate_release(sc) != NGX_OK) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
 #if (NGX_HTTP_SSL)
     if (c->ssl) {
         ngx_ssl_free_buffer(c);
@@ -608,29 +993,58 @@ static u_char *
 ngx_http_spdy_state_detect_settings(ngx_http_spdy_connection_t *sc,
     u_char *pos, u_char *end)
 {
+    uint32_t    head;
+    ngx_uint_t  version;
+
     if (end - pos < NGX_SPDY_FRAME_HEADER_SIZE) {
         return ngx_http_spdy_state_save(sc, pos, end,
                                         ngx_http_spdy_state_detect_settings);
     }
 
     /*
-     * Since this is the first frame in a buffer,
-     * then it is properly aligned
+     * Both spdy/2 and spdy/3.1 are advertised via NPN, and a plain text
+     * connection may use either of them, so the protocol version is taken
+     * from the first frame, which must be a control frame
      */
 
-    if (*(uint32_t *) pos == htonl(ngx_spdy_ctl_frame_head(NGX_SPDY_SETTINGS)))
-    {
-        sc->length = ngx_spdy_frame_length(htonl(((uint32_t *) pos)[1]));
+    head = ngx_spdy_frame_parse_uint32(pos);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
-                       "spdy SETTINGS frame received, size: %uz", sc->length);
+    if (ngx_spdy_data_frame_check(head)) {
+        ngx_log_error(NGX_LOG_INFO, sc->connection->log, 0,
+                      "client sent DATA spdy frame as the first frame");
+        return ngx_http_spdy_state_protocol_error(sc);
+    }
 
-        pos += NGX_SPDY_FRAME_HEADER_SIZE;
+    version = ngx_spdy_ctl_frame_version(head);
 
-        return ngx_http_spdy_state_settings(sc, pos, end);
+    if (version != NGX_SPDY_VERSION_2 && version != NGX_SPDY_VERSION_3) {
+        ngx_log_error(NGX_LOG_INFO, sc->connection->log, 0,
+                      "client sent unsupported spdy version: %ui", version);
+        return ngx_http_spdy_state_protocol_error(sc);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
+                   "spdy version: %ui", version);
+
+    sc->version = version;
+
+    if (ngx_http_spdy_send_settings(sc) != NGX_OK) {
+        return ngx_http_spdy_state_internal_error(sc);
     }
 
-    ngx_http_spdy_send_settings(sc);
+    if (version == NGX_SPDY_VERSION_3) {
+
+        /* spdy/3.1 session window starts at 64k, open it up to the maximum */
+
+        if (ngx_http_spdy_send_window_update(sc, 0, NGX_SPDY_MAX_WINDOW
+                                                    - sc->recv_window)
+            != NGX_OK)
+        {
+            return ngx_http_spdy_state_internal_error(sc);
+        }
+
+        sc->recv_window = NGX_SPDY_MAX_WINDOW;
+    }
 
     return ngx_http_spdy_state_head(sc, pos, end);
 }
@@ -662,7 +1076,7 @@ ngx_http_spdy_state_head(ngx_http_spdy_connection_t *sc, u_char *pos,
                    "spdy process frame head:%08Xd f:%ui l:%ui",
                    head, sc->flags, sc->length);
 
-    if (ngx_spdy_ctl_frame_check(head)) {
+    if (ngx_spdy_ctl_frame_check(head, sc->version)) {
         switch (ngx_spdy_ctl_frame_type(head)) {
 
         case NGX_SPDY_SYN_STREAM:
@@ -675,7 +1089,8 @@ ngx_http_spdy_state_head(ngx_http_spdy_connection_t *sc, u_char *pos,
             return ngx_http_spdy_state_rst_stream(sc, pos, end);
 
         case NGX_SPDY_SETTINGS:
-            return ngx_http_spdy_state_skip(sc, pos, end);
+            sc->headers = 0;
+            return ngx_http_spdy_state_settings(sc, pos, end);
 
         case NGX_SPDY_NOOP:
             return ngx_http_spdy_state_noop(sc, pos, end);
@@ -689,6 +1104,13 @@ ngx_http_spdy_state_head(ngx_http_spdy_connection_t *sc, u_char *pos,
         case NGX_SPDY_HEADERS:
             return ngx_http_spdy_state_protocol_error(sc);
 
+        case NGX_SPDY_WINDOW_UPDATE:
+            if (sc->version == NGX_SPDY_VERSION_2) {
+                return ngx_http_spdy_state_skip(sc, pos, end);
+            }
+
+            return ngx_http_spdy_state_window_update(sc, pos, end);
+
         default: /* TODO logging */
             return ngx_http_spdy_state_skip(sc, pos, end);
         }
@@ -729,7 +1151,7 @@ ngx_http_spdy_state_syn_stream(ngx_http_spdy_connection_t *sc, u_char *pos,
     sc->length -= NGX_SPDY_SYN_STREAM_SIZE;
 
     sid = ngx_spdy_frame_parse_sid(pos);
-    prio = pos[8] >> 6;
+    prio = (sc->version == NGX_SPDY_VERSION_2) ? pos[8] >> 6 : pos[8] >> 5;
 
     pos += NGX_SPDY_SYN_STREAM_SIZE;
 
@@ -806,6 +1228,11 @@ ngx_http_spdy_state_headers(ngx_http_spdy_connection_t *sc, u_char *pos,
 
     buf = r->header_in;
 
+    if (sc->inflate_wbits == 0) {
+        /* the window size of client, from CINFO of the zlib header */
+        sc->inflate_wbits = (pos[0] >> 4) + 8;
+    }
+
     sc->zstream_in.next_in = pos;
     sc->zstream_in.avail_in = size;
     sc->zstream_in.next_out = buf->last;
@@ -814,8 +1241,15 @@ ngx_http_spdy_state_headers(ngx_http_spdy_connection_t *sc, u_char *pos,
     z = inflate(&sc->zstream_in, Z_NO_FLUSH);
 
     if (z == Z_NEED_DICT) {
-        z = inflateSetDictionary(&sc->zstream_in, ngx_http_spdy_dict,
-                                 sizeof(ngx_http_spdy_dict));
+        if (sc->version == NGX_SPDY_VERSION_2) {
+            z = inflateSetDictionary(&sc->zstream_in, ngx_http_spdy_dict,
+                                     sizeof(ngx_http_spdy_dict));
+
+        } else {
+            z = inflateSetDictionary(&sc->zstream_in, ngx_http_spdy_v3_dict,
+                                     sizeof(ngx_http_spdy_v3_dict));
+        }
+
         if (z != Z_OK) {
             ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                           "spdy inflateSetDictionary() failed: %d", z);
@@ -850,19 +1284,22 @@ ngx_http_spdy_state_headers(ngx_http_spdy_connection_t *sc, u_char *pos,
 
     if (r->headers_in.headers.part.elts == NULL) {
 
-        if (buf->last - buf->pos < NGX_SPDY_NV_NUM_SIZE) {
+        if (buf->last - buf->pos < (ssize_t) ngx_http_spdy_nv_size(sc)) {
             return ngx_http_spdy_state_save(sc, pos, end,
                                             ngx_http_spdy_state_headers);
         }
 
-        sc->headers = ngx_spdy_frame_parse_uint16(buf->pos);
+        sc->headers = ngx_http_spdy_nv_parse(sc, buf->pos);
 
-        buf->pos += NGX_SPDY_NV_NUM_SIZE;
+        buf->pos += ngx_http_spdy_nv_size(sc);
 
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "spdy headers count: %ui", sc->headers);
 
-        if (ngx_list_init(&r->headers_in.headers, r->pool, sc->headers + 3,
+        /* the count is not trusted for preallocation, the list grows */
+
+        if (ngx_list_init(&r->headers_in.headers, r->pool,
+                          ngx_min(sc->headers, 20) + 3,
                           sizeof(ngx_table_elt_t))
             != NGX_OK)
         {
@@ -1033,6 +1470,11 @@ ngx_http_spdy_state_headers_skip(ngx_http_spdy_connection_t *sc, u_char *pos,
                                         ngx_http_spdy_state_headers_skip);
     }
 
+    if (sc->inflate_wbits == 0) {
+        /* the first header block may be skipped as well */
+        sc->inflate_wbits = (pos[0] >> 4) + 8;
+    }
+
     sc->zstream_in.next_in = pos;
     sc->zstream_in.avail_in = (size < sc->length) ? size : sc->length;
 
@@ -1066,6 +1508,87 @@ ngx_http_spdy_state_headers_skip(ngx_http_spdy_connection_t *sc, u_char *pos,
 static u_char *
 ngx_http_spdy_state_data(ngx_http_spdy_connection_t *sc, u_char *pos,
     u_char *end)
+{
+    ngx_http_spdy_stream_t  *stream;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
+                   "spdy DATA frame");
+
+    if (sc->version == NGX_SPDY_VERSION_2) {
+        return ngx_http_spdy_state_read_data(sc, pos, end);
+    }
+
+    if (sc->length > sc->recv_window) {
+        ngx_log_error(NGX_LOG_INFO, sc->connection->log, 0,
+                      "client violated connection flow control: "
+                      "received DATA frame length %uz, available window %uz",
+                      sc->length, sc->recv_window);
+
+        if (ngx_http_spdy_send_goaway(sc, NGX_SPDY_PROTOCOL_ERROR) == NGX_OK) {
+            (void) ngx_http_spdy_send_output_queue(sc);
+        }
+
+        return ngx_http_spdy_state_protocol_error(sc);
+    }
+
+    sc->recv_window -= sc->length;
+
+    if (sc->recv_window < NGX_SPDY_MAX_WINDOW / 4) {
+
+        if (ngx_http_spdy_send_window_update(sc, 0, NGX_SPDY_MAX_WINDOW
+                                                    - sc->recv_window)
+            != NGX_OK)
+        {
+            return ngx_http_spdy_state_internal_error(sc);
+        }
+
+        sc->recv_window = NGX_SPDY_MAX_WINDOW;
+    }
+
+    stream = sc->stream;
+
+    if (stream == NULL) {
+        return ngx_http_spdy_state_read_data(sc, pos, end);
+    }
+
+    if (sc->length > stream->recv_window) {
+        ngx_log_error(NGX_LOG_INFO, sc->connection->log, 0,
+                      "client violated flow control for stream %ui: "
+                      "received DATA frame length %uz, available window %uz",
+                      stream->id, sc->length, stream->recv_window);
+
+        if (ngx_http_spdy_terminate_stream(sc, stream,
+                                           NGX_SPDY_FLOW_CONTROL_ERROR)
+            != NGX_OK)
+        {
+            return ngx_http_spdy_state_internal_error(sc);
+        }
+
+        return ngx_http_spdy_state_skip(sc, pos, end);
+    }
+
+    stream->recv_window -= sc->length;
+
+    if (stream->recv_window < NGX_SPDY_STREAM_WINDOW / 4) {
+
+        if (ngx_http_spdy_send_window_update(sc, stream->id,
+                                             NGX_SPDY_STREAM_WINDOW
+                                             - stream->recv_window)
+            != NGX_OK)
+        {
+            return ngx_http_spdy_state_internal_error(sc);
+        }
+
+        stream->recv_window = NGX_SPDY_STREAM_WINDOW;
+    }
+
+    return ngx_http_spdy_state_read_data(sc, pos, end);
+}
+
+
+static u_char *
+ngx_http_spdy_state_read_data(ngx_http_spdy_connection_t *sc, u_char *pos,
+    u_char *end)
 {
     size_t                     size;
     ssize_t                    n;
@@ -1080,9 +1603,6 @@ ngx_http_spdy_state_data(ngx_http_spdy_connection_t *sc, u_char *pos,
 
     stream = sc->stream;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
-                   "spdy DATA frame");
-
     if (stream == NULL) {
         return ngx_http_spdy_state_skip(sc, pos, end);
     }
@@ -1182,7 +1702,7 @@ ngx_http_spdy_state_data(ngx_http_spdy_connection_t *sc, u_char *pos,
 
     if (!complete) {
         return ngx_http_spdy_state_save(sc, pos, end,
-                                        ngx_http_spdy_state_data);
+                                        ngx_http_spdy_state_read_data);
     }
 
     if (sc->flags & NGX_SPDY_FLAG_FIN) {
@@ -1345,7 +1865,7 @@ ngx_http_spdy_state_ping(ngx_http_spdy_connection_t *sc, u_char *pos,
 
     p = buf->pos;
 
-    p = ngx_spdy_frame_write_head(p, NGX_SPDY_PING);
+    p = ngx_spdy_frame_write_head(p, sc->version, NGX_SPDY_PING);
     p = ngx_spdy_frame_write_flags_and_len(p, 0, NGX_SPDY_PING_SIZE);
 
     p = ngx_cpymem(p, pos, NGX_SPDY_PING_SIZE);
@@ -1360,6 +1880,103 @@ ngx_http_spdy_state_ping(ngx_http_spdy_connection_t *sc, u_char *pos,
 }
 
 
+static u_char *
+ngx_http_spdy_state_window_update(ngx_http_spdy_connection_t *sc, u_char *pos,
+    u_char *end)
+{
+    size_t                   delta;
+    ngx_uint_t               sid;
+    ngx_queue_t             *q;
+    ngx_http_spdy_stream_t  *stream;
+
+    if (end - pos < NGX_SPDY_WINDOW_UPDATE_SIZE) {
+        return ngx_http_spdy_state_save(sc, pos, end,
+                                        ngx_http_spdy_state_window_update);
+    }
+
+    if (sc->length != NGX_SPDY_WINDOW_UPDATE_SIZE) {
+        ngx_log_error(NGX_LOG_INFO, sc->connection->log, 0,
+                      "client sent WINDOW_UPDATE frame "
+                      "with incorrect length %uz", sc->length);
+
+        return ngx_http_spdy_state_protocol_error(sc);
+    }
+
+    sid = ngx_spdy_frame_parse_sid(pos);
+
+    pos += NGX_SPDY_SID_SIZE;
+
+    delta = ngx_spdy_frame_parse_delta(pos);
+
+    pos += NGX_SPDY_DELTA_SIZE;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
+                   "spdy WINDOW_UPDATE sid:%ui delta:%uz", sid, delta);
+
+    if (sid) {
+        stream = ngx_http_spdy_get_stream_by_id(sc, sid);
+
+        if (stream == NULL) {
+            return ngx_http_spdy_state_complete(sc, pos, end);
+        }
+
+        if (delta > (size_t) (NGX_SPDY_MAX_WINDOW - stream->send_window)) {
+            ngx_log_error(NGX_LOG_INFO, sc->connection->log, 0,
+                          "client violated flow control for stream %ui: "
+                          "received WINDOW_UPDATE frame with delta %uz "
+                          "not allowed for window %z",
+                          sid, delta, stream->send_window);
+
+            if (ngx_http_spdy_terminate_stream(sc, stream,
+                                               NGX_SPDY_FLOW_CONTROL_ERROR)
+                != NGX_OK)
+            {
+                return ngx_http_spdy_state_internal_error(sc);
+            }
+
+            return ngx_http_spdy_state_complete(sc, pos, end);
+        }
+
+        stream->send_window += delta;
+
+        if (stream->exhausted && stream->send_window > 0) {
+            stream->exhausted = 0;
+            ngx_http_spdy_resume_stream(stream);
+        }
+
+        return ngx_http_spdy_state_complete(sc, pos, end);
+    }
+
+    if (delta > (size_t) (NGX_SPDY_MAX_WINDOW - sc->send_window)) {
+        ngx_log_error(NGX_LOG_INFO, sc->connection->log, 0,
+                      "client violated connection flow control: "
+                      "received WINDOW_UPDATE frame with delta %uz "
+                      "not allowed for window %z",
+                      delta, sc->send_window);
+
+        if (ngx_http_spdy_send_goaway(sc, NGX_SPDY_PROTOCOL_ERROR) == NGX_OK) {
+            (void) ngx_http_spdy_send_output_queue(sc);
+        }
+
+        return ngx_http_spdy_state_protocol_error(sc);
+    }
+
+    sc->send_window += delta;
+
+    while (sc->send_window > 0 && !ngx_queue_empty(&sc->window_waiting)) {
+        q = ngx_queue_head(&sc->window_waiting);
+        ngx_queue_remove(q);
+
+        stream = ngx_queue_data(q, ngx_http_spdy_stream_t, queue);
+        stream->queued = 0;
+
+        ngx_http_spdy_resume_stream(stream);
+    }
+
+    return ngx_http_spdy_state_complete(sc, pos, end);
+}
+
+
 static u_char *
 ngx_http_spdy_state_skip(ngx_http_spdy_connection_t *sc, u_char *pos,
     u_char *end)
@@ -1382,8 +1999,7 @@ static u_char *
 ngx_http_spdy_state_settings(ngx_http_spdy_connection_t *sc, u_char *pos,
     u_char *end)
 {
-    ngx_uint_t                 v;
-    ngx_http_spdy_srv_conf_t  *sscf;
+    ngx_uint_t  id, v;
 
     if (sc->headers == 0) {
 
@@ -1392,12 +2008,17 @@ ngx_http_spdy_state_settings(ngx_http_spdy_connection_t *sc, u_char *pos,
                                             ngx_http_spdy_state_settings);
         }
 
+        if (sc->length < NGX_SPDY_SETTINGS_NUM_SIZE) {
+            /* TODO logging */
+            return ngx_http_spdy_state_protocol_error(sc);
+        }
+
         sc->headers = ngx_spdy_frame_parse_uint32(pos);
 
         pos += NGX_SPDY_SETTINGS_NUM_SIZE;
         sc->length -= NGX_SPDY_SETTINGS_NUM_SIZE;
 
-        if (sc->length < sc->headers * NGX_SPDY_SETTINGS_PAIR_SIZE) {
+        if (sc->length / NGX_SPDY_SETTINGS_PAIR_SIZE < sc->headers) {
             /* TODO logging */
             return ngx_http_spdy_state_protocol_error(sc);
         }
@@ -1415,27 +2036,45 @@ ngx_http_spdy_state_settings(ngx_http_spdy_connection_t *sc, u_char *pos,
 
         sc->headers--;
 
-        if (pos[0] != NGX_SPDY_SETTINGS_MAX_STREAMS) {
-            pos += NGX_SPDY_SETTINGS_PAIR_SIZE;
-            sc->length -= NGX_SPDY_SETTINGS_PAIR_SIZE;
-            continue;
+        if (sc->version == NGX_SPDY_VERSION_2) {
+            /* spdy/2 clients send the 24-bit id in little-endian */
+            id = pos[0];
+
+        } else {
+            id = ngx_spdy_frame_parse_uint32(pos) & 0x00ffffff;
         }
 
-        v = ngx_spdy_frame_parse_uint32(pos + NGX_SPDY_SETTINGS_IDF_SIZE);
+        pos += NGX_SPDY_SETTINGS_IDF_SIZE;
+
+        v = ngx_spdy_frame_parse_uint32(pos);
 
-        sscf = ngx_http_get_module_srv_conf(sc->http_connection->conf_ctx,
-                                            ngx_http_spdy_module);
+        pos += NGX_SPDY_SETTINGS_VAL_SIZE;
+        sc->length -= NGX_SPDY_SETTINGS_PAIR_SIZE;
 
-        if (v != sscf->concurrent_streams) {
-            ngx_http_spdy_send_settings(sc);
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
+                       "spdy SETTINGS param id:%ui value:%ui", id, v);
+
+        if (id != NGX_SPDY_SETTINGS_INIT_WINDOW
+            || sc->version == NGX_SPDY_VERSION_2)
+        {
+            continue;
         }
 
-        return ngx_http_spdy_state_skip(sc, pos, end);
-    }
+        if (v > NGX_SPDY_MAX_WINDOW) {
+            ngx_log_error(NGX_LOG_INFO, sc->connection->log, 0,
+                          "client sent SETTINGS frame with incorrect "
+                          "INITIAL_WINDOW_SIZE value %ui", v);
 
-    ngx_http_spdy_send_settings(sc);
+            return ngx_http_spdy_state_protocol_error(sc);
+        }
 
-    return ngx_http_spdy_state_complete(sc, pos, end);
+        ngx_http_spdy_adjust_windows(sc, (ssize_t) v
+                                         - (ssize_t) sc->init_window);
+
+        sc->init_window = v;
+    }
+
+    return ngx_http_spdy_state_skip(sc, pos, end);
 }
 
 
@@ -1502,29 +2141,64 @@ ngx_http_spdy_state_internal_error(ngx_http_spdy_connection_t *sc)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
                    "spdy state internal error");
 
-    /* TODO */
-    ngx_http_spdy_finalize_connection(sc, NGX_HTTP_INTERNAL_SERVER_ERROR);
-    return NULL;
+    /* TODO */
+    ngx_http_spdy_finalize_connection(sc, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_http_spdy_send_rst_stream(ngx_http_spdy_connection_t *sc, ngx_uint_t sid,
+    ngx_uint_t status, ngx_uint_t priority)
+{
+    u_char                     *p;
+    ngx_buf_t                  *buf;
+    ngx_http_spdy_out_frame_t  *frame;
+
+    if (sc->connection->error) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
+                   "spdy write RST_STREAM sid:%ui st:%ui", sid, status);
+
+    frame = ngx_http_spdy_get_ctl_frame(sc, NGX_SPDY_RST_STREAM_SIZE,
+                                        priority);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    buf = frame->first->buf;
+
+    p = buf->pos;
+
+    p = ngx_spdy_frame_write_head(p, sc->version, NGX_SPDY_RST_STREAM);
+    p = ngx_spdy_frame_write_flags_and_len(p, 0, NGX_SPDY_RST_STREAM_SIZE);
+
+    p = ngx_spdy_frame_write_sid(p, sid);
+    p = ngx_spdy_frame_aligned_write_uint32(p, status);
+
+    buf->last = p;
+
+    ngx_http_spdy_queue_frame(sc, frame);
+
+    return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_spdy_send_rst_stream(ngx_http_spdy_connection_t *sc, ngx_uint_t sid,
-    ngx_uint_t status, ngx_uint_t priority)
+ngx_http_spdy_send_window_update(ngx_http_spdy_connection_t *sc, ngx_uint_t sid,
+    ngx_uint_t delta)
 {
     u_char                     *p;
     ngx_buf_t                  *buf;
     ngx_http_spdy_out_frame_t  *frame;
 
-    if (sc->connection->error) {
-        return NGX_OK;
-    }
-
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
-                   "spdy write RST_STREAM sid:%ui st:%ui", sid, status);
+                   "spdy write WINDOW_UPDATE sid:%ui delta:%ui", sid, delta);
 
-    frame = ngx_http_spdy_get_ctl_frame(sc, NGX_SPDY_RST_STREAM_SIZE,
-                                        priority);
+    frame = ngx_http_spdy_get_ctl_frame(sc, NGX_SPDY_WINDOW_UPDATE_SIZE,
+                                        NGX_SPDY_HIGHEST_PRIORITY);
     if (frame == NULL) {
         return NGX_ERROR;
     }
@@ -1533,11 +2207,11 @@ ngx_http_spdy_send_rst_stream(ngx_http_spdy_connection_t *sc, ngx_uint_t sid,
 
     p = buf->pos;
 
-    p = ngx_spdy_frame_write_head(p, NGX_SPDY_RST_STREAM);
-    p = ngx_spdy_frame_write_flags_and_len(p, 0, NGX_SPDY_RST_STREAM_SIZE);
+    p = ngx_spdy_frame_write_head(p, sc->version, NGX_SPDY_WINDOW_UPDATE);
+    p = ngx_spdy_frame_write_flags_and_len(p, 0, NGX_SPDY_WINDOW_UPDATE_SIZE);
 
     p = ngx_spdy_frame_write_sid(p, sid);
-    p = ngx_spdy_frame_aligned_write_uint32(p, status);
+    p = ngx_spdy_frame_aligned_write_uint32(p, delta);
 
     buf->last = p;
 
@@ -1547,19 +2221,21 @@ ngx_http_spdy_send_rst_stream(ngx_http_spdy_connection_t *sc, ngx_uint_t sid,
 }
 
 
-#if 0
 static ngx_int_t
-ngx_http_spdy_send_goaway(ngx_http_spdy_connection_t *sc)
+ngx_http_spdy_send_goaway(ngx_http_spdy_connection_t *sc, ngx_uint_t status)
 {
     u_char                     *p;
+    size_t                      size;
     ngx_buf_t                  *buf;
     ngx_http_spdy_out_frame_t  *frame;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
-                   "spdy create GOAWAY sid:%ui", sc->last_sid);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
+                   "spdy create GOAWAY sid:%ui st:%ui", sc->last_sid, status);
 
-    frame = ngx_http_spdy_get_ctl_frame(sc, NGX_SPDY_GOAWAY_SIZE,
-                                        NGX_SPDY_HIGHEST_PRIORITY);
+    size = (sc->version == NGX_SPDY_VERSION_2) ? NGX_SPDY_GOAWAY_SIZE
+                                                : NGX_SPDY_V3_GOAWAY_SIZE;
+
+    frame = ngx_http_spdy_get_ctl_frame(sc, size, NGX_SPDY_HIGHEST_PRIORITY);
     if (frame == NULL) {
         return NGX_ERROR;
     }
@@ -1568,25 +2244,30 @@ ngx_http_spdy_send_goaway(ngx_http_spdy_connection_t *sc)
 
     p = buf->pos;
 
-    p = ngx_spdy_frame_write_head(p, NGX_SPDY_GOAWAY);
-    p = ngx_spdy_frame_write_flags_and_len(p, 0, NGX_SPDY_GOAWAY_SIZE);
+    p = ngx_spdy_frame_write_head(p, sc->version, NGX_SPDY_GOAWAY);
+    p = ngx_spdy_frame_write_flags_and_len(p, 0, size);
 
     p = ngx_spdy_frame_write_sid(p, sc->last_sid);
 
+    if (sc->version != NGX_SPDY_VERSION_2) {
+        p = ngx_spdy_frame_aligned_write_uint32(p, status);
+    }
+
     buf->last = p;
 
     ngx_http_spdy_queue_frame(sc, frame);
 
     return NGX_OK;
 }
-#endif
 
 
 static ngx_int_t
 ngx_http_spdy_send_settings(ngx_http_spdy_connection_t *sc)
 {
     u_char                     *p;
+    size_t                      len;
     ngx_buf_t                  *buf;
+    ngx_uint_t                  n;
     ngx_pool_t                 *pool;
     ngx_chain_t                *cl;
     ngx_http_spdy_srv_conf_t   *sscf;
@@ -1597,6 +2278,10 @@ ngx_http_spdy_send_settings(ngx_http_spdy_connection_t *sc)
 
     pool = sc->connection->pool;
 
+    n = (sc->version == NGX_SPDY_VERSION_2) ? 1 : 2;
+
+    len = NGX_SPDY_SETTINGS_NUM_SIZE + n * NGX_SPDY_SETTINGS_PAIR_SIZE;
+
     frame = ngx_palloc(pool, sizeof(ngx_http_spdy_out_frame_t));
     if (frame == NULL) {
         return NGX_ERROR;
@@ -1607,9 +2292,7 @@ ngx_http_spdy_send_settings(ngx_http_spdy_connection_t *sc)
         return NGX_ERROR;
     }
 
-    buf = ngx_create_temp_buf(pool, NGX_SPDY_FRAME_HEADER_SIZE
-                                    + NGX_SPDY_SETTINGS_NUM_SIZE
-                                    + NGX_SPDY_SETTINGS_PAIR_SIZE);
+    buf = ngx_create_temp_buf(pool, NGX_SPDY_FRAME_HEADER_SIZE + len);
     if (buf == NULL) {
         return NGX_ERROR;
     }
@@ -1624,30 +2307,42 @@ ngx_http_spdy_send_settings(ngx_http_spdy_connection_t *sc)
     frame->handler = ngx_http_spdy_settings_frame_handler;
 #if (NGX_DEBUG)
     frame->stream = NULL;
-    frame->size = NGX_SPDY_FRAME_HEADER_SIZE
-                  + NGX_SPDY_SETTINGS_NUM_SIZE
-                  + NGX_SPDY_SETTINGS_PAIR_SIZE;
+    frame->size = NGX_SPDY_FRAME_HEADER_SIZE + len;
 #endif
     frame->priority = NGX_SPDY_HIGHEST_PRIORITY;
     frame->blocked = 0;
+    frame->scheduled = 0;
 
     p = buf->pos;
 
-    p = ngx_spdy_frame_write_head(p, NGX_SPDY_SETTINGS);
+    p = ngx_spdy_frame_write_head(p, sc->version, NGX_SPDY_SETTINGS);
     p = ngx_spdy_frame_write_flags_and_len(p, NGX_SPDY_FLAG_CLEAR_SETTINGS,
-                                              NGX_SPDY_SETTINGS_NUM_SIZE
-                                              + NGX_SPDY_SETTINGS_PAIR_SIZE);
+                                           len);
+
+    p = ngx_spdy_frame_aligned_write_uint32(p, n);
 
-    p = ngx_spdy_frame_aligned_write_uint32(p, 1);
-    p = ngx_spdy_frame_aligned_write_uint32(p,
+    if (sc->version == NGX_SPDY_VERSION_2) {
+        p = ngx_spdy_frame_aligned_write_uint32(p,
                                             NGX_SPDY_SETTINGS_MAX_STREAMS << 24
                                             | NGX_SPDY_SETTINGS_FLAG_PERSIST);
 
+    } else {
+        p = ngx_spdy_frame_aligned_write_uint32(p,
+                                            NGX_SPDY_SETTINGS_FLAG_PERSIST << 24
+                                            | NGX_SPDY_SETTINGS_MAX_STREAMS);
+    }
+
     sscf = ngx_http_get_module_srv_conf(sc->http_connection->conf_ctx,
                                         ngx_http_spdy_module);
 
     p = ngx_spdy_frame_aligned_write_uint32(p, sscf->concurrent_streams);
 
+    if (sc->version == NGX_SPDY_VERSION_3) {
+        p = ngx_spdy_frame_aligned_write_uint32(p,
+                                                NGX_SPDY_SETTINGS_INIT_WINDOW);
+        p = ngx_spdy_frame_aligned_write_uint32(p, NGX_SPDY_STREAM_WINDOW);
+    }
+
     buf->last = p;
 
     ngx_http_spdy_queue_frame(sc, frame);
@@ -1728,6 +2423,7 @@ ngx_http_spdy_get_ctl_frame(ngx_http_spdy_connection_t *sc, size_t size,
 
     frame->priority = priority;
     frame->blocked = 0;
+    frame->scheduled = 0;
 
     return frame;
 }
@@ -1866,6 +2562,9 @@ ngx_http_spdy_create_stream(ngx_http_spdy_connection_t *sc, ngx_uint_t id,
     stream->connection = sc;
     stream->priority = priority;
 
+    stream->send_window = sc->init_window;
+    stream->recv_window = NGX_SPDY_STREAM_WINDOW;
+
     sscf = ngx_http_get_module_srv_conf(r, ngx_http_spdy_module);
 
     index = ngx_http_spdy_stream_index(sscf, id);
@@ -1903,12 +2602,83 @@ ngx_http_spdy_get_stream_by_id(ngx_http_spdy_connection_t *sc,
 }
 
 
+static ngx_int_t
+ngx_http_spdy_terminate_stream(ngx_http_spdy_connection_t *sc,
+    ngx_http_spdy_stream_t *stream, ngx_uint_t status)
+{
+    ngx_event_t       *rev;
+    ngx_connection_t  *fc;
+
+    if (ngx_http_spdy_send_rst_stream(sc, stream->id, status,
+                                      NGX_SPDY_HIGHEST_PRIORITY)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    stream->in_closed = 1;
+    stream->out_closed = 1;
+
+    fc = stream->request->connection;
+    fc->error = 1;
+
+    rev = fc->read;
+    rev->handler(rev);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_spdy_adjust_windows(ngx_http_spdy_connection_t *sc, ssize_t delta)
+{
+    ngx_uint_t                 i, size;
+    ngx_http_spdy_stream_t    *stream, *next;
+    ngx_http_spdy_srv_conf_t  *sscf;
+
+    sscf = ngx_http_get_module_srv_conf(sc->http_connection->conf_ctx,
+                                        ngx_http_spdy_module);
+
+    size = ngx_http_spdy_streams_index_size(sscf);
+
+    for (i = 0; i < size; i++) {
+
+        for (stream = sc->streams_index[i]; stream; stream = next) {
+            next = stream->index;
+
+            stream->send_window += delta;
+
+            if (stream->exhausted && stream->send_window > 0) {
+                stream->exhausted = 0;
+                ngx_http_spdy_resume_stream(stream);
+            }
+        }
+    }
+}
+
+
+static void
+ngx_http_spdy_resume_stream(ngx_http_spdy_stream_t *stream)
+{
+    ngx_event_t  *wev;
+
+    wev = stream->request->connection->write;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, wev->log, 0,
+                   "spdy resume stream %ui", stream->id);
+
+    wev->delayed = 0;
+    wev->handler(wev);
+}
+
+
 static ngx_int_t
 ngx_http_spdy_parse_header(ngx_http_request_t *r)
 {
-    u_char                     *p, *end, ch;
-    ngx_uint_t                  len, hash;
-    ngx_http_core_srv_conf_t   *cscf;
+    u_char                       *p, *end, ch;
+    ngx_uint_t                    len, hash;
+    ngx_http_core_srv_conf_t     *cscf;
+    ngx_http_spdy_connection_t   *sc;
 
     enum {
         sw_name_len = 0,
@@ -1922,21 +2692,23 @@ ngx_http_spdy_parse_header(ngx_http_request_t *r)
     p = r->header_in->pos;
     end = r->header_in->last;
 
+    sc = r->spdy_stream->connection;
+
     switch (state) {
 
     case sw_name_len:
 
-        if (end - p < NGX_SPDY_NV_NLEN_SIZE) {
+        if (end - p < (ssize_t) ngx_http_spdy_nv_size(sc)) {
             return NGX_AGAIN;
         }
 
-        len = ngx_spdy_frame_parse_uint16(p);
+        len = ngx_http_spdy_nv_parse(sc, p);
 
-        if (!len) {
+        if (!len || len > NGX_SPDY_MAX_FRAME_SIZE) {
             return NGX_HTTP_PARSE_INVALID_HEADER;
         }
 
-        p += NGX_SPDY_NV_NLEN_SIZE;
+        p += ngx_http_spdy_nv_size(sc);
 
         r->header_name_end = p + len;
         r->lowcase_index = len;
@@ -1972,6 +2744,15 @@ ngx_http_spdy_parse_header(ngx_http_request_t *r)
                 continue;
             }
 
+            /* spdy/3 special headers start with a colon */
+
+            if (ch == ':'
+                && p == r->header_name_start
+                && sc->version == NGX_SPDY_VERSION_3)
+            {
+                continue;
+            }
+
             switch (ch) {
             case '\0':
             case LF:
@@ -1995,17 +2776,21 @@ ngx_http_spdy_parse_header(ngx_http_request_t *r)
 
     case sw_value_len:
 
-        if (end - p < NGX_SPDY_NV_VLEN_SIZE) {
+        if (end - p < (ssize_t) ngx_http_spdy_nv_size(sc)) {
             break;
         }
 
-        len = ngx_spdy_frame_parse_uint16(p);
+        len = ngx_http_spdy_nv_parse(sc, p);
 
         if (!len) {
             return NGX_ERROR;
         }
 
-        p += NGX_SPDY_NV_VLEN_SIZE;
+        if (len > NGX_SPDY_MAX_FRAME_SIZE) {
+            return NGX_HTTP_PARSE_INVALID_HEADER;
+        }
+
+        p += ngx_http_spdy_nv_size(sc);
 
         r->header_end = p + len;
 
@@ -2119,10 +2904,10 @@ ngx_http_spdy_alloc_large_header_buffer(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_spdy_handle_request_header(ngx_http_request_t *r)
 {
-    ngx_uint_t                       i;
+    ngx_uint_t                       i, n;
     ngx_table_elt_t                 *h;
     ngx_http_core_srv_conf_t        *cscf;
-    ngx_http_spdy_request_header_t  *sh;
+    ngx_http_spdy_request_header_t  *sh, *headers;
 
     if (r->invalid_header) {
         cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
@@ -2136,8 +2921,17 @@ ngx_http_spdy_handle_request_header(ngx_http_request_t *r)
         }
 
     } else {
-        for (i = 0; i < NGX_SPDY_REQUEST_HEADERS; i++) {
-            sh = &ngx_http_spdy_request_headers[i];
+        if (r->spdy_stream->connection->version == NGX_SPDY_VERSION_2) {
+            headers = ngx_http_spdy_request_headers;
+            n = NGX_SPDY_REQUEST_HEADERS;
+
+        } else {
+            headers = ngx_http_spdy_v3_request_headers;
+            n = NGX_SPDY_V3_REQUEST_HEADERS;
+        }
+
+        for (i = 0; i < n; i++) {
+            sh = &headers[i];
 
             if (sh->hash != r->header_hash
                 || sh->len != r->lowcase_index
@@ -2150,6 +2944,13 @@ ngx_http_spdy_handle_request_header(ngx_http_request_t *r)
 
             return sh->handler(r);
         }
+
+        if (r->header_name_start[0] == ':') {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "client sent unknown special header: \"%*s\"",
+                          r->lowcase_index, r->header_name_start);
+            return NGX_OK;
+        }
     }
 
     h = ngx_list_push(&r->headers_in.headers);
@@ -2185,6 +2986,11 @@ ngx_http_spdy_request_headers_init()
         h = &ngx_http_spdy_request_headers[i];
         h->hash = ngx_hash_key(h->header, h->len);
     }
+
+    for (i = 0; i < NGX_SPDY_V3_REQUEST_HEADERS; i++) {
+        h = &ngx_http_spdy_v3_request_headers[i];
+        h->hash = ngx_hash_key(h->header, h->len);
+    }
 }
 
 
@@ -2373,6 +3179,34 @@ ngx_http_spdy_parse_version(ngx_http_request_t *r)
 }
 
 
+static ngx_int_t
+ngx_http_spdy_parse_host(ngx_http_request_t *r)
+{
+    ngx_table_elt_t  *h;
+
+    /* ":host" is passed on as an ordinary "Host" header */
+
+    h = ngx_list_push(&r->headers_in.headers);
+    if (h == NULL) {
+        ngx_http_spdy_close_stream(r->spdy_stream,
+                                   NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return NGX_ERROR;
+    }
+
+    h->hash = ngx_hash(ngx_hash(ngx_hash('h', 'o'), 's'), 't');
+
+    ngx_str_set(&h->key, "host");
+
+    h->value.len = r->header_size;
+    h->value.data = r->header_start;
+    h->value.data[h->value.len] = '\0';
+
+    h->lowcase_key = h->key.data;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_spdy_construct_request_line(ngx_http_request_t *r)
 {
@@ -2630,6 +3464,11 @@ ngx_http_spdy_close_stream(ngx_http_spdy_stream_t *stream, ngx_int_t rc)
         sc->stream = NULL;
     }
 
+    if (stream->queued) {
+        ngx_queue_remove(&stream->queue);
+        stream->queued = 0;
+    }
+
     sscf = ngx_http_get_module_srv_conf(sc->http_connection->conf_ctx,
                                         ngx_http_spdy_module);
 
@@ -2775,6 +3614,11 @@ ngx_http_spdy_keepalive_handler(ngx_event_t *rev)
         return;
     }
 
+    if (ngx_http_spdy_inflate_restore(sc) != NGX_OK) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
     c->write->handler = ngx_http_spdy_write_handler;
 
     rev->handler = ngx_http_spdy_read_handler;
@@ -2805,6 +3649,9 @@ ngx_http_spdy_finalize_connection(ngx_http_spdy_connection_t *sc,
 
     sc->last_out = NULL;
 
+    ngx_rbtree_init(&sc->sched, &sc->sched_sentinel,
+                    ngx_rbtree_insert_timer_value);
+
     sc->blocked = 1;
 
     sscf = ngx_http_get_module_srv_conf(sc->http_connection->conf_ctx,
@@ -2855,6 +3702,168 @@ ngx_http_spdy_pool_cleanup(void *data)
     if (sc->pool) {
         ngx_destroy_pool(sc->pool);
     }
+
+    if (sc->inflate_active) {
+        (void) inflateEnd(&sc->zstream_in);
+    }
+
+    if (sc->deflate_active) {
+        (void) deflateEnd(&sc->zstream_out);
+    }
+
+    if (sc->inflate_window) {
+        ngx_free(sc->inflate_window);
+    }
+}
+
+
+ngx_int_t
+ngx_http_spdy_deflate_init(ngx_http_spdy_connection_t *sc)
+{
+    int                        rc;
+    ngx_http_spdy_srv_conf_t  *sscf;
+
+    sscf = ngx_http_get_module_srv_conf(sc->http_connection->conf_ctx,
+                                        ngx_http_spdy_module);
+
+    if (sc->deflate_started) {
+
+        /*
+         * the zlib header and the dictionary were already sent, and every
+         * header block ends on a byte boundary after Z_SYNC_FLUSH, so raw
+         * deflate continues the stream with an empty history
+         */
+
+        rc = deflateInit2(&sc->zstream_out, (int) sscf->headers_comp,
+                          Z_DEFLATED, -NGX_SPDY_DEFLATE_WBITS,
+                          NGX_SPDY_DEFLATE_MEMLEVEL, Z_DEFAULT_STRATEGY);
+
+        if (rc != Z_OK) {
+            ngx_log_error(NGX_LOG_ALERT, sc->connection->log, 0,
+                          "deflateInit2() failed: %d", rc);
+            return NGX_ERROR;
+        }
+
+        sc->deflate_active = 1;
+
+        return NGX_OK;
+    }
+
+    rc = deflateInit2(&sc->zstream_out, (int) sscf->headers_comp,
+                      Z_DEFLATED, NGX_SPDY_DEFLATE_WBITS,
+                      NGX_SPDY_DEFLATE_MEMLEVEL, Z_DEFAULT_STRATEGY);
+
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, sc->connection->log, 0,
+                      "deflateInit2() failed: %d", rc);
+        return NGX_ERROR;
+    }
+
+    sc->deflate_active = 1;
+
+    if (sc->version == NGX_SPDY_VERSION_2) {
+        rc = deflateSetDictionary(&sc->zstream_out, ngx_http_spdy_dict,
+                                  sizeof(ngx_http_spdy_dict));
+
+    } else {
+        rc = deflateSetDictionary(&sc->zstream_out, ngx_http_spdy_v3_dict,
+                                  sizeof(ngx_http_spdy_v3_dict));
+    }
+
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, sc->connection->log, 0,
+                      "deflateSetDictionary() failed: %d", rc);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_spdy_inflate_release(ngx_http_spdy_connection_t *sc)
+{
+#if (ZLIB_VERNUM >= 0x1271)
+    int    rc;
+    uInt   len;
+
+    /*
+     * client may refer to the previous header blocks, so only the window
+     * is kept, it is never larger than the inflate state with the window
+     */
+
+    if (!sc->inflate_active || sc->zstream_in.total_in == 0) {
+        return NGX_OK;
+    }
+
+    rc = inflateGetDictionary(&sc->zstream_in, NULL, &len);
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, sc->connection->log, 0,
+                      "inflateGetDictionary() failed: %d", rc);
+        return NGX_ERROR;
+    }
+
+    if (len) {
+        sc->inflate_window = ngx_alloc(len, sc->connection->log);
+        if (sc->inflate_window == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) inflateGetDictionary(&sc->zstream_in, sc->inflate_window,
+                                    &len);
+    }
+
+    sc->inflate_window_len = len;
+
+    (void) inflateEnd(&sc->zstream_in);
+    sc->inflate_active = 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
+                   "spdy inflate released, window:%uz",
+                   sc->inflate_window_len);
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_spdy_inflate_restore(ngx_http_spdy_connection_t *sc)
+{
+    int  rc;
+
+    if (sc->inflate_active) {
+        return NGX_OK;
+    }
+
+    /* the zlib header has been processed already */
+
+    rc = inflateInit2(&sc->zstream_in, -(int) sc->inflate_wbits);
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, sc->connection->log, 0,
+                      "inflateInit2() failed: %d", rc);
+        return NGX_ERROR;
+    }
+
+    sc->inflate_active = 1;
+
+    if (sc->inflate_window == NULL) {
+        return NGX_OK;
+    }
+
+    rc = inflateSetDictionary(&sc->zstream_in, sc->inflate_window,
+                              (uInt) sc->inflate_window_len);
+
+    ngx_free(sc->inflate_window);
+    sc->inflate_window = NULL;
+
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, sc->connection->log, 0,
+                      "inflateSetDictionary() failed: %d", rc);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
 }
 
 
@@ -2863,17 +3872,66 @@ ngx_http_spdy_zalloc(void *opaque, u_int items, u_int size)
 {
     ngx_http_spdy_connection_t *sc = opaque;
 
-    return ngx_palloc(sc->connection->pool, items * size);
+    size_t                   len;
+    ngx_uint_t               i;
+    ngx_http_spdy_zblock_t  *b;
+    ngx_http_spdy_zcache_t  *zc;
+
+    len = (size_t) items * size;
+
+    for (i = 0; i < NGX_SPDY_ZCACHE_SLOTS; i++) {
+        zc = &ngx_http_spdy_zcache[i];
+
+        if (zc->size == len && zc->free) {
+            b = zc->free;
+            zc->free = b->next;
+            zc->nfree--;
+
+            return (u_char *) b + NGX_SPDY_ZBLOCK_SIZE;
+        }
+    }
+
+    b = ngx_alloc(NGX_SPDY_ZBLOCK_SIZE + len, sc->connection->log);
+    if (b == NULL) {
+        return Z_NULL;
+    }
+
+    b->size = len;
+
+    return (u_char *) b + NGX_SPDY_ZBLOCK_SIZE;
 }
 
 
 static void
 ngx_http_spdy_zfree(void *opaque, void *address)
 {
-#if 0
-    ngx_http_spdy_connection_t *sc = opaque;
+    ngx_uint_t               i;
+    ngx_http_spdy_zblock_t  *b;
+    ngx_http_spdy_zcache_t  *zc;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, sc->connection->log, 0,
-                   "spdy zfree: %p", address);
-#endif
+    b = (ngx_http_spdy_zblock_t *) ((u_char *) address - NGX_SPDY_ZBLOCK_SIZE);
+
+    for (i = 0; i < NGX_SPDY_ZCACHE_SLOTS; i++) {
+        zc = &ngx_http_spdy_zcache[i];
+
+        if (zc->size == 0) {
+            zc->size = b->size;
+        }
+
+        if (zc->size != b->size) {
+            continue;
+        }
+
+        if (zc->nfree < NGX_SPDY_ZCACHE_FREE) {
+            b->next = zc->free;
+            zc->free = b;
+            zc->nfree++;
+
+            return;
+        }
+
+        break;
+    }
+
+    ngx_free(b);
 }
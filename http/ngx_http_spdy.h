@@ -15,11 +15,13 @@
 #include <zlib.h>
 
 
-#define NGX_SPDY_VERSION              2
+#define NGX_SPDY_VERSION_2            2
+#define NGX_SPDY_VERSION_3            3
 
 #ifdef TLSEXT_TYPE_next_proto_neg
-#define NGX_SPDY_NPN_ADVERTISE        "\x06spdy/2"
+#define NGX_SPDY_NPN_ADVERTISE        "\x08spdy/3.1\x06spdy/2"
 #define NGX_SPDY_NPN_NEGOTIATED       "spdy/2"
+#define NGX_SPDY_V3_NPN_NEGOTIATED    "spdy/3.1"
 #endif
 
 #define NGX_SPDY_STATE_BUFFER_SIZE    16
@@ -34,6 +36,7 @@
 #define NGX_SPDY_PING                 6
 #define NGX_SPDY_GOAWAY               7
 #define NGX_SPDY_HEADERS              8
+#define NGX_SPDY_WINDOW_UPDATE        9
 
 #define NGX_SPDY_FRAME_HEADER_SIZE    8
 
@@ -41,21 +44,29 @@
 
 #define NGX_SPDY_SYN_STREAM_SIZE      10
 #define NGX_SPDY_SYN_REPLY_SIZE       6
+#define NGX_SPDY_V3_SYN_REPLY_SIZE    4
 #define NGX_SPDY_RST_STREAM_SIZE      8
 #define NGX_SPDY_PING_SIZE            4
 #define NGX_SPDY_GOAWAY_SIZE          4
+#define NGX_SPDY_V3_GOAWAY_SIZE       8
 #define NGX_SPDY_NV_NUM_SIZE          2
 #define NGX_SPDY_NV_NLEN_SIZE         2
 #define NGX_SPDY_NV_VLEN_SIZE         2
+#define NGX_SPDY_V3_NV_NUM_SIZE       4
+#define NGX_SPDY_V3_NV_NLEN_SIZE      4
+#define NGX_SPDY_V3_NV_VLEN_SIZE      4
 #define NGX_SPDY_SETTINGS_NUM_SIZE    4
 #define NGX_SPDY_SETTINGS_IDF_SIZE    4
 #define NGX_SPDY_SETTINGS_VAL_SIZE    4
+#define NGX_SPDY_WINDOW_UPDATE_SIZE   8
+#define NGX_SPDY_DELTA_SIZE           4
 
 #define NGX_SPDY_SETTINGS_PAIR_SIZE                                           \
     (NGX_SPDY_SETTINGS_IDF_SIZE + NGX_SPDY_SETTINGS_VAL_SIZE)
 
 #define NGX_SPDY_HIGHEST_PRIORITY     0
 #define NGX_SPDY_LOWEST_PRIORITY      3
+#define NGX_SPDY_V3_LOWEST_PRIORITY   7
 
 #define NGX_SPDY_FLAG_FIN             0x01
 #define NGX_SPDY_FLAG_UNIDIRECTIONAL  0x02
@@ -63,6 +74,10 @@
 
 #define NGX_SPDY_MAX_FRAME_SIZE       ((1 << 24) - 1)
 
+#define NGX_SPDY_DEFAULT_WINDOW       65536
+#define NGX_SPDY_MAX_WINDOW           0x7fffffff
+#define NGX_SPDY_STREAM_WINDOW        NGX_SPDY_MAX_WINDOW
+
 #define NGX_SPDY_DATA_DISCARD         1
 #define NGX_SPDY_DATA_ERROR           2
 #define NGX_SPDY_DATA_INTERNAL_ERROR  3
@@ -79,6 +94,7 @@ struct ngx_http_spdy_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
 
+    ngx_uint_t                       version;
     ngx_uint_t                       processing;
 
     u_char                           buffer[NGX_SPDY_STATE_BUFFER_SIZE];
@@ -88,6 +104,10 @@ struct ngx_http_spdy_connection_s {
     z_stream                         zstream_in;
     z_stream                         zstream_out;
 
+    u_char                          *inflate_window;
+    size_t                           inflate_window_len;
+    ngx_uint_t                       inflate_wbits;
+
     ngx_pool_t                      *pool;
 
     ngx_http_spdy_out_frame_t       *free_ctl_frames;
@@ -98,6 +118,10 @@ struct ngx_http_spdy_connection_s {
     ngx_http_spdy_out_frame_t       *last_out;
     ngx_http_spdy_stream_t          *last_stream;
 
+    ngx_rbtree_t                     sched;
+    ngx_rbtree_node_t                sched_sentinel;
+    ngx_rbtree_key_t                 vtime;
+
     ngx_http_spdy_stream_t          *stream;
 
     ngx_uint_t                       headers;
@@ -106,8 +130,17 @@ struct ngx_http_spdy_connection_s {
 
     ngx_uint_t                       last_sid;
 
+    ssize_t                          send_window;
+    size_t                           recv_window;
+    size_t                           init_window;
+
+    ngx_queue_t                      window_waiting;
+
     unsigned                         blocked:2;
     unsigned                         waiting:1; /* FIXME better name */
+    unsigned                         inflate_active:1;
+    unsigned                         deflate_active:1;
+    unsigned                         deflate_started:1;
 };
 
 
@@ -123,11 +156,26 @@ struct ngx_http_spdy_stream_s {
     ngx_http_spdy_out_frame_t       *free_frames;
     ngx_chain_t                     *free_data_headers;
 
-    unsigned                         priority:2;
+    ssize_t                          send_window;
+    size_t                           recv_window;
+
+    ngx_chain_t                     *out;
+    ngx_chain_t                     *free_bufs;
+    ngx_queue_t                      queue;
+
+    ngx_rbtree_node_t                node;
+    ngx_http_spdy_out_frame_t       *sched_first;
+    ngx_http_spdy_out_frame_t       *sched_last;
+    ngx_rbtree_key_t                 vfinish;
+    size_t                           buffered;
+
+    unsigned                         priority:3;
     unsigned                         handled:1;
     unsigned                         in_closed:1;
     unsigned                         out_closed:1;
     unsigned                         skip_data:2;
+    unsigned                         exhausted:1;
+    unsigned                         queued:1;
 };
 
 
@@ -144,8 +192,10 @@ struct ngx_http_spdy_out_frame_s {
     size_t                           size;
 
     ngx_uint_t                       priority;
+    ngx_rbtree_key_t                 tag;
     unsigned                         blocked:1;
     unsigned                         fin:1;
+    unsigned                         scheduled:1;
 };
 
 
@@ -194,6 +244,9 @@ ngx_int_t ngx_http_spdy_read_request_body(ngx_http_request_t *r,
 void ngx_http_spdy_close_stream(ngx_http_spdy_stream_t *stream, ngx_int_t rc);
 
 ngx_int_t ngx_http_spdy_send_output_queue(ngx_http_spdy_connection_t *sc);
+ngx_int_t ngx_http_spdy_deflate_init(ngx_http_spdy_connection_t *sc);
+void ngx_http_spdy_queue_data_frame(ngx_http_spdy_connection_t *sc,
+    ngx_http_spdy_out_frame_t *frame);
 
 
 #define ngx_spdy_frame_aligned_write_uint16(p, s)                             \
@@ -221,11 +274,11 @@ ngx_int_t ngx_http_spdy_send_output_queue(ngx_http_spdy_connection_t *sc);
 #endif
 
 
-#define ngx_spdy_ctl_frame_head(t)                                            \
-    ((uint32_t) NGX_SPDY_CTL_BIT << 31 | NGX_SPDY_VERSION << 16 | (t))
+#define ngx_spdy_ctl_frame_head(v, t)                                         \
+    ((uint32_t) NGX_SPDY_CTL_BIT << 31 | (v) << 16 | (t))
 
-#define ngx_spdy_frame_write_head(p, t)                                       \
-    ngx_spdy_frame_aligned_write_uint32(p, ngx_spdy_ctl_frame_head(t))
+#define ngx_spdy_frame_write_head(p, v, t)                                    \
+    ngx_spdy_frame_aligned_write_uint32(p, ngx_spdy_ctl_frame_head(v, t))
 
 #define ngx_spdy_frame_write_flags_and_len(p, f, l)                           \
     ngx_spdy_frame_aligned_write_uint32(p, (f) << 24 | (l))
@@ -16,19 +16,38 @@
 
 #define NGX_SPDY_WRITE_BUFFERED  NGX_HTTP_WRITE_BUFFERED
 
-#define ngx_http_spdy_nv_nsize(h)  (NGX_SPDY_NV_NLEN_SIZE + sizeof(h) - 1)
-#define ngx_http_spdy_nv_vsize(h)  (NGX_SPDY_NV_VLEN_SIZE + sizeof(h) - 1)
+/*
+ * the name/value block is sized for spdy/3 that uses 32-bit lengths,
+ * spdy/2 lengths are 16-bit, so it is always enough
+ */
+
+#define ngx_http_spdy_nv_nsize(h)  (NGX_SPDY_V3_NV_NLEN_SIZE + sizeof(h) - 1)
+#define ngx_http_spdy_nv_vsize(h)  (NGX_SPDY_V3_NV_VLEN_SIZE + sizeof(h) - 1)
+
+#define ngx_http_spdy_nv_len_size(sc)                                         \
+    ((sc)->version == NGX_SPDY_VERSION_2 ? NGX_SPDY_NV_NLEN_SIZE             \
+                                         : NGX_SPDY_V3_NV_NLEN_SIZE)
+
+#define ngx_http_spdy_nv_write_len(sc, p, n)                                  \
+    ((sc)->version == NGX_SPDY_VERSION_2 ? ngx_spdy_frame_write_uint16(p, n) \
+                                         : ngx_spdy_frame_write_uint32(p, n))
 
-#define ngx_http_spdy_nv_write_num   ngx_spdy_frame_write_uint16
-#define ngx_http_spdy_nv_write_nlen  ngx_spdy_frame_write_uint16
-#define ngx_http_spdy_nv_write_vlen  ngx_spdy_frame_write_uint16
+#define ngx_http_spdy_nv_write_num   ngx_http_spdy_nv_write_len
+#define ngx_http_spdy_nv_write_nlen  ngx_http_spdy_nv_write_len
+#define ngx_http_spdy_nv_write_vlen  ngx_http_spdy_nv_write_len
 
-#define ngx_http_spdy_nv_write_name(p, h)                                     \
-    ngx_cpymem(ngx_http_spdy_nv_write_nlen(p, sizeof(h) - 1), h, sizeof(h) - 1)
+#define ngx_http_spdy_nv_write_name(sc, p, h)                                 \
+    ngx_cpymem(ngx_http_spdy_nv_write_nlen(sc, p, sizeof(h) - 1),             \
+               h, sizeof(h) - 1)
 
-#define ngx_http_spdy_nv_write_val(p, h)                                      \
-    ngx_cpymem(ngx_http_spdy_nv_write_vlen(p, sizeof(h) - 1), h, sizeof(h) - 1)
+#define ngx_http_spdy_nv_write_val(sc, p, h)                                  \
+    ngx_cpymem(ngx_http_spdy_nv_write_vlen(sc, p, sizeof(h) - 1),             \
+               h, sizeof(h) - 1)
 
+static ngx_int_t ngx_http_spdy_filter_flush(ngx_http_request_t *r,
+    ngx_http_spdy_stream_t *stream);
+static ngx_chain_t *ngx_http_spdy_filter_split(ngx_http_request_t *r,
+    ngx_http_spdy_stream_t *stream, ngx_chain_t *in, off_t size);
 static ngx_inline ngx_int_t ngx_http_spdy_filter_send(
     ngx_connection_t *fc, ngx_http_spdy_stream_t *stream);
 
@@ -89,7 +108,7 @@ static ngx_int_t
 ngx_http_spdy_header_filter(ngx_http_request_t *r)
 {
     int                           rc;
-    size_t                        len;
+    size_t                        len, hlen, nvlen;
     u_char                       *p, *buf, *last;
     ngx_buf_t                    *b;
     ngx_str_t                     host;
@@ -129,6 +148,11 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
 
     c = r->connection;
 
+    stream = r->spdy_stream;
+    sc = stream->connection;
+
+    nvlen = ngx_http_spdy_nv_len_size(sc);
+
     if (r->method == NGX_HTTP_HEAD) {
         r->header_only = 1;
     }
@@ -158,10 +182,10 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
         r->headers_out.last_modified = NULL;
     }
 
-    len = NGX_SPDY_NV_NUM_SIZE
-          + ngx_http_spdy_nv_nsize("version")
+    len = NGX_SPDY_V3_NV_NUM_SIZE
+          + ngx_http_spdy_nv_nsize(":version")
           + ngx_http_spdy_nv_vsize("HTTP/1.1")
-          + ngx_http_spdy_nv_nsize("status")
+          + ngx_http_spdy_nv_nsize(":status")
           + ngx_http_spdy_nv_vsize("418");
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
@@ -179,7 +203,7 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
 
     if (r->headers_out.content_type.len) {
         len += ngx_http_spdy_nv_nsize("content-type")
-               + NGX_SPDY_NV_VLEN_SIZE + r->headers_out.content_type.len;
+               + NGX_SPDY_V3_NV_VLEN_SIZE + r->headers_out.content_type.len;
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -192,7 +216,7 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
         && r->headers_out.content_length_n >= 0)
     {
         len += ngx_http_spdy_nv_nsize("content-length")
-               + NGX_SPDY_NV_VLEN_SIZE + NGX_OFF_T_LEN;
+               + NGX_SPDY_V3_NV_VLEN_SIZE + NGX_OFF_T_LEN;
     }
 
     if (r->headers_out.last_modified == NULL
@@ -289,8 +313,8 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
             continue;
         }
 
-        len += NGX_SPDY_NV_NLEN_SIZE + header[i].key.len
-               + NGX_SPDY_NV_VLEN_SIZE  + header[i].value.len;
+        len += NGX_SPDY_V3_NV_NLEN_SIZE + header[i].key.len
+               + NGX_SPDY_V3_NV_VLEN_SIZE  + header[i].value.len;
     }
 
     buf = ngx_alloc(len, r->pool->log);
@@ -298,30 +322,39 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
-    last = buf + NGX_SPDY_NV_NUM_SIZE;
+    last = buf + nvlen;
 
-    last = ngx_http_spdy_nv_write_name(last, "version");
-    last = ngx_http_spdy_nv_write_val(last, "HTTP/1.1");
+    if (sc->version == NGX_SPDY_VERSION_2) {
+        last = ngx_http_spdy_nv_write_name(sc, last, "version");
+        last = ngx_http_spdy_nv_write_val(sc, last, "HTTP/1.1");
 
-    last = ngx_http_spdy_nv_write_name(last, "status");
-    last = ngx_spdy_frame_write_uint16(last, 3);
+        last = ngx_http_spdy_nv_write_name(sc, last, "status");
+
+    } else {
+        last = ngx_http_spdy_nv_write_name(sc, last, ":version");
+        last = ngx_http_spdy_nv_write_val(sc, last, "HTTP/1.1");
+
+        last = ngx_http_spdy_nv_write_name(sc, last, ":status");
+    }
+
+    last = ngx_http_spdy_nv_write_vlen(sc, last, 3);
     last = ngx_sprintf(last, "%03ui", r->headers_out.status);
 
     count = 2;
 
     if (r->headers_out.server == NULL) {
-        last = ngx_http_spdy_nv_write_name(last, "server");
+        last = ngx_http_spdy_nv_write_name(sc, last, "server");
         last = clcf->server_tokens
-               ? ngx_http_spdy_nv_write_val(last, NGINX_VER)
-               : ngx_http_spdy_nv_write_val(last, "nginx");
+               ? ngx_http_spdy_nv_write_val(sc, last, NGINX_VER)
+               : ngx_http_spdy_nv_write_val(sc, last, "nginx");
 
         count++;
     }
 
     if (r->headers_out.date == NULL) {
-        last = ngx_http_spdy_nv_write_name(last, "date");
+        last = ngx_http_spdy_nv_write_name(sc, last, "date");
 
-        last = ngx_http_spdy_nv_write_vlen(last, ngx_cached_http_time.len);
+        last = ngx_http_spdy_nv_write_vlen(sc, last, ngx_cached_http_time.len);
 
         last = ngx_cpymem(last, ngx_cached_http_time.data,
                           ngx_cached_http_time.len);
@@ -331,9 +364,9 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
 
     if (r->headers_out.content_type.len) {
 
-        last = ngx_http_spdy_nv_write_name(last, "content-type");
+        last = ngx_http_spdy_nv_write_name(sc, last, "content-type");
 
-        p = last + NGX_SPDY_NV_VLEN_SIZE;
+        p = last + nvlen;
 
         last = ngx_cpymem(p, r->headers_out.content_type.data,
                           r->headers_out.content_type.len);
@@ -352,7 +385,7 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
             r->headers_out.content_type.data = p;
         }
 
-        (void) ngx_http_spdy_nv_write_vlen(p - NGX_SPDY_NV_VLEN_SIZE,
+        (void) ngx_http_spdy_nv_write_vlen(sc, p - nvlen,
                                            r->headers_out.content_type.len);
 
         count++;
@@ -361,13 +394,13 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
     if (r->headers_out.content_length == NULL
         && r->headers_out.content_length_n >= 0)
     {
-        last = ngx_http_spdy_nv_write_name(last, "content-length");
+        last = ngx_http_spdy_nv_write_name(sc, last, "content-length");
 
-        p = last + NGX_SPDY_NV_VLEN_SIZE;
+        p = last + nvlen;
 
         last = ngx_sprintf(p, "%O", r->headers_out.content_length_n);
 
-        (void) ngx_http_spdy_nv_write_vlen(p - NGX_SPDY_NV_VLEN_SIZE,
+        (void) ngx_http_spdy_nv_write_vlen(sc, p - nvlen,
                                            last - p);
 
         count++;
@@ -376,13 +409,13 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        last = ngx_http_spdy_nv_write_name(last, "last-modified");
+        last = ngx_http_spdy_nv_write_name(sc, last, "last-modified");
 
-        p = last + NGX_SPDY_NV_VLEN_SIZE;
+        p = last + nvlen;
 
         last = ngx_http_time(p, r->headers_out.last_modified_time);
 
-        (void) ngx_http_spdy_nv_write_vlen(p - NGX_SPDY_NV_VLEN_SIZE,
+        (void) ngx_http_spdy_nv_write_vlen(sc, p - nvlen,
                                            last - p);
 
         count++;
@@ -390,9 +423,9 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
 
     if (host.data) {
 
-        last = ngx_http_spdy_nv_write_name(last, "location");
+        last = ngx_http_spdy_nv_write_name(sc, last, "location");
 
-        p = last + NGX_SPDY_NV_VLEN_SIZE;
+        p = last + nvlen;
 
         last = ngx_cpymem(p, "http", sizeof("http") - 1);
 
@@ -419,7 +452,7 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
         r->headers_out.location->value.data = p;
         ngx_str_set(&r->headers_out.location->key, "location");
 
-        (void) ngx_http_spdy_nv_write_vlen(p - NGX_SPDY_NV_VLEN_SIZE,
+        (void) ngx_http_spdy_nv_write_vlen(sc, p - nvlen,
                                            r->headers_out.location->value.len);
 
         count++;
@@ -455,12 +488,12 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
             continue;
         }
 
-        last = ngx_http_spdy_nv_write_nlen(last, header[i].key.len);
+        last = ngx_http_spdy_nv_write_nlen(sc, last, header[i].key.len);
 
         ngx_strlow(last, header[i].key.data, header[i].key.len);
         last += header[i].key.len;
 
-        p = last + NGX_SPDY_NV_VLEN_SIZE;
+        p = last + nvlen;
 
         last = ngx_cpymem(p, header[i].value.data, header[i].value.len);
 
@@ -494,28 +527,32 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
             h[j].hash = 2;
         }
 
-        (void) ngx_http_spdy_nv_write_vlen(p - NGX_SPDY_NV_VLEN_SIZE,
+        (void) ngx_http_spdy_nv_write_vlen(sc, p - nvlen,
                                            last - p);
 
         count++;
     }
 
-    (void) ngx_spdy_frame_write_uint16(buf, count);
-
-    stream = r->spdy_stream;
-    sc = stream->connection;
+    (void) ngx_http_spdy_nv_write_num(sc, buf, count);
 
     len = last - buf;
 
-    b = ngx_create_temp_buf(r->pool, NGX_SPDY_FRAME_HEADER_SIZE
-                                     + NGX_SPDY_SYN_REPLY_SIZE
+    if (!sc->deflate_active && ngx_http_spdy_deflate_init(sc) != NGX_OK) {
+        ngx_free(buf);
+        return NGX_ERROR;
+    }
+
+    hlen = (sc->version == NGX_SPDY_VERSION_2) ? NGX_SPDY_SYN_REPLY_SIZE
+                                               : NGX_SPDY_V3_SYN_REPLY_SIZE;
+
+    b = ngx_create_temp_buf(r->pool, NGX_SPDY_FRAME_HEADER_SIZE + hlen
                                      + deflateBound(&sc->zstream_out, len));
     if (b == NULL) {
         ngx_free(buf);
         return NGX_ERROR;
     }
 
-    b->last += NGX_SPDY_FRAME_HEADER_SIZE + NGX_SPDY_SYN_REPLY_SIZE;
+    b->last += NGX_SPDY_FRAME_HEADER_SIZE + hlen;
 
     sc->zstream_out.next_in = buf;
     sc->zstream_out.avail_in = len;
@@ -526,6 +563,8 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
 
     ngx_free(buf);
 
+    sc->deflate_started = 1;
+
     if (rc != Z_OK) {
         ngx_log_error(NGX_LOG_ALERT, c->log, 0,
                       "spdy deflate() failed: %d", rc);
@@ -541,7 +580,7 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
     b->last = sc->zstream_out.next_out;
 
     p = b->pos;
-    p = ngx_spdy_frame_write_head(p, NGX_SPDY_SYN_REPLY);
+    p = ngx_spdy_frame_write_head(p, sc->version, NGX_SPDY_SYN_REPLY);
 
     len = b->last - b->pos;
 
@@ -579,6 +618,7 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
     frame->size = len;
     frame->priority = stream->priority;
     frame->blocked = 1;
+    frame->scheduled = 0;
     frame->fin = r->header_only;
 
     ngx_log_debug3(NGX_LOG_DEBUG_HTTP, stream->request->connection->log, 0,
@@ -606,11 +646,9 @@ ngx_http_spdy_header_filter(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_spdy_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
-    off_t                       size;
-    ngx_buf_t                  *b;
-    ngx_chain_t                *cl, *ll, *out, **ln;
-    ngx_http_spdy_stream_t     *stream;
-    ngx_http_spdy_out_frame_t  *frame;
+    ngx_buf_t               *b;
+    ngx_chain_t             *cl, *ll, **ln;
+    ngx_http_spdy_stream_t  *stream;
 
     stream = r->spdy_stream;
 
@@ -623,6 +661,10 @@ ngx_http_spdy_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
     if (in == NULL || r->header_only) {
 
+        if (stream->out) {
+            return ngx_http_spdy_filter_flush(r, stream);
+        }
+
         if (stream->waiting) {
             return NGX_AGAIN;
         }
@@ -632,11 +674,9 @@ ngx_http_spdy_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return NGX_OK;
     }
 
-    size = 0;
-    ln = &out;
-    ll = in;
+    for (ln = &stream->out; *ln; ln = &(*ln)->next) { /* void */ }
 
-    for ( ;; ) {
+    for (ll = in; ll; ll = ll->next) {
         b = ll->buf;
 #if 1
         if (ngx_buf_size(b) == 0 && !ngx_buf_special(b)) {
@@ -662,38 +702,220 @@ ngx_http_spdy_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             return NGX_ERROR;
         }
 
-        size += ngx_buf_size(b);
         cl->buf = b;
 
         *ln = cl;
         ln = &cl->next;
+    }
+
+    *ln = NULL;
+
+    return ngx_http_spdy_filter_flush(r, stream);
+}
+
+
+static ngx_int_t
+ngx_http_spdy_filter_flush(ngx_http_request_t *r,
+    ngx_http_spdy_stream_t *stream)
+{
+    off_t                        size, limit, n;
+    size_t                       buffered;
+    ngx_chain_t                 *cl, *first, *last, **ln;
+    ngx_event_t                 *wev;
+    ngx_connection_t            *fc;
+    ngx_http_core_loc_conf_t    *clcf;
+    ngx_http_spdy_srv_conf_t    *sscf;
+    ngx_http_spdy_out_frame_t   *frame;
+    ngx_http_spdy_connection_t  *sc;
+
+    fc = r->connection;
+    sc = stream->connection;
+
+    sscf = ngx_http_get_module_srv_conf(sc->http_connection->conf_ctx,
+                                        ngx_http_spdy_module);
+
+    for ( ;; ) {
+
+        while (stream->out) {
+
+            /*
+             * the data which do not fit into the stream buffer or,
+             * in spdy/3.1, into the stream and session send windows
+             * are kept in stream->out until the queued DATA frames
+             * are sent or a WINDOW_UPDATE frame arrives
+             */
+
+            if (stream->buffered >= sscf->stream_buffer_size) {
+                limit = 0;
+
+            } else {
+                limit = sscf->stream_buffer_size - stream->buffered;
+            }
+
+            if (sc->version != NGX_SPDY_VERSION_2) {
+                limit = ngx_min(limit, stream->send_window);
+                limit = ngx_min(limit, sc->send_window);
+
+                if (limit < 0) {
+                    limit = 0;
+                }
+            }
+
+            if (limit == 0 && ngx_buf_size(stream->out->buf)) {
+                break;
+            }
+
+            size = 0;
+            last = NULL;
+
+            for (ln = &stream->out; *ln; ln = &cl->next) {
+                cl = *ln;
+
+                n = ngx_buf_size(cl->buf);
+
+                if (n > limit - size) {
+
+                    if (size == limit) {
+                        break;
+                    }
+
+                    cl = ngx_http_spdy_filter_split(r, stream, cl,
+                                                    limit - size);
+                    if (cl == NULL) {
+                        return NGX_ERROR;
+                    }
+
+                    *ln = cl;
+                    n = limit - size;
+                }
+
+                size += n;
+                last = cl;
+            }
+
+            first = stream->out;
+            stream->out = last->next;
+            last->next = NULL;
+
+            frame = ngx_http_spdy_filter_get_data_frame(stream, (size_t) size,
+                                                        last->buf->last_buf,
+                                                        first, last);
+            if (frame == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_http_spdy_queue_data_frame(sc, frame);
+
+            stream->waiting++;
+            stream->buffered += (size_t) size;
 
-        if (ll->next == NULL) {
+            r->main->blocked++;
+
+            if (sc->version != NGX_SPDY_VERSION_2) {
+                stream->send_window -= size;
+                sc->send_window -= size;
+            }
+        }
+
+        buffered = stream->buffered;
+
+        if (ngx_http_spdy_send_output_queue(sc) == NGX_ERROR) {
+            fc->error = 1;
+            return NGX_ERROR;
+        }
+
+        if (stream->out == NULL || stream->buffered == buffered) {
             break;
         }
+    }
+
+    wev = fc->write;
 
-        ll = ll->next;
+    if (stream->out) {
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "spdy:%ui DATA frame blocked: buffered:%uz "
+                       "stream window:%z session window:%z",
+                       stream->id, stream->buffered,
+                       stream->send_window, sc->send_window);
+
+        if (sc->version != NGX_SPDY_VERSION_2
+            && stream->buffered < sscf->stream_buffer_size)
+        {
+            if (stream->send_window <= 0) {
+                stream->exhausted = 1;
+
+            } else if (sc->send_window <= 0 && !stream->queued) {
+                ngx_queue_insert_tail(&sc->window_waiting, &stream->queue);
+                stream->queued = 1;
+            }
+        }
+
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        ngx_add_timer(wev, clcf->send_timeout);
+
+        fc->buffered |= NGX_SPDY_WRITE_BUFFERED;
+
+        if (stream->waiting) {
+            wev->delayed = 1;
+        }
+
+        return NGX_AGAIN;
     }
 
-    if (size > NGX_SPDY_MAX_FRAME_SIZE) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-                      "FIXME: chain too big in spdy filter: %O", size);
-        return NGX_ERROR;
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
     }
 
-    frame = ngx_http_spdy_filter_get_data_frame(stream, (size_t) size,
-                                                b->last_buf, out, cl);
-    if (frame == NULL) {
-        return NGX_ERROR;
+    if (stream->waiting) {
+        fc->buffered |= NGX_SPDY_WRITE_BUFFERED;
+        wev->delayed = 1;
+        return NGX_AGAIN;
     }
 
-    ngx_http_spdy_queue_frame(stream->connection, frame);
+    fc->buffered &= ~NGX_SPDY_WRITE_BUFFERED;
+
+    return NGX_OK;
+}
+
 
-    stream->waiting++;
+static ngx_chain_t *
+ngx_http_spdy_filter_split(ngx_http_request_t *r,
+    ngx_http_spdy_stream_t *stream, ngx_chain_t *in, off_t size)
+{
+    ngx_buf_t    *b, *buf;
+    ngx_chain_t  *cl;
+
+    cl = ngx_chain_get_free_buf(r->pool, &stream->free_bufs);
+    if (cl == NULL) {
+        return NULL;
+    }
 
-    r->main->blocked++;
+    buf = in->buf;
+    b = cl->buf;
 
-    return ngx_http_spdy_filter_send(r->connection, stream);
+    ngx_memcpy(b, buf, sizeof(ngx_buf_t));
+
+    b->tag = (ngx_buf_tag_t) &ngx_http_spdy_module;
+    b->recycled = 0;
+    b->flush = 0;
+    b->sync = 0;
+    b->last_buf = 0;
+    b->last_in_chain = 0;
+
+    if (ngx_buf_in_memory(buf)) {
+        b->last = b->pos + (size_t) size;
+        buf->pos = b->last;
+    }
+
+    if (buf->in_file) {
+        b->file_last = b->file_pos + size;
+        buf->file_pos = b->file_last;
+    }
+
+    cl->next = in;
+
+    return cl;
 }
 
 
@@ -776,6 +998,7 @@ ngx_http_spdy_filter_get_data_frame(ngx_http_spdy_stream_t *stream,
     frame->size = NGX_SPDY_FRAME_HEADER_SIZE + len;
     frame->priority = stream->priority;
     frame->blocked = 0;
+    frame->scheduled = 0;
     frame->fin = fin;
 
     return frame;
@@ -880,7 +1103,13 @@ ngx_http_spdy_data_frame_handler(ngx_http_spdy_connection_t *sc,
 
         ln = cl->next;
 
-        ngx_free_chain(stream->request->pool, cl);
+        if (cl->buf->tag == (ngx_buf_tag_t) &ngx_http_spdy_module) {
+            cl->next = stream->free_bufs;
+            stream->free_bufs = cl;
+
+        } else {
+            ngx_free_chain(stream->request->pool, cl);
+        }
 
         if (cl == frame->last) {
             goto done;
@@ -896,6 +1125,8 @@ done:
 
     stream->request->header_size += NGX_SPDY_FRAME_HEADER_SIZE;
 
+    stream->buffered -= frame->size - NGX_SPDY_FRAME_HEADER_SIZE;
+
     ngx_http_spdy_handle_frame(stream, frame);
 
     ngx_http_spdy_handle_stream(sc, stream);
@@ -945,6 +1176,12 @@ ngx_http_spdy_handle_stream(ngx_http_spdy_connection_t *sc,
 
         stream->next = sc->last_stream;
         sc->last_stream = stream;
+
+        return;
+    }
+
+    if (stream->out) {
+        ngx_post_event(fc->write, &ngx_posted_events);
     }
 }
 
@@ -954,8 +1191,9 @@ ngx_http_spdy_filter_cleanup(void *data)
 {
     ngx_http_spdy_stream_t *stream = data;
 
-    ngx_http_request_t         *r;
-    ngx_http_spdy_out_frame_t  *frame, **fn;
+    ngx_http_request_t          *r;
+    ngx_http_spdy_out_frame_t   *frame, **fn;
+    ngx_http_spdy_connection_t  *sc;
 
     if (stream->waiting == 0) {
         return;
@@ -963,7 +1201,20 @@ ngx_http_spdy_filter_cleanup(void *data)
 
     r = stream->request;
 
-    fn = &stream->connection->last_out;
+    sc = stream->connection;
+
+    if (stream->sched_first) {
+        ngx_rbtree_delete(&sc->sched, &stream->node);
+
+        for (frame = stream->sched_first; frame; frame = frame->next) {
+            stream->waiting--;
+            r->blocked--;
+        }
+
+        stream->sched_first = NULL;
+    }
+
+    fn = &sc->last_out;
 
     for ( ;; ) {
         frame = *fn;
@@ -32,6 +32,8 @@ static char *ngx_http_spdy_recv_buffer_size(ngx_conf_t *cf, void *post,
 static char *ngx_http_spdy_pool_size(ngx_conf_t *cf, void *post, void *data);
 static char *ngx_http_spdy_streams_index_mask(ngx_conf_t *cf, void *post,
     void *data);
+static char *ngx_http_spdy_stream_buffer_size(ngx_conf_t *cf, void *post,
+    void *data);
 
 
 static ngx_conf_num_bounds_t  ngx_http_spdy_headers_comp_bounds = {
@@ -44,6 +46,8 @@ static ngx_conf_post_t  ngx_http_spdy_pool_size_post =
     { ngx_http_spdy_pool_size };
 static ngx_conf_post_t  ngx_http_spdy_streams_index_mask_post =
     { ngx_http_spdy_streams_index_mask };
+static ngx_conf_post_t  ngx_http_spdy_stream_buffer_size_post =
+    { ngx_http_spdy_stream_buffer_size };
 
 
 static ngx_command_t  ngx_http_spdy_commands[] = {
@@ -76,6 +80,13 @@ static ngx_command_t  ngx_http_spdy_commands[] = {
       offsetof(ngx_http_spdy_srv_conf_t, streams_index_mask),
       &ngx_http_spdy_streams_index_mask_post },
 
+    { ngx_string("spdy_stream_buffer_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_spdy_srv_conf_t, stream_buffer_size),
+      &ngx_http_spdy_stream_buffer_size_post },
+
     { ngx_string("spdy_recv_timeout"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -168,11 +179,18 @@ ngx_http_spdy_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
     if (r->spdy_stream) {
-        v->len = 1;
         v->valid = 1;
         v->no_cacheable = 0;
         v->not_found = 0;
-        v->data = (u_char *) "2";
+
+        if (r->spdy_stream->connection->version == NGX_SPDY_VERSION_2) {
+            v->len = sizeof("2") - 1;
+            v->data = (u_char *) "2";
+
+        } else {
+            v->len = sizeof("3.1") - 1;
+            v->data = (u_char *) "3.1";
+        }
 
         return NGX_OK;
     }
@@ -261,6 +279,7 @@ ngx_http_spdy_create_srv_conf(ngx_conf_t *cf)
 
     sscf->concurrent_streams = NGX_CONF_UNSET_UINT;
     sscf->streams_index_mask = NGX_CONF_UNSET_UINT;
+    sscf->stream_buffer_size = NGX_CONF_UNSET_SIZE;
 
     sscf->recv_timeout = NGX_CONF_UNSET_MSEC;
     sscf->keepalive_timeout = NGX_CONF_UNSET_MSEC;
@@ -285,6 +304,9 @@ ngx_http_spdy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_uint_value(conf->streams_index_mask,
                               prev->streams_index_mask, 32 - 1);
 
+    ngx_conf_merge_size_value(conf->stream_buffer_size,
+                              prev->stream_buffer_size, 64 * 1024);
+
     ngx_conf_merge_msec_value(conf->recv_timeout,
                               prev->recv_timeout, 30000);
     ngx_conf_merge_msec_value(conf->keepalive_timeout,
@@ -349,3 +371,20 @@ ngx_http_spdy_streams_index_mask(ngx_conf_t *cf, void *post, void *data)
 
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_http_spdy_stream_buffer_size(ngx_conf_t *cf, void *post, void *data)
+{
+    size_t *sp = data;
+
+    if (*sp == 0) {
+        return "value is too small";
+    }
+
+    if (*sp > NGX_SPDY_MAX_FRAME_SIZE) {
+        *sp = NGX_SPDY_MAX_FRAME_SIZE;
+    }
+
+    return NGX_CONF_OK;
+}
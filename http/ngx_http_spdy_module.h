@@ -24,6 +24,7 @@ typedef struct {
     size_t                          pool_size;
     ngx_uint_t                      concurrent_streams;
     ngx_uint_t                      streams_index_mask;
+    size_t                          stream_buffer_size;
     ngx_msec_t                      recv_timeout;
     ngx_msec_t                      keepalive_timeout;
     ngx_int_t                       headers_comp;
@@ -30,9 +30,12 @@ static void ngx_http_upstream_connect(ngx_http_request_t *r,
 static ngx_int_t ngx_http_upstream_reinit(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_send_request(ngx_http_request_t *r,
-    ngx_http_upstream_t *u);
+    ngx_http_upstream_t *u, ngx_uint_t do_write);
+static ngx_int_t ngx_http_upstream_send_request_body(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t do_write);
 static void ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static void ngx_http_upstream_read_request_handler(ngx_http_request_t *r);
 static void ngx_http_upstream_process_header(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_test_next(ngx_http_request_t *r,
@@ -56,6 +59,16 @@ static void ngx_http_upstream_upgraded_write_upstream(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
+static ngx_uint_t ngx_http_upstream_upgraded_pending(ngx_http_upstream_t *u,
+    ngx_uint_t from_upstream);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_http_upstream_init_splice(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_splice_cleanup(void *data);
+static ngx_int_t ngx_http_upstream_splice_upgraded(ngx_connection_t *src,
+    ngx_connection_t *dst, ngx_http_upstream_splice_t *sp,
+    ngx_uint_t do_write);
+#endif
 static void
     ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r);
 static void
@@ -77,6 +90,8 @@ static void ngx_http_upstream_dummy_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_next(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_uint_t ft_type);
+static void ngx_http_upstream_retry(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static void ngx_http_upstream_cleanup(void *data);
 static void ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_int_t rc);
@@ -553,8 +568,11 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
     u->output.pool = r->pool;
     u->output.bufs.num = 1;
     u->output.bufs.size = clcf->client_body_buffer_size;
-    u->output.output_filter = ngx_chain_writer;
-    u->output.filter_ctx = &u->writer;
+
+    if (u->output.output_filter == NULL) {
+        u->output.output_filter = ngx_chain_writer;
+        u->output.filter_ctx = &u->writer;
+    }
 
     u->writer.pool = r->pool;
 
@@ -1240,6 +1258,17 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
+    if (u->pipelined) {
+
+        /*
+         * the request was sent on a busy keepalive connection,
+         * ngx_http_upstream_resume_pipelined() is called in its turn
+         */
+
+        u->request_sent = 1;
+        return;
+    }
+
     /* rc == NGX_OK || rc == NGX_AGAIN */
 	
 	/*
@@ -1322,6 +1351,7 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     }
 
     u->request_sent = 0;
+    u->request_body_sent = 0;
 
 	//δ(rc == NGX_AGAIN,rcngx_event_connect_peerķֵ)ӵд¼붨ʱ
   	//ηӽɹصngx_http_upstream_send_request ( ¼д )
@@ -1340,7 +1370,7 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 #endif
 
 	//Ѿӣη
-    ngx_http_upstream_send_request(r, u);
+    ngx_http_upstream_send_request(r, u, 1);
 }
 
 
@@ -1403,7 +1433,7 @@ ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
         c->write->handler = ngx_http_upstream_handler;
         c->read->handler = ngx_http_upstream_handler;
 
-        ngx_http_upstream_send_request(r, u);
+        ngx_http_upstream_send_request(r, u, 1);
 
         return;
     }
@@ -1415,6 +1445,72 @@ ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
 #endif
 
 
+void
+ngx_http_upstream_resume_pipelined(ngx_http_request_t *r, ngx_connection_t *c)
+{
+    ngx_connection_t     *downstream;
+    ngx_http_log_ctx_t   *ctx;
+    ngx_http_upstream_t  *u;
+
+    downstream = r->connection;
+    u = r->upstream;
+
+    ctx = downstream->log->data;
+    ctx->current_request = r;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, downstream->log, 0,
+                   "http upstream resume pipelined: %p", c);
+
+    u->pipelined = 0;
+
+    if (c == NULL) {
+
+        /*
+         * the connection was closed before the response was received,
+         * the failure has been accounted by the request that owned it
+         */
+
+        ngx_http_upstream_retry(r, u);
+
+        ngx_http_run_posted_requests(downstream);
+        return;
+    }
+
+    u->peer.connection = c;
+    u->peer.cached = 1;
+
+    c->data = r;
+    c->write->handler = ngx_http_upstream_handler;
+    c->read->handler = ngx_http_upstream_handler;
+
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
+    u->read_event_handler = ngx_http_upstream_process_header;
+
+    c->sendfile &= downstream->sendfile;
+    u->output.sendfile = c->sendfile;
+
+    c->log = downstream->log;
+    c->pool->log = c->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    u->writer.out = NULL;
+    u->writer.last = &u->writer.out;
+    u->writer.connection = c;
+    u->writer.limit = 0;
+
+    u->request_body_sent = 1;
+
+    ngx_add_timer(c->read, u->conf->read_timeout);
+
+    if (c->read->ready || u->pipeline_buf) {
+        ngx_http_upstream_process_header(r, u);
+    }
+
+    ngx_http_run_posted_requests(downstream);
+}
+
+
 static ngx_int_t
 ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
@@ -1426,6 +1522,7 @@ ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     u->keepalive = 0;
     u->upgrade = 0;
+    u->pipeline_buf = NULL;
 
     ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
     u->headers_in.content_length_n = -1;
@@ -1484,7 +1581,8 @@ ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
 
 static void
-ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
+ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_uint_t do_write)
 {
     ngx_int_t          rc;
     ngx_connection_t  *c;
@@ -1504,16 +1602,18 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
 	
 	//ͻеݵη,ngx_http_upstream_tṹеrequest_bufs
 	//ֻеһεø÷ʱҪrequest_bufs
-    rc = ngx_output_chain(&u->output, u->request_sent ? NULL : u->request_bufs);
-
-	//ʾѾrequest_bufs
-    u->request_sent = 1;
+    rc = ngx_http_upstream_send_request_body(r, u, do_write);
 
     if (rc == NGX_ERROR) {
         ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
         return;
     }
 
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        ngx_http_upstream_finalize_request(r, u, rc);
+        return;
+    }
+
     if (c->write->timer_set) {
         ngx_del_timer(c->write);
     }
@@ -1521,7 +1621,12 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
 	//Ƴд¼ʱ
 	
     if (rc == NGX_AGAIN) {
-        ngx_add_timer(c->write, u->conf->send_timeout);
+
+        /* the unbuffered request body may be waited for from the client */
+
+        if (!c->write->ready) {
+            ngx_add_timer(c->write, u->conf->send_timeout);
+        }
 
 		//д¼ӵepollУngx_http_upstream_send_request
         if (ngx_handle_write_event(c->write, u->conf->send_lowat) != NGX_OK) {
@@ -1535,6 +1640,8 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     /* rc == NGX_OK */
 
+    u->request_body_sent = 1;
+
     if (c->tcp_nopush == NGX_TCP_NOPUSH_SET) {
         if (ngx_tcp_push(c->fd) == NGX_ERROR) {
             ngx_log_error(NGX_LOG_CRIT, c->log, ngx_socket_errno,
@@ -1578,6 +1685,127 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
 }
 
 
+static ngx_int_t
+ngx_http_upstream_send_request_body(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t do_write)
+{
+    int                        tcp_nodelay;
+    ngx_int_t                  rc;
+    ngx_chain_t               *out, *cl, *ln;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream send request body");
+
+    if (!r->request_body_no_buffering) {
+
+        /* buffered request body */
+
+        if (!u->request_sent) {
+            u->request_sent = 1;
+            out = u->request_bufs;
+
+        } else {
+            out = NULL;
+        }
+
+        return ngx_output_chain(&u->output, out);
+    }
+
+    if (!u->request_sent) {
+        u->request_sent = 1;
+        out = u->request_bufs;
+
+        /* append the part of the body read so far */
+
+        if (r->request_body->bufs) {
+            for (cl = out; cl->next; cl = cl->next) { /* void */ }
+
+            cl->next = r->request_body->bufs;
+            r->request_body->bufs = NULL;
+        }
+
+        c = u->peer.connection;
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
+
+            tcp_nodelay = 1;
+
+            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
+            {
+                ngx_connection_error(c, ngx_socket_errno,
+                                     "setsockopt(TCP_NODELAY) failed");
+                return NGX_ERROR;
+            }
+
+            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
+        }
+
+        r->read_event_handler = ngx_http_upstream_read_request_handler;
+
+    } else {
+        out = NULL;
+    }
+
+    for ( ;; ) {
+
+        if (do_write) {
+            rc = ngx_output_chain(&u->output, out);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            while (out) {
+                ln = out;
+                out = out->next;
+                ngx_free_chain(r->pool, ln);
+            }
+
+            if (rc == NGX_OK && !r->reading_body) {
+                break;
+            }
+        }
+
+        if (r->reading_body) {
+
+            /* read the client request body */
+
+            rc = ngx_http_read_unbuffered_request_body(r);
+
+            if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+                return rc;
+            }
+
+            out = r->request_body->bufs;
+            r->request_body->bufs = NULL;
+        }
+
+        /* stop if there is nothing to send */
+
+        if (out == NULL) {
+            rc = NGX_AGAIN;
+            break;
+        }
+
+        do_write = 1;
+    }
+
+    if (!r->reading_body) {
+        if (!u->store && !r->post_action && !u->conf->ignore_client_abort) {
+            r->read_event_handler =
+                                  ngx_http_upstream_rd_check_broken_connection;
+        }
+    }
+
+    return rc;
+}
+
+
 //ĴСδ֪Ҫεø÷ܷȫ
 //÷ڼ״̬ngx_http_upstream_send_request
 static void
@@ -1618,7 +1846,29 @@ ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
         return;
     }
 
-    ngx_http_upstream_send_request(r, u);
+    ngx_http_upstream_send_request(r, u, 1);
+}
+
+
+static void
+ngx_http_upstream_read_request_handler(ngx_http_request_t *r)
+{
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
+
+    c = r->connection;
+    u = r->upstream;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream read request handler");
+
+    if (c->read->timedout) {
+        c->timedout = 1;
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    ngx_http_upstream_send_request(r, u, 0);
 }
 
 
@@ -1685,34 +1935,54 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
     for ( ;; ) {
 		
 		//ʼӦ3ֲͬķֵ
-        n = c->recv(c, u->buffer.last, u->buffer.end - u->buffer.last);
+        if (u->pipeline_buf) {
 
-        if (n == NGX_AGAIN) {
+            /* the response was read along with the previous one */
+
+            n = u->pipeline_buf->last - u->pipeline_buf->pos;
+
+            if (n > u->buffer.end - u->buffer.last) {
+                ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                              "upstream sent too big pipelined response, "
+                              "retrying on a new connection");
+                ngx_http_upstream_retry(r, u);
+                return;
+            }
+
+            u->buffer.last = ngx_cpymem(u->buffer.last, u->pipeline_buf->pos,
+                                        n);
+            u->pipeline_buf = NULL;
+
+        } else {
+            n = c->recv(c, u->buffer.last, u->buffer.end - u->buffer.last);
+
+            if (n == NGX_AGAIN) {
 #if 0
-            ngx_add_timer(rev, u->read_timeout);
+                ngx_add_timer(rev, u->read_timeout);
 #endif
 
-            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-                ngx_http_upstream_finalize_request(r, u,
+                if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                    ngx_http_upstream_finalize_request(r, u,
                                                NGX_HTTP_INTERNAL_SERVER_ERROR);
+                    return;
+                }
+
                 return;
             }
 
-            return;
-        }
+            if (n == 0) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream prematurely closed connection");
+            }
 
-        if (n == 0) {
-            ngx_log_error(NGX_LOG_ERR, c->log, 0,
-                          "upstream prematurely closed connection");
-        }
+            if (n == NGX_ERROR || n == 0) {
+                ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+                return;
+            }
 
-        if (n == NGX_ERROR || n == 0) {
-            ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
-            return;
+            u->buffer.last += n;
         }
 
-        u->buffer.last += n;
-
 #if 0
         u->valid_header_in = 0;
 
@@ -2365,10 +2635,16 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
             r->cache->body_start = u->conf->buffer_size;
             r->cache->file_cache = u->conf->cache->data;
 
-            if (ngx_http_file_cache_create(r) != NGX_OK) {
+            rc = ngx_http_file_cache_create(r);
+
+            if (rc == NGX_ERROR) {
                 ngx_http_upstream_finalize_request(r, u, 0);
                 return;
             }
+
+            if (rc == NGX_DECLINED) {
+                u->cacheable = 0;
+            }
         }
 
         break;
@@ -2440,6 +2716,14 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     p->temp_file->path = u->conf->temp_path;
     p->temp_file->pool = r->pool;
 
+#if (NGX_HTTP_CACHE)
+
+    if (u->cacheable && r->cache->shard && r->cache->shard->temp_path) {
+        p->temp_file->path = r->cache->shard->temp_path;
+    }
+
+#endif
+
     if (p->cacheable) {
         p->temp_file->persistent = 1;
 
@@ -2593,6 +2877,23 @@ ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
         }
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    if (u->conf->splice
+#if (NGX_SSL)
+        && c->ssl == NULL
+        && u->peer.connection->ssl == NULL
+#endif
+        )
+    {
+        if (ngx_http_upstream_init_splice(r, u) == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, 0);
+            return;
+        }
+    }
+
+#endif
+
     if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
         ngx_http_upstream_finalize_request(r, u, 0);
         return;
@@ -2706,6 +3007,26 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
 
     for ( ;; ) {
 
+#if (NGX_HAVE_SPLICE)
+
+        /* the buffered data, if any, are sent before switching to splice */
+
+        if (u->splice && b->pos == b->last) {
+
+            if (ngx_http_upstream_splice_upgraded(src, dst,
+                                                  &u->splice[from_upstream],
+                                                  do_write)
+                != NGX_OK)
+            {
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
+
+            break;
+        }
+
+#endif
+
         if (do_write) {
 
             size = b->last - b->pos;
@@ -2755,8 +3076,8 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
         break;
     }
 
-    if ((upstream->read->eof && u->buffer.pos == u->buffer.last)
-        || (downstream->read->eof && u->from_client.pos == u->from_client.last)
+    if ((upstream->read->eof && !ngx_http_upstream_upgraded_pending(u, 1))
+        || (downstream->read->eof && !ngx_http_upstream_upgraded_pending(u, 0))
         || (downstream->read->eof && upstream->read->eof))
     {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
@@ -2814,6 +3135,208 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
 }
 
 
+static ngx_uint_t
+ngx_http_upstream_upgraded_pending(ngx_http_upstream_t *u,
+    ngx_uint_t from_upstream)
+{
+    ngx_buf_t  *b;
+
+    b = from_upstream ? &u->buffer : &u->from_client;
+
+    if (b->pos != b->last) {
+        return 1;
+    }
+
+#if (NGX_HAVE_SPLICE)
+
+    if (u->splice && u->splice[from_upstream].size) {
+        return 1;
+    }
+
+#endif
+
+    return 0;
+}
+
+
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_http_upstream_init_splice(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_uint_t                   i;
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_upstream_splice_t  *sp;
+
+    sp = ngx_palloc(r->pool, 2 * sizeof(ngx_http_upstream_splice_t));
+    if (sp == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < 2; i++) {
+        sp[i].fd[0] = NGX_INVALID_FILE;
+        sp[i].fd[1] = NGX_INVALID_FILE;
+        sp[i].size = 0;
+    }
+
+    cln->handler = ngx_http_upstream_splice_cleanup;
+    cln->data = sp;
+
+    for (i = 0; i < 2; i++) {
+
+        if (pipe(sp[i].fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          "pipe() failed, splice is not used");
+            return NGX_DECLINED;
+        }
+
+        if (ngx_nonblocking(sp[i].fd[0]) == -1
+            || ngx_nonblocking(sp[i].fd[1]) == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          ngx_nonblocking_n " failed, splice is not used");
+            return NGX_DECLINED;
+        }
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream splice pipes: %d:%d %d:%d",
+                   sp[0].fd[0], sp[0].fd[1], sp[1].fd[0], sp[1].fd[1]);
+
+    u->splice = sp;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_splice_cleanup(void *data)
+{
+    ngx_http_upstream_splice_t  *sp = data;
+
+    ngx_uint_t  i;
+
+    for (i = 0; i < 4; i++) {
+        if (sp[i / 2].fd[i % 2] != NGX_INVALID_FILE) {
+            (void) close(sp[i / 2].fd[i % 2]);
+        }
+    }
+}
+
+
+/*
+ * the data are moved from the src socket to the dst socket through a pipe,
+ * without copying them to the user space; the pipe is never filled over
+ * NGX_HTTP_UPSTREAM_SPLICE_SIZE, the default pipe capacity
+ */
+
+#define NGX_HTTP_UPSTREAM_SPLICE_SIZE  65536
+
+
+static ngx_int_t
+ngx_http_upstream_splice_upgraded(ngx_connection_t *src,
+    ngx_connection_t *dst, ngx_http_upstream_splice_t *sp,
+    ngx_uint_t do_write)
+{
+    size_t     size;
+    ssize_t    n;
+    ngx_err_t  err;
+
+    for ( ;; ) {
+
+        if (do_write && sp->size && dst->write->ready) {
+
+            n = splice(sp->fd[0], NULL, dst->fd, NULL, sp->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, dst->log, 0,
+                           "splice to socket: %z of %uz", n, sp->size);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err != NGX_EAGAIN && err != NGX_EINTR) {
+                    dst->write->error = 1;
+                    ngx_connection_error(dst, err,
+                                         "splice() to socket failed");
+                    return NGX_ERROR;
+                }
+
+                if (err == NGX_EAGAIN) {
+                    dst->write->ready = 0;
+                }
+
+            } else {
+                sp->size -= n;
+                dst->sent += n;
+            }
+        }
+
+        size = NGX_HTTP_UPSTREAM_SPLICE_SIZE - sp->size;
+
+        if (size && src->read->ready) {
+
+            n = splice(src->fd, NULL, sp->fd[1], NULL, size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, src->log, 0,
+                           "splice from socket: %z of %uz", n, size);
+
+            if (n > 0) {
+                sp->size += n;
+                do_write = 1;
+
+                continue;
+            }
+
+            if (n == 0) {
+                src->read->ready = 0;
+                src->read->eof = 1;
+                break;
+            }
+
+            err = ngx_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            if (err == NGX_EAGAIN) {
+
+                if (sp->size == 0) {
+                    src->read->ready = 0;
+                    break;
+                }
+
+                /* the pipe is full, it is flushed first */
+
+                if (dst->write->ready) {
+                    do_write = 1;
+                    continue;
+                }
+
+                break;
+            }
+
+            src->read->eof = 1;
+            src->read->error = 1;
+            ngx_connection_error(src, err, "splice() from socket failed");
+        }
+
+        break;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static void
 ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r)
 {
@@ -3384,7 +3907,10 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
     if (status) {
         u->state->status = status;
 
-        if (u->peer.tries == 0 || !(u->conf->next_upstream & ft_type)) {
+        if (u->peer.tries == 0
+            || !(u->conf->next_upstream & ft_type)
+            || (u->request_sent && r->request_body_no_buffering))
+        {
 
 #if (NGX_HTTP_CACHE)
 
@@ -3443,6 +3969,57 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
 }
 
 
+static void
+ngx_http_upstream_retry(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream retry without pipelining");
+
+    /*
+     * the request is repeated to the same peer on a connection of its own:
+     * the peer is kept by the balancer, so it is neither marked as failed
+     * nor charged a try
+     */
+
+    u->pipelining = 0;
+    u->pipeline_buf = NULL;
+
+    if (u->peer.sockaddr) {
+        u->peer.free(&u->peer, u->peer.data, NGX_PEER_RETRY);
+    }
+
+    if (r->connection->error) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_CLIENT_CLOSED_REQUEST);
+        return;
+    }
+
+    if (u->peer.connection) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "close http upstream connection: %d",
+                       u->peer.connection->fd);
+#if (NGX_HTTP_SSL)
+
+        if (u->peer.connection->ssl) {
+            u->peer.connection->ssl->no_wait_shutdown = 1;
+            u->peer.connection->ssl->no_send_shutdown = 1;
+
+            (void) ngx_ssl_shutdown(u->peer.connection);
+        }
+#endif
+
+        if (u->peer.connection->pool) {
+            ngx_destroy_pool(u->peer.connection->pool);
+        }
+
+        ngx_close_connection(u->peer.connection);
+        u->peer.connection = NULL;
+    }
+
+    ngx_http_upstream_connect(r, u);
+}
+
+
 static void
 ngx_http_upstream_cleanup(void *data)
 {
@@ -151,12 +151,14 @@ typedef struct {
     ngx_uint_t                       next_upstream;
     ngx_uint_t                       store_access;
     ngx_flag_t                       buffering;
+    ngx_flag_t                       request_buffering;
     ngx_flag_t                       pass_request_headers;
     ngx_flag_t                       pass_request_body;
 
     ngx_flag_t                       ignore_client_abort;
     ngx_flag_t                       intercept_errors;
     ngx_flag_t                       cyclic_temp_file;
+    ngx_flag_t                       splice;
 
     ngx_path_t                      *temp_path;
 
@@ -261,6 +263,16 @@ typedef struct {
 } ngx_http_upstream_resolved_t;
 
 
+#if (NGX_HAVE_SPLICE)
+
+typedef struct {
+    ngx_fd_t                         fd[2];
+    size_t                           size;
+} ngx_http_upstream_splice_t;
+
+#endif
+
+
 typedef void (*ngx_http_upstream_handler_pt)(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 
@@ -294,11 +306,19 @@ struct ngx_http_upstream_s {
 
     ngx_buf_t                        from_client;
 
+#if (NGX_HAVE_SPLICE)
+    /* splice[0] from client, splice[1] from upstream */
+    ngx_http_upstream_splice_t      *splice;
+#endif
+
 	//ע:ûԶinput_filter壬ʹbuffer洢ȫİ壬
 	//ʱbuffer㹻Сngx_http_upstream_conf_týṹеbuffer_sizeԱ
     ngx_buf_t                        buffer;
     off_t                            length;
 
+    /* data of the next response read from a pipelined connection */
+    ngx_buf_t                       *pipeline_buf;
+
 	/*
 	  1.ҪתʱʹĬϵinput_filterʱout_bufsָӦ
 	    (ʵout_bufsлngx_buffer_tÿָbufferеһ---recvյһTCP)
@@ -367,6 +387,9 @@ struct ngx_http_upstream_s {
     unsigned                         upgrade:1;
 
     unsigned                         request_sent:1;
+    unsigned                         request_body_sent:1;
+    unsigned                         pipelining:1;
+    unsigned                         pipelined:1;
     unsigned                         header_sent:1;
 };
 
@@ -389,6 +412,8 @@ ngx_int_t ngx_http_upstream_header_variable(ngx_http_request_t *r,
 
 ngx_int_t ngx_http_upstream_create(ngx_http_request_t *r);
 void ngx_http_upstream_init(ngx_http_request_t *r);
+void ngx_http_upstream_resume_pipelined(ngx_http_request_t *r,
+    ngx_connection_t *c);
 ngx_http_upstream_srv_conf_t *ngx_http_upstream_add(ngx_conf_t *cf,
     ngx_url_t *u, ngx_uint_t flags);
 char *ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -32,6 +32,9 @@ typedef struct {
 
     time_t           session_timeout;
 
+    ngx_flag_t       session_tickets;
+    ngx_array_t     *session_ticket_keys;
+
     ngx_str_t        certificate;
     ngx_str_t        certificate_key;
     ngx_str_t        dhparam;
@@ -108,6 +108,12 @@ typedef struct iocb  ngx_aiocb_t;
 #endif
 
 
+#if !defined NGX_HAVE_SPLICE && defined SPLICE_F_MOVE
+/* splice() is declared in <fcntl.h> with _GNU_SOURCE */
+#define NGX_HAVE_SPLICE              1
+#endif
+
+
 #define NGX_HAVE_OS_SPECIFIC_INIT    1
 #define ngx_debug_init()
 